@@ -0,0 +1,70 @@
+/**
+ * @file batch.h
+ * @brief run many independent CPU + memory instances across all host cores
+ * @author Edwin
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+
+/**
+ * @brief how the instances of a batch are executed
+ * the lockstep engine only pays off when the instances run the same code from the same storage,
+ * mapped with memory_map_shared or loader_rom_map; with a copy of the program in the RAM of every
+ * instance, or code that takes an interrupt and talks to a device every hundred cycles or so, it
+ * is slower than running them on their own
+ */
+typedef enum batch_engine {
+    BATCH_SCALAR,                   /*!< every instance on its own with cpu_run */
+    BATCH_LOCKSTEP                  /*!< groups of LOCKSTEP_GROUP instances on the lockstep engine */
+} Batch_engine;
+
+/**
+ * @brief one emulated machine of a batch
+ * after batch_run the CPU holds the final registers and state of the instance
+ */
+typedef struct batch_instance {
+    CPU_type_t cpu;
+    Memory_type_t mem;
+    uint64_t cycles;                ///< cycles executed by the last batch_run
+} Batch_instance_t;
+
+/**
+ * @brief a set of instances and the number of threads to run them on
+ */
+typedef struct batch {
+    Batch_instance_t* instances;
+    size_t count;
+    unsigned threads;               ///< worker threads, 0 for one per online host core
+    Batch_engine engine;
+    int validate;                   ///< lockstep engine only, check it against the scalar core
+} Batch_type_t;
+
+/**
+ * create count instances, each with its own cleared memory and a reset CPU
+ * load the program and the inputs of every instance before calling batch_run
+ * @return 0 on success, -1 if the instances could not be allocated
+ */
+int batch_initialize(Batch_type_t*, size_t count);
+
+/**
+ * release every instance
+ */
+void batch_free(Batch_type_t*);
+
+/**
+ * run every instance for cycle_budget cycles, or until it halts
+ * the instances are split evenly between the worker threads; a thread that runs out of work
+ * steals half of the remaining instances of another thread
+ * if fewer threads can be started than asked for, the ones that did start do all the work
+ * @return 0 on success, -1 if the work queues could not be allocated or a lockstep group
+ * diverged from the scalar core in validation mode
+ */
+int batch_run(Batch_type_t*, uint64_t cycle_budget);
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * @file block-cache.h
+ * @brief cache of predecoded basic blocks, keyed by the address of their first instruction
+ * @author Edwin
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+
+#define BLOCK_MAX_OPS 32                    ///< longest block, in instructions
+#define BLOCK_MAX_PENALTY 2                 ///< most cycles an instruction can take on top of its base cycles
+
+struct jit;
+struct block_op;
+
+/**
+ * @brief handler that executes one predecoded instruction
+ * called with PC pointing at the opcode, the handler moves it on to the next instruction
+ */
+typedef void (*block_handler_t)(CPU_type_t*, Memory_type_t* mem, const struct block_op*);
+
+/**
+ * @brief one predecoded instruction
+ */
+typedef struct block_op {
+    block_handler_t handler;
+    uint16_t operand;                       ///< operand bytes, little endian
+    uint16_t next;                          ///< address of the following instruction
+    uint16_t target;                        ///< where a taken branch goes, next for everything else
+    uint8_t opcode;
+    uint8_t cycles;                         ///< base cycle count
+} Block_op_t;
+
+/**
+ * @brief idle loops the core fast-forwards through
+ * a block that branches back to its own start and has no side effects can be skipped ahead
+ * instead of run round and round
+ */
+typedef enum block_spin {
+    BLOCK_SPIN_NONE,                        /*!< not an idle loop */
+    BLOCK_SPIN_DELAY,                       /*!< DEX, DEY, INX or INY and BNE back: runs until the register wraps to 0 */
+    BLOCK_SPIN_POLL                         /*!< only reads and register instructions: once it comes back to the state it
+                                                 started from it spins until a device or an event changes what it reads */
+} Block_spin;
+
+/**
+ * @brief straight line run of instructions
+ * a block ends after a branch, jump, call, return, interrupt or halt, at the end of the page it
+ * starts in, or after BLOCK_MAX_OPS instructions
+ */
+typedef struct block {
+    uint16_t start;                         ///< address of the first instruction
+    uint32_t end;                           ///< address following the last byte of the block
+    uint16_t next;                          ///< where execution falls through to
+    uint16_t target;                        ///< where the last instruction branches or jumps to, next if it cannot tell
+    uint32_t cycles;                        ///< base cycles of all the instructions
+    uint32_t worst;                         ///< most cycles the instructions before the last one can take
+    uint16_t count;                         ///< number of instructions
+    uint8_t spin;                           ///< Block_spin, the kind of idle loop the block is
+    uint8_t breakpoint;                     ///< the first instruction has a breakpoint, the core stops before it
+    uint32_t executions;                    ///< times the block was run, counted while a JIT is attached
+    void* native;                           ///< translated code, NULL if none
+    struct block* page_next;                ///< next block starting in the same page
+    Block_op_t ops[];
+} Block_t;
+
+/**
+ * @brief predecoded code of one address space
+ *
+ * While the cache is attached, cpu_run and cpu_run_cycles execute whole blocks of predecoded
+ * instructions and only decode code the first time it runs.
+ *
+ * RAM pages holding cached code are write protected in the page table, so writes to them take
+ * the slow path, which drops the blocks covering the address written to and leaves the rest of
+ * the page cached. Once no block is left in a page its write pointer is given back. Writes to
+ * pages without code keep the fast path.
+ *
+ * Idle loops, a delay loop or a loop polling memory for a value, are found when their block is
+ * decoded. The core runs one iteration and then moves the registers and the cycle counter
+ * straight to where they would be after the iterations that fit before the end of the time
+ * slice. Scheduler events only run between slices, so nothing the loop reads can change in the
+ * iterations skipped. A loop polling a device page is only skipped if the device is steady, see
+ * Memory_device_t.
+ *
+ * Breakpoints are marks on blocks rather than a test of every PC: a block is cut short before an
+ * instruction with a breakpoint, so every breakpoint starts a block, and the core stops with
+ * CPU_BREAK when it looks up a marked block. The core reads the mark together with the idle loop
+ * kind, the runs without breakpoints pay nothing for them. In stepping mode the core stops the
+ * same way after every block it runs, so a checker can compare the machine with a reference
+ * between blocks without cutting them up itself.
+ *
+ * Storage changed behind the CPU's back (through Memory_type_t.data, or through a second mapping
+ * of the same storage) is not seen, call block_cache_flush after such a change.
+ */
+typedef struct block_cache {
+    Memory_type_t* mem;
+    CPU_variant variant;                    ///< core the blocks are decoded for, CPUs of other variants ignore the cache
+    Block_t** lookup;                       ///< block starting at every address, NULL if none
+    Block_t* page[MEMORY_PAGES];            ///< blocks starting in every page
+    uint16_t users[MEMORY_PAGES];           ///< blocks with code in every page
+    Block_t* retired;                       ///< dropped blocks, freed once none of them can be running
+    uint32_t generation;                    ///< changes whenever a block is dropped
+    struct jit* jit;                        ///< native code tier, NULL when it is off
+
+    uint8_t* breakpoints;                   ///< one bit per address, NULL until the first breakpoint is set
+    int stepping;                           ///< stop with CPU_BREAK after every block, for checking the core block by block
+
+    uint64_t built;                         ///< blocks decoded
+    uint64_t invalidated;                   ///< blocks dropped because their code was written to
+    uint64_t skipped;                       ///< cycles fast-forwarded in idle loops
+} Block_cache_t;
+
+/**
+ * predecoded handler for every opcode byte of every variant, defined by the core
+ */
+extern const block_handler_t* const cpu_block_dispatch[CPU_VARIANTS];
+
+/**
+ * create an empty cache for one CPU variant and attach it to an address space
+ * the cache has to be freed before the address space is
+ * @return 0 on success, -1 if it could not be allocated
+ */
+int block_cache_initialize(Block_cache_t*, Memory_type_t* mem, CPU_variant variant);
+
+/**
+ * drop every block and detach the cache from its address space
+ */
+void block_cache_free(Block_cache_t*);
+
+/**
+ * drop every block
+ */
+void block_cache_flush(Block_cache_t*);
+
+/**
+ * decode the block starting at an address
+ * @return the block, or NULL if the code there cannot be cached (device pages, end of memory)
+ */
+Block_t* block_cache_build(Block_cache_t*, uint16_t address);
+
+/**
+ * drop the blocks covering an address, called by the memory slow path on a write to a
+ * protected page
+ */
+void block_cache_invalidate(Block_cache_t*, uint16_t address);
+
+/**
+ * drop every block with code in a page, called before the page is mapped to something else
+ */
+void block_cache_invalidate_page(Block_cache_t*, uint8_t page);
+
+/**
+ * stop the CPU before it runs the instruction at an address
+ * the blocks covering the address are dropped, so they are decoded again around the breakpoint
+ * @return 0 on success, -1 if the breakpoints could not be allocated
+ */
+int block_cache_set_breakpoint(Block_cache_t*, uint16_t address);
+
+/**
+ * remove a breakpoint
+ */
+void block_cache_clear_breakpoint(Block_cache_t*, uint16_t address);
+
+/* a breakpoint is set at an address */
+static inline int block_cache_breakpoint(const Block_cache_t* cache, uint16_t address) {
+    return (cache->breakpoints != NULL) && ((cache->breakpoints[address >> 3] >> (address & 7)) & 1);
+}
+
+/* block starting at an address, decoded the first time it is asked for */
+static inline Block_t* block_cache_lookup(Block_cache_t* cache, uint16_t address) {
+    Block_t* block = cache->lookup[address];
+    if(MEM_LIKELY(block != NULL)) {
+        return block;
+    }
+    return block_cache_build(cache, address);
+}
+
+#endif
@@ -5,6 +5,41 @@
 #ifndef INC_6502_CPU_EMULATOR_CONFIG_H
 #define INC_6502_CPU_EMULATOR_CONFIG_H
 
-#define USE_NMOS 1
+/* every setting can be given on the compiler command line instead, -DUSE_TRACE=1 */
+
+/* variant of the CPUs the emulator creates itself, see CPU_variant in cpu.h */
+#ifndef CPU_DEFAULT_VARIANT
+#define CPU_DEFAULT_VARIANT CPU_W65C02S
+#endif
+
+/* dispatch through labels-as-values in cpu_run where the compiler supports it */
+#ifndef USE_COMPUTED_GOTO
+#define USE_COMPUTED_GOTO 1
+#endif
+
+/* keep N, V, Z and C unpacked while the core runs and only pack SR when it is read */
+#ifndef USE_LAZY_FLAGS
+#define USE_LAZY_FLAGS 1
+#endif
+
+/* build the x86-64 native code tier of the block cache, see jit.h */
+#ifndef USE_JIT
+#define USE_JIT 1
+#endif
+
+/* build the instruction profiler, see profiler.h; the core has no trace of it when this is 0 */
+#ifndef USE_PROFILER
+#define USE_PROFILER 0
+#endif
+
+/* build the execution trace ring buffer, see trace.h; the core has no trace of it when this is 0 */
+#ifndef USE_TRACE
+#define USE_TRACE 0
+#endif
+
+/* let a replay record and replay the interrupt lines, see replay.h; costs nothing while none is attached */
+#ifndef USE_REPLAY
+#define USE_REPLAY 1
+#endif
 
 #endif //INC_6502_CPU_EMULATOR_CONFIG_H
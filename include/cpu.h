@@ -9,6 +9,7 @@
 #define CPU_H
 
 #include <stdint.h>
+#include "config.h"
 #include "types.h"
 #include "memory-map.h"
 
@@ -22,6 +23,24 @@
 #define Z_MASK (1 << 1)
 #define C_MASK (1 << 0)
 
+/* CPU variants, every one has a core of its own built from its opcode map */
+typedef enum cpu_variant {
+    CPU_NMOS,                       /*!< NMOS 6502 */
+    CPU_65C02,                      /*!< CMOS 65C02 */
+    CPU_W65C02S,                    /*!< WDC W65C02S, the 65C02 with the bit instructions, WAI and STP */
+    CPU_VARIANTS
+} CPU_variant;
+
+/* execution state of the CPU */
+typedef enum cpu_state {
+    CPU_RUNNING,                    /*!< fetching and executing instructions */
+    CPU_WAITING,                    /*!< halted by WAI until an interrupt arrives */
+    CPU_STOPPED,                    /*!< halted by STP until the next reset */
+    CPU_PENDING,                    /*!< running, takes an interrupt or runs an event before the next instruction */
+    CPU_BREAK                       /*!< stopped by a debugger breakpoint or watchpoint, the clock stands still until
+                                         cpu_resume */
+} CPU_state;
+
 /* 6502 CPU */
 typedef struct  {
     uint16_t PC;    /* program counter */
@@ -31,7 +50,35 @@ typedef struct  {
     uint8_t SR;             /* status register */
     uint8_t SP;     /* stack pointer */
 
-    uint32_t cycles;
+#if USE_LAZY_FLAGS
+    /*
+     * while the core runs N, V, Z and C are kept here instead of in SR, which is packed again
+     * before cpu_step, cpu_run and cpu_run_cycles return and read back when they start
+     */
+    uint8_t flag_n;         /* result N was set from, N is its bit 7 */
+    uint8_t flag_v;         /* V is bit 6 */
+    uint8_t flag_z;         /* result Z was set from, Z is set when it is zero */
+    uint8_t flag_c;         /* 0 or 1 */
+#endif
+
+    uint64_t cycles;        /* cycles executed since power on */
+    uint64_t deadline;      /* end of the current time slice, see cpu_run_cycles */
+    CPU_state state;
+    CPU_variant variant;    /* core that runs this CPU, set by cpu_initialize */
+
+    uint32_t irq;           /* IRQ line, one bit per source holding it asserted */
+    uint8_t nmi;            /* an NMI edge waits to be taken */
+    struct scheduler* events;   /* device events, NULL if none, see scheduler.h */
+
+#if USE_PROFILER
+    struct profiler* profiler;  /* counts every instruction when not NULL, see profiler.h */
+#endif
+#if USE_TRACE
+    struct trace* trace;        /* records every instruction when not NULL, see trace.h */
+#endif
+#if USE_REPLAY
+    struct replay* replay;      /* records or replays the interrupt lines when not NULL, see replay.h */
+#endif
 } CPU_type_t;
 
 /* addressing modes */
@@ -52,13 +99,15 @@ typedef enum addressing_modes {
     ZPG_INDX_Y,                     /*!< zp,y zero page indexed with Y */
     ZPG_IND,                        /*!< (zp) zero page indirect */
     ZPG_IND_INDX_Y,                  /*!< (zp),y zero page indexed indirect with Y */
-    INV,                             /*!< invalid mode */
-    II              // WHICH IS THIS?
+    ZPG_PC_REL,                     /*!< zp,r zero page, program counter relative */
+    INV                             /*!< invalid mode */
 } Addressing_mode;
 
 /*
  * @brief OpCodes
- * MOS6502 opcodes arranged alphabetically
+ * mnemonics of every variant arranged alphabetically, the opcode map of a variant tells which
+ * of them it has. BRA, PHX, PHY, PLX, PLY, STZ, TRB, TSB and the bit instructions are CMOS only,
+ * WAI and STP are W65C02S only. The undocumented NMOS opcodes come last
  */
 typedef enum OPCODES {
     ADC,    ///< add with carry
@@ -117,7 +166,7 @@ typedef enum OPCODES {
     STX,    ///< store index X in memory
     STY,    ///< store index Y in memory
     STZ,    ///< store zero in memory
-    STP,
+    STP,    ///< stop the clock until reset
     TAX,    ///< transfer accumulator to index X
     TAY,    ///< transfer accumulator to index Y
     TRB,    ///< test and reset memory bits with accumulator
@@ -126,7 +175,7 @@ typedef enum OPCODES {
     TXA,    ///< transfer index Y to accumulator
     TXS,    ///< transfer index X to stack pointer
     TYA,     ///< transfer index Y to accumulator
-    WAI,
+    WAI,    ///< wait for an interrupt
     INVLD,      ///< invalid opcode
 
     BBR0, ///< newer opcodes
@@ -145,7 +194,7 @@ typedef enum OPCODES {
     BBS5,
     BBS6,
     BBS7,
-    RMBO,
+    RMB0,
     RMB1,
     RMB2,
     RMB3,
@@ -160,92 +209,142 @@ typedef enum OPCODES {
     SMB4,
     SMB5,
     SMB6,
-    SMB7
+    SMB7,
+
+    ALR,    ///< AND then shift accumulator right, undocumented NMOS opcodes
+    ANC,    ///< AND then copy N to carry
+    ANE,    ///< (A OR magic) AND X AND operand into accumulator, unstable
+    ARR,    ///< AND then rotate accumulator right
+    DCP,    ///< decrement memory then compare with accumulator
+    ISC,    ///< increment memory then subtract it from accumulator
+    JAM,    ///< halt until reset
+    LAS,    ///< memory AND stack pointer into accumulator, X and stack pointer
+    LAX,    ///< load accumulator and index X with memory
+    LXA,    ///< (A OR magic) AND operand into accumulator and X, unstable
+    RLA,    ///< rotate memory left then AND with accumulator
+    RRA,    ///< rotate memory right then add to accumulator
+    SAX,    ///< store accumulator AND index X
+    SBX,    ///< accumulator AND index X minus operand into X
+    SHA,    ///< store accumulator AND X AND high byte of address plus one, unstable
+    SHX,    ///< store index X AND high byte of address plus one, unstable
+    SHY,    ///< store index Y AND high byte of address plus one, unstable
+    SLO,    ///< shift memory left then OR with accumulator
+    SRE,    ///< shift memory right then exclusive-or with accumulator
+    TAS     ///< accumulator AND X into stack pointer, then stored like SHA, unstable
 } Opcode;
 
 /**
  * @brief Instruction
- * An instruction is made up of the opcode and the
+ * An instruction is made up of the opcode and the addressing mode that tells
+ * how the bytes following the opcode are interpreted
  */
 typedef struct instruction {
     Opcode opcode;
     Addressing_mode addr_mode;
+    uint8_t cycles;                 ///< base cycle count
 } Instruction;
 
-//extern Instruction instr;                      // to store the fetched instruction
-
-/**
- * @brief addressing modes table
- * This table is a 16x16 array that stores the addressing mode for each instruction as defined
- * in the datasheet
- *
- * When an opcode is fetched from program memory, we cross-reference it with this table to find out
- * which addressing mode we are using
- *
- * The addressing mode will determine what the next byte fetched from memory represents
- *
- */
-static Addressing_mode addressing_modes[16][16] = {
-        /* HI/LOW               |      0            |       1         |        2          |       3      |         4      |   5             |     6              |     7     |      8           |      9     |          A           |     B      |       C      |            D    |            E     |         F       */
-        /* 0 */                {STK,        ZPG_INDX_X,         INV,        INV,        ZPG,        ZPG,        ZPG,        ZPG,       STK,        IMM,        ACC,        INV,        ABS_A,      ABS_A,      ABS_A,          PC_REL },
-        /* 1 */                 {PC_REL,    ZPG_INDX_Y,         ZPG,        INV,        ZPG,  ZPG_INDX_X,  ZPG_INDX_X,      ZPG,       IMP,        ABS_INDX_Y,  ACC,        INV,        ABS_A,      ABS_INDX_X, ABS_INDX_X,  PC_REL },
-        /* 2 */                 {ABS_A,     ZPG_INDX_X,         INV,         INV,       ZPG,         ZPG,          ZPG,       ZPG,     STK,           IMM,      ACC,        INV,        ABS_A,       ABS_A,     ABS_A,         PC_REL },
-        /* 3 */                 {PC_REL,    ZPG_INDX_Y,         ZPG,        INV,   ZPG_INDX_X,  ZPG_INDX_X,  ZPG_INDX_X,      ZPG,      II,     ABS_INDX_Y,       ACC,       INV,     ABS_INDX_X,   ABS_INDX_X, ABS_INDX_X,      PC_REL},
-        /* 4 */                 {STK,      ZPG_INDX_X,         INV,        INV,          INV,         ZPG,        ZPG,        ZPG,     STK,          IMM,        ACC,       INV,       ABS_A,       ABS_A,        ABS_A,      PC_REL},
-        /* 5 */                 {PC_REL,   ZPG_INDX_Y,          ZPG,        INV,         INV, ZPG_INDX_X, ZPG_INDX_X,         ZPG,     IMP,   ABS_INDX_Y,         STK,       INV,      ABS_IND,      ABS_A,      ABS_A,         PC_REL},
-        /* 6 */                 {STK,      ZPG_INDX_X,          INV,        INV,        ZPG,        ZPG,        ZPG,        ZPG,       STK,          IMM,       ACC,        INV,      ABS_A,         ABS_A,       ABS_A,        PC_REL},
-        /* 7 */                 {PC_REL,   ZPG_INDX_Y,          ZPG,        INV,  ZPG_INDX_X, ZPG_INDX_X, ZPG_INDX_X,       ZPG,       IMP,  ABS_INDX_Y,       STK,        INV,  ABS_INDX_X,    ABS_INDX_X, ABS_INDX_X,         PC_REL },
-        /* 8 */                 {PC_REL,   ZPG_INDX_IND,          INV,      INV,        ZPG,         ZPG,        ZPG,       ZPG,       IMP,         IMM,       IMP,        INV,        ABS_A,       ABS_A,       ABS_A,          PC_REL },
-        /* 9 */                 {PC_REL, ZPG_INDX_Y,          ZPG,        INV,   ZPG_INDX_X,  ZPG_INDX_X, ZPG_INDX_Y,       ZPG,       IMP,  ABS_INDX_Y,       IMP,        INV,         ACC,        ABS_A,        ABS_A,          PC_REL },
-        /* A */                { IMM,    ZPG_INDX_Y,        ZPG,         IMM,          INV,         ZPG,        ZPG,       ZPG,        ZPG, IMP,            IMM,           IMP,         INV,        ACC,         ABS_A,         PC_REL },
-        /* B */                 {PC_REL, ZPG_INDX_Y,        ZPG,         INV,    ZPG_INDX_X,  ZPG_INDX_X,  ZPG_INDX_Y,    ZPG,          IMP, ABS_INDX_Y,    IMP,            INV, ABS_INDX_X,   ABS_INDX_X,   ABS_INDX_Y,        PC_REL  },
-        /* C */                {IMM,     ZPG_INDX_X,        INV,        INV,            ZPG,        ZPG,         ZPG,      ZPG,        IMP, IMM,            IMP,            II,      ABS_A,         ABS_A,        ABS_A,        PC_REL  },
-        /* D */                {PC_REL,  ZPG_INDX_Y,        ZPG,        INV,            INV, ZPG_INDX_X,  ZPG_INDX_X,      ZPG,        IMP, ABS_INDX_Y,     STK,            II,         INV,    ABS_INDX_X,  ABS_INDX_Y,        PC_REL  },
-        /* E */                {IMM,     ZPG_INDX_X,        INV,        INV,            ZPG,        ZPG,         ZPG,     ZPG,         IMP, IMM,            IMP,            INV,       ABS_A,       ABS_A,        ABS_A,        PC_REL },
-        /* F */                { PC_REL, ZPG_INDX_Y,    ZPG_IND,        INV,            INV, ZPG_INDX_X,  ZPG_INDX_X,     ZPG,         IMP, ABS_INDX_Y,     STK,            INV,        INV,    ABS_INDX_X, ABS_INDX_X,         PC_REL }
-};
-
-/**
- * @brief this table stores the op codes in a 16x16 table
- */
-static Opcode opcodes[16][16] = {
-        /* HI/LOW   |   0  |               1   |              2   |            3    |          4           |   5           |   6    |          7   |           8  |            9   |           A    |          B      |               C            |     D     |    E  |               F       */
-        /* 0 */ {BRK,       ORA,        INVLD,      INVLD,      TSB,        ORA,        ASL,        RMBO,       PHP,        ORA,        ASL,        INVLD,      TSB,        ORA,        ASL,        BBR0 },
-        /* 1 */ {BPL,       ORA,        ORA,        INVLD,      TRB,        ORA,        ASL,        RMB1,       CLC,        ORA,        INC,        INVLD,      TRB,        ORA,        ASL,        BBR1 },
-        /* 2 */ {JSR,       AND,        INVLD,      INVLD,      BIT,        AND,        ROL,        RMB2,       PLP,        AND,        ROL,        INVLD,      BIT,        AND,        ROL,        BBR2},
-        /* 3 */ {BMI,       AND,        AND,        INVLD,      BIT,        AND,        ROL,        RMB3,       SEC,        AND,        DEC,        INVLD,      BIT,        AND,        ROL,        BBR2},
-        /* 4 */ { RTI,      EOR,        INVLD,      INVLD,      INVLD,      EOR,        LSR,        RMB4,       PHA,        EOR,        LSR,        INVLD,      JMP,        EOR,        LSR,        BBR4 },
-        /* 5 */ { BVC,      EOR,        EOR,        INVLD,      INVLD,      EOR,        LSR,        RMB5,       CLI,        EOR,        PHY,        INVLD,      INVLD,      EOR,        LSR,        BBR5 },
-        /* 6 */ { RTS,      ADC,        INVLD,      INVLD,      STZ,        ADC,        ROR,        RMB6,       PLA,        ADC,        ROR,        INVLD,      JMP,        ADC,        ROR,        BBR6 },
-        /* 7 */ { BVS,      ADC,        ADC,        INVLD,      STZ,        ADC,        ROR,        RMB7,       SEI,        ADC,        PLY,        INVLD,      JMP,        ADC,        ROR,        BBR7 },
-        /* 8 */ { BRA,      STA,        INVLD,      INVLD,      STY,        STA,        STX,        SMB0,       DEY,        BIT,        TXA,        INVLD,      STY,        STA,        STX,        BBS0 },
-        /* 9 */ { BCC,      STA,        STA,        INVLD,      STY,        STA,        STX,        SMB1,       TYA,        STA,        TXS,        INVLD,      STZ,        STA,        STZ,        BBS1 },
-        /* A */ { LDY,      LDA,        LDX,        INVLD,      LDY,        LDA,        LDX,        SMB2,       TAY,        LDA,        TAX,        INVLD,      LDY,        LDA,        LDX,        BBS2 },
-        /* B */ { BCS,      LDA,        LDA,        INVLD,      LDY,        LDA,        LDX,        SMB3,       CLV,        LDA,        TSX,        INVLD,      LDY,        LDA,        LDX,        BBS3 },
-        /* C */ { CPY,      CMP,        INVLD,      INVLD,      CPY,        CMP,        DEC,        SMB4,       INY,        CMP,        DEX,        WAI,        CPY,        CMP,        DEC,        BBS4 },
-        /* D */ { BNE,      CMP,        CMP,        INVLD,      INVLD,      CMP,        DEC,        SMB5,       CLD,        CMP,        PHX,        STP,        INVLD,      CMP,        DEC,        BBS5 },
-        /* E */ { CPX,      SBC,        INVLD,      INVLD,      CPX,        SBC,        INC,        SMB6,       INX,        SBC,        NOP,        INVLD,      CPX,        SBC,        INC,        BBS6 },
-        /* F */  { BEQ,         SBC,        SBC,    INVLD,      INVLD,      SBC,        INC,        SMB7,       SED,        SBC,        PLX,        INVLD,      INVLD,      SBC,        INC,        BBS7 }
-};
-
-
-/**
- * reset the CPU to after-reset register values
+/**
+ * @brief opcode maps
+ * One map per variant with one entry per opcode byte, cpu_instructions[variant][opcode]. The
+ * executing core does not use these tables, it dispatches straight through its own table of
+ * handlers; they are for decoding and debugging
+ */
+extern const Instruction* const cpu_instructions[CPU_VARIANTS];
+
+/**
+ * @brief handler that executes one instruction
+ * called with PC pointing at the byte following the opcode
+ */
+typedef void (*cpu_handler_t)(CPU_type_t*, Memory_type_t* mem);
+
+/**
+ * pick the variant of a CPU and power it on
+ * the registers are left as the reset sequence leaves them, except PC, which is 0 until
+ * cpu_reset reads the reset vector; set PC to run from somewhere else without a reset
+ */
+void cpu_initialize(CPU_type_t*, CPU_variant variant);
+
+/**
+ * run the reset sequence: 7 cycles, SP moves down by 3, I is set, D cleared and PC loaded from
+ * the reset vector at 0xFFFC; an NMI waiting to be taken is dropped, the IRQ lines stay as the
+ * devices hold them
+ * the variant is kept, a CPU without a valid one becomes CPU_DEFAULT_VARIANT
  * see datasheet
  */
-void cpu_reset(CPU_type_t*);
+void cpu_reset(CPU_type_t*, Memory_type_t* mem);
+
+/**
+ * assert IRQ lines, the CPU takes an IRQ before its next instruction while any line is asserted
+ * and I is clear, and a CPU halted by WAI resumes
+ * may be called by devices while the CPU runs, from a memory access or an event
+ * @param lines one bit per interrupt source
+ */
+void cpu_irq_assert(CPU_type_t*, uint32_t lines);
+
+/**
+ * release IRQ lines asserted by cpu_irq_assert
+ */
+void cpu_irq_release(CPU_type_t*, uint32_t lines);
+
+/**
+ * raise an NMI, taken before the next instruction whatever I is
+ */
+void cpu_nmi(CPU_type_t*);
 
 /**
- * fetch instruction from memory at the address pointed to by PC
+ * carry on after a breakpoint or watchpoint stopped the CPU, an interrupt that came in meanwhile
+ * is taken before the next instruction
+ * cpu_run would stop at the same breakpoint again, cpu_step runs the instruction under it
+ */
+void cpu_resume(CPU_type_t*);
+
+/**
+ * fetch instruction from memory at the address pointed to by PC, decoded for the CPU's variant
  * @param m memory
  * @param address address of the instruction in memory
  */
-Instruction* cpu_fetch_instruction(CPU_type_t*, uint16_t* memory,  uint16_t address, Instruction*);
+Instruction* cpu_fetch_instruction(CPU_type_t*, Memory_type_t* mem,  uint16_t address, Instruction*);
+
+/**
+ * @brief decodes instruction fetched from memory, as the default variant would
+ * @param data opcode byte
+ * @param ins where to store the opcode, addressing mode and base cycles
+ */
+Instruction* cpu_decode_instruction(uint8_t data, Instruction* ins);
+
+/**
+ * @brief length of an instruction in bytes, opcode included
+ */
+uint8_t cpu_instruction_length(Addressing_mode mode);
+
+/**
+ * @brief execute the instruction at PC
+ * an interrupt waiting to be taken is taken instead, and a halted CPU skips ahead to the next
+ * event of its scheduler and runs it
+ * @return number of cycles the instruction took
+ */
+uint32_t cpu_step(CPU_type_t*, Memory_type_t* mem);
+
+/**
+ * @brief execute instructions until the cycle budget is used up or the CPU halts
+ * interrupts are taken between instructions, and a CPU halted by WAI or STP carries on to the
+ * events of its scheduler within the budget, see scheduler.h
+ * runs from the block cache when one is attached to the memory, see block-cache.h
+ * the last instruction may overrun the budget by a few cycles
+ * @param cycle_budget number of cycles to run for
+ * @return number of cycles executed
+ */
+uint64_t cpu_run(CPU_type_t*, Memory_type_t* mem, uint64_t cycle_budget);
 
 /**
- * @brief decodes instruction fetched from memory
+ * @brief run one time slice of n cycles
+ * unlike cpu_run, cycles the last instruction overran the previous slice by are taken off this
+ * one, so a machine run in slices of n cycles stays exactly on its schedule
+ * @param n length of the slice in cycles
+ * @return number of cycles executed
  */
-void cpu_decode_instruction();
+uint64_t cpu_run_cycles(CPU_type_t*, Memory_type_t* mem, uint64_t n);
 
 
 #endif
\ No newline at end of file
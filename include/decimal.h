@@ -0,0 +1,69 @@
+/**
+ * @file decimal.h
+ * @brief lookup tables for ADC and SBC in decimal mode
+ * @author Edwin
+ */
+
+#ifndef DECIMAL_H
+#define DECIMAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief how a core sets the flags in decimal mode
+ * the NMOS core takes N, V and Z (and for SBC all four flags) from the binary arithmetic, the CMOS
+ * cores take N and Z from the result
+ */
+typedef enum decimal_flavor {
+    DECIMAL_NMOS,
+    DECIMAL_CMOS,
+    DECIMAL_FLAVORS
+} Decimal_flavor;
+
+/**
+ * @brief accumulator and flags after one decimal ADC or SBC
+ */
+typedef struct decimal_result {
+    uint8_t value;                          ///< new accumulator
+    uint8_t flags;                          ///< N, V, Z and C at their places in SR, the other bits clear
+} Decimal_result_t;
+
+/**
+ * @brief every result of one flavor, indexed by [carry in][accumulator][operand]
+ * each carry half is a 64 K entry table over accumulator and operand
+ */
+typedef struct decimal_tables {
+    Decimal_result_t adc[2][256][256];
+    Decimal_result_t sbc[2][256][256];
+} Decimal_tables_t;
+
+extern Decimal_tables_t decimal_tables[DECIMAL_FLAVORS];
+
+/**
+ * fill the tables, only the first call does anything
+ * called by cpu_reset, safe to call from several threads
+ */
+void decimal_initialize(void);
+
+/**
+ * check every entry of the tables, valid BCD or not, against a reference built from the
+ * published per-chip decimal mode algorithms
+ * @return number of entries that differ, 0 if all match
+ */
+size_t decimal_verify(void);
+
+/**
+ * one decimal ADC, worked out by the reference algorithms rather than looked up
+ * for checkers that must not share the tables with the cores, see reference.h
+ * @param carry 0 or 1
+ */
+Decimal_result_t decimal_reference_adc(uint8_t ac, uint8_t value, unsigned carry, Decimal_flavor flavor);
+
+/**
+ * one decimal SBC, worked out by the reference algorithms
+ * @param carry 0 or 1, 0 borrows
+ */
+Decimal_result_t decimal_reference_sbc(uint8_t ac, uint8_t value, unsigned carry, Decimal_flavor flavor);
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ * @file differential.h
+ * @brief runs a fast engine and the reference stepper side by side and stops where they differ
+ * @author Edwin
+ */
+
+#ifndef DIFFERENTIAL_H
+#define DIFFERENTIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "memory-map.h"
+#include "lockstep.h"
+
+#define DIFFERENTIAL_TRACE 64               ///< reference instructions kept for the report
+#define DIFFERENTIAL_SLICE 64               ///< default cycles between comparisons of lockstep lanes
+#define DIFFERENTIAL_LANES 8                ///< lanes every file of a corpus runs on with the lockstep engine
+
+/**
+ * @brief one instruction run by the reference, with the registers before it
+ */
+typedef struct differential_entry {
+    uint64_t cycles;
+    uint16_t PC;
+    uint8_t opcode;
+    uint8_t AC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t SR;
+    uint8_t SP;
+} Differential_entry_t;
+
+/**
+ * @brief first comparison the two machines did not agree on
+ */
+typedef struct differential_divergence {
+    uint64_t since;                         ///< cycle counter of the last comparison they agreed on
+    CPU_type_t expected;                    ///< state of the reference
+    CPU_type_t actual;                      ///< state of the fast engine
+    uint32_t address;                       ///< first byte of memory that differed, MEMORY_SIZE if none did
+    uint8_t expected_byte;
+    uint8_t actual_byte;
+    Differential_entry_t trace[DIFFERENTIAL_TRACE]; ///< last instructions of the reference since then, oldest first
+    size_t length;                          ///< entries of trace
+    uint64_t dropped;                       ///< instructions since then that did not fit in trace
+} Differential_divergence_t;
+
+/**
+ * @brief a machine on a fast engine and its twin on the reference stepper
+ *
+ * The fast machine runs with cpu_run, on whatever is attached to it: the block cache, the native
+ * code tier or neither for the computed goto core. The reference is stepped instruction by
+ * instruction with reference_step up to the cycle the fast machine stopped at; it shares no
+ * handler, flag or run loop code with the cores, see reference.h, so a mistake in the core's
+ * instructions shows up as a difference rather than being made on both sides. Both machines
+ * have to be built the same beforehand, with their own memory and devices.
+ *
+ * By default the machines are compared at block boundaries: the block cache of the fast machine
+ * is put in stepping mode for the run, so cpu_run comes back after every block it runs, and the
+ * reference is stepped to the cycle it came back at. Native code and idle loops run as they
+ * would anywhere else: a native block going round its own loop, or an idle loop fast-forwarded,
+ * comes back once at the end. Without a block cache every instruction is a block. An interval
+ * cuts the run into slices of that many cycles instead, wherever they fall.
+ *
+ * The registers, cycle counter and state of the two CPUs are compared, and so is every page of
+ * the two address spaces that reads from storage. At the first difference the run stops; since
+ * the machines agreed at the previous comparison, the instructions the reference ran in between
+ * are the whole of the trace that needs looking at.
+ */
+typedef struct differential {
+    CPU_type_t* cpu;                        ///< fast engine
+    Memory_type_t* mem;
+    CPU_type_t* reference_cpu;
+    Memory_type_t* reference_mem;
+    uint32_t interval;                      ///< cycles between comparisons, 0 to compare after every block
+
+    uint64_t checks;                        ///< comparisons made
+    Differential_entry_t ring[DIFFERENTIAL_TRACE];
+    uint64_t steps;                         ///< reference instructions since the last comparison
+
+    int diverged;
+    Differential_divergence_t divergence;
+} Differential_t;
+
+/**
+ * @brief one file of a corpus
+ */
+typedef struct differential_job {
+    const char* path;                       ///< program or ROM, in any format loader_load reads
+    int result;                             ///< 0 agreed, 1 diverged, -1 could not be loaded
+    uint64_t cycles;                        ///< cycles run
+    size_t lane;                            ///< lane that diverged, on the lockstep engine
+    Differential_divergence_t divergence;   ///< where it diverged
+} Differential_job_t;
+
+/**
+ * @brief how the files of a corpus are run
+ */
+typedef struct differential_corpus {
+    Differential_job_t* jobs;
+    size_t count;
+    CPU_variant variant;
+    uint16_t address;                       ///< where raw files are loaded
+    uint32_t interval;                      ///< cycles between comparisons, 0 to compare after every block
+    unsigned threads;                       ///< worker threads, 0 for one per online host core
+    int blocks;                             ///< run the fast machines on a block cache
+    int jit;                                ///< and on the native code tier, when it is built
+    int lockstep;                           ///< run every file on DIFFERENTIAL_LANES lanes of a lockstep engine instead
+} Differential_corpus_t;
+
+/**
+ * pair a machine with its twin
+ * @param cpu, mem fast engine
+ * @param reference_cpu, reference_mem same machine for the reference stepper
+ */
+void differential_initialize(Differential_t*, CPU_type_t* cpu, Memory_type_t* mem,
+                             CPU_type_t* reference_cpu, Memory_type_t* reference_mem);
+
+/**
+ * run both machines for a number of cycles, or until the fast one halts with nothing to wake it
+ * @return 0 if they agreed all the way, 1 if they diverged, see divergence
+ */
+int differential_run(Differential_t*, uint64_t cycle_budget);
+
+/**
+ * run the lanes of a lockstep engine for a number of cycles, each next to its own reference
+ * every lane is paired with a reference as by differential_initialize, with the lane's memory
+ * as the fast machine's and its CPU as where the lane is copied out to for the comparisons. The
+ * lanes are compared after every interval cycles of the first pair, every DIFFERENTIAL_SLICE
+ * cycles if it is 0, since the engine has no blocks to stop at
+ * @return 0 if every lane agreed all the way, 1 if one diverged, see the pair it diverged in
+ */
+int differential_run_lockstep(Lockstep_type_t*, Differential_t* lanes, uint64_t cycle_budget);
+
+/**
+ * print a divergence: both states, the memory that differed and the trace
+ * @param variant instruction set the trace is printed in
+ */
+void differential_print(const Differential_divergence_t*, CPU_variant variant, FILE* out);
+
+/**
+ * step a few instructions whose cycle counts were worked out by hand on both the interpreter and
+ * the reference stepper; they take their base cycles from the same opcode maps, so a wrong entry
+ * there is only caught by a count that comes from outside
+ * @return number of instructions either of them took the wrong number of cycles for
+ */
+size_t differential_verify_timing(CPU_variant variant);
+
+/**
+ * load every file of a corpus on a fresh pair of machines and run it, on worker threads
+ * a file starts where it gives an entry point, else at the reset vector when it covers it, else
+ * at its first address. On the lockstep engine pairs of lanes start with different accumulator
+ * and index registers, so the lanes part and meet again on code that reads them first
+ * @return number of files that diverged or could not be loaded, -1 if the threads could not be allocated
+ */
+long differential_run_corpus(Differential_corpus_t*, uint64_t cycle_budget);
+
+#endif
@@ -0,0 +1,141 @@
+/**
+ * @file disassembler.h
+ * @brief formats instructions in assembler syntax and resolves addresses against a symbol file
+ * @author Edwin
+ */
+
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+
+#define DISASSEMBLER_TEXT 64                ///< room for one instruction, symbols longer than that are cut short
+
+/**
+ * @brief how one opcode byte of a variant is printed
+ */
+typedef struct disassembler_opcode {
+    const char* mnemonic;                   ///< opcodes a variant does not define read NOP, which is what they do
+    uint8_t mode;                           ///< Addressing_mode, gives the form of the operand
+    uint8_t length;                         ///< bytes, opcode included
+} Disassembler_opcode_t;
+
+/**
+ * @brief descriptor tables
+ * One table per variant with one entry per opcode byte, disassembler_opcodes[variant][opcode]. They
+ * are built from the same opcode maps as the cores, so the disassembly cannot disagree with what
+ * runs
+ */
+extern const Disassembler_opcode_t* const disassembler_opcodes[CPU_VARIANTS];
+
+/**
+ * @brief one address of a symbol file
+ */
+typedef struct disassembler_symbol {
+    uint16_t address;
+    uint32_t name;                          ///< offset of the name in the symbol table's names
+} Disassembler_symbol_t;
+
+/**
+ * @brief symbols sorted by address
+ *
+ * Every name lives in one block of text, so a table of tens of thousands of labels is two
+ * allocations. Once it is sorted the lookups only read it, several threads may share it. When an
+ * address has more than one name, the one added first is the one printed.
+ */
+typedef struct disassembler_symbols {
+    Disassembler_symbol_t* entries;
+    size_t count;
+    size_t capacity;
+    char* names;
+    size_t names_size;
+    size_t names_capacity;
+} Disassembler_symbols_t;
+
+/**
+ * @brief one instruction of a range
+ */
+typedef struct disassembler_line {
+    uint16_t address;
+    uint8_t length;
+    uint8_t bytes[3];
+    char text[DISASSEMBLER_TEXT];
+} Disassembler_line_t;
+
+/**
+ * format the instruction at bytes
+ * addresses are printed as the name of their symbol when there is one, immediate operands never are
+ * @param text where to write it, always NUL terminated when size is not 0
+ * @param variant instruction set
+ * @param address where the instruction is, for branch targets
+ * @param bytes opcode and the bytes following it, as many as its length
+ * @param symbols NULL to print plain addresses
+ * @return length of the instruction in bytes
+ */
+uint8_t disassembler_format(char* text, size_t size, CPU_variant variant, uint16_t address,
+                            const uint8_t* bytes, const Disassembler_symbols_t* symbols);
+
+/**
+ * disassemble count instructions of an address space, one after the other
+ * reads storage only; the range stops before an instruction with a byte on a device page, reading
+ * it could have side effects
+ * @return instructions written to lines
+ */
+size_t disassembler_range(const Memory_type_t* mem, CPU_variant variant, uint16_t address,
+                          Disassembler_line_t* lines, size_t count, const Disassembler_symbols_t* symbols);
+
+/**
+ * disassemble up to count instructions of a buffer, say a ROM image
+ * @param origin address of the first byte of data
+ * @return instructions written to lines, the range stops before an instruction that runs past size
+ */
+size_t disassembler_buffer(const uint8_t* data, size_t size, uint16_t origin, CPU_variant variant,
+                           Disassembler_line_t* lines, size_t count, const Disassembler_symbols_t* symbols);
+
+/**
+ * create an empty symbol table
+ */
+void disassembler_symbols_initialize(Disassembler_symbols_t*);
+
+/**
+ * release a symbol table
+ */
+void disassembler_symbols_free(Disassembler_symbols_t*);
+
+/**
+ * add a symbol, the table has to be sorted again before the next lookup
+ * @return 0 on success, -1 if the table could not grow
+ */
+int disassembler_symbols_add(Disassembler_symbols_t*, uint16_t address, const char* name);
+
+/**
+ * sort the table by address
+ */
+void disassembler_symbols_sort(Disassembler_symbols_t*);
+
+/**
+ * add the symbols of a file and sort the table
+ * reads VICE label files as written by ld65 -Ln ("al C:1234 .name") and assignments as most
+ * assemblers list them ("name = $1234", "name equ $1234", "name: $1234"), in hex with $ or 0x or
+ * in decimal; blank lines, comments after ; or # and lines that are neither are skipped
+ * @return symbols added, -1 if the file could not be read or the table could not grow
+ */
+long disassembler_symbols_load(Disassembler_symbols_t*, const char* path);
+
+/**
+ * name of an address
+ * @return NULL if it has none
+ */
+const char* disassembler_symbol_at(const Disassembler_symbols_t*, uint16_t address);
+
+/**
+ * nearest symbol at or below an address, for name+offset
+ * @param offset where to store how far past the symbol the address is
+ * @return NULL if there is no symbol below the address
+ */
+const char* disassembler_symbol_nearest(const Disassembler_symbols_t*, uint16_t address, uint16_t* offset);
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * @file gdb-stub.h
+ * @brief GDB remote serial protocol server for debugging the guest program
+ * @author Edwin
+ */
+
+#ifndef GDB_STUB_H
+#define GDB_STUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+#include "block-cache.h"
+#include "watch.h"
+
+#define GDB_STUB_PACKET 4096                ///< largest packet taken from GDB, told to it in qSupported
+#define GDB_STUB_WATCHES 32                 ///< watchpoints that can be set at once
+#define GDB_STUB_SLICE 100000               ///< cycles run between two looks at the connection for an interrupt
+
+/**
+ * @brief kinds of watchpoint, numbered as in the Z packets
+ */
+typedef enum gdb_watch_kind {
+    GDB_WATCH_WRITE = 2,
+    GDB_WATCH_READ = 3,
+    GDB_WATCH_ACCESS = 4
+} Gdb_watch_kind;
+
+/**
+ * @brief one watchpoint
+ */
+typedef struct gdb_watch {
+    uint16_t address;
+    uint16_t length;                        ///< bytes watched from address on
+    uint8_t kind;                           ///< Gdb_watch_kind
+    int range;                              ///< range of the stub's watch
+} Gdb_watch_t;
+
+/**
+ * @brief debugger stub of one CPU and its address space
+ *
+ * Breakpoints are set in the block cache, see block-cache.h: the core stops on them without
+ * comparing PC with anything, so the guest runs at full speed between them. A stub attached to
+ * an address space without a block cache for the CPU's variant brings one of its own. Code in
+ * device pages, which is never cached, is checked for breakpoints instruction by instruction, and
+ * so is all code while a profiler or a trace is attached to the CPU, which leaves the block cache
+ * out of the run.
+ *
+ * Watchpoints are ranges of a watch, see watch.h, which stops the CPU after an access that hits.
+ * Only the pages they cover leave the fast path.
+ *
+ * While GDB is connected the CPU only runs when GDB tells it to, in slices of GDB_STUB_SLICE
+ * cycles with a look at the connection for an interrupt in between. Scheduler events run as
+ * usual. Memory reads by GDB never reach a device, device pages read as 0.
+ */
+typedef struct gdb_stub {
+    CPU_type_t* cpu;
+    Memory_type_t* mem;
+    Block_cache_t* cache;                   ///< where the breakpoints are set
+    Block_cache_t own_cache;                ///< the cache when the address space had none
+    int owns_cache;
+
+    int listener;                           ///< listening socket, -1 if none
+    int connection;                         ///< connection to GDB, -1 if none
+    char* path;                             ///< Unix socket to remove on free, NULL if none
+    int no_ack;                             ///< GDB asked for no acknowledgements
+
+    Watch_t watch;
+    Gdb_watch_t watches[GDB_STUB_WATCHES];
+    size_t watch_count;
+
+    uint8_t input[GDB_STUB_PACKET];         ///< bytes received and not looked at yet
+    size_t input_start;
+    size_t input_end;
+    char packet[GDB_STUB_PACKET + 1];
+    char reply[2 * GDB_STUB_PACKET + 8];
+} Gdb_stub_t;
+
+/**
+ * attach a stub to a CPU and its address space
+ * the block cache of the address space has to outlive the stub
+ * @return 0 on success, -1 if a cache could not be allocated or the address space has a cache
+ * for another variant
+ */
+int gdb_stub_initialize(Gdb_stub_t*, CPU_type_t* cpu, Memory_type_t* mem);
+
+/**
+ * remove the breakpoints and watchpoints, close the sockets and release the stub
+ */
+void gdb_stub_free(Gdb_stub_t*);
+
+/**
+ * listen for GDB
+ * @param address "host:port" or ":port" for TCP, ":port" listening on the loopback interface
+ * only, "unix:path" or a path with a slash in it for a Unix socket
+ * @return 0 on success, -1 with errno set on error
+ */
+int gdb_stub_listen(Gdb_stub_t*, const char* address);
+
+/**
+ * wait for GDB to connect and serve it until it goes
+ * the CPU does not run while GDB is not connected
+ * @return 0 when GDB detached or the connection broke, 1 when GDB killed the program, -1 with
+ * errno set if no connection could be taken
+ */
+int gdb_stub_serve(Gdb_stub_t*);
+
+/**
+ * set a breakpoint
+ * @return 0 on success, -1 if it could not be allocated
+ */
+int gdb_stub_set_breakpoint(Gdb_stub_t*, uint16_t address);
+
+/**
+ * remove a breakpoint
+ */
+void gdb_stub_clear_breakpoint(Gdb_stub_t*, uint16_t address);
+
+/**
+ * set a watchpoint on length bytes from address, wrapping at the end of memory
+ * @return 0 on success, -1 if GDB_STUB_WATCHES are already set
+ */
+int gdb_stub_set_watch(Gdb_stub_t*, uint16_t address, uint16_t length, Gdb_watch_kind kind);
+
+/**
+ * remove a watchpoint set with the same arguments
+ * @return 0 on success, -1 if there is none
+ */
+int gdb_stub_clear_watch(Gdb_stub_t*, uint16_t address, uint16_t length, Gdb_watch_kind kind);
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * @file jit.h
+ * @brief translates hot blocks of the block cache to x86-64 machine code
+ * @author Edwin
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+#include "block-cache.h"
+
+#define JIT_ARENA_SIZE (1024 * 1024)        ///< default size of the code arena
+#define JIT_THRESHOLD 64                    ///< runs of a block before it is translated
+
+/**
+ * @brief first block whose native code did not match the interpreter in validation mode
+ */
+typedef struct jit_divergence {
+    uint16_t start;                         ///< address of the block
+    uint32_t address;                       ///< first byte of memory that differed, MEMORY_SIZE if none did
+    CPU_type_t expected;                    ///< state after the interpreter
+    CPU_type_t actual;                      ///< state after the native code
+} Jit_divergence_t;
+
+/**
+ * @brief native code tier on top of a block cache
+ *
+ * A block that has run threshold times is translated into the code arena. The native code keeps
+ * AC, X, Y and SR in host registers and runs the instructions it supports inline; it returns to
+ * the core at the first instruction it does not support, and before any access to a page
+ * without a page table pointer, which covers device pages, writes to ROM and writes to pages
+ * holding cached code. Decimal mode ADC and SBC go back to the core too. The core carries on
+ * with the predecoded instructions from where the native code stopped.
+ *
+ * A native block only runs when every instruction of it is sure to start before the end of the
+ * time slice, so it stops on the same instruction the interpreter would. The same goes for
+ * every time a block that loops back to its own start goes round inside the native code.
+ *
+ * In validation mode every run of native code is replayed on the interpreter from the same state
+ * and the registers and all writable memory are compared. The interpreter's result is kept, so
+ * the run stays correct, and a block that differs loses its native code. This copies the
+ * address space a few times per block and is only meant for testing.
+ */
+typedef struct jit {
+    Block_cache_t* cache;
+    uint8_t* arena;
+    size_t size;
+    size_t used;
+    uint32_t threshold;
+
+    uint64_t compiled;                      ///< blocks translated
+    uint64_t rejected;                      ///< hot blocks starting with an instruction that is not supported
+    uint64_t flushes;                       ///< times the arena filled up and was emptied
+
+    int validate;
+    uint8_t* before;                        ///< writable pages before a validated block
+    uint8_t* after;                         ///< writable pages after the native code
+    int diverged;
+    Jit_divergence_t divergence;
+} Jit_type_t;
+
+/**
+ * create the code arena and turn the JIT on for a block cache
+ * @param arena_size bytes of native code, 0 for JIT_ARENA_SIZE
+ * @return 0 on success, -1 if the arena could not be mapped or the JIT is not built for this host
+ */
+int jit_initialize(Jit_type_t*, Block_cache_t* cache, size_t arena_size);
+
+/**
+ * turn the JIT off for its block cache and release the arena
+ */
+void jit_free(Jit_type_t*);
+
+/**
+ * translate a block
+ * @return 0 on success, -1 if its first instruction is not supported or the arena is full
+ */
+int jit_compile(Jit_type_t*, Block_t* block);
+
+/**
+ * drop the native code of every block and empty the arena
+ */
+void jit_flush(Jit_type_t*);
+
+/**
+ * run the native code of a block, which may go round a loop back to its start until end
+ * @return number of instructions of the last run of the block it executed, the core runs the rest
+ */
+uint32_t jit_enter(Jit_type_t*, Block_t* block, CPU_type_t* cpu, Memory_type_t* mem, uint64_t end);
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * @file loader.h
+ * @brief loads programs into RAM and maps ROM images into the address space
+ * @author Edwin
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "memory-map.h"
+
+/**
+ * @brief file formats the loader reads
+ */
+typedef enum loader_format {
+    LOADER_AUTO,                    /*!< tell from the contents and the file name */
+    LOADER_RAW,                     /*!< bytes as they are, at an address given by the caller */
+    LOADER_PRG,                     /*!< C64 PRG, 2 bytes of load address followed by the bytes */
+    LOADER_IHEX,                    /*!< Intel HEX, 16 bit addresses or extended with 0 */
+    LOADER_SREC,                    /*!< Motorola S-record, S1 to S3 data below 64KB */
+    LOADER_INES                     /*!< iNES cartridge, its PRG ROM */
+} Loader_format;
+
+/**
+ * @brief what a loaded file held
+ */
+typedef struct loader_info {
+    Loader_format format;           ///< format the file was read as
+    uint16_t first;                 ///< lowest address written
+    uint16_t last;                  ///< highest address written
+    uint32_t bytes;                 ///< bytes written
+    int32_t entry;                  ///< start address given by the file, the reset vector of iNES, -1 if none
+} Loader_info_t;
+
+/**
+ * @brief ROM image mapped from a file
+ *
+ * A ROM is mapped read only from its file and mapped into address spaces straight from that
+ * mapping, nothing is copied. Every open of the same file in the process returns the same ROM,
+ * so any number of machines share one copy of it, which the host shares with other processes
+ * mapping the file as well.
+ */
+typedef struct loader_rom {
+    const uint8_t* data;            ///< ROM image, the PRG ROM of an iNES file
+    uint32_t size;                  ///< bytes of image
+    Loader_format format;           ///< LOADER_RAW or LOADER_INES
+
+    void* mapping;                  ///< whole file
+    size_t length;                  ///< bytes of file
+    uint64_t device;                ///< file identity, shared ROMs are looked up by it
+    uint64_t inode;
+    unsigned users;                 ///< opens not yet closed
+    struct loader_rom* next;
+} Loader_rom_t;
+
+/**
+ * tell the format of a file image from its first bytes and, failing that, the file name
+ * @param path file name, may be NULL
+ * @return the format, LOADER_RAW if none matches
+ */
+Loader_format loader_detect(const uint8_t* data, size_t size, const char* path);
+
+/**
+ * store a program in memory, as the CPU would store it: ROM pages are left as they are and
+ * device pages get the bytes written to them
+ * @param format LOADER_AUTO to detect it
+ * @param address where a raw file goes, the other formats carry their own addresses
+ * @param info what was loaded, may be NULL
+ * @return 0 on success, -1 if the file could not be read, is malformed or does not fit
+ */
+int loader_load(Memory_type_t*, const char* path, Loader_format format, uint16_t address, Loader_info_t* info);
+
+/**
+ * same as loader_load for a file image already in memory
+ */
+int loader_load_image(Memory_type_t*, const uint8_t* data, size_t size, Loader_format format, uint16_t address, Loader_info_t* info);
+
+/**
+ * map a raw or iNES ROM file, or take another user of it if it is mapped already
+ * thread safe
+ * @return the ROM, NULL if the file could not be mapped or holds no ROM
+ */
+const Loader_rom_t* loader_rom_open(const char* path);
+
+/**
+ * drop a user of a ROM, the file is unmapped when the last one is dropped
+ * the ROM must not be mapped in any address space by then
+ */
+void loader_rom_close(const Loader_rom_t*);
+
+/**
+ * map a ROM over a range of pages
+ * the image is repeated over the range, as a chip decoding fewer address lines than the range
+ * spans is; the part of its last page past the end of the image reads as 0
+ * @param pages pages to cover, 0 for the size of the image
+ */
+void loader_rom_map(Memory_type_t*, const Loader_rom_t* rom, uint8_t first_page, uint16_t pages);
+
+#endif
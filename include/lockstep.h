@@ -0,0 +1,133 @@
+/**
+ * @file lockstep.h
+ * @brief structure-of-arrays engine that steps many CPUs running the same program together
+ * @author Edwin
+ */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+
+#define LOCKSTEP_VECTOR 32                  ///< lanes handled by one vector operation
+#define LOCKSTEP_GROUP 256                  ///< lanes per engine when run from a batch
+
+/**
+ * @brief first lane whose state differed from the scalar core in validation mode
+ */
+typedef struct lockstep_divergence {
+    size_t lane;
+    uint16_t PC;                            ///< address of the instruction
+    uint8_t opcode;
+    CPU_type_t expected;                    ///< state after cpu_step
+    CPU_type_t actual;                      ///< state after the lockstep engine
+    uint16_t address;                       ///< address the instruction stored to, 0 if it is no store
+    uint8_t expected_byte;                  ///< byte cpu_step stored there
+    uint8_t actual_byte;                    ///< byte the lockstep engine stored there
+} Lockstep_divergence_t;
+
+struct lockstep_group;
+
+/**
+ * @brief lockstep engine
+ *
+ * The registers of every lane are kept in one array per register so that lanes at the same PC
+ * can execute an ALU instruction as a handful of vector operations across all of them. Operands
+ * are gathered from, and stores scattered to, the memory of each lane. Instructions that are not
+ * vectorised, and accesses to devices and instrumented pages, are made by the scalar core, which
+ * steps the lane in place.
+ *
+ * The lanes that are running are kept in groups, one per PC and CPU variant, and a group keeps
+ * its lanes from one step to the next. The group at the lowest PC is stepped until it reaches the
+ * PC of another group, where the two are merged, or passes it, which lets lanes that went
+ * different ways through a branch fall back into step where the paths join. A group only looks
+ * at its lanes again when one of them may have left it: after a branch that went both ways, a
+ * step on the scalar core, or when the lane closest to its end or its next event could get there.
+ *
+ * The instruction is decoded once per step from the first lane of the group. The other lanes are
+ * checked to run the same code when the group enters a page; lanes that map the same storage
+ * there, a ROM from loader_rom_map or a program mapped with memory_map_shared, are not checked
+ * again while the group stays in the page. Lanes that each have a copy of the code in their own
+ * RAM have the bytes of every instruction compared, which costs about as much as decoding it.
+ *
+ * Every lane is brought along the way cpu_run would: the events of its scheduler that are due
+ * run, a pending interrupt is taken and a halted lane skips to its next event. A lane leaves its
+ * group as soon as one of its events is due, so none runs late. For the length of lockstep_run
+ * the scheduler of a lane is attached to the lane, so its callbacks assert and release the lane's
+ * interrupt lines.
+ */
+typedef struct lockstep {
+    size_t lanes;
+    size_t stride;                          ///< lanes rounded up to LOCKSTEP_VECTOR
+
+    uint16_t* PC;
+    uint8_t* AC;
+    uint8_t* X;
+    uint8_t* Y;
+    uint8_t* SR;
+    uint8_t* SP;
+    uint64_t* cycles;
+    uint64_t* end;                          ///< each lane runs until its cycle counter reaches this
+    uint64_t* limit;                        ///< end, or the next event of the lane if that comes first
+    uint8_t* state;                         ///< CPU_state of each lane
+
+    CPU_type_t* cpu;                        ///< rest of the CPU state of each lane
+    Memory_type_t** mem;                    ///< memory of each lane, owned by the caller
+    struct scheduler** events;              ///< scheduler of each lane during a run, NULL if none
+    CPU_type_t** attached;                  ///< CPU each of those schedulers is attached to outside the run
+
+    struct lockstep_group* groups;
+    size_t group_count;
+    uint32_t* member;                       ///< lanes of every group, each group a sorted run of them
+    size_t used;                            ///< entries of member in use, those of groups that went away included
+    uint32_t* spare;                        ///< room to pack the runs of member
+    uint32_t* moved;                        ///< lanes that left the group being stepped
+    size_t moved_count;
+
+    /* scratch for one step */
+    uint8_t* mask;                          ///< 0xFF for the lanes of the group being stepped
+    uint8_t* operand;
+    uint16_t* address;
+    uint8_t* before;                        ///< byte at the address before the step, for validation
+    CPU_type_t* shadow;                     ///< state before the step, for validation
+
+    uint8_t kind[CPU_VARIANTS][256];        ///< how each opcode of each variant is stepped
+    void (*alu)(struct lockstep*, size_t first, size_t last, Opcode, int memory);   ///< vector ALU for the host
+
+    int validate;                           ///< check every vectorised step, and the byte it stores, against cpu_step
+    int diverged;
+    Lockstep_divergence_t divergence;
+} Lockstep_type_t;
+
+/**
+ * create an engine with room for a number of lanes
+ * @return 0 on success, -1 if it could not be allocated
+ */
+int lockstep_initialize(Lockstep_type_t*, size_t lanes);
+
+/**
+ * release the engine, the memories of the lanes are not touched
+ */
+void lockstep_free(Lockstep_type_t*);
+
+/**
+ * copy a CPU into a lane and attach the memory it runs on
+ */
+void lockstep_load(Lockstep_type_t*, size_t lane, const CPU_type_t* cpu, Memory_type_t* mem);
+
+/**
+ * copy the state of a lane back out to a CPU
+ */
+void lockstep_store(const Lockstep_type_t*, size_t lane, CPU_type_t* cpu);
+
+/**
+ * run every lane for cycle_budget cycles, or until it halts with no event to wake it before then,
+ * like cpu_run does for one CPU
+ * @return 0 on success, -1 if validation found a lane that diverged from the scalar core
+ */
+int lockstep_run(Lockstep_type_t*, uint64_t cycle_budget);
+
+#endif
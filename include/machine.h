@@ -0,0 +1,125 @@
+/**
+ * @file machine.h
+ * @brief a CPU and its address space, with snapshots of both and copy on write forks
+ * @author Edwin
+ */
+
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+
+#define MACHINE_SNAPSHOT_MAGIC "6502SNP1"   ///< first 8 bytes of a snapshot file
+#define MACHINE_SNAPSHOT_VERSION 1          ///< format written, files of later versions are refused
+#define MACHINE_SNAPSHOT_ALIGN 4096         ///< alignment of the memory image in a snapshot file
+
+/**
+ * @brief how a page was mapped when a snapshot was taken
+ */
+typedef enum machine_page {
+    MACHINE_PAGE_RAM,               /*!< the machine's own RAM, restored from the snapshot */
+    MACHINE_PAGE_MAPPED,            /*!< storage of its own, ROM or a bank, not restored */
+    MACHINE_PAGE_DEVICE             /*!< device, its state is restored if it has any */
+} Machine_page;
+
+struct machine_snapshot;
+
+/**
+ * @brief one emulated machine
+ *
+ * A machine restored from a snapshot does not get a copy of the snapshot's memory: its RAM
+ * pages are shared copy on write with the snapshot's memory image, see memory_map_shared. Only
+ * the pages written to since are copied and marked dirty, so restoring the same snapshot again
+ * only maps the dirty pages back and costs nothing for the rest.
+ *
+ * The mapping of the pages, ROM, banks and devices, is the machine's own and is not part of a
+ * snapshot; restore into machines mapped the same way as the one the snapshot was taken of.
+ * Storage changed behind the CPU's back (through Memory_type_t.data) is not seen.
+ */
+typedef struct machine {
+    CPU_type_t cpu;
+    Memory_type_t mem;
+    const struct machine_snapshot* base;    ///< snapshot the RAM is shared with, NULL if none
+} Machine_t;
+
+/**
+ * @brief saved state of a machine
+ *
+ * The snapshot is kept as the image of its file, so saving it is a single write and loading it
+ * maps the file: the CPU registers, the page map and device state in a small header, followed by
+ * the whole address space at a MACHINE_SNAPSHOT_ALIGN aligned offset. Device pages read as 0 in
+ * the image. A snapshot has to outlive every machine restored or forked from it.
+ */
+typedef struct machine_snapshot {
+    uint8_t* image;                         ///< file image
+    size_t size;                            ///< bytes of image
+    const uint8_t* memory;                  ///< MEMORY_SIZE bytes of address space within the image
+    int mapped;                             ///< image is a file mapping
+} Machine_snapshot_t;
+
+/**
+ * create the memory and a reset CPU
+ * @return 0 on success, -1 if the memory could not be allocated
+ */
+int machine_initialize(Machine_t*, CPU_variant variant);
+
+/**
+ * release the memory, a block cache attached to it has to be freed first
+ */
+void machine_free(Machine_t*);
+
+/**
+ * save the CPU, the address space and the state of the devices
+ * call while the CPU is not running. Events posted to a scheduler are not part of the machine,
+ * the IRQ lines and the NMI latch are
+ * @return 0 on success, -1 if the snapshot could not be allocated
+ */
+int machine_snapshot(const Machine_t*, Machine_snapshot_t* snapshot);
+
+/**
+ * release a snapshot, no machine may be restored or forked from it any more
+ */
+void machine_snapshot_free(Machine_snapshot_t*);
+
+/**
+ * write a snapshot to a file
+ * @return 0 on success, -1 on a write error
+ */
+int machine_snapshot_save(const Machine_snapshot_t*, FILE* out);
+
+/**
+ * map a snapshot file read only, its memory image is shared by the machines restored from it
+ * @return 0 on success, -1 if the file could not be mapped or is not a snapshot
+ */
+int machine_snapshot_load(Machine_snapshot_t*, const char* path);
+
+/**
+ * read a snapshot image of a known size from a stream, into memory of its own
+ * @return 0 on success, -1 if it could not be allocated or read or is not a snapshot
+ */
+int machine_snapshot_read(Machine_snapshot_t*, FILE* in, size_t size);
+
+/**
+ * put a machine back in the state of a snapshot
+ * the first restore from a snapshot shares every RAM page with it, later ones only map the
+ * pages written to since back
+ * @return 0 on success, -1 if the devices of the machine do not match the snapshot's, in which
+ * case the machine is left as it was
+ */
+int machine_restore(Machine_t*, const Machine_snapshot_t* snapshot);
+
+/**
+ * create a machine in the state of another one, sharing its memory copy on write
+ * the parent has to have been restored from a snapshot: the pages it shares with it are shared
+ * by the child as well and only its dirty pages are copied. ROM, banks and devices are mapped in
+ * the child to the same storage and devices as in the parent, a device a replay of the parent stands
+ * in for to the device itself. The child has no scheduler or replay attached
+ * @return 0 on success, -1 if the parent has no snapshot or the memory could not be allocated
+ */
+int machine_fork(Machine_t* child, const Machine_t* parent);
+
+#endif
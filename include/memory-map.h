@@ -9,17 +9,244 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define MEMORY_SIZE (1024 * 64)             ///< 64KB in the MAX addressable memory
-extern uint8_t HI_BYTE_MASK;                ///< for extracting the high byte
-extern uint8_t LO_BYTE_MASK;                ///< for extracting the low byte
+#define MEMORY_ALIGNMENT 64                 ///< align the address space to a cache line
+#define MEMORY_PAGE_SIZE 256                ///< the address space is mapped in 256 byte pages
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+#define STACK_BASE 0x0100                   ///< the stack lives in page 1
+#define HI_BYTE_MASK 0xF0                   ///< for extracting the high byte
+#define LO_BYTE_MASK 0x0F                   ///< for extracting the low byte
 
+#if defined(__GNUC__)
+#define MEM_LIKELY(x) __builtin_expect(!!(x), 1)
+#else
+#define MEM_LIKELY(x) (x)
+#endif
+
+/**
+ * @brief memory mapped device
+ * the handlers receive the full 16 bit address so one device can span several pages
+ */
+typedef struct mem_device {
+    uint8_t (*read)(void* context, uint16_t address);
+    void (*write)(void* context, uint16_t address, uint8_t value);
+    void* context;
+    void* state;                    ///< state saved and restored with machine snapshots, NULL if none
+    uint32_t state_size;            ///< bytes of state
+    uint8_t steady;                 ///< reads have no side effects and return the same value until the device is
+                                    ///< written to or one of its scheduler events runs, so idle loops polling it
+                                    ///< can be skipped, see block-cache.h
+} Memory_device_t;
+
+/**
+ * @brief hooks of an instrumented page, see memory_instrument
+ * read and write are called after the access with the value read or written, execute before the
+ * instruction at an address is fetched; any of them may be NULL
+ */
+typedef struct mem_hook {
+    void (*read)(void* context, uint16_t address, uint8_t value);
+    void (*write)(void* context, uint16_t address, uint8_t value);
+    void (*execute)(void* context, uint16_t address);
+    void* context;
+} Memory_hook_t;
+
+struct block_cache;
+
+/**
+ * @brief the 64KB address space of the CPU
+ *
+ * The address space is split into 256 pages of 256 bytes. Every page has a read and a write
+ * pointer to the first byte of its backing storage. RAM and ROM accesses index straight through
+ * these pointers; a NULL pointer sends the access down the slow path to the page's device, and a
+ * ROM page has a NULL write pointer and no device so writes to it are dropped.
+ *
+ * Bank switching is done by mapping a different block of storage over the same pages.
+ *
+ * A block cache write protects the RAM pages it has decoded code from by moving their write
+ * pointer to code_page, see block-cache.h.
+ *
+ * RAM pages can be shared copy on write with storage that is not theirs, a machine snapshot
+ * for one, see machine.h. A shared page reads straight from the shared storage and has no write
+ * pointer; the first write copies it into its own RAM and marks it dirty.
+ *
+ * A page can be instrumented with hooks that see every access to it, see memory_instrument. Its
+ * read and write pointers are moved to hooked_read and hooked_write, so its accesses take the slow
+ * path, which does what the fast path would have done and then calls the hooks. Code is never
+ * cached in an instrumented page. The pages that are not instrumented keep the fast path.
+ */
 typedef struct mem {
+    const uint8_t* read_page[MEMORY_PAGES];     ///< backing storage for reads, NULL for device pages
+    uint8_t* write_page[MEMORY_PAGES];          ///< backing storage for writes, NULL for ROM and device pages
+    Memory_device_t* device[MEMORY_PAGES];      ///< handlers for device pages
+    uint8_t* code_page[MEMORY_PAGES];           ///< write storage of RAM pages holding cached code
+    const uint8_t* shared_page[MEMORY_PAGES];   ///< storage a RAM page shares copy on write, NULL if none
+    uint64_t dirty[MEMORY_PAGES / 64];          ///< pages that stopped sharing since they were mapped shared
+    struct block_cache* blocks;                 ///< attached block cache, NULL if none
+    Memory_hook_t* hook[MEMORY_PAGES];          ///< hooks of instrumented pages, NULL for the others
+    const uint8_t* hooked_read[MEMORY_PAGES];   ///< read pointer of an instrumented page
+    uint8_t* hooked_write[MEMORY_PAGES];        ///< write pointer of an instrumented page
+
     uint32_t size;
+    uint8_t* data;                              ///< MEMORY_SIZE bytes RAM, MEMORY_ALIGNMENT aligned
 } Memory_type_t;
 
-uint16_t* memory_initialize(Memory_type_t*);
+/**
+ * create the address space, clear it and map the whole of it to RAM
+ * @return pointer to the first byte of RAM, or NULL if it could not be allocated
+ */
+uint8_t* memory_initialize(Memory_type_t*);
+
+/**
+ * release the address space created by memory_initialize
+ */
+void memory_free(Memory_type_t*);
+
+/**
+ * map read/write storage over a range of pages
+ * @param first_page page number of the first page (address >> 8)
+ * @param pages number of pages
+ * @param storage pages * MEMORY_PAGE_SIZE bytes
+ */
+void memory_map_ram(Memory_type_t*, uint8_t first_page, uint16_t pages, uint8_t* storage);
+
+/**
+ * map read only storage over a range of pages, writes to these pages are ignored
+ */
+void memory_map_rom(Memory_type_t*, uint8_t first_page, uint16_t pages, const uint8_t* storage);
+
+/**
+ * hand every access to a range of pages to a device
+ * the device struct must stay alive as long as it is mapped
+ */
+void memory_map_device(Memory_type_t*, uint8_t first_page, uint16_t pages, Memory_device_t* device);
+
+/**
+ * map a range of pages back to the RAM created by memory_initialize
+ */
+void memory_unmap(Memory_type_t*, uint8_t first_page, uint16_t pages);
+
+/**
+ * share storage copy on write over a range of RAM pages
+ * reads come from the storage, which is never written to; the first write to a page copies it
+ * into the page's RAM created by memory_initialize and sets its dirty bit
+ * @param storage pages * MEMORY_PAGE_SIZE bytes, has to outlive the mapping
+ */
+void memory_map_shared(Memory_type_t*, uint8_t first_page, uint16_t pages, const uint8_t* storage);
+
+/**
+ * send every access to a range of pages through hooks, on top of what the pages are mapped to
+ * the pages can be mapped to something else while they are instrumented, they stay instrumented
+ * @param hook has to stay alive as long as the pages are instrumented, NULL to take the hooks off
+ */
+void memory_instrument(Memory_type_t*, uint8_t first_page, uint16_t pages, Memory_hook_t* hook);
+
+/* read pointer of a page, the one behind the hooks when it is instrumented; NULL for device pages */
+static inline const uint8_t* memory_page_storage(const Memory_type_t* m, uint8_t page) {
+    return (m->hook[page] != NULL) ? m->hooked_read[page] : m->read_page[page];
+}
+
+/* page stopped sharing its storage, by a write or by being mapped to something else */
+static inline int memory_page_dirty(const Memory_type_t* m, uint8_t page) {
+    return (m->dirty[page >> 6] >> (page & 63)) & 1;
+}
+
+/* slow paths taken for pages without backing storage and for instrumented pages */
+uint8_t memory_read_slow(Memory_type_t*, uint16_t address);
+void memory_write_slow(Memory_type_t*, uint16_t address, uint8_t value);
+
+/**
+ * write a byte as the CPU would, but without calling the hooks of an instrumented page, for
+ * debuggers changing memory
+ */
+void memory_poke(Memory_type_t*, uint16_t address, uint8_t value);
+
+/*
+ * accessors used by the CPU core
+ * every 16 bit address is valid, so none of these need a bound check
+ */
+
+static inline uint8_t mem_read8(Memory_type_t* m, uint16_t address) {
+    const uint8_t* page = m->read_page[address >> 8];
+    if(MEM_LIKELY(page != NULL)) {
+        return page[address & 0xFF];
+    }
+    return memory_read_slow(m, address);
+}
+
+static inline void mem_write8(Memory_type_t* m, uint16_t address, uint8_t value) {
+    uint8_t* page = m->write_page[address >> 8];
+    if(MEM_LIKELY(page != NULL)) {
+        page[address & 0xFF] = value;
+    } else {
+        memory_write_slow(m, address, value);
+    }
+}
+
+/* little endian word, the high byte wraps from 0xFFFF to 0x0000 */
+static inline uint16_t mem_read16(Memory_type_t* m, uint16_t address) {
+    return mem_read8(m, address) | (mem_read8(m, (uint16_t) (address + 1)) << 8);
+}
+
+/* zero page, the page is known so there is no page lookup */
+static inline uint8_t mem_read_zp(Memory_type_t* m, uint8_t address) {
+    const uint8_t* page = m->read_page[0];
+    if(MEM_LIKELY(page != NULL)) {
+        return page[address];
+    }
+    return memory_read_slow(m, address);
+}
+
+static inline void mem_write_zp(Memory_type_t* m, uint8_t address, uint8_t value) {
+    uint8_t* page = m->write_page[0];
+    if(MEM_LIKELY(page != NULL)) {
+        page[address] = value;
+    } else {
+        memory_write_slow(m, address, value);
+    }
+}
+
+/* pointers in zero page wrap around within zero page */
+static inline uint16_t mem_read16_zp(Memory_type_t* m, uint8_t address) {
+    return mem_read_zp(m, address) | (mem_read_zp(m, (uint8_t) (address + 1)) << 8);
+}
+
+/* byte at an address without touching devices or hooks, for debuggers and tracers; device pages read as 0 */
+static inline uint8_t mem_peek8(const Memory_type_t* m, uint16_t address) {
+    const uint8_t* page = m->read_page[address >> 8];
+    if(MEM_LIKELY(page != NULL)) {
+        return page[address & 0xFF];
+    }
+    page = memory_page_storage(m, address >> 8);
+    return (page != NULL) ? page[address & 0xFF] : 0;
+}
+
+/* the instruction at an address is about to be fetched, the hooks of an instrumented page are told */
+static inline void mem_execute(Memory_type_t* m, uint16_t address) {
+    const Memory_hook_t* hook = m->hook[address >> 8];
+    if( (hook != NULL) && (hook->execute != NULL) ) {
+        hook->execute(hook->context, address);
+    }
+}
+
+/* stack, indexed by the stack pointer */
+static inline uint8_t mem_stack_read(Memory_type_t* m, uint8_t sp) {
+    const uint8_t* page = m->read_page[STACK_BASE >> 8];
+    if(MEM_LIKELY(page != NULL)) {
+        return page[sp];
+    }
+    return memory_read_slow(m, STACK_BASE | sp);
+}
 
+static inline void mem_stack_write(Memory_type_t* m, uint8_t sp, uint8_t value) {
+    uint8_t* page = m->write_page[STACK_BASE >> 8];
+    if(MEM_LIKELY(page != NULL)) {
+        page[sp] = value;
+    } else {
+        memory_write_slow(m, STACK_BASE | sp, value);
+    }
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,124 @@
+/**
+ * @file profiler.h
+ * @brief per instruction profile of the guest program
+ * @author Edwin
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define PROFILER_MAX_DEPTH 256              ///< deepest JSR nesting followed, deeper calls count in their caller
+
+/**
+ * @brief one routine in one calling context
+ * the root node stands for the code running outside any JSR seen by the profiler
+ */
+typedef struct profiler_node {
+    uint16_t routine;                       ///< address the JSR went to
+    uint32_t parent;                        ///< index of the caller's node
+    uint32_t child;                         ///< first callee, 0 if none
+    uint32_t sibling;                       ///< next callee of the same caller, 0 if none
+    uint64_t calls;
+    uint64_t cycles;                        ///< cycles spent in the routine itself, callees not included
+} Profiler_node_t;
+
+/**
+ * @brief JSR the profiler is inside of
+ */
+typedef struct profiler_frame {
+    uint32_t node;
+    uint8_t sp;                             ///< SP after the JSR pushed its return address
+} Profiler_frame_t;
+
+/**
+ * @brief counters of one profiling run
+ *
+ * While a CPU has a profiler attached, cpu_step, cpu_run and cpu_run_cycles execute one
+ * instruction at a time through the interpreter's handlers, leaving out the block cache and the
+ * native code, and hand every instruction to profiler_record. It counts:
+ *
+ *   - executions and cycles per PC
+ *   - executions and cycles per opcode byte, which is also per handler of the core, and per
+ *     addressing mode
+ *   - cycles per subroutine in every calling context, following JSR and RTS with a shadow stack
+ *     that is matched against SP, so returns that skip frames or RTS used as a jump keep it in
+ *     step
+ *   - taken backward branches and jumps, the loops, with the cycles spent between their target
+ *     and the branch
+ *
+ * The profile is written as JSON, or as collapsed stacks for flame graph tools.
+ *
+ * Nothing of this is built unless USE_PROFILER is set in config.h; without it the CPU has no
+ * profiler pointer, the core has no profiling loop and profiler_initialize fails.
+ */
+typedef struct profiler {
+    CPU_variant variant;                    ///< decodes the opcodes of the report
+    uint64_t* pc_count;                     ///< instructions started at every address
+    uint64_t* pc_cycles;
+    uint64_t* back_edges;                   ///< taken backward branches and jumps at every address
+    uint16_t* back_target;                  ///< where the last of them went
+    uint64_t opcode_count[256];
+    uint64_t opcode_cycles[256];
+    uint64_t instructions;
+    uint64_t cycles;
+
+    Profiler_node_t* nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    uint32_t node;                          ///< calling context of the running instruction
+    Profiler_frame_t stack[PROFILER_MAX_DEPTH];
+    uint32_t depth;
+} Profiler_t;
+
+/**
+ * allocate the counters
+ * @return 0 on success, -1 if they could not be allocated or the profiler is not built in
+ */
+int profiler_initialize(Profiler_t*);
+
+/**
+ * release the counters, the profiler has to be detached first
+ */
+void profiler_free(Profiler_t*);
+
+/**
+ * clear every counter and go back to the root context
+ */
+void profiler_reset(Profiler_t*);
+
+/**
+ * profile every instruction the CPU executes from now on
+ * the call stack starts empty, returns from routines entered before are ignored
+ */
+void profiler_attach(Profiler_t*, CPU_type_t* cpu);
+
+/**
+ * stop profiling the CPU, the counters are kept
+ */
+void profiler_detach(CPU_type_t* cpu);
+
+/**
+ * count one instruction, called by the core after executing it
+ * @param pc address of the opcode
+ * @param opcode opcode byte
+ * @param cycles cycles the instruction took
+ */
+void profiler_record(Profiler_t*, const CPU_type_t* cpu, uint16_t pc, uint8_t opcode, uint32_t cycles);
+
+/**
+ * write the profile as one JSON object
+ * @return 0 on success, -1 on a write error
+ */
+int profiler_write_json(const Profiler_t*, FILE* out);
+
+/**
+ * write one line "top;$1234;$5678 cycles" per calling context with cycles of its own
+ * @return 0 on success, -1 on a write error
+ */
+int profiler_write_collapsed(const Profiler_t*, FILE* out);
+
+#endif
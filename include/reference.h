@@ -0,0 +1,41 @@
+/**
+ * @file reference.h
+ * @brief plain instruction stepper with eager flags, the yardstick the cores are checked against
+ * @author Edwin
+ */
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+
+/**
+ * @brief reference stepper
+ *
+ * An interpreter of its own for all three variants that shares no code with the cores: no
+ * handlers, no dispatch tables, no lazy flags, no run loops or caches. It takes from them only
+ * the opcode maps of cpu.h, which say what each opcode byte is, and the decimal mode reference of
+ * decimal.h, which is what the cores' decimal tables are checked against. Every instruction is
+ * decoded from memory, and all of its flags are written to SR as it runs.
+ *
+ * It keeps the timing model of the cores: base cycles from the opcode map, one more for an
+ * indexed read crossing a page, for a taken branch and for a branch to another page, and one
+ * more for decimal ADC and SBC on the CMOS parts.
+ *
+ * It runs on the same CPU_type_t as the cores and treats interrupts, halts and the events of the
+ * CPU's scheduler as cpu_step does, so devices drive it through cpu_irq_assert and cpu_nmi. The
+ * lazy flag fields are left alone; cpu_step and cpu_run read SR afresh, so a CPU can be handed
+ * from the stepper to a core and back.
+ */
+
+/**
+ * execute the instruction at PC, or take the interrupt waiting to be taken
+ * a halted CPU first skips to the next event of its scheduler and runs it, the events due
+ * after the instruction are run as well
+ * @return number of cycles the instruction took
+ */
+uint32_t reference_step(CPU_type_t*, Memory_type_t* mem);
+
+#endif
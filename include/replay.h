@@ -0,0 +1,203 @@
+/**
+ * @file replay.h
+ * @brief recording of what a machine takes from the outside, and bit exact replay of it with
+ * seeking and stepping back
+ * @author Edwin
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "memory-map.h"
+#include "machine.h"
+#include "scheduler.h"
+
+#define REPLAY_MAGIC "6502RPL1"             ///< first 8 bytes of a recording
+#define REPLAY_VERSION 1                    ///< format written, files of later versions are refused
+#define REPLAY_INTERVAL 20000000            ///< default cycles between two keyframes
+#define REPLAY_READS 4096                   ///< device reads buffered before they are written out
+#define REPLAY_NEAR 200000                  ///< a seek running further than twice this keeps a keyframe this far before its end
+
+/**
+ * @brief what a replay does with the machine
+ */
+typedef enum replay_mode {
+    REPLAY_RECORD,                  /*!< devices and interrupts run, what they do is written down */
+    REPLAY_PLAY                     /*!< device reads and interrupts come from a recording */
+} Replay_mode;
+
+/**
+ * @brief interrupt line changes, tagged as in the file
+ */
+typedef enum replay_kind {
+    REPLAY_ASSERT = 'A',            /*!< cpu_irq_assert */
+    REPLAY_RELEASE = 'L',           /*!< cpu_irq_release */
+    REPLAY_NMI = 'N'                /*!< cpu_nmi */
+} Replay_kind;
+
+/**
+ * @brief one interrupt line change of a recording
+ */
+typedef struct replay_event {
+    uint64_t when;                          ///< applied at the first instruction boundary at or after it
+    uint32_t lines;
+    uint8_t kind;                           ///< Replay_kind
+} Replay_event_t;
+
+/**
+ * @brief state of the machine at one point of a recording
+ */
+typedef struct replay_keyframe {
+    uint64_t cycles;
+    uint64_t reads;                         ///< device reads before it
+    uint64_t events;                        ///< line changes before it
+    uint16_t PC;                            ///< registers, checked when a replay passes the keyframe
+    uint8_t AC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t SR;
+    uint8_t SP;
+    Machine_snapshot_t snapshot;
+} Replay_keyframe_t;
+
+/**
+ * @brief stands in for a device of the machine while it is recorded or replayed
+ */
+typedef struct replay_tap {
+    Memory_device_t device;                 ///< mapped in place of the original, with its state
+    Memory_device_t* original;
+    struct replay* replay;
+} Replay_tap_t;
+
+/**
+ * @brief recording or replay of one machine
+ *
+ * A machine is deterministic apart from its devices, so a recording only holds what they hand
+ * it: the value of every read from a device page, in the order the CPU made them, and every
+ * interrupt line change with the cycle it came at. The devices are mapped over by taps, and the
+ * core hands line changes to the replay when it is built with USE_REPLAY set in config.h. RAM
+ * and ROM accesses do not go near it, a device read costs a byte in a buffer, so recording can be
+ * left on.
+ *
+ * A line change made by a device while the CPU accesses it is put after the instruction, one made
+ * by an event or between two runs at the boundary it was made at; either way it is replayed before
+ * the same instruction it was taken before. The taps are not steady, see Memory_device_t: how many
+ * times a skipped polling loop would have read its device depends on where the time slices ended.
+ *
+ * Every interval cycles the machine is saved as a keyframe. A seek restores the last keyframe
+ * before the cycle and runs forward from there, so it costs at most an interval of emulation; a
+ * seek that runs far keeps a keyframe of its own REPLAY_NEAR before where it stops, so stepping
+ * back again and again does not go all the way back each time. A replay passing a recorded
+ * keyframe checks the registers and the reads against it and stops with diverged set if they
+ * differ.
+ *
+ * While replaying, writes still reach the devices, so the banks they switch are switched, but
+ * reads come from the recording without reaching them and the line changes they make are dropped
+ * for the recorded ones. The machine has to be mapped as it was recorded, its devices included:
+ * the mapping is not part of a keyframe, see machine.h. Storage changed behind the CPU's back and
+ * resets are not recorded.
+ *
+ * The file is append only, a header and tagged records: 'R' a run of read values, 'A', 'L' and
+ * 'N' a line change with its distance in cycles from the previous one, 'K' a keyframe and 'E' the
+ * cycle the recording ended at. Counts and distances are LEB128 varints. A recording cut short
+ * replays up to its last complete record.
+ */
+typedef struct replay {
+    Machine_t* machine;
+    Replay_mode mode;
+    uint64_t interval;                      ///< cycles between keyframes
+    Replay_tap_t taps[MEMORY_PAGES];        ///< one per device
+    size_t tap_count;
+    Scheduler_t scheduler;                  ///< applies the recorded line changes when the CPU had no scheduler
+    int owns_scheduler;
+
+    /* recording */
+    FILE* out;
+    uint8_t pending[REPLAY_READS];          ///< reads not written out yet
+    size_t pending_count;
+    uint64_t last;                          ///< cycle of the last line change written
+    uint64_t next_keyframe;
+    int in_access;                          ///< a device is being accessed, its line changes come after the instruction
+    int error;                              ///< a write of the recording failed
+
+    /* replaying */
+    uint8_t* values;                        ///< every read of the recording
+    uint64_t value_count;
+    Replay_event_t* changes;                ///< every line change of the recording
+    uint64_t change_count;
+    Replay_keyframe_t* keyframes;
+    size_t keyframe_count;
+    Replay_keyframe_t near;                 ///< kept by the last long seek, snapshot.image NULL if none
+    uint64_t end;                           ///< cycle the recording ended at, UINT64_MAX if it was cut short
+    int applying;                           ///< the replay changes the lines itself
+    int diverged;                           ///< the machine did not match a keyframe
+    int overrun;                            ///< the CPU read more than was recorded
+
+    uint64_t reads;                         ///< device reads recorded or replayed so far
+    uint64_t events;                        ///< line changes recorded or replayed so far
+} Replay_t;
+
+/**
+ * start recording a machine from where it is now
+ * writes the header and a first keyframe; the devices stay mapped over by taps until replay_free
+ * @param out recording, written sequentially and flushed at every keyframe
+ * @param interval cycles between keyframes, 0 for REPLAY_INTERVAL
+ * @return 0 on success, -1 if the keyframe could not be taken or written, or the core is built
+ * without USE_REPLAY
+ */
+int replay_record(Replay_t*, Machine_t* machine, FILE* out, uint64_t interval);
+
+/**
+ * load a recording and put the machine in the state it started in
+ * @return 0 on success, -1 if the file could not be read or is not a recording, the core is
+ * built without USE_REPLAY, or the first keyframe does not fit the machine's devices
+ */
+int replay_load(Replay_t*, Machine_t* machine, const char* path);
+
+/**
+ * stop recording or replaying: write out the buffered reads and the end of a recording, give
+ * the devices back and release the keyframes; the machine keeps its state, the file is left open
+ * @return 0, -1 if a write of the recording failed
+ */
+int replay_free(Replay_t*);
+
+/**
+ * run the machine for a number of cycles, writing keyframes while recording
+ * a replay stops early at the end of the recording, where it diverged and where it ran out of reads
+ * @return cycles run, 0 once the CPU is halted with nothing left to wake it
+ */
+uint64_t replay_run(Replay_t*, uint64_t cycles);
+
+/**
+ * move a replay to the first instruction boundary at or after a cycle, forward or back
+ * a seek past the end of the recording stops at the end
+ * @return 0 on success, -1 if the cycle is before the recording started or the CPU ran out of
+ * reads on the way
+ */
+int replay_seek(Replay_t*, uint64_t cycle);
+
+/**
+ * run one instruction of a replay, an interrupt being taken counts as one
+ * @return cycles it took, 0 at the end of the recording
+ */
+uint32_t replay_step(Replay_t*);
+
+/**
+ * go back to the instruction boundary before this one
+ * @return 0 on success, -1 at the start of the recording
+ */
+int replay_step_back(Replay_t*);
+
+/**
+ * device a tap stands in for, the device itself if it is not a tap of the replay
+ */
+Memory_device_t* replay_device(const Replay_t*, Memory_device_t* device);
+
+/* interrupt line change made while a replay is attached, called by the core; @return 0 to drop it */
+int replay_line(Replay_t*, Replay_kind kind, uint32_t lines);
+
+#endif
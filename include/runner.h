@@ -0,0 +1,105 @@
+/**
+ * @file runner.h
+ * @brief runs batches of programs to a stop condition on worker threads and keeps their final state
+ * @author Edwin
+ */
+
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define RUNNER_ADDRESS 0x0200               ///< default address of raw programs
+
+/**
+ * @brief why a job ended
+ */
+typedef enum runner_stop {
+    RUNNER_LIMIT,                   /*!< it ran out of cycles or instructions */
+    RUNNER_PC,                      /*!< it reached the stop address */
+    RUNNER_BRK,                     /*!< it reached the BRK handler */
+    RUNNER_MEMORY,                  /*!< it wrote the stop value to the stop address */
+    RUNNER_STP,                     /*!< STP halted the CPU */
+    RUNNER_WAI,                     /*!< WAI halted the CPU, with nothing to wake it */
+    RUNNER_ERROR                    /*!< the program or the ROM could not be loaded */
+} Runner_stop;
+
+/**
+ * @brief stop conditions of a job, or-ed together
+ */
+typedef enum runner_condition {
+    RUNNER_STOP_PC = 1,             /*!< before the instruction at stop_pc */
+    RUNNER_STOP_BRK = 2,            /*!< before the first instruction of the BRK handler */
+    RUNNER_STOP_MEMORY = 4          /*!< after an instruction writing stop_value to stop_address */
+} Runner_condition;
+
+/**
+ * @brief one run of a program
+ */
+typedef struct runner_job {
+    const char* name;                       ///< name in the results
+    const char* program;                    ///< loaded into RAM, in any format loader_load reads, NULL if none
+    const char* rom;                        ///< raw or iNES ROM mapped at the top of memory, NULL if none
+    uint16_t address;                       ///< where a raw program is loaded
+    int32_t reset;                          ///< where to start instead of the reset vector, -1 if nowhere
+    uint64_t cycles;                        ///< cycle limit, 0 for none
+    uint64_t instructions;                  ///< instruction limit, 0 for none
+    unsigned stops;                         ///< Runner_condition bits
+    uint16_t stop_pc;
+    uint16_t stop_address;
+    uint8_t stop_value;
+
+    /* results */
+    Runner_stop stop;
+    uint16_t PC;                            ///< final registers
+    uint8_t AC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t SP;
+    uint8_t SR;
+    uint64_t cycles_run;
+    uint64_t instructions_run;
+    int stepped;                            ///< the job was stepped, instructions_run is 0 otherwise
+    double seconds;                         ///< wall clock time of the run, setup left out
+} Runner_job_t;
+
+/**
+ * @brief jobs and how they are run
+ *
+ * Every worker keeps one machine, with its block cache and native code, for all the jobs it runs.
+ * A job is set up by loading its ROM and program into cleared RAM and saving the machine as an
+ * image, see machine.h; a job set up the same way as the one before it on the worker only restores
+ * the image, which maps the pages the previous job wrote to back and nothing else. The code
+ * decoded and compiled for the image stays cached from one job to the next. Jobs are handed out
+ * grouped by setup, the results stay where the jobs are.
+ *
+ * A job starts where its program gives an entry point, else at the reset vector when the program
+ * or a ROM covers it, else at the program's first address; reset overrides all three. The stop
+ * addresses are breakpoints of the block cache and the stop value is looked for by a watch on its
+ * page, so none of them slow the rest of the program down. The BRK handler is where the vector
+ * points when the job starts: the machine has no devices, so nothing else goes there. A job with
+ * an instruction limit, or run without a block cache, is stepped on the interpreter instead.
+ */
+typedef struct runner {
+    Runner_job_t* jobs;
+    size_t count;
+    CPU_variant variant;
+    unsigned threads;                       ///< worker threads, 0 for one per online host core
+    int blocks;                             ///< run on a block cache
+    int jit;                                ///< and on the native code tier, when it is built
+} Runner_t;
+
+/**
+ * run every job, on worker threads
+ * @return number of jobs that could not be run, -1 if the threads could not be allocated
+ */
+long runner_run(Runner_t*);
+
+/**
+ * name of a stop reason, in lower case
+ */
+const char* runner_stop_to_str(Runner_stop stop);
+
+#endif
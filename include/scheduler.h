@@ -0,0 +1,111 @@
+/**
+ * @file scheduler.h
+ * @brief cycle stamped events that devices post to the CPU they are attached to
+ * @author Edwin
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define SCHEDULER_NONE UINT64_MAX           ///< time of the next event when there is none
+
+/**
+ * @brief called when the CPU's cycle counter reaches the time of an event
+ * may assert or release interrupt lines and post further events, see cpu_irq_assert
+ * @param now cycle counter, the event's time or a little after it
+ */
+typedef void (*scheduler_callback_t)(void* context, CPU_type_t* cpu, uint64_t now);
+
+/**
+ * @brief one posted event
+ */
+typedef struct scheduler_event {
+    uint64_t when;                          ///< cycle it is due
+    uint64_t order;                         ///< events due on the same cycle run in the order they were posted
+    scheduler_callback_t callback;
+    void* context;
+} Scheduler_event_t;
+
+/**
+ * @brief event queue of one CPU
+ *
+ * A min-heap on the time the events are due. While a CPU has a scheduler attached, cpu_run and
+ * cpu_run_cycles cut their time slice short at the next event, so the core runs flat out between
+ * events without asking any device whether it wants something, and only looks at the interrupt
+ * lines when an event or the program itself may have changed them. A CPU halted by WAI or STP
+ * skips its clock straight to the next event.
+ *
+ * An event posted from within the run for a time before the end of the current slice, by a device
+ * the program wrote to, stops the core after the instruction so that it is not late.
+ */
+typedef struct scheduler {
+    Scheduler_event_t* heap;
+    size_t count;
+    size_t capacity;
+    uint64_t posted;                        ///< events posted so far, orders events due together
+    CPU_type_t* cpu;                        ///< CPU the scheduler is attached to, NULL if none
+    uint64_t horizon;                       ///< end of the slice the CPU is running, 0 when it is not
+} Scheduler_t;
+
+/**
+ * create an empty queue
+ * @param capacity events it has room for before it grows, 0 for a default
+ * @return 0 on success, -1 if it could not be allocated
+ */
+int scheduler_initialize(Scheduler_t*, size_t capacity);
+
+/**
+ * release the queue, it has to be detached first
+ */
+void scheduler_free(Scheduler_t*);
+
+/**
+ * run the events of a CPU from now on
+ */
+void scheduler_attach(Scheduler_t*, CPU_type_t* cpu);
+
+/**
+ * stop running the CPU's events, they stay in the queue
+ */
+void scheduler_detach(CPU_type_t* cpu);
+
+/**
+ * post an event
+ * @param when cycle it is due; an event posted for a cycle that has passed runs before the next
+ * instruction
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int scheduler_post(Scheduler_t*, uint64_t when, scheduler_callback_t callback, void* context);
+
+/**
+ * take every event with this callback and context out of the queue
+ * @return number of events taken out
+ */
+size_t scheduler_cancel(Scheduler_t*, scheduler_callback_t callback, void* context);
+
+/**
+ * post an event asserting, or releasing, IRQ lines of the CPU
+ * @param lines one bit per interrupt source, see cpu_irq_assert
+ */
+int scheduler_irq(Scheduler_t*, uint64_t when, uint32_t lines, int assert);
+
+/**
+ * post an event raising an NMI
+ */
+int scheduler_nmi(Scheduler_t*, uint64_t when);
+
+/**
+ * run every event due at or before now, in order, called by the core
+ */
+void scheduler_run(Scheduler_t*, uint64_t now);
+
+/* time of the next event */
+static inline uint64_t scheduler_next(const Scheduler_t* s) {
+    return (s->count != 0) ? s->heap[0].when : SCHEDULER_NONE;
+}
+
+#endif
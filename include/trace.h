@@ -0,0 +1,141 @@
+/**
+ * @file trace.h
+ * @brief ring buffer of the last instructions executed, and its compressed file format
+ * @author Edwin
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "cpu.h"
+
+#define TRACE_MAGIC "6502TRC1"              ///< first 8 bytes of a trace file
+#define TRACE_ENTRIES (1u << 20)            ///< default ring size, in instructions
+
+/**
+ * @brief one executed instruction, registers as they were before it
+ */
+typedef struct trace_entry {
+    uint64_t cycles;                        ///< cycle counter when the instruction started
+    uint16_t pc;
+    uint16_t operand;                       ///< operand bytes, little endian
+    uint16_t address;                       ///< effective address, if has_address
+    uint8_t opcode;
+    uint8_t AC;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t SR;
+    uint8_t SP;
+    uint8_t has_address;                    ///< the addressing mode reads or writes memory
+} Trace_entry_t;
+
+/**
+ * @brief trace of one CPU
+ *
+ * While a CPU has a trace attached, cpu_step, cpu_run and cpu_run_cycles execute one instruction
+ * at a time through the interpreter's handlers, leaving out the block cache and the native code,
+ * and store every instruction in the ring before running it. The ring always holds the last
+ * capacity instructions, trace_save writes them out after the fact.
+ *
+ * The ring has a single writer, the core, and a single reader, the stream thread, and neither
+ * takes a lock: the core publishes an entry by moving head on, the stream thread frees the
+ * entries it has written out by moving tail on. While streaming the core waits rather than
+ * overwrite entries that have not been written out yet, so the file is complete.
+ *
+ * Files are delta encoded: a record is a byte telling which fields changed, the opcode and its
+ * operand bytes, then only the changed fields. PC is left out when it follows on from the
+ * previous instruction, the cycle stamp when the previous instruction took its base cycles, and
+ * the effective address when it is the operand. A typical record is 3 to 5 bytes against the
+ * 24 of an entry.
+ *
+ * Recording is only built with USE_TRACE set in config.h, reading trace files always is.
+ */
+typedef struct trace {
+    Trace_entry_t* ring;
+    uint64_t capacity;                      ///< entries, a power of two
+    _Atomic uint64_t head;                  ///< entries recorded since the trace was created
+    _Atomic uint64_t tail;                  ///< entries streamed
+    CPU_variant variant;                    ///< decodes the opcodes of the entries
+
+    FILE* out;                              ///< stream, NULL when not streaming
+    pthread_t writer;
+    atomic_int streaming;
+    atomic_int stop;
+    int error;                              ///< a write of the stream failed
+    uint64_t bytes;                         ///< bytes streamed
+} Trace_t;
+
+/**
+ * @brief state of a trace file being read
+ */
+typedef struct trace_reader {
+    FILE* in;
+    CPU_variant variant;
+    Trace_entry_t last;                     ///< previous record, the next one is relative to it
+} Trace_reader_t;
+
+/**
+ * create the ring
+ * @param entries instructions to keep, rounded up to a power of two, 0 for TRACE_ENTRIES
+ * @return 0 on success, -1 if it could not be allocated or recording is not built in
+ */
+int trace_initialize(Trace_t*, size_t entries);
+
+/**
+ * stop streaming and release the ring, the trace has to be detached first
+ */
+void trace_free(Trace_t*);
+
+/**
+ * record every instruction the CPU executes from now on
+ */
+void trace_attach(Trace_t*, CPU_type_t* cpu);
+
+/**
+ * stop recording the CPU, the ring is kept
+ */
+void trace_detach(CPU_type_t* cpu);
+
+/**
+ * store the instruction at PC in the ring, called by the core before executing it with SR packed
+ * @param opcode opcode byte at PC
+ */
+void trace_record(Trace_t*, const CPU_type_t* cpu, const Memory_type_t* mem, uint8_t opcode);
+
+/**
+ * write the instructions in the ring to a file, oldest first
+ * call while the CPU is not running
+ * @return 0 on success, -1 on a write error
+ */
+int trace_save(const Trace_t*, FILE* out);
+
+/**
+ * write every instruction recorded from now on to a file, from a background thread
+ * @return 0 on success, -1 if it could not be started
+ */
+int trace_stream_start(Trace_t*, FILE* out);
+
+/**
+ * write out what is left in the ring and stop the stream thread, the file is left open
+ * call while the CPU is not running
+ * @return 0 if every write succeeded, -1 if not
+ */
+int trace_stream_stop(Trace_t*);
+
+/**
+ * read the header of a trace file
+ * @return 0 on success, -1 if it is not a trace file
+ */
+int trace_reader_open(Trace_reader_t*, FILE* in);
+
+/**
+ * read the next instruction
+ * @return 1 if one was read, 0 at the end of the file, -1 if the file is cut short
+ */
+int trace_read(Trace_reader_t*, Trace_entry_t* entry);
+
+#endif
@@ -24,5 +24,12 @@ const char* cpu_opcode_to_str(Opcode code);
  */
 const char* cpu_addressing_mode_to_str(Addressing_mode addr_mode);
 
+/**
+ * @brief This function returns the CPU variant as a string
+ * @param variant CPU variant to convert to string
+ * @return name of the chip
+ */
+const char* cpu_variant_to_str(CPU_variant variant);
+
 #endif
 
@@ -0,0 +1,150 @@
+/**
+ * @file watch.h
+ * @brief read, write and execute watches on ranges of the address space, with a log of their hits
+ * @author Edwin
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu.h"
+#include "memory-map.h"
+#include "block-cache.h"
+#include "disassembler.h"
+
+#define WATCH_RANGES 64                     ///< ranges that can be watched at once
+
+/**
+ * @brief accesses a range is watched for, or-ed together
+ */
+typedef enum watch_kind {
+    WATCH_READ = 1,
+    WATCH_WRITE = 2,
+    WATCH_EXECUTE = 4,
+    WATCH_ACCESS = WATCH_READ | WATCH_WRITE
+} Watch_kind;
+
+/**
+ * @brief one watched range
+ */
+typedef struct watch_range {
+    uint16_t first;
+    uint16_t last;                          ///< last byte watched, the range wraps at the end of memory when below first
+    uint8_t kinds;                          ///< Watch_kind bits, 0 for a free slot
+    uint8_t stop;                           ///< a hit stops the CPU with CPU_BREAK after the instruction
+} Watch_range_t;
+
+/**
+ * @brief one access to a watched range
+ */
+typedef struct watch_hit {
+    uint64_t cycles;                        ///< cycle counter when the access was made
+    uint16_t pc;                            ///< instruction that made it
+    uint16_t address;
+    uint8_t value;                          ///< byte read or written, the opcode for an execute hit
+    uint8_t kind;                           ///< one Watch_kind bit
+} Watch_hit_t;
+
+/**
+ * @brief watches of one CPU and its address space
+ *
+ * Only the pages a range covers are instrumented, see memory_instrument; they take the slow path
+ * for every access, and the others keep the fast path and run as fast as without watches. Code is
+ * not cached in an instrumented page, it runs instruction by instruction and tells the watches
+ * before each one. A watch attached to an address space without a block cache for the CPU's
+ * variant brings one of its own: without a cache cpu_run interprets every page alike and tells
+ * none of them.
+ *
+ * Hits go to a ring of the last capacity hits, hits counts all of them. The instruction of a hit
+ * is found by its end, which is where PC points while it accesses memory: in the block decoded
+ * around it or, for code run from an instrumented page, from the last instruction started there.
+ * An access by code that was never decoded is put down to the address following the
+ * instruction. Fetching the instruction from an instrumented page is not a read hit.
+ *
+ * A page has one set of hooks, so an address space takes one watch at a time. Every access of the
+ * CPU is seen, including the stack and vector accesses of interrupts; storage changed behind the
+ * CPU's back is not.
+ */
+typedef struct watch {
+    CPU_type_t* cpu;
+    Memory_type_t* mem;
+    Block_cache_t* cache;
+    Block_cache_t own_cache;                ///< the cache when the address space had none
+    int owns_cache;
+    Memory_hook_t hook;                     ///< set on the instrumented pages
+
+    Watch_range_t ranges[WATCH_RANGES];
+    size_t count;                           ///< slots in use are below count
+    uint16_t covering[MEMORY_PAGES];        ///< ranges covering every page, the page is instrumented while not 0
+
+    uint16_t fetch;                         ///< last instruction started in an instrumented page
+    uint8_t fetch_length;                   ///< and its length, 0 while there is none
+    uint8_t fetched;                        ///< bytes of it fetched so far
+
+    Watch_hit_t* log;                       ///< ring of the last capacity hits
+    size_t capacity;
+    uint64_t hits;                          ///< hits since the watch was created or the log cleared
+
+    int stop_range;                         ///< range that stopped the CPU, -1 if none; the caller clears it
+    Watch_hit_t stop;                       ///< hit that stopped it
+} Watch_t;
+
+/**
+ * attach watches to a CPU and its address space
+ * the block cache of the address space has to outlive the watch
+ * @param capacity hits kept in the log, 0 to only count them
+ * @return 0 on success, -1 if the log or a cache could not be allocated or the address space has a
+ * cache for another variant
+ */
+int watch_initialize(Watch_t*, CPU_type_t* cpu, Memory_type_t* mem, size_t capacity);
+
+/**
+ * remove every range, give the pages their fast path back and release the log
+ */
+void watch_free(Watch_t*);
+
+/**
+ * watch a range
+ * @param first first byte
+ * @param last last byte, below first for a range wrapping at the end of memory
+ * @param kinds Watch_kind bits
+ * @param stop a hit stops the CPU with CPU_BREAK after the instruction making it, see cpu_resume
+ * @return number of the range, -1 if WATCH_RANGES are already watched or kinds is 0
+ */
+int watch_add(Watch_t*, uint16_t first, uint16_t last, unsigned kinds, int stop);
+
+/**
+ * stop watching a range
+ * @param range number watch_add returned
+ */
+void watch_remove(Watch_t*, int range);
+
+/**
+ * hits held in the log
+ */
+static inline size_t watch_logged(const Watch_t* w) {
+    return (w->hits < w->capacity) ? (size_t) w->hits : w->capacity;
+}
+
+/**
+ * hit of the log, 0 being the oldest one held
+ */
+static inline const Watch_hit_t* watch_entry(const Watch_t* w, size_t i) {
+    return &w->log[(w->hits - watch_logged(w) + i) % w->capacity];
+}
+
+/**
+ * forget the hits logged so far
+ */
+void watch_clear_log(Watch_t*);
+
+/**
+ * print the log, oldest hit first, with the instruction of every hit
+ * @param symbols NULL to print plain addresses
+ */
+void watch_print(const Watch_t*, const Disassembler_symbols_t* symbols, FILE* out);
+
+#endif
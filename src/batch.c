@@ -0,0 +1,260 @@
+/**
+ * @file batch.c
+ * @brief run many independent CPU + memory instances across all host cores
+ * @author Edwin
+ */
+
+/**
+ * Every instance is a task, or every group of LOCKSTEP_GROUP instances on the lockstep engine.
+ * The tasks are split into one contiguous range per worker. A range is packed into a single 64
+ * bit word (begin in the low half, end in the high half) so that the owner taking a task from the
+ * front and a thief taking half the tasks from the back are both a single compare-and-swap on the
+ * same word.
+ *
+ * No task is added once the run has started, so a worker is done when its own range and every
+ * other range are empty.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "batch.h"
+#include "lockstep.h"
+
+#define RANGE(begin, end) (((uint64_t) (end) << 32) | (uint32_t) (begin))
+#define RANGE_BEGIN(r) ((uint32_t) (r))
+#define RANGE_END(r) ((uint32_t) ((r) >> 32))
+
+/* keep the ranges of two workers out of the same cache line */
+typedef struct batch_queue {
+    _Atomic uint64_t range;
+    char pad[64 - sizeof(uint64_t)];
+} Batch_queue_t;
+
+typedef struct batch_worker {
+    Batch_type_t* batch;
+    Batch_queue_t* queues;
+    unsigned id;
+    unsigned count;                 ///< number of workers
+    uint64_t cycle_budget;
+    atomic_int* failed;
+} Batch_worker_t;
+
+/**
+ * take the next task from the front of a range
+ * @return task index, or -1 if the range is empty
+ */
+static long queue_pop(Batch_queue_t* q) {
+    uint64_t r = atomic_load_explicit(&q->range, memory_order_acquire);
+
+    while(RANGE_BEGIN(r) < RANGE_END(r)) {
+        if(atomic_compare_exchange_weak_explicit(&q->range, &r, RANGE(RANGE_BEGIN(r) + 1, RANGE_END(r)),
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+            return RANGE_BEGIN(r);
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * move the back half of a victim's range into an empty queue
+ * @return first stolen task for the thief to run, or -1 if there was nothing to steal
+ */
+static long queue_steal(Batch_queue_t* victim, Batch_queue_t* own) {
+    uint64_t r = atomic_load_explicit(&victim->range, memory_order_acquire);
+
+    while(RANGE_BEGIN(r) < RANGE_END(r)) {
+        uint32_t begin = RANGE_BEGIN(r);
+        uint32_t end = RANGE_END(r);
+        uint32_t mid = begin + (end - begin) / 2;
+
+        if(atomic_compare_exchange_weak_explicit(&victim->range, &r, RANGE(begin, mid),
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+            atomic_store_explicit(&own->range, RANGE(mid + 1, end), memory_order_release);
+            return mid;
+        }
+    }
+
+    return -1;
+}
+
+static size_t task_size(const Batch_type_t* b) {
+    return (b->engine == BATCH_LOCKSTEP) ? LOCKSTEP_GROUP : 1;
+}
+
+static void run_instance(Batch_instance_t* instance, uint64_t cycle_budget) {
+    instance->cycles = cpu_run(&instance->cpu, &instance->mem, cycle_budget);
+}
+
+static int run_lockstep(Batch_type_t* b, size_t first, size_t count, uint64_t cycle_budget) {
+    Lockstep_type_t ls;
+    int status;
+
+    if(lockstep_initialize(&ls, count) != 0) {
+        /* no room for the lanes, run the group one instance at a time instead */
+        for(size_t i = 0; i < count; i++) {
+            run_instance(&b->instances[first + i], cycle_budget);
+        }
+        return 0;
+    }
+
+    ls.validate = b->validate;
+    for(size_t i = 0; i < count; i++) {
+        lockstep_load(&ls, i, &b->instances[first + i].cpu, &b->instances[first + i].mem);
+    }
+
+    status = lockstep_run(&ls, cycle_budget);
+
+    for(size_t i = 0; i < count; i++) {
+        Batch_instance_t* instance = &b->instances[first + i];
+        uint64_t start = instance->cpu.cycles;
+
+        lockstep_store(&ls, i, &instance->cpu);
+        instance->cycles = instance->cpu.cycles - start;
+    }
+
+    lockstep_free(&ls);
+    return status;
+}
+
+static void run_task(Batch_worker_t* w, size_t task) {
+    Batch_type_t* b = w->batch;
+    size_t first = task * task_size(b);
+
+    if(b->engine == BATCH_LOCKSTEP) {
+        size_t count = (b->count - first < LOCKSTEP_GROUP) ? b->count - first : LOCKSTEP_GROUP;
+        if(run_lockstep(b, first, count, w->cycle_budget) != 0) {
+            atomic_store(w->failed, 1);
+        }
+    } else {
+        run_instance(&b->instances[first], w->cycle_budget);
+    }
+}
+
+static void* batch_worker(void* arg) {
+    Batch_worker_t* w = (Batch_worker_t*) arg;
+    Batch_queue_t* own = &w->queues[w->id];
+
+    for(;;) {
+        long task = queue_pop(own);
+
+        /* out of work, go round the other workers starting with the next one */
+        for(unsigned i = 1; (task < 0) && (i < w->count); i++) {
+            task = queue_steal(&w->queues[(w->id + i) % w->count], own);
+        }
+
+        if(task < 0) {
+            break;
+        }
+
+        run_task(w, (size_t) task);
+    }
+
+    return NULL;
+}
+
+/**
+ * create the instances
+ * @param b batch
+ * @param count number of instances
+ * @return 0 on success
+ */
+int batch_initialize(Batch_type_t* b, size_t count) {
+    b->instances = (Batch_instance_t*) calloc(count, sizeof(Batch_instance_t));
+    b->count = 0;
+    b->threads = 0;
+    b->engine = BATCH_SCALAR;
+    b->validate = 0;
+
+    if(b->instances == NULL) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        if(memory_initialize(&b->instances[i].mem) == NULL) {
+            batch_free(b);
+            return -1;
+        }
+        cpu_initialize(&b->instances[i].cpu, CPU_DEFAULT_VARIANT);
+        b->count++;
+    }
+
+    return 0;
+}
+
+/**
+ * free the instances
+ * @param b batch
+ */
+void batch_free(Batch_type_t* b) {
+    for(size_t i = 0; i < b->count; i++) {
+        memory_free(&b->instances[i].mem);
+    }
+
+    free(b->instances);
+    b->instances = NULL;
+    b->count = 0;
+}
+
+/**
+ * run every instance for the cycle budget
+ * the calling thread is worker 0
+ * @param b batch
+ * @param cycle_budget cycles per instance
+ * @return 0 on success, -1 if the work queues could not be allocated or a lockstep group
+ * diverged from the scalar core in validation mode
+ */
+int batch_run(Batch_type_t* b, uint64_t cycle_budget) {
+    size_t tasks = (b->count + task_size(b) - 1) / task_size(b);
+    unsigned count = b->threads;
+    atomic_int failed = 0;
+
+    if(count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (online > 0) ? (unsigned) online : 1;
+    }
+    if(count > tasks) {
+        count = tasks ? (unsigned) tasks : 1;
+    }
+
+    Batch_queue_t* queues = (Batch_queue_t*) aligned_alloc(64, count * sizeof(Batch_queue_t));
+    Batch_worker_t* workers = (Batch_worker_t*) calloc(count, sizeof(Batch_worker_t));
+    pthread_t* threads = (pthread_t*) calloc(count, sizeof(pthread_t));
+
+    if( (queues == NULL) || (workers == NULL) || (threads == NULL) ) {
+        free(queues);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    for(unsigned i = 0; i < count; i++) {
+        size_t begin = tasks * i / count;
+        size_t end = tasks * (i + 1) / count;
+
+        atomic_init(&queues[i].range, RANGE(begin, end));
+        workers[i] = (Batch_worker_t) { b, queues, i, count, cycle_budget, &failed };
+    }
+
+    unsigned started = 1;
+    for(; started < count; started++) {
+        if(pthread_create(&threads[started], NULL, batch_worker, &workers[started]) != 0) {
+            /* the workers that did start steal the ranges of the ones that did not */
+            break;
+        }
+    }
+
+    batch_worker(&workers[0]);
+
+    for(unsigned i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(queues);
+    free(workers);
+    free(threads);
+
+    return atomic_load(&failed) ? -1 : 0;
+}
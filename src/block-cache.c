@@ -0,0 +1,365 @@
+/**
+ * @file block-cache.c
+ * @brief cache of predecoded basic blocks, keyed by the address of their first instruction
+ * @author Edwin
+ */
+
+/**
+ * A block is listed under the page its first instruction is in. Its last instruction may run
+ * over into the next page, so a write drops blocks from the page it hits and from the page
+ * before it.
+ *
+ * Dropped blocks are not freed straight away, the write may have come from the block that is
+ * running. They are kept on the retired list until the next block is built, and the generation
+ * count tells the core to stop running the block it is in.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "block-cache.h"
+
+static int block_ends(Opcode opcode, Addressing_mode mode) {
+    switch(opcode) {
+        case JMP: case JSR: case RTS: case RTI: case BRK:
+        case WAI: case STP: case JAM:
+            return 1;
+        default:
+            return (mode == PC_REL) || (mode == ZPG_PC_REL);
+    }
+}
+
+/* instructions an idle loop may be made of: no writes, no stack, no change to I */
+static int spin_pure(const Instruction* ins) {
+    switch(ins->addr_mode) {
+        case IMP: case ACC: case IMM: case ZPG: case ABS_A: case PC_REL: case ZPG_PC_REL:
+            break;
+        default:
+            return 0;
+    }
+
+    switch(ins->opcode) {
+        case LDA: case LDX: case LDY: case CMP: case CPX: case CPY: case BIT:
+        case AND: case ORA: case EOR: case ADC: case SBC:
+        case TAX: case TAY: case TXA: case TYA: case TSX: case TXS:
+        case INX: case INY: case DEX: case DEY:
+        case CLC: case CLD: case CLV: case SEC: case SED: case NOP:
+        case BPL: case BMI: case BVC: case BVS: case BCC: case BCS: case BNE: case BEQ: case BRA:
+            return 1;
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+            return ins->addr_mode == ACC;
+        default:
+            return (ins->opcode >= BBR0) && (ins->opcode <= BBS7);
+    }
+}
+
+/* the kind of idle loop a block is */
+static Block_spin spin_kind(const Block_op_t* ops, uint16_t count, uint16_t start, CPU_variant variant) {
+    const Block_op_t* last = &ops[count - 1];
+    const Instruction* ins = &cpu_instructions[variant][last->opcode];
+
+    if(last->target != start) {
+        return BLOCK_SPIN_NONE;
+    }
+    if( (ins->opcode != JMP || ins->addr_mode != ABS_A) && !spin_pure(ins) ) {
+        return BLOCK_SPIN_NONE;
+    }
+    for(uint16_t i = 0; i + 1 < count; i++) {
+        if(!spin_pure(&cpu_instructions[variant][ops[i].opcode])) {
+            return BLOCK_SPIN_NONE;
+        }
+    }
+
+    if( (count == 2) && (ins->opcode == BNE) ) {
+        switch(cpu_instructions[variant][ops[0].opcode].opcode) {
+            case DEX: case DEY: case INX: case INY:
+                return BLOCK_SPIN_DELAY;
+            default:
+                break;
+        }
+    }
+    return BLOCK_SPIN_POLL;
+}
+
+/* the block gets one more user in a page, the first one write protects a RAM page */
+static void page_use(Block_cache_t* cache, uint8_t page) {
+    Memory_type_t* mem = cache->mem;
+
+    if( (cache->users[page]++ == 0) && (mem->write_page[page] != NULL) ) {
+        mem->code_page[page] = mem->write_page[page];
+        mem->write_page[page] = NULL;
+    }
+}
+
+static void page_release(Block_cache_t* cache, uint8_t page) {
+    Memory_type_t* mem = cache->mem;
+
+    if( (--cache->users[page] == 0) && (mem->code_page[page] != NULL) ) {
+        mem->write_page[page] = mem->code_page[page];
+        mem->code_page[page] = NULL;
+    }
+}
+
+static void retire(Block_cache_t* cache, Block_t* block) {
+    uint8_t first = block->start >> 8;
+    uint8_t last = (uint8_t) ((block->end - 1) >> 8);
+
+    cache->lookup[block->start] = NULL;
+    page_release(cache, first);
+    if(last != first) {
+        page_release(cache, last);
+    }
+
+    block->page_next = cache->retired;
+    cache->retired = block;
+    cache->generation++;
+}
+
+static void free_retired(Block_cache_t* cache) {
+    while(cache->retired != NULL) {
+        Block_t* block = cache->retired;
+        cache->retired = block->page_next;
+        free(block);
+    }
+}
+
+/* drop the blocks starting in a page that have code in [first, last] */
+static void drop(Block_cache_t* cache, uint8_t page, uint32_t first, uint32_t last) {
+    Block_t** link = &cache->page[page];
+
+    while(*link != NULL) {
+        Block_t* block = *link;
+
+        if( (block->start <= last) && (block->end > first) ) {
+            *link = block->page_next;
+            retire(cache, block);
+        } else {
+            link = &block->page_next;
+        }
+    }
+}
+
+/**
+ * create the cache
+ * @param cache block cache
+ * @param mem address space the cache decodes from
+ * @param variant CPU variant the cache decodes for
+ * @return 0 on success
+ */
+int block_cache_initialize(Block_cache_t* cache, Memory_type_t* mem, CPU_variant variant) {
+    memset(cache, 0, sizeof(*cache));
+
+    cache->lookup = (Block_t**) calloc(MEMORY_SIZE, sizeof(Block_t*));
+    if(cache->lookup == NULL) {
+        return -1;
+    }
+
+    cache->mem = mem;
+    cache->variant = variant;
+    mem->blocks = cache;
+
+    return 0;
+}
+
+/**
+ * free the cache
+ * @param cache block cache
+ */
+void block_cache_free(Block_cache_t* cache) {
+    if(cache->lookup == NULL) {
+        return;
+    }
+
+    block_cache_flush(cache);
+    free_retired(cache);
+    free(cache->lookup);
+    cache->lookup = NULL;
+    free(cache->breakpoints);
+    cache->breakpoints = NULL;
+
+    if(cache->mem->blocks == cache) {
+        cache->mem->blocks = NULL;
+    }
+}
+
+/**
+ * drop every block
+ * @param cache block cache
+ */
+void block_cache_flush(Block_cache_t* cache) {
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        drop(cache, (uint8_t) page, 0, MEMORY_SIZE);
+    }
+}
+
+/**
+ * decode instructions from an address until one ends the block
+ * @param cache block cache
+ * @param address address of the first instruction
+ * @return the new block
+ */
+Block_t* block_cache_build(Block_cache_t* cache, uint16_t address) {
+    Memory_type_t* mem = cache->mem;
+    Block_op_t ops[BLOCK_MAX_OPS];
+    uint16_t count = 0;
+    uint32_t cycles = 0;
+    uint32_t worst = 0;
+    uint32_t pc = address;
+    const uint8_t page = address >> 8;
+
+    /* nothing can be running a block now */
+    free_retired(cache);
+
+    /* code read from a device can change at any time */
+    if(mem->read_page[page] == NULL) {
+        return NULL;
+    }
+
+    while( (count < BLOCK_MAX_OPS) && ((pc >> 8) == page) ) {
+        uint8_t opcode = mem_read8(mem, (uint16_t) pc);
+        const Instruction* ins = &cpu_instructions[cache->variant][opcode];
+        uint8_t length = cpu_instruction_length(ins->addr_mode);
+        uint32_t next = pc + length;
+
+        /* stop before an instruction running off the end of memory or into a device */
+        if( (next > MEMORY_SIZE) || (mem->read_page[(next - 1) >> 8] == NULL) ) {
+            break;
+        }
+        /* and before a breakpoint, it starts a block of its own */
+        if( (count != 0) && block_cache_breakpoint(cache, (uint16_t) pc) ) {
+            break;
+        }
+
+        Block_op_t* op = &ops[count++];
+        op->handler = cpu_block_dispatch[cache->variant][opcode];
+        op->operand = (length == 1) ? 0 :
+                      (length == 2) ? mem_read8(mem, (uint16_t) (pc + 1)) :
+                                      mem_read16(mem, (uint16_t) (pc + 1));
+        op->next = (uint16_t) next;
+        op->target = op->next;
+        op->opcode = opcode;
+        op->cycles = ins->cycles;
+
+        if(ins->addr_mode == PC_REL) {
+            op->target = (uint16_t) (next + (int8_t) op->operand);
+        } else if(ins->addr_mode == ZPG_PC_REL) {
+            op->target = (uint16_t) (next + (int8_t) (op->operand >> 8));
+        } else if( (ins->opcode == JMP || ins->opcode == JSR) && (ins->addr_mode == ABS_A) ) {
+            op->target = op->operand;
+        }
+
+        cycles += ins->cycles;
+        worst += ins->cycles + BLOCK_MAX_PENALTY;
+        pc = next;
+
+        if(block_ends(ins->opcode, ins->addr_mode)) {
+            break;
+        }
+    }
+
+    if(count == 0) {
+        return NULL;
+    }
+
+    Block_t* block = (Block_t*) malloc(sizeof(Block_t) + count * sizeof(Block_op_t));
+    if(block == NULL) {
+        return NULL;
+    }
+
+    memcpy(block->ops, ops, count * sizeof(Block_op_t));
+    block->start = address;
+    block->end = pc;
+    block->next = (uint16_t) pc;
+    block->target = ops[count - 1].target;
+    block->cycles = cycles;
+    block->worst = worst - ops[count - 1].cycles - BLOCK_MAX_PENALTY;
+    block->count = count;
+    block->spin = (uint8_t) spin_kind(ops, count, address, cache->variant);
+    block->breakpoint = (uint8_t) block_cache_breakpoint(cache, address);
+    block->executions = 0;
+    block->native = NULL;
+
+    block->page_next = cache->page[page];
+    cache->page[page] = block;
+    cache->lookup[address] = block;
+
+    page_use(cache, page);
+    if(((pc - 1) >> 8) != page) {
+        page_use(cache, (uint8_t) ((pc - 1) >> 8));
+    }
+
+    cache->built++;
+    return block;
+}
+
+/**
+ * drop the blocks whose code covers an address
+ * @param cache block cache
+ * @param address address written to
+ */
+void block_cache_invalidate(Block_cache_t* cache, uint16_t address) {
+    uint8_t page = address >> 8;
+    uint32_t before = cache->generation;
+
+    drop(cache, page, address, address);
+    if(page > 0) {
+        drop(cache, page - 1, address, address);
+    }
+
+    cache->invalidated += cache->generation - before;
+}
+
+/**
+ * drop every block with code in a page
+ * @param cache block cache
+ * @param page page number
+ */
+void block_cache_invalidate_page(Block_cache_t* cache, uint8_t page) {
+    uint32_t first = page * MEMORY_PAGE_SIZE;
+    uint32_t last = first + MEMORY_PAGE_SIZE - 1;
+
+    drop(cache, page, first, last);
+    if(page > 0) {
+        drop(cache, page - 1, first, last);
+    }
+}
+
+/* drop the blocks covering an address without counting them as invalidated */
+static void redecode(Block_cache_t* cache, uint16_t address) {
+    uint8_t page = address >> 8;
+
+    drop(cache, page, address, address);
+    if(page > 0) {
+        drop(cache, page - 1, address, address);
+    }
+}
+
+/**
+ * set a breakpoint
+ * @param cache block cache
+ * @param address address of the instruction to stop before
+ * @return 0 on success, -1 if the breakpoints could not be allocated
+ */
+int block_cache_set_breakpoint(Block_cache_t* cache, uint16_t address) {
+    if(cache->breakpoints == NULL) {
+        cache->breakpoints = (uint8_t*) calloc(MEMORY_SIZE / 8, 1);
+        if(cache->breakpoints == NULL) {
+            return -1;
+        }
+    }
+
+    cache->breakpoints[address >> 3] |= (uint8_t) (1 << (address & 7));
+    redecode(cache, address);
+    return 0;
+}
+
+/**
+ * remove a breakpoint
+ * @param cache block cache
+ * @param address address it was set at
+ */
+void block_cache_clear_breakpoint(Block_cache_t* cache, uint16_t address) {
+    if(block_cache_breakpoint(cache, address)) {
+        cache->breakpoints[address >> 3] &= (uint8_t) ~(1 << (address & 7));
+        redecode(cache, address);
+    }
+}
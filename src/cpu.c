@@ -1,55 +1,1553 @@
 #include "cpu.h"
+#include "config.h"
 #include "memory-map.h"
+#include "block-cache.h"
+#include "jit.h"
+#include "decimal.h"
+#include "profiler.h"
+#include "trace.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "disassembler.h"
 #include <stdio.h>
 #include <stdint.h>
 
+#if defined(__GNUC__)
+#define CPU_INLINE static inline __attribute__((always_inline))
+#define CPU_NONNULL __attribute__((nonnull))
+#define CPU_UNUSED __attribute__((unused))
+#else
+#define CPU_INLINE static inline
+#define CPU_NONNULL
+#define CPU_UNUSED
+#endif
+
+#define NMI_VECTOR 0xFFFA               ///< NMI vector
+#define RESET_VECTOR 0xFFFC             ///< reset vector
+#define IRQ_VECTOR 0xFFFE               ///< BRK/IRQ vector
+#define RESET_CYCLES 7                  ///< length of the reset sequence
+#define INTERRUPT_CYCLES 7              ///< length of the IRQ and NMI sequences
+
 /**
- * store the reset memory addresses.
- * the stack will always reside in the address space of 0x0100 - 0x01FF
- * we only need to store the LSB since this address will always start with 0x01
- * Around 7 cycles are used to get the SP to 0xFF but since I am not
- * emulating a cycle accurate CPU, I jump to the final values of the registers
+ * opcode maps, one per CPU variant and one entry per opcode byte
+ * X(opcode byte, mnemonic, addressing mode, base cycles)
+ *
+ * Opcodes a variant does not define are listed as INVLD with the addressing mode that gives
+ * their length in bytes
+ */
+
+/*
+ * NMOS 6502, shifts and rotates on a,x always take 7 cycles and JMP (a) takes 5
+ * the undocumented opcodes are listed under their common names, 0xEB is the same as SBC #
+ */
+#define CPU_OPCODE_MAP_NMOS(X) \
+    /* 0 */ \
+    X(0x00, BRK, STK, 7)            X(0x01, ORA, ZPG_INDX_IND, 6)   X(0x02, JAM, IMP, 2)            X(0x03, SLO, ZPG_INDX_IND, 8) \
+    X(0x04, NOP, ZPG, 3)            X(0x05, ORA, ZPG, 3)            X(0x06, ASL, ZPG, 5)            X(0x07, SLO, ZPG, 5) \
+    X(0x08, PHP, STK, 3)            X(0x09, ORA, IMM, 2)            X(0x0A, ASL, ACC, 2)            X(0x0B, ANC, IMM, 2) \
+    X(0x0C, NOP, ABS_A, 4)          X(0x0D, ORA, ABS_A, 4)          X(0x0E, ASL, ABS_A, 6)          X(0x0F, SLO, ABS_A, 6) \
+    /* 1 */ \
+    X(0x10, BPL, PC_REL, 2)         X(0x11, ORA, ZPG_IND_INDX_Y, 5) X(0x12, JAM, IMP, 2)            X(0x13, SLO, ZPG_IND_INDX_Y, 8) \
+    X(0x14, NOP, ZPG_INDX_X, 4)     X(0x15, ORA, ZPG_INDX_X, 4)     X(0x16, ASL, ZPG_INDX_X, 6)     X(0x17, SLO, ZPG_INDX_X, 6) \
+    X(0x18, CLC, IMP, 2)            X(0x19, ORA, ABS_INDX_Y, 4)     X(0x1A, NOP, IMP, 2)            X(0x1B, SLO, ABS_INDX_Y, 7) \
+    X(0x1C, NOP, ABS_INDX_X, 4)     X(0x1D, ORA, ABS_INDX_X, 4)     X(0x1E, ASL, ABS_INDX_X, 7)     X(0x1F, SLO, ABS_INDX_X, 7) \
+    /* 2 */ \
+    X(0x20, JSR, ABS_A, 6)          X(0x21, AND, ZPG_INDX_IND, 6)   X(0x22, JAM, IMP, 2)            X(0x23, RLA, ZPG_INDX_IND, 8) \
+    X(0x24, BIT, ZPG, 3)            X(0x25, AND, ZPG, 3)            X(0x26, ROL, ZPG, 5)            X(0x27, RLA, ZPG, 5) \
+    X(0x28, PLP, STK, 4)            X(0x29, AND, IMM, 2)            X(0x2A, ROL, ACC, 2)            X(0x2B, ANC, IMM, 2) \
+    X(0x2C, BIT, ABS_A, 4)          X(0x2D, AND, ABS_A, 4)          X(0x2E, ROL, ABS_A, 6)          X(0x2F, RLA, ABS_A, 6) \
+    /* 3 */ \
+    X(0x30, BMI, PC_REL, 2)         X(0x31, AND, ZPG_IND_INDX_Y, 5) X(0x32, JAM, IMP, 2)            X(0x33, RLA, ZPG_IND_INDX_Y, 8) \
+    X(0x34, NOP, ZPG_INDX_X, 4)     X(0x35, AND, ZPG_INDX_X, 4)     X(0x36, ROL, ZPG_INDX_X, 6)     X(0x37, RLA, ZPG_INDX_X, 6) \
+    X(0x38, SEC, IMP, 2)            X(0x39, AND, ABS_INDX_Y, 4)     X(0x3A, NOP, IMP, 2)            X(0x3B, RLA, ABS_INDX_Y, 7) \
+    X(0x3C, NOP, ABS_INDX_X, 4)     X(0x3D, AND, ABS_INDX_X, 4)     X(0x3E, ROL, ABS_INDX_X, 7)     X(0x3F, RLA, ABS_INDX_X, 7) \
+    /* 4 */ \
+    X(0x40, RTI, STK, 6)            X(0x41, EOR, ZPG_INDX_IND, 6)   X(0x42, JAM, IMP, 2)            X(0x43, SRE, ZPG_INDX_IND, 8) \
+    X(0x44, NOP, ZPG, 3)            X(0x45, EOR, ZPG, 3)            X(0x46, LSR, ZPG, 5)            X(0x47, SRE, ZPG, 5) \
+    X(0x48, PHA, STK, 3)            X(0x49, EOR, IMM, 2)            X(0x4A, LSR, ACC, 2)            X(0x4B, ALR, IMM, 2) \
+    X(0x4C, JMP, ABS_A, 3)          X(0x4D, EOR, ABS_A, 4)          X(0x4E, LSR, ABS_A, 6)          X(0x4F, SRE, ABS_A, 6) \
+    /* 5 */ \
+    X(0x50, BVC, PC_REL, 2)         X(0x51, EOR, ZPG_IND_INDX_Y, 5) X(0x52, JAM, IMP, 2)            X(0x53, SRE, ZPG_IND_INDX_Y, 8) \
+    X(0x54, NOP, ZPG_INDX_X, 4)     X(0x55, EOR, ZPG_INDX_X, 4)     X(0x56, LSR, ZPG_INDX_X, 6)     X(0x57, SRE, ZPG_INDX_X, 6) \
+    X(0x58, CLI, IMP, 2)            X(0x59, EOR, ABS_INDX_Y, 4)     X(0x5A, NOP, IMP, 2)            X(0x5B, SRE, ABS_INDX_Y, 7) \
+    X(0x5C, NOP, ABS_INDX_X, 4)     X(0x5D, EOR, ABS_INDX_X, 4)     X(0x5E, LSR, ABS_INDX_X, 7)     X(0x5F, SRE, ABS_INDX_X, 7) \
+    /* 6 */ \
+    X(0x60, RTS, STK, 6)            X(0x61, ADC, ZPG_INDX_IND, 6)   X(0x62, JAM, IMP, 2)            X(0x63, RRA, ZPG_INDX_IND, 8) \
+    X(0x64, NOP, ZPG, 3)            X(0x65, ADC, ZPG, 3)            X(0x66, ROR, ZPG, 5)            X(0x67, RRA, ZPG, 5) \
+    X(0x68, PLA, STK, 4)            X(0x69, ADC, IMM, 2)            X(0x6A, ROR, ACC, 2)            X(0x6B, ARR, IMM, 2) \
+    X(0x6C, JMP, ABS_IND, 5)        X(0x6D, ADC, ABS_A, 4)          X(0x6E, ROR, ABS_A, 6)          X(0x6F, RRA, ABS_A, 6) \
+    /* 7 */ \
+    X(0x70, BVS, PC_REL, 2)         X(0x71, ADC, ZPG_IND_INDX_Y, 5) X(0x72, JAM, IMP, 2)            X(0x73, RRA, ZPG_IND_INDX_Y, 8) \
+    X(0x74, NOP, ZPG_INDX_X, 4)     X(0x75, ADC, ZPG_INDX_X, 4)     X(0x76, ROR, ZPG_INDX_X, 6)     X(0x77, RRA, ZPG_INDX_X, 6) \
+    X(0x78, SEI, IMP, 2)            X(0x79, ADC, ABS_INDX_Y, 4)     X(0x7A, NOP, IMP, 2)            X(0x7B, RRA, ABS_INDX_Y, 7) \
+    X(0x7C, NOP, ABS_INDX_X, 4)     X(0x7D, ADC, ABS_INDX_X, 4)     X(0x7E, ROR, ABS_INDX_X, 7)     X(0x7F, RRA, ABS_INDX_X, 7) \
+    /* 8 */ \
+    X(0x80, NOP, IMM, 2)            X(0x81, STA, ZPG_INDX_IND, 6)   X(0x82, NOP, IMM, 2)            X(0x83, SAX, ZPG_INDX_IND, 6) \
+    X(0x84, STY, ZPG, 3)            X(0x85, STA, ZPG, 3)            X(0x86, STX, ZPG, 3)            X(0x87, SAX, ZPG, 3) \
+    X(0x88, DEY, IMP, 2)            X(0x89, NOP, IMM, 2)            X(0x8A, TXA, IMP, 2)            X(0x8B, ANE, IMM, 2) \
+    X(0x8C, STY, ABS_A, 4)          X(0x8D, STA, ABS_A, 4)          X(0x8E, STX, ABS_A, 4)          X(0x8F, SAX, ABS_A, 4) \
+    /* 9 */ \
+    X(0x90, BCC, PC_REL, 2)         X(0x91, STA, ZPG_IND_INDX_Y, 6) X(0x92, JAM, IMP, 2)            X(0x93, SHA, ZPG_IND_INDX_Y, 6) \
+    X(0x94, STY, ZPG_INDX_X, 4)     X(0x95, STA, ZPG_INDX_X, 4)     X(0x96, STX, ZPG_INDX_Y, 4)     X(0x97, SAX, ZPG_INDX_Y, 4) \
+    X(0x98, TYA, IMP, 2)            X(0x99, STA, ABS_INDX_Y, 5)     X(0x9A, TXS, IMP, 2)            X(0x9B, TAS, ABS_INDX_Y, 5) \
+    X(0x9C, SHY, ABS_INDX_X, 5)     X(0x9D, STA, ABS_INDX_X, 5)     X(0x9E, SHX, ABS_INDX_Y, 5)     X(0x9F, SHA, ABS_INDX_Y, 5) \
+    /* A */ \
+    X(0xA0, LDY, IMM, 2)            X(0xA1, LDA, ZPG_INDX_IND, 6)   X(0xA2, LDX, IMM, 2)            X(0xA3, LAX, ZPG_INDX_IND, 6) \
+    X(0xA4, LDY, ZPG, 3)            X(0xA5, LDA, ZPG, 3)            X(0xA6, LDX, ZPG, 3)            X(0xA7, LAX, ZPG, 3) \
+    X(0xA8, TAY, IMP, 2)            X(0xA9, LDA, IMM, 2)            X(0xAA, TAX, IMP, 2)            X(0xAB, LXA, IMM, 2) \
+    X(0xAC, LDY, ABS_A, 4)          X(0xAD, LDA, ABS_A, 4)          X(0xAE, LDX, ABS_A, 4)          X(0xAF, LAX, ABS_A, 4) \
+    /* B */ \
+    X(0xB0, BCS, PC_REL, 2)         X(0xB1, LDA, ZPG_IND_INDX_Y, 5) X(0xB2, JAM, IMP, 2)            X(0xB3, LAX, ZPG_IND_INDX_Y, 5) \
+    X(0xB4, LDY, ZPG_INDX_X, 4)     X(0xB5, LDA, ZPG_INDX_X, 4)     X(0xB6, LDX, ZPG_INDX_Y, 4)     X(0xB7, LAX, ZPG_INDX_Y, 4) \
+    X(0xB8, CLV, IMP, 2)            X(0xB9, LDA, ABS_INDX_Y, 4)     X(0xBA, TSX, IMP, 2)            X(0xBB, LAS, ABS_INDX_Y, 4) \
+    X(0xBC, LDY, ABS_INDX_X, 4)     X(0xBD, LDA, ABS_INDX_X, 4)     X(0xBE, LDX, ABS_INDX_Y, 4)     X(0xBF, LAX, ABS_INDX_Y, 4) \
+    /* C */ \
+    X(0xC0, CPY, IMM, 2)            X(0xC1, CMP, ZPG_INDX_IND, 6)   X(0xC2, NOP, IMM, 2)            X(0xC3, DCP, ZPG_INDX_IND, 8) \
+    X(0xC4, CPY, ZPG, 3)            X(0xC5, CMP, ZPG, 3)            X(0xC6, DEC, ZPG, 5)            X(0xC7, DCP, ZPG, 5) \
+    X(0xC8, INY, IMP, 2)            X(0xC9, CMP, IMM, 2)            X(0xCA, DEX, IMP, 2)            X(0xCB, SBX, IMM, 2) \
+    X(0xCC, CPY, ABS_A, 4)          X(0xCD, CMP, ABS_A, 4)          X(0xCE, DEC, ABS_A, 6)          X(0xCF, DCP, ABS_A, 6) \
+    /* D */ \
+    X(0xD0, BNE, PC_REL, 2)         X(0xD1, CMP, ZPG_IND_INDX_Y, 5) X(0xD2, JAM, IMP, 2)            X(0xD3, DCP, ZPG_IND_INDX_Y, 8) \
+    X(0xD4, NOP, ZPG_INDX_X, 4)     X(0xD5, CMP, ZPG_INDX_X, 4)     X(0xD6, DEC, ZPG_INDX_X, 6)     X(0xD7, DCP, ZPG_INDX_X, 6) \
+    X(0xD8, CLD, IMP, 2)            X(0xD9, CMP, ABS_INDX_Y, 4)     X(0xDA, NOP, IMP, 2)            X(0xDB, DCP, ABS_INDX_Y, 7) \
+    X(0xDC, NOP, ABS_INDX_X, 4)     X(0xDD, CMP, ABS_INDX_X, 4)     X(0xDE, DEC, ABS_INDX_X, 7)     X(0xDF, DCP, ABS_INDX_X, 7) \
+    /* E */ \
+    X(0xE0, CPX, IMM, 2)            X(0xE1, SBC, ZPG_INDX_IND, 6)   X(0xE2, NOP, IMM, 2)            X(0xE3, ISC, ZPG_INDX_IND, 8) \
+    X(0xE4, CPX, ZPG, 3)            X(0xE5, SBC, ZPG, 3)            X(0xE6, INC, ZPG, 5)            X(0xE7, ISC, ZPG, 5) \
+    X(0xE8, INX, IMP, 2)            X(0xE9, SBC, IMM, 2)            X(0xEA, NOP, IMP, 2)            X(0xEB, SBC, IMM, 2) \
+    X(0xEC, CPX, ABS_A, 4)          X(0xED, SBC, ABS_A, 4)          X(0xEE, INC, ABS_A, 6)          X(0xEF, ISC, ABS_A, 6) \
+    /* F */ \
+    X(0xF0, BEQ, PC_REL, 2)         X(0xF1, SBC, ZPG_IND_INDX_Y, 5) X(0xF2, JAM, IMP, 2)            X(0xF3, ISC, ZPG_IND_INDX_Y, 8) \
+    X(0xF4, NOP, ZPG_INDX_X, 4)     X(0xF5, SBC, ZPG_INDX_X, 4)     X(0xF6, INC, ZPG_INDX_X, 6)     X(0xF7, ISC, ZPG_INDX_X, 6) \
+    X(0xF8, SED, IMP, 2)            X(0xF9, SBC, ABS_INDX_Y, 4)     X(0xFA, NOP, IMP, 2)            X(0xFB, ISC, ABS_INDX_Y, 7) \
+    X(0xFC, NOP, ABS_INDX_X, 4)     X(0xFD, SBC, ABS_INDX_X, 4)     X(0xFE, INC, ABS_INDX_X, 7)     X(0xFF, ISC, ABS_INDX_X, 7)
+
+/* 65C02 without the Rockwell bit instructions or WAI and STP, their opcodes are one byte NOPs */
+#define CPU_OPCODE_MAP_65C02(X) \
+    /* 0 */ \
+    X(0x00, BRK, STK, 7)            X(0x01, ORA, ZPG_INDX_IND, 6)   X(0x02, INVLD, IMM, 2)          X(0x03, INVLD, IMP, 1) \
+    X(0x04, TSB, ZPG, 5)            X(0x05, ORA, ZPG, 3)            X(0x06, ASL, ZPG, 5)            X(0x07, INVLD, IMP, 1) \
+    X(0x08, PHP, STK, 3)            X(0x09, ORA, IMM, 2)            X(0x0A, ASL, ACC, 2)            X(0x0B, INVLD, IMP, 1) \
+    X(0x0C, TSB, ABS_A, 6)          X(0x0D, ORA, ABS_A, 4)          X(0x0E, ASL, ABS_A, 6)          X(0x0F, INVLD, IMP, 1) \
+    /* 1 */ \
+    X(0x10, BPL, PC_REL, 2)         X(0x11, ORA, ZPG_IND_INDX_Y, 5) X(0x12, ORA, ZPG_IND, 5)        X(0x13, INVLD, IMP, 1) \
+    X(0x14, TRB, ZPG, 5)            X(0x15, ORA, ZPG_INDX_X, 4)     X(0x16, ASL, ZPG_INDX_X, 6)     X(0x17, INVLD, IMP, 1) \
+    X(0x18, CLC, IMP, 2)            X(0x19, ORA, ABS_INDX_Y, 4)     X(0x1A, INC, ACC, 2)            X(0x1B, INVLD, IMP, 1) \
+    X(0x1C, TRB, ABS_A, 6)          X(0x1D, ORA, ABS_INDX_X, 4)     X(0x1E, ASL, ABS_INDX_X, 6)     X(0x1F, INVLD, IMP, 1) \
+    /* 2 */ \
+    X(0x20, JSR, ABS_A, 6)          X(0x21, AND, ZPG_INDX_IND, 6)   X(0x22, INVLD, IMM, 2)          X(0x23, INVLD, IMP, 1) \
+    X(0x24, BIT, ZPG, 3)            X(0x25, AND, ZPG, 3)            X(0x26, ROL, ZPG, 5)            X(0x27, INVLD, IMP, 1) \
+    X(0x28, PLP, STK, 4)            X(0x29, AND, IMM, 2)            X(0x2A, ROL, ACC, 2)            X(0x2B, INVLD, IMP, 1) \
+    X(0x2C, BIT, ABS_A, 4)          X(0x2D, AND, ABS_A, 4)          X(0x2E, ROL, ABS_A, 6)          X(0x2F, INVLD, IMP, 1) \
+    /* 3 */ \
+    X(0x30, BMI, PC_REL, 2)         X(0x31, AND, ZPG_IND_INDX_Y, 5) X(0x32, AND, ZPG_IND, 5)        X(0x33, INVLD, IMP, 1) \
+    X(0x34, BIT, ZPG_INDX_X, 4)     X(0x35, AND, ZPG_INDX_X, 4)     X(0x36, ROL, ZPG_INDX_X, 6)     X(0x37, INVLD, IMP, 1) \
+    X(0x38, SEC, IMP, 2)            X(0x39, AND, ABS_INDX_Y, 4)     X(0x3A, DEC, ACC, 2)            X(0x3B, INVLD, IMP, 1) \
+    X(0x3C, BIT, ABS_INDX_X, 4)     X(0x3D, AND, ABS_INDX_X, 4)     X(0x3E, ROL, ABS_INDX_X, 6)     X(0x3F, INVLD, IMP, 1) \
+    /* 4 */ \
+    X(0x40, RTI, STK, 6)            X(0x41, EOR, ZPG_INDX_IND, 6)   X(0x42, INVLD, IMM, 2)          X(0x43, INVLD, IMP, 1) \
+    X(0x44, INVLD, ZPG, 3)          X(0x45, EOR, ZPG, 3)            X(0x46, LSR, ZPG, 5)            X(0x47, INVLD, IMP, 1) \
+    X(0x48, PHA, STK, 3)            X(0x49, EOR, IMM, 2)            X(0x4A, LSR, ACC, 2)            X(0x4B, INVLD, IMP, 1) \
+    X(0x4C, JMP, ABS_A, 3)          X(0x4D, EOR, ABS_A, 4)          X(0x4E, LSR, ABS_A, 6)          X(0x4F, INVLD, IMP, 1) \
+    /* 5 */ \
+    X(0x50, BVC, PC_REL, 2)         X(0x51, EOR, ZPG_IND_INDX_Y, 5) X(0x52, EOR, ZPG_IND, 5)        X(0x53, INVLD, IMP, 1) \
+    X(0x54, INVLD, ZPG_INDX_X, 4)   X(0x55, EOR, ZPG_INDX_X, 4)     X(0x56, LSR, ZPG_INDX_X, 6)     X(0x57, INVLD, IMP, 1) \
+    X(0x58, CLI, IMP, 2)            X(0x59, EOR, ABS_INDX_Y, 4)     X(0x5A, PHY, STK, 3)            X(0x5B, INVLD, IMP, 1) \
+    X(0x5C, INVLD, ABS_A, 8)        X(0x5D, EOR, ABS_INDX_X, 4)     X(0x5E, LSR, ABS_INDX_X, 6)     X(0x5F, INVLD, IMP, 1) \
+    /* 6 */ \
+    X(0x60, RTS, STK, 6)            X(0x61, ADC, ZPG_INDX_IND, 6)   X(0x62, INVLD, IMM, 2)          X(0x63, INVLD, IMP, 1) \
+    X(0x64, STZ, ZPG, 3)            X(0x65, ADC, ZPG, 3)            X(0x66, ROR, ZPG, 5)            X(0x67, INVLD, IMP, 1) \
+    X(0x68, PLA, STK, 4)            X(0x69, ADC, IMM, 2)            X(0x6A, ROR, ACC, 2)            X(0x6B, INVLD, IMP, 1) \
+    X(0x6C, JMP, ABS_IND, 6)        X(0x6D, ADC, ABS_A, 4)          X(0x6E, ROR, ABS_A, 6)          X(0x6F, INVLD, IMP, 1) \
+    /* 7 */ \
+    X(0x70, BVS, PC_REL, 2)         X(0x71, ADC, ZPG_IND_INDX_Y, 5) X(0x72, ADC, ZPG_IND, 5)        X(0x73, INVLD, IMP, 1) \
+    X(0x74, STZ, ZPG_INDX_X, 4)     X(0x75, ADC, ZPG_INDX_X, 4)     X(0x76, ROR, ZPG_INDX_X, 6)     X(0x77, INVLD, IMP, 1) \
+    X(0x78, SEI, IMP, 2)            X(0x79, ADC, ABS_INDX_Y, 4)     X(0x7A, PLY, STK, 4)            X(0x7B, INVLD, IMP, 1) \
+    X(0x7C, JMP, ABS_INDX_IND, 6)   X(0x7D, ADC, ABS_INDX_X, 4)     X(0x7E, ROR, ABS_INDX_X, 6)     X(0x7F, INVLD, IMP, 1) \
+    /* 8 */ \
+    X(0x80, BRA, PC_REL, 2)         X(0x81, STA, ZPG_INDX_IND, 6)   X(0x82, INVLD, IMM, 2)          X(0x83, INVLD, IMP, 1) \
+    X(0x84, STY, ZPG, 3)            X(0x85, STA, ZPG, 3)            X(0x86, STX, ZPG, 3)            X(0x87, INVLD, IMP, 1) \
+    X(0x88, DEY, IMP, 2)            X(0x89, BIT, IMM, 2)            X(0x8A, TXA, IMP, 2)            X(0x8B, INVLD, IMP, 1) \
+    X(0x8C, STY, ABS_A, 4)          X(0x8D, STA, ABS_A, 4)          X(0x8E, STX, ABS_A, 4)          X(0x8F, INVLD, IMP, 1) \
+    /* 9 */ \
+    X(0x90, BCC, PC_REL, 2)         X(0x91, STA, ZPG_IND_INDX_Y, 6) X(0x92, STA, ZPG_IND, 5)        X(0x93, INVLD, IMP, 1) \
+    X(0x94, STY, ZPG_INDX_X, 4)     X(0x95, STA, ZPG_INDX_X, 4)     X(0x96, STX, ZPG_INDX_Y, 4)     X(0x97, INVLD, IMP, 1) \
+    X(0x98, TYA, IMP, 2)            X(0x99, STA, ABS_INDX_Y, 5)     X(0x9A, TXS, IMP, 2)            X(0x9B, INVLD, IMP, 1) \
+    X(0x9C, STZ, ABS_A, 4)          X(0x9D, STA, ABS_INDX_X, 5)     X(0x9E, STZ, ABS_INDX_X, 5)     X(0x9F, INVLD, IMP, 1) \
+    /* A */ \
+    X(0xA0, LDY, IMM, 2)            X(0xA1, LDA, ZPG_INDX_IND, 6)   X(0xA2, LDX, IMM, 2)            X(0xA3, INVLD, IMP, 1) \
+    X(0xA4, LDY, ZPG, 3)            X(0xA5, LDA, ZPG, 3)            X(0xA6, LDX, ZPG, 3)            X(0xA7, INVLD, IMP, 1) \
+    X(0xA8, TAY, IMP, 2)            X(0xA9, LDA, IMM, 2)            X(0xAA, TAX, IMP, 2)            X(0xAB, INVLD, IMP, 1) \
+    X(0xAC, LDY, ABS_A, 4)          X(0xAD, LDA, ABS_A, 4)          X(0xAE, LDX, ABS_A, 4)          X(0xAF, INVLD, IMP, 1) \
+    /* B */ \
+    X(0xB0, BCS, PC_REL, 2)         X(0xB1, LDA, ZPG_IND_INDX_Y, 5) X(0xB2, LDA, ZPG_IND, 5)        X(0xB3, INVLD, IMP, 1) \
+    X(0xB4, LDY, ZPG_INDX_X, 4)     X(0xB5, LDA, ZPG_INDX_X, 4)     X(0xB6, LDX, ZPG_INDX_Y, 4)     X(0xB7, INVLD, IMP, 1) \
+    X(0xB8, CLV, IMP, 2)            X(0xB9, LDA, ABS_INDX_Y, 4)     X(0xBA, TSX, IMP, 2)            X(0xBB, INVLD, IMP, 1) \
+    X(0xBC, LDY, ABS_INDX_X, 4)     X(0xBD, LDA, ABS_INDX_X, 4)     X(0xBE, LDX, ABS_INDX_Y, 4)     X(0xBF, INVLD, IMP, 1) \
+    /* C */ \
+    X(0xC0, CPY, IMM, 2)            X(0xC1, CMP, ZPG_INDX_IND, 6)   X(0xC2, INVLD, IMM, 2)          X(0xC3, INVLD, IMP, 1) \
+    X(0xC4, CPY, ZPG, 3)            X(0xC5, CMP, ZPG, 3)            X(0xC6, DEC, ZPG, 5)            X(0xC7, INVLD, IMP, 1) \
+    X(0xC8, INY, IMP, 2)            X(0xC9, CMP, IMM, 2)            X(0xCA, DEX, IMP, 2)            X(0xCB, INVLD, IMP, 1) \
+    X(0xCC, CPY, ABS_A, 4)          X(0xCD, CMP, ABS_A, 4)          X(0xCE, DEC, ABS_A, 6)          X(0xCF, INVLD, IMP, 1) \
+    /* D */ \
+    X(0xD0, BNE, PC_REL, 2)         X(0xD1, CMP, ZPG_IND_INDX_Y, 5) X(0xD2, CMP, ZPG_IND, 5)        X(0xD3, INVLD, IMP, 1) \
+    X(0xD4, INVLD, ZPG_INDX_X, 4)   X(0xD5, CMP, ZPG_INDX_X, 4)     X(0xD6, DEC, ZPG_INDX_X, 6)     X(0xD7, INVLD, IMP, 1) \
+    X(0xD8, CLD, IMP, 2)            X(0xD9, CMP, ABS_INDX_Y, 4)     X(0xDA, PHX, STK, 3)            X(0xDB, INVLD, IMP, 1) \
+    X(0xDC, INVLD, ABS_A, 4)        X(0xDD, CMP, ABS_INDX_X, 4)     X(0xDE, DEC, ABS_INDX_X, 7)     X(0xDF, INVLD, IMP, 1) \
+    /* E */ \
+    X(0xE0, CPX, IMM, 2)            X(0xE1, SBC, ZPG_INDX_IND, 6)   X(0xE2, INVLD, IMM, 2)          X(0xE3, INVLD, IMP, 1) \
+    X(0xE4, CPX, ZPG, 3)            X(0xE5, SBC, ZPG, 3)            X(0xE6, INC, ZPG, 5)            X(0xE7, INVLD, IMP, 1) \
+    X(0xE8, INX, IMP, 2)            X(0xE9, SBC, IMM, 2)            X(0xEA, NOP, IMP, 2)            X(0xEB, INVLD, IMP, 1) \
+    X(0xEC, CPX, ABS_A, 4)          X(0xED, SBC, ABS_A, 4)          X(0xEE, INC, ABS_A, 6)          X(0xEF, INVLD, IMP, 1) \
+    /* F */ \
+    X(0xF0, BEQ, PC_REL, 2)         X(0xF1, SBC, ZPG_IND_INDX_Y, 5) X(0xF2, SBC, ZPG_IND, 5)        X(0xF3, INVLD, IMP, 1) \
+    X(0xF4, INVLD, ZPG_INDX_X, 4)   X(0xF5, SBC, ZPG_INDX_X, 4)     X(0xF6, INC, ZPG_INDX_X, 6)     X(0xF7, INVLD, IMP, 1) \
+    X(0xF8, SED, IMP, 2)            X(0xF9, SBC, ABS_INDX_Y, 4)     X(0xFA, PLX, STK, 4)            X(0xFB, INVLD, IMP, 1) \
+    X(0xFC, INVLD, ABS_A, 4)        X(0xFD, SBC, ABS_INDX_X, 4)     X(0xFE, INC, ABS_INDX_X, 7)     X(0xFF, INVLD, IMP, 1)
+
+/* W65C02S, unused opcodes execute as NOPs */
+#define CPU_OPCODE_MAP_W65C02S(X) \
+    /* 0 */ \
+    X(0x00, BRK, STK, 7)            X(0x01, ORA, ZPG_INDX_IND, 6)   X(0x02, INVLD, IMM, 2)          X(0x03, INVLD, IMP, 1) \
+    X(0x04, TSB, ZPG, 5)            X(0x05, ORA, ZPG, 3)            X(0x06, ASL, ZPG, 5)            X(0x07, RMB0, ZPG, 5) \
+    X(0x08, PHP, STK, 3)            X(0x09, ORA, IMM, 2)            X(0x0A, ASL, ACC, 2)            X(0x0B, INVLD, IMP, 1) \
+    X(0x0C, TSB, ABS_A, 6)          X(0x0D, ORA, ABS_A, 4)          X(0x0E, ASL, ABS_A, 6)          X(0x0F, BBR0, ZPG_PC_REL, 5) \
+    /* 1 */ \
+    X(0x10, BPL, PC_REL, 2)         X(0x11, ORA, ZPG_IND_INDX_Y, 5) X(0x12, ORA, ZPG_IND, 5)        X(0x13, INVLD, IMP, 1) \
+    X(0x14, TRB, ZPG, 5)            X(0x15, ORA, ZPG_INDX_X, 4)     X(0x16, ASL, ZPG_INDX_X, 6)     X(0x17, RMB1, ZPG, 5) \
+    X(0x18, CLC, IMP, 2)            X(0x19, ORA, ABS_INDX_Y, 4)     X(0x1A, INC, ACC, 2)            X(0x1B, INVLD, IMP, 1) \
+    X(0x1C, TRB, ABS_A, 6)          X(0x1D, ORA, ABS_INDX_X, 4)     X(0x1E, ASL, ABS_INDX_X, 6)     X(0x1F, BBR1, ZPG_PC_REL, 5) \
+    /* 2 */ \
+    X(0x20, JSR, ABS_A, 6)          X(0x21, AND, ZPG_INDX_IND, 6)   X(0x22, INVLD, IMM, 2)          X(0x23, INVLD, IMP, 1) \
+    X(0x24, BIT, ZPG, 3)            X(0x25, AND, ZPG, 3)            X(0x26, ROL, ZPG, 5)            X(0x27, RMB2, ZPG, 5) \
+    X(0x28, PLP, STK, 4)            X(0x29, AND, IMM, 2)            X(0x2A, ROL, ACC, 2)            X(0x2B, INVLD, IMP, 1) \
+    X(0x2C, BIT, ABS_A, 4)          X(0x2D, AND, ABS_A, 4)          X(0x2E, ROL, ABS_A, 6)          X(0x2F, BBR2, ZPG_PC_REL, 5) \
+    /* 3 */ \
+    X(0x30, BMI, PC_REL, 2)         X(0x31, AND, ZPG_IND_INDX_Y, 5) X(0x32, AND, ZPG_IND, 5)        X(0x33, INVLD, IMP, 1) \
+    X(0x34, BIT, ZPG_INDX_X, 4)     X(0x35, AND, ZPG_INDX_X, 4)     X(0x36, ROL, ZPG_INDX_X, 6)     X(0x37, RMB3, ZPG, 5) \
+    X(0x38, SEC, IMP, 2)            X(0x39, AND, ABS_INDX_Y, 4)     X(0x3A, DEC, ACC, 2)            X(0x3B, INVLD, IMP, 1) \
+    X(0x3C, BIT, ABS_INDX_X, 4)     X(0x3D, AND, ABS_INDX_X, 4)     X(0x3E, ROL, ABS_INDX_X, 6)     X(0x3F, BBR3, ZPG_PC_REL, 5) \
+    /* 4 */ \
+    X(0x40, RTI, STK, 6)            X(0x41, EOR, ZPG_INDX_IND, 6)   X(0x42, INVLD, IMM, 2)          X(0x43, INVLD, IMP, 1) \
+    X(0x44, INVLD, ZPG, 3)          X(0x45, EOR, ZPG, 3)            X(0x46, LSR, ZPG, 5)            X(0x47, RMB4, ZPG, 5) \
+    X(0x48, PHA, STK, 3)            X(0x49, EOR, IMM, 2)            X(0x4A, LSR, ACC, 2)            X(0x4B, INVLD, IMP, 1) \
+    X(0x4C, JMP, ABS_A, 3)          X(0x4D, EOR, ABS_A, 4)          X(0x4E, LSR, ABS_A, 6)          X(0x4F, BBR4, ZPG_PC_REL, 5) \
+    /* 5 */ \
+    X(0x50, BVC, PC_REL, 2)         X(0x51, EOR, ZPG_IND_INDX_Y, 5) X(0x52, EOR, ZPG_IND, 5)        X(0x53, INVLD, IMP, 1) \
+    X(0x54, INVLD, ZPG_INDX_X, 4)   X(0x55, EOR, ZPG_INDX_X, 4)     X(0x56, LSR, ZPG_INDX_X, 6)     X(0x57, RMB5, ZPG, 5) \
+    X(0x58, CLI, IMP, 2)            X(0x59, EOR, ABS_INDX_Y, 4)     X(0x5A, PHY, STK, 3)            X(0x5B, INVLD, IMP, 1) \
+    X(0x5C, INVLD, ABS_A, 8)        X(0x5D, EOR, ABS_INDX_X, 4)     X(0x5E, LSR, ABS_INDX_X, 6)     X(0x5F, BBR5, ZPG_PC_REL, 5) \
+    /* 6 */ \
+    X(0x60, RTS, STK, 6)            X(0x61, ADC, ZPG_INDX_IND, 6)   X(0x62, INVLD, IMM, 2)          X(0x63, INVLD, IMP, 1) \
+    X(0x64, STZ, ZPG, 3)            X(0x65, ADC, ZPG, 3)            X(0x66, ROR, ZPG, 5)            X(0x67, RMB6, ZPG, 5) \
+    X(0x68, PLA, STK, 4)            X(0x69, ADC, IMM, 2)            X(0x6A, ROR, ACC, 2)            X(0x6B, INVLD, IMP, 1) \
+    X(0x6C, JMP, ABS_IND, 6)        X(0x6D, ADC, ABS_A, 4)          X(0x6E, ROR, ABS_A, 6)          X(0x6F, BBR6, ZPG_PC_REL, 5) \
+    /* 7 */ \
+    X(0x70, BVS, PC_REL, 2)         X(0x71, ADC, ZPG_IND_INDX_Y, 5) X(0x72, ADC, ZPG_IND, 5)        X(0x73, INVLD, IMP, 1) \
+    X(0x74, STZ, ZPG_INDX_X, 4)     X(0x75, ADC, ZPG_INDX_X, 4)     X(0x76, ROR, ZPG_INDX_X, 6)     X(0x77, RMB7, ZPG, 5) \
+    X(0x78, SEI, IMP, 2)            X(0x79, ADC, ABS_INDX_Y, 4)     X(0x7A, PLY, STK, 4)            X(0x7B, INVLD, IMP, 1) \
+    X(0x7C, JMP, ABS_INDX_IND, 6)   X(0x7D, ADC, ABS_INDX_X, 4)     X(0x7E, ROR, ABS_INDX_X, 6)     X(0x7F, BBR7, ZPG_PC_REL, 5) \
+    /* 8 */ \
+    X(0x80, BRA, PC_REL, 2)         X(0x81, STA, ZPG_INDX_IND, 6)   X(0x82, INVLD, IMM, 2)          X(0x83, INVLD, IMP, 1) \
+    X(0x84, STY, ZPG, 3)            X(0x85, STA, ZPG, 3)            X(0x86, STX, ZPG, 3)            X(0x87, SMB0, ZPG, 5) \
+    X(0x88, DEY, IMP, 2)            X(0x89, BIT, IMM, 2)            X(0x8A, TXA, IMP, 2)            X(0x8B, INVLD, IMP, 1) \
+    X(0x8C, STY, ABS_A, 4)          X(0x8D, STA, ABS_A, 4)          X(0x8E, STX, ABS_A, 4)          X(0x8F, BBS0, ZPG_PC_REL, 5) \
+    /* 9 */ \
+    X(0x90, BCC, PC_REL, 2)         X(0x91, STA, ZPG_IND_INDX_Y, 6) X(0x92, STA, ZPG_IND, 5)        X(0x93, INVLD, IMP, 1) \
+    X(0x94, STY, ZPG_INDX_X, 4)     X(0x95, STA, ZPG_INDX_X, 4)     X(0x96, STX, ZPG_INDX_Y, 4)     X(0x97, SMB1, ZPG, 5) \
+    X(0x98, TYA, IMP, 2)            X(0x99, STA, ABS_INDX_Y, 5)     X(0x9A, TXS, IMP, 2)            X(0x9B, INVLD, IMP, 1) \
+    X(0x9C, STZ, ABS_A, 4)          X(0x9D, STA, ABS_INDX_X, 5)     X(0x9E, STZ, ABS_INDX_X, 5)     X(0x9F, BBS1, ZPG_PC_REL, 5) \
+    /* A */ \
+    X(0xA0, LDY, IMM, 2)            X(0xA1, LDA, ZPG_INDX_IND, 6)   X(0xA2, LDX, IMM, 2)            X(0xA3, INVLD, IMP, 1) \
+    X(0xA4, LDY, ZPG, 3)            X(0xA5, LDA, ZPG, 3)            X(0xA6, LDX, ZPG, 3)            X(0xA7, SMB2, ZPG, 5) \
+    X(0xA8, TAY, IMP, 2)            X(0xA9, LDA, IMM, 2)            X(0xAA, TAX, IMP, 2)            X(0xAB, INVLD, IMP, 1) \
+    X(0xAC, LDY, ABS_A, 4)          X(0xAD, LDA, ABS_A, 4)          X(0xAE, LDX, ABS_A, 4)          X(0xAF, BBS2, ZPG_PC_REL, 5) \
+    /* B */ \
+    X(0xB0, BCS, PC_REL, 2)         X(0xB1, LDA, ZPG_IND_INDX_Y, 5) X(0xB2, LDA, ZPG_IND, 5)        X(0xB3, INVLD, IMP, 1) \
+    X(0xB4, LDY, ZPG_INDX_X, 4)     X(0xB5, LDA, ZPG_INDX_X, 4)     X(0xB6, LDX, ZPG_INDX_Y, 4)     X(0xB7, SMB3, ZPG, 5) \
+    X(0xB8, CLV, IMP, 2)            X(0xB9, LDA, ABS_INDX_Y, 4)     X(0xBA, TSX, IMP, 2)            X(0xBB, INVLD, IMP, 1) \
+    X(0xBC, LDY, ABS_INDX_X, 4)     X(0xBD, LDA, ABS_INDX_X, 4)     X(0xBE, LDX, ABS_INDX_Y, 4)     X(0xBF, BBS3, ZPG_PC_REL, 5) \
+    /* C */ \
+    X(0xC0, CPY, IMM, 2)            X(0xC1, CMP, ZPG_INDX_IND, 6)   X(0xC2, INVLD, IMM, 2)          X(0xC3, INVLD, IMP, 1) \
+    X(0xC4, CPY, ZPG, 3)            X(0xC5, CMP, ZPG, 3)            X(0xC6, DEC, ZPG, 5)            X(0xC7, SMB4, ZPG, 5) \
+    X(0xC8, INY, IMP, 2)            X(0xC9, CMP, IMM, 2)            X(0xCA, DEX, IMP, 2)            X(0xCB, WAI, IMP, 3) \
+    X(0xCC, CPY, ABS_A, 4)          X(0xCD, CMP, ABS_A, 4)          X(0xCE, DEC, ABS_A, 6)          X(0xCF, BBS4, ZPG_PC_REL, 5) \
+    /* D */ \
+    X(0xD0, BNE, PC_REL, 2)         X(0xD1, CMP, ZPG_IND_INDX_Y, 5) X(0xD2, CMP, ZPG_IND, 5)        X(0xD3, INVLD, IMP, 1) \
+    X(0xD4, INVLD, ZPG_INDX_X, 4)   X(0xD5, CMP, ZPG_INDX_X, 4)     X(0xD6, DEC, ZPG_INDX_X, 6)     X(0xD7, SMB5, ZPG, 5) \
+    X(0xD8, CLD, IMP, 2)            X(0xD9, CMP, ABS_INDX_Y, 4)     X(0xDA, PHX, STK, 3)            X(0xDB, STP, IMP, 3) \
+    X(0xDC, INVLD, ABS_A, 4)        X(0xDD, CMP, ABS_INDX_X, 4)     X(0xDE, DEC, ABS_INDX_X, 7)     X(0xDF, BBS5, ZPG_PC_REL, 5) \
+    /* E */ \
+    X(0xE0, CPX, IMM, 2)            X(0xE1, SBC, ZPG_INDX_IND, 6)   X(0xE2, INVLD, IMM, 2)          X(0xE3, INVLD, IMP, 1) \
+    X(0xE4, CPX, ZPG, 3)            X(0xE5, SBC, ZPG, 3)            X(0xE6, INC, ZPG, 5)            X(0xE7, SMB6, ZPG, 5) \
+    X(0xE8, INX, IMP, 2)            X(0xE9, SBC, IMM, 2)            X(0xEA, NOP, IMP, 2)            X(0xEB, INVLD, IMP, 1) \
+    X(0xEC, CPX, ABS_A, 4)          X(0xED, SBC, ABS_A, 4)          X(0xEE, INC, ABS_A, 6)          X(0xEF, BBS6, ZPG_PC_REL, 5) \
+    /* F */ \
+    X(0xF0, BEQ, PC_REL, 2)         X(0xF1, SBC, ZPG_IND_INDX_Y, 5) X(0xF2, SBC, ZPG_IND, 5)        X(0xF3, INVLD, IMP, 1) \
+    X(0xF4, INVLD, ZPG_INDX_X, 4)   X(0xF5, SBC, ZPG_INDX_X, 4)     X(0xF6, INC, ZPG_INDX_X, 6)     X(0xF7, SMB7, ZPG, 5) \
+    X(0xF8, SED, IMP, 2)            X(0xF9, SBC, ABS_INDX_Y, 4)     X(0xFA, PLX, STK, 4)            X(0xFB, INVLD, IMP, 1) \
+    X(0xFC, INVLD, ABS_A, 4)        X(0xFD, SBC, ABS_INDX_X, 4)     X(0xFE, INC, ABS_INDX_X, 7)     X(0xFF, BBS7, ZPG_PC_REL, 5)
+
+/*
+ * stack
+ */
+
+CPU_INLINE void push8(CPU_type_t* cpu, Memory_type_t* mem, uint8_t value) {
+    mem_stack_write(mem, cpu->SP--, value);
+}
+
+CPU_INLINE uint8_t pull8(CPU_type_t* cpu, Memory_type_t* mem) {
+    return mem_stack_read(mem, ++cpu->SP);
+}
+
+CPU_INLINE void push16(CPU_type_t* cpu, Memory_type_t* mem, uint16_t value) {
+    push8(cpu, mem, value >> 8);
+    push8(cpu, mem, value & 0xFF);
+}
+
+CPU_INLINE uint16_t pull16(CPU_type_t* cpu, Memory_type_t* mem) {
+    uint16_t lo = pull8(cpu, mem);
+    return lo | (pull8(cpu, mem) << 8);
+}
+
+/*
+ * status register
+ * with lazy flags N, V, Z and C are stored as the values they come from and only packed into SR
+ * by status_pack. mask is a constant at every call site, so the switches fold away
+ */
+
+CPU_INLINE void set_flag(CPU_type_t* cpu, uint8_t mask, int on) {
+#if USE_LAZY_FLAGS
+    switch (mask) {
+        case N_MASK: cpu->flag_n = on ? N_MASK : 0; return;
+        case V_MASK: cpu->flag_v = on ? V_MASK : 0; return;
+        case Z_MASK: cpu->flag_z = !on; return;
+        case C_MASK: cpu->flag_c = on != 0; return;
+        default: break;
+    }
+#endif
+    cpu->SR = on ? (cpu->SR | mask) : (cpu->SR & ~mask);
+}
+
+/* non zero when the flag is set, C comes back as 0 or 1 */
+CPU_INLINE unsigned get_flag(const CPU_type_t* cpu, uint8_t mask) {
+#if USE_LAZY_FLAGS
+    switch (mask) {
+        case N_MASK: return cpu->flag_n & N_MASK;
+        case V_MASK: return cpu->flag_v & V_MASK;
+        case Z_MASK: return cpu->flag_z == 0;
+        case C_MASK: return cpu->flag_c;
+        default: break;
+    }
+#endif
+    return cpu->SR & mask;
+}
+
+CPU_INLINE void set_nz(CPU_type_t* cpu, uint8_t value) {
+#if USE_LAZY_FLAGS
+    cpu->flag_n = value;
+    cpu->flag_z = value;
+#else
+    cpu->SR = (cpu->SR & ~(N_MASK | Z_MASK)) | (value & N_MASK) | (value ? 0 : Z_MASK);
+#endif
+}
+
+/* packed status register, as pushed by PHP, BRK and interrupts */
+CPU_INLINE uint8_t read_status(const CPU_type_t* cpu) {
+#if USE_LAZY_FLAGS
+    return (cpu->SR & ~(N_MASK | V_MASK | Z_MASK | C_MASK)) |
+           (cpu->flag_n & N_MASK) | (cpu->flag_v & V_MASK) | (cpu->flag_z ? 0 : Z_MASK) | cpu->flag_c;
+#else
+    return cpu->SR;
+#endif
+}
+
+/* status register pulled by PLP and RTI */
+CPU_INLINE void write_status(CPU_type_t* cpu, uint8_t value) {
+    cpu->SR = value;
+#if USE_LAZY_FLAGS
+    cpu->flag_n = value;
+    cpu->flag_v = value;
+    cpu->flag_z = ~value & Z_MASK;
+    cpu->flag_c = value & C_MASK;
+#endif
+}
+
+/* N, V, Z and C packed as in SR, the other flags are left alone */
+CPU_INLINE void set_nvzc(CPU_type_t* cpu, uint8_t flags) {
+#if USE_LAZY_FLAGS
+    cpu->flag_n = flags;
+    cpu->flag_v = flags;
+    cpu->flag_z = ~flags & Z_MASK;
+    cpu->flag_c = flags & C_MASK;
+#else
+    cpu->SR = (cpu->SR & ~(N_MASK | V_MASK | Z_MASK | C_MASK)) | flags;
+#endif
+}
+
+/* SR is up to date outside the core, these move the flags in and out of it */
+CPU_INLINE void status_unpack(CPU_type_t* cpu) {
+    write_status(cpu, cpu->SR);
+}
+
+CPU_INLINE void status_pack(CPU_type_t* cpu) {
+    cpu->SR = read_status(cpu);
+}
+
+/*
+ * interrupts
+ * I lives in SR with or without lazy flags. An instruction that lets an asserted IRQ through
+ * makes the CPU pending, which stops the core after it; the run loop then takes the interrupt
+ */
+CPU_INLINE void interrupt_poll(CPU_type_t* cpu) {
+    if( (cpu->state == CPU_RUNNING) && (cpu->nmi || ( (cpu->irq != 0) && !(cpu->SR & I_MASK) )) ) {
+        cpu->state = CPU_PENDING;
+    }
+}
+
+/*
+ * operand bytes
+ * pre is NULL when decoding from memory, or the predecoded instruction when running from the
+ * block cache, in which case PC already points at the next instruction. Either way it is known
+ * at compile time whether pre is NULL, so the test folds away
+ */
+
+CPU_INLINE uint8_t fetch8(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre) {
+    if (pre != NULL) {
+        return (uint8_t) pre->operand;
+    }
+    return mem_read8(mem, cpu->PC++);
+}
+
+CPU_INLINE uint16_t fetch16(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre) {
+    if (pre != NULL) {
+        return pre->operand;
+    }
+    uint16_t value = mem_read16(mem, cpu->PC);
+    cpu->PC += 2;
+    return value;
+}
+
+/*
+ * addressing modes
+ * mode is a constant at every call site, so the switch folds away once inlined
+ *
+ * indexed reads take one more cycle when the index carries into the high byte of the address;
+ * writes and read-modify-writes always take the long path, which their base cycles include,
+ * so they pass page_penalty = 0
+ */
+
+CPU_INLINE void page_cross(CPU_type_t* cpu, uint16_t base, uint16_t address, const int page_penalty) {
+    if(page_penalty) {
+        cpu->cycles += (base ^ address) > 0xFF;
+    }
+}
+
+CPU_INLINE uint16_t operand_address(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, const Addressing_mode mode, const int page_penalty) {
+    uint16_t address;
+    uint16_t base;
+
+    switch (mode) {
+        case IMM:
+            address = (pre != NULL) ? (uint16_t) (cpu->PC - 1) : cpu->PC++;
+            break;
+        case ZPG:
+            address = fetch8(cpu, mem, pre);
+            break;
+        case ZPG_INDX_X:
+            address = (uint8_t) (fetch8(cpu, mem, pre) + cpu->X);
+            break;
+        case ZPG_INDX_Y:
+            address = (uint8_t) (fetch8(cpu, mem, pre) + cpu->Y);
+            break;
+        case ZPG_IND:
+            address = mem_read16_zp(mem, fetch8(cpu, mem, pre));
+            break;
+        case ZPG_INDX_IND:
+            address = mem_read16_zp(mem, (uint8_t) (fetch8(cpu, mem, pre) + cpu->X));
+            break;
+        case ZPG_IND_INDX_Y:
+            base = mem_read16_zp(mem, fetch8(cpu, mem, pre));
+            address = base + cpu->Y;
+            page_cross(cpu, base, address, page_penalty);
+            break;
+        case ABS_A:
+            address = fetch16(cpu, mem, pre);
+            break;
+        case ABS_INDX_X:
+            base = fetch16(cpu, mem, pre);
+            address = base + cpu->X;
+            page_cross(cpu, base, address, page_penalty);
+            break;
+        case ABS_INDX_Y:
+            base = fetch16(cpu, mem, pre);
+            address = base + cpu->Y;
+            page_cross(cpu, base, address, page_penalty);
+            break;
+        case ABS_IND:
+            address = mem_read16(mem, fetch16(cpu, mem, pre));
+            break;
+        case ABS_INDX_IND:
+            address = mem_read16(mem, (uint16_t) (fetch16(cpu, mem, pre) + cpu->X));
+            break;
+        default:
+            /* implied, accumulator and stack modes have no operand */
+            address = 0;
+            break;
+    }
+
+    return address;
+}
+
+CPU_INLINE uint8_t operand(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, const Addressing_mode mode) {
+    if ( (mode == IMM) && (pre != NULL) ) {
+        return (uint8_t) pre->operand;
+    }
+    return mem_read8(mem, operand_address(cpu, mem, pre, mode, 1));
+}
+
+/*
+ * read-modify-write on the accumulator or on memory
+ * fn is a constant too; the ALU helpers are plain inline so they can be passed by pointer
+ */
+typedef uint8_t (*alu_fn)(CPU_type_t*, uint8_t);
+
+CPU_INLINE void rmw(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, const Addressing_mode mode, const alu_fn fn, const int page_penalty) {
+    if (mode == ACC) {
+        cpu->AC = fn(cpu, cpu->AC);
+    } else {
+        uint16_t address = operand_address(cpu, mem, pre, mode, page_penalty);
+        mem_write8(mem, address, fn(cpu, mem_read8(mem, address)));
+    }
+}
+
+/* a taken branch costs one more cycle, and another one if it lands in a different page */
+CPU_INLINE void branch(CPU_type_t* cpu, int8_t offset, int taken) {
+    if (taken) {
+        uint16_t target = cpu->PC + offset;
+        cpu->cycles += 1 + (((cpu->PC ^ target) & 0xFF00) != 0);
+        cpu->PC = target;
+    }
+}
+
+/*
+ * ALU
+ */
+
+static inline uint8_t alu_asl(CPU_type_t* cpu, uint8_t value) {
+    set_flag(cpu, C_MASK, value & 0x80);
+    value <<= 1;
+    set_nz(cpu, value);
+    return value;
+}
+
+static inline uint8_t alu_lsr(CPU_type_t* cpu, uint8_t value) {
+    set_flag(cpu, C_MASK, value & 0x01);
+    value >>= 1;
+    set_nz(cpu, value);
+    return value;
+}
+
+static inline uint8_t alu_rol(CPU_type_t* cpu, uint8_t value) {
+    uint8_t result = (value << 1) | get_flag(cpu, C_MASK);
+    set_flag(cpu, C_MASK, value & 0x80);
+    set_nz(cpu, result);
+    return result;
+}
+
+static inline uint8_t alu_ror(CPU_type_t* cpu, uint8_t value) {
+    uint8_t result = (value >> 1) | (get_flag(cpu, C_MASK) << 7);
+    set_flag(cpu, C_MASK, value & 0x01);
+    set_nz(cpu, result);
+    return result;
+}
+
+static inline uint8_t alu_inc(CPU_type_t* cpu, uint8_t value) {
+    set_nz(cpu, ++value);
+    return value;
+}
+
+static inline uint8_t alu_dec(CPU_type_t* cpu, uint8_t value) {
+    set_nz(cpu, --value);
+    return value;
+}
+
+CPU_INLINE void alu_compare(CPU_type_t* cpu, uint8_t reg, uint8_t value) {
+    set_flag(cpu, C_MASK, reg >= value);
+    set_nz(cpu, (uint8_t) (reg - value));
+}
+
+/*
+ * decimal mode ADC and SBC look the accumulator and flags up in the tables of decimal.h, the CMOS
+ * cores take one more cycle to set N and Z from the result
+ */
+CPU_INLINE void decimal_result(CPU_type_t* cpu, const Decimal_result_t table[2][256][256], uint8_t value, const CPU_variant variant) {
+    const Decimal_result_t* result = &table[get_flag(cpu, C_MASK)][cpu->AC][value];
+
+    cpu->AC = result->value;
+    set_nvzc(cpu, result->flags);
+    cpu->cycles += (variant != CPU_NMOS);
+}
+
+CPU_INLINE const Decimal_tables_t* decimal_flavor(const CPU_variant variant) {
+    return &decimal_tables[(variant == CPU_NMOS) ? DECIMAL_NMOS : DECIMAL_CMOS];
+}
+
+CPU_INLINE void alu_adc(CPU_type_t* cpu, uint8_t value, const CPU_variant variant) {
+    if (get_flag(cpu, D_MASK)) {
+        decimal_result(cpu, decimal_flavor(variant)->adc, value, variant);
+        return;
+    }
+
+    unsigned sum = cpu->AC + value + get_flag(cpu, C_MASK);
+    set_flag(cpu, V_MASK, ~(cpu->AC ^ value) & (cpu->AC ^ sum) & 0x80);
+    set_flag(cpu, C_MASK, sum > 0xFF);
+    cpu->AC = (uint8_t) sum;
+    set_nz(cpu, cpu->AC);
+}
+
+CPU_INLINE void alu_sbc(CPU_type_t* cpu, uint8_t value, const CPU_variant variant) {
+    if (get_flag(cpu, D_MASK)) {
+        decimal_result(cpu, decimal_flavor(variant)->sbc, value, variant);
+        return;
+    }
+
+    int diff = cpu->AC - value - !get_flag(cpu, C_MASK);
+    set_flag(cpu, V_MASK, (cpu->AC ^ value) & (cpu->AC ^ diff) & 0x80);
+    set_flag(cpu, C_MASK, diff >= 0);
+    cpu->AC = (uint8_t) diff;
+    set_nz(cpu, cpu->AC);
+}
+
+/*
+ * instructions
+ * one function per mnemonic, specialised per opcode by the constant addressing mode and per core
+ * by the constant variant
+ */
+
+/* the body follows the macro, so the parameters a handler does not need are marked rather than cast to void */
+#define EXEC(op) CPU_INLINE void exec_##op(CPU_type_t* cpu, CPU_UNUSED Memory_type_t* mem, CPU_UNUSED const Block_op_t* pre, \
+                                           CPU_UNUSED const Addressing_mode mode, CPU_UNUSED const CPU_variant variant)
+
+EXEC(LDA) { cpu->AC = operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+EXEC(LDX) { cpu->X = operand(cpu, mem, pre, mode); set_nz(cpu, cpu->X); }
+EXEC(LDY) { cpu->Y = operand(cpu, mem, pre, mode); set_nz(cpu, cpu->Y); }
+EXEC(STA) { mem_write8(mem, operand_address(cpu, mem, pre, mode, 0), cpu->AC); }
+EXEC(STX) { mem_write8(mem, operand_address(cpu, mem, pre, mode, 0), cpu->X); }
+EXEC(STY) { mem_write8(mem, operand_address(cpu, mem, pre, mode, 0), cpu->Y); }
+EXEC(STZ) { mem_write8(mem, operand_address(cpu, mem, pre, mode, 0), 0); }
+
+EXEC(AND) { cpu->AC &= operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+EXEC(ORA) { cpu->AC |= operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+EXEC(EOR) { cpu->AC ^= operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+EXEC(ADC) { alu_adc(cpu, operand(cpu, mem, pre, mode), variant); }
+EXEC(SBC) { alu_sbc(cpu, operand(cpu, mem, pre, mode), variant); }
+EXEC(CMP) { alu_compare(cpu, cpu->AC, operand(cpu, mem, pre, mode)); }
+EXEC(CPX) { alu_compare(cpu, cpu->X, operand(cpu, mem, pre, mode)); }
+EXEC(CPY) { alu_compare(cpu, cpu->Y, operand(cpu, mem, pre, mode)); }
+
+EXEC(BIT) {
+    uint8_t value = operand(cpu, mem, pre, mode);
+    set_flag(cpu, Z_MASK, !(cpu->AC & value));
+    if (mode != IMM) {
+        /* the immediate form only affects Z */
+        set_flag(cpu, N_MASK, value & N_MASK);
+        set_flag(cpu, V_MASK, value & V_MASK);
+    }
+}
+
+EXEC(TSB) {
+    uint16_t address = operand_address(cpu, mem, pre, mode, 0);
+    uint8_t value = mem_read8(mem, address);
+    set_flag(cpu, Z_MASK, !(cpu->AC & value));
+    mem_write8(mem, address, value | cpu->AC);
+}
+
+EXEC(TRB) {
+    uint16_t address = operand_address(cpu, mem, pre, mode, 0);
+    uint8_t value = mem_read8(mem, address);
+    set_flag(cpu, Z_MASK, !(cpu->AC & value));
+    mem_write8(mem, address, value & ~cpu->AC);
+}
+
+/*
+ * on the CMOS cores shifts and rotates on a,x only take the extra cycle when a page is crossed,
+ * the NMOS core always takes it and has it in the base cycles
+ */
+EXEC(ASL) { rmw(cpu, mem, pre, mode, alu_asl, variant != CPU_NMOS); }
+EXEC(LSR) { rmw(cpu, mem, pre, mode, alu_lsr, variant != CPU_NMOS); }
+EXEC(ROL) { rmw(cpu, mem, pre, mode, alu_rol, variant != CPU_NMOS); }
+EXEC(ROR) { rmw(cpu, mem, pre, mode, alu_ror, variant != CPU_NMOS); }
+EXEC(INC) { rmw(cpu, mem, pre, mode, alu_inc, 0); }
+EXEC(DEC) { rmw(cpu, mem, pre, mode, alu_dec, 0); }
+
+EXEC(INX) { set_nz(cpu, ++cpu->X); }
+EXEC(INY) { set_nz(cpu, ++cpu->Y); }
+EXEC(DEX) { set_nz(cpu, --cpu->X); }
+EXEC(DEY) { set_nz(cpu, --cpu->Y); }
+
+EXEC(TAX) { cpu->X = cpu->AC; set_nz(cpu, cpu->X); }
+EXEC(TAY) { cpu->Y = cpu->AC; set_nz(cpu, cpu->Y); }
+EXEC(TXA) { cpu->AC = cpu->X; set_nz(cpu, cpu->AC); }
+EXEC(TYA) { cpu->AC = cpu->Y; set_nz(cpu, cpu->AC); }
+EXEC(TSX) { cpu->X = cpu->SP; set_nz(cpu, cpu->X); }
+EXEC(TXS) { cpu->SP = cpu->X; }
+
+EXEC(PHA) { push8(cpu, mem, cpu->AC); }
+EXEC(PHX) { push8(cpu, mem, cpu->X); }
+EXEC(PHY) { push8(cpu, mem, cpu->Y); }
+EXEC(PHP) { push8(cpu, mem, read_status(cpu) | B_MASK | IG_MASK); }
+EXEC(PLA) { cpu->AC = pull8(cpu, mem); set_nz(cpu, cpu->AC); }
+EXEC(PLX) { cpu->X = pull8(cpu, mem); set_nz(cpu, cpu->X); }
+EXEC(PLY) { cpu->Y = pull8(cpu, mem); set_nz(cpu, cpu->Y); }
+EXEC(PLP) { write_status(cpu, (pull8(cpu, mem) & ~B_MASK) | IG_MASK); interrupt_poll(cpu); }
+
+EXEC(CLC) { set_flag(cpu, C_MASK, 0); }
+EXEC(CLD) { set_flag(cpu, D_MASK, 0); }
+EXEC(CLI) { set_flag(cpu, I_MASK, 0); interrupt_poll(cpu); }
+EXEC(CLV) { set_flag(cpu, V_MASK, 0); }
+EXEC(SEC) { set_flag(cpu, C_MASK, 1); }
+EXEC(SED) { set_flag(cpu, D_MASK, 1); }
+EXEC(SEI) { set_flag(cpu, I_MASK, 1); }
+
+EXEC(BPL) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), !get_flag(cpu, N_MASK)); }
+EXEC(BMI) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), get_flag(cpu, N_MASK)); }
+EXEC(BVC) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), !get_flag(cpu, V_MASK)); }
+EXEC(BVS) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), get_flag(cpu, V_MASK)); }
+EXEC(BCC) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), !get_flag(cpu, C_MASK)); }
+EXEC(BCS) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), get_flag(cpu, C_MASK)); }
+EXEC(BNE) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), !get_flag(cpu, Z_MASK)); }
+EXEC(BEQ) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), get_flag(cpu, Z_MASK)); }
+EXEC(BRA) { branch(cpu, (int8_t) fetch8(cpu, mem, pre), 1); }
+
+EXEC(JMP) {
+    if ( (variant == CPU_NMOS) && (mode == ABS_IND) ) {
+        /* the NMOS core does not carry into the high byte of the pointer */
+        uint16_t pointer = fetch16(cpu, mem, pre);
+        uint16_t high = (pointer & 0xFF00) | ((pointer + 1) & 0x00FF);
+        cpu->PC = mem_read8(mem, pointer) | (mem_read8(mem, high) << 8);
+        return;
+    }
+    cpu->PC = operand_address(cpu, mem, pre, mode, 0);
+}
+
+EXEC(JSR) {
+    uint16_t target = fetch16(cpu, mem, pre);
+    push16(cpu, mem, cpu->PC - 1);           // address of the last byte of the JSR
+    cpu->PC = target;
+}
+
+EXEC(RTS) { cpu->PC = pull16(cpu, mem) + 1; }
+
+EXEC(RTI) {
+    write_status(cpu, (pull8(cpu, mem) & ~B_MASK) | IG_MASK);
+    cpu->PC = pull16(cpu, mem);
+    interrupt_poll(cpu);
+}
+
+EXEC(BRK) {
+    push16(cpu, mem, cpu->PC + 1);           // skip the signature byte
+    push8(cpu, mem, read_status(cpu) | B_MASK | IG_MASK);
+    set_flag(cpu, I_MASK, 1);
+    if (variant != CPU_NMOS) {
+        /* only the CMOS cores leave decimal mode on an interrupt */
+        set_flag(cpu, D_MASK, 0);
+    }
+    cpu->PC = mem_read16(mem, IRQ_VECTOR);
+}
+
+/* WAI falls straight through when an IRQ is asserted already, masked or not */
+EXEC(WAI) { cpu->state = (cpu->irq != 0) ? CPU_PENDING : CPU_WAITING; }
+EXEC(STP) { cpu->state = CPU_STOPPED; }
+
+/* unused opcodes only step over their operand bytes, the NMOS NOP a,x reads like LDA a,x */
+EXEC(NOP) { (void) operand_address(cpu, mem, pre, mode, mode == ABS_INDX_X); }
+EXEC(INVLD) { (void) operand_address(cpu, mem, pre, mode, 0); }
+
+/*
+ * undocumented NMOS instructions
+ * the combined ones do a read-modify-write on memory and then an ALU operation with the new value,
+ * so they take the long path and pass page_penalty = 0 like the rest of the read-modify-writes
+ */
+CPU_INLINE uint8_t rmw_memory(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, const Addressing_mode mode, const alu_fn fn) {
+    uint16_t address = operand_address(cpu, mem, pre, mode, 0);
+    uint8_t value = fn(cpu, mem_read8(mem, address));
+    mem_write8(mem, address, value);
+    return value;
+}
+
+EXEC(SLO) { cpu->AC |= rmw_memory(cpu, mem, pre, mode, alu_asl); set_nz(cpu, cpu->AC); }
+EXEC(RLA) { cpu->AC &= rmw_memory(cpu, mem, pre, mode, alu_rol); set_nz(cpu, cpu->AC); }
+EXEC(SRE) { cpu->AC ^= rmw_memory(cpu, mem, pre, mode, alu_lsr); set_nz(cpu, cpu->AC); }
+EXEC(RRA) { alu_adc(cpu, rmw_memory(cpu, mem, pre, mode, alu_ror), variant); }
+EXEC(DCP) { alu_compare(cpu, cpu->AC, rmw_memory(cpu, mem, pre, mode, alu_dec)); }
+EXEC(ISC) { alu_sbc(cpu, rmw_memory(cpu, mem, pre, mode, alu_inc), variant); }
+
+EXEC(LAX) { cpu->AC = cpu->X = operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+EXEC(SAX) { mem_write8(mem, operand_address(cpu, mem, pre, mode, 0), cpu->AC & cpu->X); }
+EXEC(LAS) { cpu->AC = cpu->X = cpu->SP = operand(cpu, mem, pre, mode) & cpu->SP; set_nz(cpu, cpu->AC); }
+
+EXEC(ANC) {
+    cpu->AC &= operand(cpu, mem, pre, mode);
+    set_nz(cpu, cpu->AC);
+    set_flag(cpu, C_MASK, cpu->AC & 0x80);
+}
+
+EXEC(ALR) { cpu->AC = alu_lsr(cpu, cpu->AC & operand(cpu, mem, pre, mode)); }
+
+/* AND then ROR, C and V come from bits 6 and 5 of the result, in decimal mode both digits are fixed up */
+EXEC(ARR) {
+    uint8_t value = cpu->AC & operand(cpu, mem, pre, mode);
+    uint8_t carry = get_flag(cpu, C_MASK);
+    uint8_t result = (value >> 1) | (carry << 7);
+
+    if (!get_flag(cpu, D_MASK)) {
+        cpu->AC = result;
+        set_nz(cpu, result);
+        set_flag(cpu, C_MASK, result & 0x40);
+        set_flag(cpu, V_MASK, (result ^ (result << 1)) & 0x40);
+        return;
+    }
+
+    /* N and Z are set before the fix up, N from the carry rotated in */
+    set_nz(cpu, result);
+    set_flag(cpu, V_MASK, (value ^ result) & 0x40);
+    if ( (value & 0x0F) + (value & 0x01) > 0x05 ) {
+        result = (result & 0xF0) | ((result + 0x06) & 0x0F);
+    }
+    set_flag(cpu, C_MASK, (value & 0xF0) + (value & 0x10) > 0x50);
+    if (get_flag(cpu, C_MASK)) {
+        result += 0x60;
+    }
+    cpu->AC = result;
+}
+
+/* X = (A AND X) - operand, without borrow in and ignoring decimal mode */
+EXEC(SBX) {
+    uint8_t value = operand(cpu, mem, pre, mode);
+    uint8_t both = cpu->AC & cpu->X;
+    set_flag(cpu, C_MASK, both >= value);
+    cpu->X = both - value;
+    set_nz(cpu, cpu->X);
+}
+
+/*
+ * the unstable ones depend on the analog state of the chip; ANE and LXA use the 0xEE most parts
+ * settle on, and the SHx stores AND their value with the high byte of the base address plus one,
+ * which also replaces the high byte of the address when the index crosses a page
+ */
+EXEC(ANE) { cpu->AC = (cpu->AC | 0xEE) & cpu->X & operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+EXEC(LXA) { cpu->AC = cpu->X = (cpu->AC | 0xEE) & operand(cpu, mem, pre, mode); set_nz(cpu, cpu->AC); }
+
+CPU_INLINE void unstable_store(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, const Addressing_mode mode, uint8_t value) {
+    uint16_t base = (mode == ZPG_IND_INDX_Y) ? mem_read16_zp(mem, fetch8(cpu, mem, pre)) : fetch16(cpu, mem, pre);
+    uint16_t address = base + ((mode == ABS_INDX_X) ? cpu->X : cpu->Y);
+
+    value &= (uint8_t) ((base >> 8) + 1);
+    if ((base ^ address) & 0xFF00) {
+        address = (address & 0x00FF) | (value << 8);
+    }
+    mem_write8(mem, address, value);
+}
+
+EXEC(SHA) { unstable_store(cpu, mem, pre, mode, cpu->AC & cpu->X); }
+EXEC(SHX) { unstable_store(cpu, mem, pre, mode, cpu->X); }
+EXEC(SHY) { unstable_store(cpu, mem, pre, mode, cpu->Y); }
+EXEC(TAS) { cpu->SP = cpu->AC & cpu->X; unstable_store(cpu, mem, pre, mode, cpu->SP); }
+
+/* JAM locks the bus up until the next reset, PC stays on the opcode */
+EXEC(JAM) { cpu->PC--; cpu->state = CPU_STOPPED; }
+
+/* bit manipulation on zero page */
+CPU_INLINE void bit_reset(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, uint8_t bit) {
+    uint8_t address = fetch8(cpu, mem, pre);
+    mem_write_zp(mem, address, mem_read_zp(mem, address) & ~(1 << bit));
+}
+
+CPU_INLINE void bit_set(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, uint8_t bit) {
+    uint8_t address = fetch8(cpu, mem, pre);
+    mem_write_zp(mem, address, mem_read_zp(mem, address) | (1 << bit));
+}
+
+/* the operand is the zero page address followed by the branch offset */
+CPU_INLINE void bit_branch(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre, uint8_t bit, int when_set) {
+    uint16_t operand = fetch16(cpu, mem, pre);
+    uint8_t value = mem_read_zp(mem, operand & 0xFF);
+    branch(cpu, (int8_t) (operand >> 8), !(value & (1 << bit)) == !when_set);
+}
+
+#define EXEC_BITS(n) \
+    EXEC(RMB##n) { bit_reset(cpu, mem, pre, n); } \
+    EXEC(SMB##n) { bit_set(cpu, mem, pre, n); } \
+    EXEC(BBR##n) { bit_branch(cpu, mem, pre, n, 0); } \
+    EXEC(BBS##n) { bit_branch(cpu, mem, pre, n, 1); }
+
+EXEC_BITS(0)
+EXEC_BITS(1)
+EXEC_BITS(2)
+EXEC_BITS(3)
+EXEC_BITS(4)
+EXEC_BITS(5)
+EXEC_BITS(6)
+EXEC_BITS(7)
+
+/*
+ * dispatch
+ * every opcode byte gets its own handler with the addressing mode and base cycle count baked in,
+ * the penalties for page crossings, taken branches and decimal mode are added while executing
+ *
+ * CPU_CORE builds the handlers, dispatch tables and execution loop of one variant from its opcode
+ * map. CORE prefixes their names and CORE_VARIANT is handed to the instructions as a constant, so
+ * every variant gets code of its own and none of them tests the variant while running
+ */
+
+#define CORE_PASTE(core, name) core##_##name
+#define CORE_EXPAND(core, name) CORE_PASTE(core, name)
+#define CORE_NAME(name) CORE_EXPAND(CORE, name)
+
+#define OPCODE_BODY(op, mode, cyc, pre) \
+    exec_##op(cpu, mem, pre, mode, CORE_VARIANT); \
+    cpu->cycles += cyc;
+
+#define INSTRUCTION_ENTRY(code, op, mode, cyc) [code] = { op, mode, cyc },
+
+/* length of an instruction in bytes, opcode included, as a constant */
+#define INSTRUCTION_LENGTH(mode) \
+    ( ((mode) == ACC) || ((mode) == IMP) || ((mode) == STK) || ((mode) == INV) ? 1 : \
+      ((mode) == ABS_A) || ((mode) == ABS_INDX_IND) || ((mode) == ABS_INDX_X) || \
+      ((mode) == ABS_INDX_Y) || ((mode) == ABS_IND) || ((mode) == ZPG_PC_REL) ? 3 : 2 )
+
+#define DISASSEMBLY_ENTRY(code, op, mode, cyc) [code] = { ((op) == INVLD) ? "NOP" : #op, mode, INSTRUCTION_LENGTH(mode) },
+
+#define HANDLER(code, op, mode, cyc) \
+    static void CORE_NAME(handler_##code)(CPU_type_t* cpu, Memory_type_t* mem) { OPCODE_BODY(op, mode, cyc, NULL) }
+
+#define DISPATCH_ENTRY(code, op, mode, cyc) [code] = CORE_NAME(handler_##code),
+
+/* the same handlers taking their operand from a predecoded instruction */
+#define BLOCK_HANDLER(code, op, mode, cyc) \
+    static CPU_NONNULL void CORE_NAME(block_handler_##code)(CPU_type_t* cpu, Memory_type_t* mem, const Block_op_t* pre) { \
+        cpu->PC = pre->next; \
+        OPCODE_BODY(op, mode, cyc, pre) \
+    }
+
+#define BLOCK_DISPATCH_ENTRY(code, op, mode, cyc) [code] = CORE_NAME(block_handler_##code),
+
+/*
+ * main execution loop, runs until the cycle counter reaches end
+ * with computed goto every handler is inlined into the loop and ends with its own indirect jump
+ * to the next one, which gives the branch predictor one entry per opcode instead of a single
+ * shared call site
+ */
+#if USE_COMPUTED_GOTO && defined(__GNUC__)
+#define LABEL_ENTRY(code, op, mode, cyc) [code] = &&op_##code,
+
+#define NEXT() \
+    if( (cpu->state != CPU_RUNNING) || (cpu->cycles >= end) ) { \
+        return; \
+    } \
+    goto *labels[mem_read8(mem, cpu->PC++)];
+
+#define LABEL(code, op, mode, cyc) op_##code: { OPCODE_BODY(op, mode, cyc, NULL) } NEXT()
+
+#define EXECUTE(map) \
+    static void CORE_NAME(execute)(CPU_type_t* cpu, Memory_type_t* mem, const uint64_t end) { \
+        static const void* const labels[256] = { \
+            map(LABEL_ENTRY) \
+        }; \
+        NEXT() \
+        map(LABEL) \
+    }
+#else
+#define EXECUTE(map) \
+    static void CORE_NAME(execute)(CPU_type_t* cpu, Memory_type_t* mem, const uint64_t end) { \
+        while( (cpu->state == CPU_RUNNING) && (cpu->cycles < end) ) { \
+            CORE_NAME(dispatch)[mem_read8(mem, cpu->PC++)](cpu, mem); \
+        } \
+    }
+#endif
+
+#define CPU_CORE(map) \
+    static const Instruction CORE_NAME(instructions)[256] = { \
+        map(INSTRUCTION_ENTRY) \
+    }; \
+    static const Disassembler_opcode_t CORE_NAME(disassembly)[256] = { \
+        map(DISASSEMBLY_ENTRY) \
+    }; \
+    map(HANDLER) \
+    static const cpu_handler_t CORE_NAME(dispatch)[256] = { \
+        map(DISPATCH_ENTRY) \
+    }; \
+    map(BLOCK_HANDLER) \
+    static const block_handler_t CORE_NAME(block_dispatch)[256] = { \
+        map(BLOCK_DISPATCH_ENTRY) \
+    }; \
+    EXECUTE(map)
+
+#define CORE nmos
+#define CORE_VARIANT CPU_NMOS
+CPU_CORE(CPU_OPCODE_MAP_NMOS)
+#undef CORE
+#undef CORE_VARIANT
+
+#define CORE cmos
+#define CORE_VARIANT CPU_65C02
+CPU_CORE(CPU_OPCODE_MAP_65C02)
+#undef CORE
+#undef CORE_VARIANT
+
+#define CORE wdc
+#define CORE_VARIANT CPU_W65C02S
+CPU_CORE(CPU_OPCODE_MAP_W65C02S)
+#undef CORE
+#undef CORE_VARIANT
+
+typedef void (*cpu_execute_t)(CPU_type_t*, Memory_type_t* mem, const uint64_t end);
+
+const Instruction* const cpu_instructions[CPU_VARIANTS] = {
+    [CPU_NMOS] = nmos_instructions, [CPU_65C02] = cmos_instructions, [CPU_W65C02S] = wdc_instructions
+};
+
+const Disassembler_opcode_t* const disassembler_opcodes[CPU_VARIANTS] = {
+    [CPU_NMOS] = nmos_disassembly, [CPU_65C02] = cmos_disassembly, [CPU_W65C02S] = wdc_disassembly
+};
+
+static const cpu_handler_t* const cpu_dispatch[CPU_VARIANTS] = {
+    [CPU_NMOS] = nmos_dispatch, [CPU_65C02] = cmos_dispatch, [CPU_W65C02S] = wdc_dispatch
+};
+
+const block_handler_t* const cpu_block_dispatch[CPU_VARIANTS] = {
+    [CPU_NMOS] = nmos_block_dispatch, [CPU_65C02] = cmos_block_dispatch, [CPU_W65C02S] = wdc_block_dispatch
+};
+
+static const cpu_execute_t cpu_execute_core[CPU_VARIANTS] = {
+    [CPU_NMOS] = nmos_execute, [CPU_65C02] = cmos_execute, [CPU_W65C02S] = wdc_execute
+};
+
+/**
+ * the reset sequence up to the vector fetch
+ * the sequence runs three stack pushes with the writes suppressed, which moves SP down by 3
+ * without touching the stack. The registers jump straight to their final values, but the 7
+ * cycles are counted
  * @param cpu
  */
-void cpu_reset(CPU_type_t* cpu) {
-    cpu->PC = 0xFFFC; // load PC with the reset
-    cpu->SP = 0xFF;
+static void reset_sequence(CPU_type_t* cpu) {
+    if( (unsigned) cpu->variant >= CPU_VARIANTS ) {
+        cpu->variant = CPU_DEFAULT_VARIANT;
+    }
+    decimal_initialize();
+
+    cpu->SP -= 3;
     cpu->AC = 0x00;
     cpu->X = 0x00;
     cpu->Y = 0x00;
 
-    // reset the status register
-    cpu->SR &= ~(N_MASK);
-    cpu->SR &= ~(V_MASK);
-    cpu->SR &= ~(B_MASK);
-    cpu->SR &= ~(D_MASK);
-    cpu->SR &= ~(I_MASK);
-    cpu->SR &= ~(Z_MASK);
-    cpu->SR &= ~(C_MASK);
+    // interrupts masked, binary mode
+    cpu->SR = IG_MASK | I_MASK;
+
+    cpu->nmi = 0;
+    cpu->cycles += RESET_CYCLES;
+    cpu->deadline = cpu->cycles;
+    cpu->state = CPU_RUNNING;
 }
 
 /**
- * fetch instruction from memory at the address pointed to by PC
- * effectively, increment the PC so it points to the next address
- * decrement the number of CPU cycles needed to fetch this instruction
+ * set the variant, then power on
+ * @param cpu
+ * @param variant core to run the CPU on
+ */
+void cpu_initialize(CPU_type_t* cpu, CPU_variant variant) {
+    cpu->variant = variant;
+#if USE_PROFILER
+    cpu->profiler = NULL;
+#endif
+#if USE_TRACE
+    cpu->trace = NULL;
+#endif
+#if USE_REPLAY
+    cpu->replay = NULL;
+#endif
+    cpu->events = NULL;
+    cpu->irq = 0;
+    cpu->cycles = 0;
+    cpu->SP = 0x00;     // SP comes up as 0 on most parts, the reset leaves it at 0xFD
+    reset_sequence(cpu);
+    cpu->PC = 0x0000;
+}
+
+/**
+ * run the reset sequence and load PC from the reset vector
+ * the stack will always reside in the address space of 0x0100 - 0x01FF
+ * IRQ lines stay as the devices holding them left them
+ * @param cpu
+ * @param mem memory holding the reset vector
+ */
+void cpu_reset(CPU_type_t* cpu, Memory_type_t* mem) {
+    reset_sequence(cpu);
+    cpu->PC = mem_read16(mem, RESET_VECTOR);
+}
+
+/**
+ * take the interrupt that made the CPU pending, an NMI before an IRQ
+ * a CPU woken from WAI by an IRQ it masks, or pending for an event, carries on with the next
+ * instruction. called with the flags unpacked
+ */
+static void cpu_interrupt(CPU_type_t* cpu, Memory_type_t* mem) {
+    uint16_t vector;
+
+    cpu->state = CPU_RUNNING;
+    if(cpu->nmi) {
+        cpu->nmi = 0;
+        vector = NMI_VECTOR;
+    } else if( (cpu->irq != 0) && !(cpu->SR & I_MASK) ) {
+        vector = IRQ_VECTOR;
+    } else {
+        return;
+    }
+
+    /* as BRK, but with B clear in the status pushed and PC pointing at the next instruction */
+    push16(cpu, mem, cpu->PC);
+    push8(cpu, mem, (read_status(cpu) & ~B_MASK) | IG_MASK);
+    set_flag(cpu, I_MASK, 1);
+    if(cpu->variant != CPU_NMOS) {
+        set_flag(cpu, D_MASK, 0);
+    }
+    cpu->PC = mem_read16(mem, vector);
+    cpu->cycles += INTERRUPT_CYCLES;
+}
+
+/**
+ * assert IRQ lines
+ * a CPU halted by WAI resumes even when I masks the IRQ
  */
-Instruction* cpu_fetch_instruction(CPU_type_t* cpu, uint16_t* memory,  uint16_t address, Instruction* ins) {
-    if( (cpu != NULL) && (memory != NULL) ) {
-        uint8_t data = memory[address];                                                // todo-> bound check
-        uint8_t hi_byte_index = (data & HI_BYTE_MASK) >> 4;
-        uint8_t lo_byte_index = (data & LO_BYTE_MASK);
+void cpu_irq_assert(CPU_type_t* cpu, uint32_t lines) {
+#if USE_REPLAY
+    if( (cpu->replay != NULL) && !replay_line(cpu->replay, REPLAY_ASSERT, lines) ) {
+        return;
+    }
+#endif
+    cpu->irq |= lines;
+    if( (cpu->state == CPU_WAITING) && (cpu->irq != 0) ) {
+        cpu->state = CPU_PENDING;
+    }
+    interrupt_poll(cpu);
+}
 
-        uint8_t opcode = opcodes[hi_byte_index][lo_byte_index];                       // get the opcode
-        uint8_t addr_mode = addressing_modes[hi_byte_index][lo_byte_index];            // get the addressing mode
+/**
+ * release IRQ lines
+ */
+void cpu_irq_release(CPU_type_t* cpu, uint32_t lines) {
+#if USE_REPLAY
+    if( (cpu->replay != NULL) && !replay_line(cpu->replay, REPLAY_RELEASE, lines) ) {
+        return;
+    }
+#endif
+    cpu->irq &= ~lines;
+}
 
-        ins->opcode = opcode;
-        ins->addr_mode = addr_mode;
+/**
+ * latch an NMI edge
+ */
+void cpu_nmi(CPU_type_t* cpu) {
+#if USE_REPLAY
+    if( (cpu->replay != NULL) && !replay_line(cpu->replay, REPLAY_NMI, 0) ) {
+        return;
+    }
+#endif
+    cpu->nmi = 1;
+    if(cpu->state == CPU_WAITING) {
+        cpu->state = CPU_PENDING;
+    }
+    interrupt_poll(cpu);
+}
+
+/**
+ * leave CPU_BREAK, polling the interrupt lines that may have changed while it was stopped
+ */
+void cpu_resume(CPU_type_t* cpu) {
+    if(cpu->state == CPU_BREAK) {
+        cpu->state = CPU_RUNNING;
+        interrupt_poll(cpu);
+    }
+}
+
+/**
+ * look the opcode byte up in the opcode map of the default variant
+ */
+Instruction* cpu_decode_instruction(uint8_t data, Instruction* ins) {
+    if(ins != NULL) {
+        *ins = cpu_instructions[CPU_DEFAULT_VARIANT][data];
+    }
+
+    return ins;
+}
+
+/**
+ * fetch instruction from memory at the address pointed to by PC
+ * effectively, increment the PC so it points to the next address
+ * the cycles are accounted for by the core when the instruction is executed
+ */
+Instruction* cpu_fetch_instruction(CPU_type_t* cpu, Memory_type_t* mem,  uint16_t address, Instruction* ins) {
+    if( (cpu != NULL) && (mem != NULL) ) {
+        uint8_t data = mem_read8(mem, address);
+        if(ins != NULL) {
+            *ins = cpu_instructions[cpu->variant][data];
+        }
 
         cpu->PC++;
-        cpu->cycles--; // check cycles
 
         return ins;
     } else {
          return NULL;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * execute a single instruction
+ * a pending interrupt counts as the instruction, a halted CPU first skips to its next event
+ */
+uint32_t cpu_step(CPU_type_t* cpu, Memory_type_t* mem) {
+    uint64_t start = cpu->cycles;
+    Scheduler_t* events = cpu->events;
+
+    if( (events != NULL) && ( (cpu->state == CPU_WAITING) || (cpu->state == CPU_STOPPED) ) ) {
+        const uint64_t next = scheduler_next(events);
+
+        if(next != SCHEDULER_NONE) {
+            if(next > cpu->cycles) {
+                cpu->cycles = next;
+            }
+            scheduler_run(events, cpu->cycles);
+        }
+    }
+
+    if(cpu->state == CPU_PENDING) {
+        status_unpack(cpu);
+        cpu_interrupt(cpu, mem);
+        status_pack(cpu);
+    } else if(cpu->state == CPU_RUNNING) {
+#if USE_PROFILER
+        const uint16_t pc = cpu->PC;
+#endif
+        mem_execute(mem, cpu->PC);
+        const uint8_t opcode = mem_read8(mem, cpu->PC);
+
+#if USE_TRACE
+        if(cpu->trace != NULL) {
+            trace_record(cpu->trace, cpu, mem, opcode);
+        }
+#endif
+        cpu->PC++;
+        status_unpack(cpu);
+        cpu_dispatch[cpu->variant][opcode](cpu, mem);
+        status_pack(cpu);
+#if USE_PROFILER
+        if(cpu->profiler != NULL) {
+            profiler_record(cpu->profiler, cpu, pc, opcode, (uint32_t) (cpu->cycles - start));
+        }
+#endif
+    }
+
+    if( (events != NULL) && (scheduler_next(events) <= cpu->cycles) ) {
+        scheduler_run(events, cpu->cycles);
+    }
+
+    return (uint32_t) (cpu->cycles - start);
+}
+
+/**
+ * length of an instruction in bytes, opcode included
+ */
+uint8_t cpu_instruction_length(Addressing_mode mode) {
+    return INSTRUCTION_LENGTH(mode);
+}
+
+/* a polling loop reads nothing with side effects: RAM, ROM or steady devices, on pages without hooks */
+static int spin_reads_steady(const Memory_type_t* mem, const Block_t* block, CPU_variant variant) {
+    for(uint16_t i = 0; i < block->count; i++) {
+        const Block_op_t* op = &block->ops[i];
+        uint16_t address;
+
+        switch(cpu_instructions[variant][op->opcode].addr_mode) {
+            case ZPG: case ZPG_PC_REL: address = op->operand & 0xFF; break;
+            case ABS_A: address = op->operand; break;
+            default: continue;
+        }
+        /* a JMP back does not read its operand */
+        if(cpu_instructions[variant][op->opcode].opcode == JMP) {
+            continue;
+        }
+
+        const Memory_device_t* device = mem->device[address >> 8];
+        if( (mem->read_page[address >> 8] == NULL) &&
+            ( (device == NULL) || !device->steady || (mem->hook[address >> 8] != NULL) ) ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * run one iteration of an idle loop block, then skip the iterations after it that end before end
+ * a delay loop is skipped up to its last iteration, which is left to run. A polling loop is
+ * skipped when the iteration brought it back to the state it started from: nothing it reads can
+ * change before end, so every iteration after it does the same again
+ */
+static void cpu_execute_spin(CPU_type_t* cpu, Memory_type_t* mem, const Block_t* block, const uint64_t end) {
+    Block_cache_t* cache = mem->blocks;
+    const uint32_t generation = cache->generation;
+    const Block_op_t* op = block->ops;
+    const Block_op_t* last = op + block->count;
+    const uint64_t start = cpu->cycles;
+    const uint8_t AC = cpu->AC, X = cpu->X, Y = cpu->Y, SP = cpu->SP, SR = read_status(cpu);
+
+    do {
+        op->handler(cpu, mem, op);
+        op++;
+    } while( (op < last) && (cpu->cycles < end) && (cache->generation == generation) &&
+             (cpu->state == CPU_RUNNING) );
+
+    if( (op < last) || (cpu->PC != block->start) || (cpu->state != CPU_RUNNING) ||
+        (cache->generation != generation) || (cpu->cycles >= end) ) {
+        return;
+    }
+
+    const uint64_t period = cpu->cycles - start;
+    uint64_t skip = (end - cpu->cycles - 1) / period;
+
+    if(block->spin == BLOCK_SPIN_DELAY) {
+        const Opcode count = cpu_instructions[cpu->variant][block->ops[0].opcode].opcode;
+        uint8_t* reg = (count == DEX || count == INX) ? &cpu->X : &cpu->Y;
+        const uint64_t left = (count == DEX || count == DEY) ? *reg : 256u - *reg;
+
+        /* the last iteration falls through BNE */
+        if(skip > left - 1) {
+            skip = left - 1;
+        }
+        *reg = (count == DEX || count == DEY) ? (uint8_t) (*reg - skip) : (uint8_t) (*reg + skip);
+        set_flag(cpu, N_MASK, *reg & N_MASK);
+    } else if( (cpu->AC != AC) || (cpu->X != X) || (cpu->Y != Y) || (cpu->SP != SP) ||
+               (read_status(cpu) != SR) || !spin_reads_steady(mem, block, cpu->variant) ) {
+        return;
+    }
+
+    cpu->cycles += skip * period;
+    cache->skipped += skip * period;
+}
+
+/**
+ * execution loop for an address space with a block cache attached
+ * a block stops early when the cycle counter reaches end, when one of its instructions wrote
+ * over cached code, which may have been its own, or when it made an interrupt pending. In
+ * stepping mode the loop stops with CPU_BREAK before the block after the first
+ * native code only runs when the whole block fits in the time slice, and hands the instructions
+ * it does not run back to the loop. Idle loops are fast-forwarded instead, see block-cache.h
+ */
+static void cpu_execute_blocks(CPU_type_t* cpu, Memory_type_t* mem, const uint64_t end) {
+    Block_cache_t* cache = mem->blocks;
+    const int stepping = cache->stepping;
+
+    for(int ran = 0; (cpu->state == CPU_RUNNING) && (cpu->cycles < end); ran = 1) {
+        if(ran && stepping) {
+            cpu->state = CPU_BREAK;
+            break;
+        }
+
+        Block_t* block = block_cache_lookup(cache, cpu->PC);
+
+        if(block == NULL) {
+            /* code that cannot be cached */
+            if(block_cache_breakpoint(cache, cpu->PC)) {
+                cpu->state = CPU_BREAK;
+                break;
+            }
+            mem_execute(mem, cpu->PC);
+            cpu_dispatch[cpu->variant][mem_read8(mem, cpu->PC++)](cpu, mem);
+            continue;
+        }
+
+        /* one test for both kinds of block that do not simply run */
+        if( (block->spin | block->breakpoint) != 0 ) {
+            if(block->breakpoint) {
+                cpu->state = CPU_BREAK;
+                break;
+            }
+            cpu_execute_spin(cpu, mem, block, end);
+            continue;
+        }
+
+        const uint32_t generation = cache->generation;
+        const Block_op_t* op = block->ops;
+        const Block_op_t* last = op + block->count;
+
+#if USE_JIT
+        if( (block->native != NULL) && (cpu->cycles + block->worst < end) ) {
+            /* native code keeps SR packed */
+            status_pack(cpu);
+            op += jit_enter(cache->jit, block, cpu, mem, end);
+            status_unpack(cpu);
+            if( (op == last) || (cache->generation != generation) ) {
+                continue;
+            }
+        } else if( (cache->jit != NULL) && (++block->executions == cache->jit->threshold) ) {
+            jit_compile(cache->jit, block);
+        }
+#endif
+
+        do {
+            op->handler(cpu, mem, op);
+            op++;
+        } while( (op < last) && (cpu->cycles < end) && (cache->generation == generation) &&
+                 (cpu->state == CPU_RUNNING) );
+    }
+}
+
+#if USE_PROFILER || USE_TRACE
+/**
+ * execution loop while a profiler or a trace is attached
+ * one instruction at a time through the dispatch table, so every one of them can be recorded.
+ * the block cache is not used, so the breakpoints set in it are looked up before every instruction
+ */
+static void cpu_execute_instrumented(CPU_type_t* cpu, Memory_type_t* mem, const uint64_t end) {
+    const cpu_handler_t* dispatch = cpu_dispatch[cpu->variant];
+    const Block_cache_t* cache = mem->blocks;
+
+    while( (cpu->state == CPU_RUNNING) && (cpu->cycles < end) ) {
+        const uint16_t pc = cpu->PC;
+
+        if( (cache != NULL) && block_cache_breakpoint(cache, pc) ) {
+            cpu->state = CPU_BREAK;
+            break;
+        }
+#if USE_PROFILER
+        const uint64_t start = cpu->cycles;
+#endif
+        mem_execute(mem, pc);
+        const uint8_t opcode = mem_read8(mem, pc);
+
+#if USE_TRACE
+        if(cpu->trace != NULL) {
+            status_pack(cpu);
+            trace_record(cpu->trace, cpu, mem, opcode);
+        }
+#endif
+        cpu->PC++;
+        dispatch[opcode](cpu, mem);
+#if USE_PROFILER
+        if(cpu->profiler != NULL) {
+            profiler_record(cpu->profiler, cpu, pc, opcode, (uint32_t) (cpu->cycles - start));
+        }
+#endif
+    }
+}
+#endif
+
+/**
+ * run until the cycle counter reaches end or the CPU halts, on the predecoded blocks when the
+ * address space has a block cache for this variant
+ */
+static void cpu_execute_slice(CPU_type_t* cpu, Memory_type_t* mem, const uint64_t end) {
+#if USE_PROFILER
+    if(cpu->profiler != NULL) {
+        cpu_execute_instrumented(cpu, mem, end);
+        return;
+    }
+#endif
+#if USE_TRACE
+    if(cpu->trace != NULL) {
+        cpu_execute_instrumented(cpu, mem, end);
+        return;
+    }
+#endif
+
+    if( (mem->blocks != NULL) && (mem->blocks->variant == cpu->variant) ) {
+        cpu_execute_blocks(cpu, mem, end);
+        return;
+    }
+
+    cpu_execute_core[cpu->variant](cpu, mem, end);
+}
+
+/**
+ * run until the cycle counter reaches end
+ * the time up to end is cut into slices at the events of the scheduler; between slices the due
+ * events run and a pending interrupt is taken. A halted CPU jumps to the next event, and the
+ * run ends once there is none left before end
+ */
+static void cpu_execute(CPU_type_t* cpu, Memory_type_t* mem, const uint64_t end) {
+    Scheduler_t* events = cpu->events;
+
+    /* a CPU stopped by a breakpoint stays where it is, time included */
+    while(cpu->state != CPU_BREAK) {
+        if( (events != NULL) && (scheduler_next(events) <= cpu->cycles) ) {
+            /* callbacks see SR packed */
+            status_pack(cpu);
+            scheduler_run(events, cpu->cycles);
+            status_unpack(cpu);
+        }
+
+        if(cpu->state == CPU_PENDING) {
+            cpu_interrupt(cpu, mem);
+        }
+
+        if(cpu->cycles >= end) {
+            break;
+        }
+
+        const uint64_t next = (events != NULL) ? scheduler_next(events) : SCHEDULER_NONE;
+
+        if(cpu->state != CPU_RUNNING) {
+            /* halted, nothing happens until the next event */
+            if(next >= end) {
+                break;
+            }
+            cpu->cycles = next;
+            continue;
+        }
+
+        if(events == NULL) {
+            cpu_execute_slice(cpu, mem, end);
+            continue;
+        }
+
+        events->horizon = (next < end) ? next : end;
+        cpu_execute_slice(cpu, mem, events->horizon);
+        events->horizon = 0;
+    }
+}
+
+/**
+ * run for a number of cycles counted from now
+ */
+uint64_t cpu_run(CPU_type_t* cpu, Memory_type_t* mem, uint64_t cycle_budget) {
+    const uint64_t start = cpu->cycles;
+
+    status_unpack(cpu);
+    cpu_execute(cpu, mem, start + cycle_budget);
+    status_pack(cpu);
+    cpu->deadline = cpu->cycles;
+
+    return cpu->cycles - start;
+}
+
+/**
+ * run for a time slice
+ * the slice ends at a deadline that advances by n on every call, so an instruction that overruns
+ * one slice is paid for out of the next and the cycle counter never drifts from the deadlines.
+ * a halted CPU lets its clock run up to the deadline so it stays in step with the machines it
+ * is scheduled with
+ */
+uint64_t cpu_run_cycles(CPU_type_t* cpu, Memory_type_t* mem, uint64_t n) {
+    const uint64_t start = cpu->cycles;
+
+    cpu->deadline += n;
+    status_unpack(cpu);
+    cpu_execute(cpu, mem, cpu->deadline);
+    status_pack(cpu);
+
+    if( (cpu->state != CPU_RUNNING) && (cpu->state != CPU_BREAK) && (cpu->cycles < cpu->deadline) ) {
+        cpu->cycles = cpu->deadline;
+    }
+
+    return cpu->cycles - start;
+}
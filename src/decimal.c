@@ -0,0 +1,204 @@
+/**
+ * @file decimal.c
+ * @brief lookup tables for ADC and SBC in decimal mode
+ * @author Edwin
+ */
+
+/**
+ * The tables are built once from the digit by digit adjustment the cores used to do inline, so a
+ * decimal ADC or SBC costs one load, like the binary ones.
+ *
+ * decimal_verify checks them against a second implementation written from the sequences in Bruce
+ * Clark's decimal mode tutorial on 6502.org, which were confirmed on real NMOS and CMOS parts for
+ * every input including the invalid BCD ones.
+ */
+
+#include <pthread.h>
+#include "decimal.h"
+#include "cpu.h"
+
+Decimal_tables_t decimal_tables[DECIMAL_FLAVORS];
+
+static pthread_once_t decimal_once = PTHREAD_ONCE_INIT;
+
+static uint8_t flags(unsigned n, unsigned v, unsigned z, unsigned c) {
+    return (n ? N_MASK : 0) | (v ? V_MASK : 0) | (z ? Z_MASK : 0) | (c ? C_MASK : 0);
+}
+
+/* N and V come from the high digit before it is adjusted, the NMOS core takes Z from the binary sum */
+static Decimal_result_t adc(uint8_t ac, uint8_t value, unsigned carry, Decimal_flavor flavor) {
+    unsigned lo = (ac & 0x0F) + (value & 0x0F) + carry;
+    if (lo > 0x09) {
+        lo += 0x06;
+    }
+    unsigned hi = (ac >> 4) + (value >> 4) + (lo > 0x0F);
+    unsigned n = (hi << 4) & 0x80;
+    unsigned v = ~(ac ^ value) & (ac ^ (hi << 4)) & 0x80;
+    if (hi > 0x09) {
+        hi += 0x06;
+    }
+    uint8_t result = (uint8_t) ((hi << 4) | (lo & 0x0F));
+
+    if (flavor == DECIMAL_NMOS) {
+        return (Decimal_result_t) { result, flags(n, v, !(uint8_t) (ac + value + carry), hi > 0x0F) };
+    }
+    return (Decimal_result_t) { result, flags(result & 0x80, v, !result, hi > 0x0F) };
+}
+
+/* V and C come from the binary difference, the NMOS core borrows from digit to digit on its own */
+static Decimal_result_t sbc(uint8_t ac, uint8_t value, unsigned carry, Decimal_flavor flavor) {
+    unsigned borrow = !carry;
+    int diff = ac - value - (int) borrow;
+    int lo = (ac & 0x0F) - (value & 0x0F) - (int) borrow;
+    unsigned v = (ac ^ value) & (ac ^ diff) & 0x80;
+    uint8_t result;
+
+    if (flavor == DECIMAL_NMOS) {
+        int hi = (ac >> 4) - (value >> 4);
+        if (lo < 0) {
+            lo -= 0x06;
+            hi--;
+        }
+        if (hi < 0) {
+            hi -= 0x06;
+        }
+        result = (uint8_t) (((unsigned) hi << 4) | (lo & 0x0F));
+        return (Decimal_result_t) { result, flags(diff & 0x80, v, !(uint8_t) diff, diff >= 0) };
+    }
+
+    int adjusted = diff;
+    if (adjusted < 0) {
+        adjusted -= 0x60;
+    }
+    if (lo < 0) {
+        adjusted -= 0x06;
+    }
+    result = (uint8_t) adjusted;
+    return (Decimal_result_t) { result, flags(result & 0x80, v, !result, diff >= 0) };
+}
+
+static void build(void) {
+    for (unsigned flavor = 0; flavor < DECIMAL_FLAVORS; flavor++) {
+        for (unsigned carry = 0; carry < 2; carry++) {
+            for (unsigned ac = 0; ac < 256; ac++) {
+                for (unsigned value = 0; value < 256; value++) {
+                    decimal_tables[flavor].adc[carry][ac][value] = adc(ac, value, carry, flavor);
+                    decimal_tables[flavor].sbc[carry][ac][value] = sbc(ac, value, carry, flavor);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * fill the tables once
+ */
+void decimal_initialize(void) {
+    pthread_once(&decimal_once, build);
+}
+
+/*
+ * reference, the sequences of the tutorial one to one
+ */
+
+/* sequence 1, accumulator and carry of ADC on every chip */
+static int reference_adc_sum(int a, int b, int c) {
+    int al = (a & 0x0F) + (b & 0x0F) + c;
+    if (al >= 0x0A) {
+        al = ((al + 0x06) & 0x0F) + 0x10;
+    }
+    a = (a & 0xF0) + (b & 0xF0) + al;
+    if (a >= 0xA0) {
+        a += 0x60;
+    }
+    return a;
+}
+
+/* sequence 2, N and V of ADC, the high digits taken as signed */
+static int reference_adc_signed(int a, int b, int c) {
+    int al = (a & 0x0F) + (b & 0x0F) + c;
+    if (al >= 0x0A) {
+        al = ((al + 0x06) & 0x0F) + 0x10;
+    }
+    return (int8_t) (a & 0xF0) + (int8_t) (b & 0xF0) + al;
+}
+
+/**
+ * decimal ADC by the reference sequences
+ */
+Decimal_result_t decimal_reference_adc(uint8_t ac, uint8_t value, unsigned carry, Decimal_flavor flavor) {
+    const int a = ac, b = value, c = (int) carry;
+    int sum = reference_adc_sum(a, b, c);
+    int sign = reference_adc_signed(a, b, c);
+    uint8_t result = (uint8_t) sum;
+    unsigned v = (sign < -128) || (sign > 127);
+
+    if (flavor == DECIMAL_NMOS) {
+        return (Decimal_result_t) { result, flags(sign & 0x80, v, ((a + b + c) & 0xFF) == 0, sum >= 0x100) };
+    }
+    return (Decimal_result_t) { result, flags(result & 0x80, v, result == 0, sum >= 0x100) };
+}
+
+/**
+ * decimal SBC by the reference sequences
+ * sequence 3 on the NMOS core, sequence 4 on the CMOS cores; the flags follow the binary SBC
+ */
+Decimal_result_t decimal_reference_sbc(uint8_t ac, uint8_t value, unsigned carry, Decimal_flavor flavor) {
+    const int a = ac, b = value, c = (int) carry;
+    int binary = a - b + c - 1;
+    int sign = (int8_t) a - (int8_t) b + c - 1;
+    unsigned v = (sign < -128) || (sign > 127);
+    int al = (a & 0x0F) - (b & 0x0F) + c - 1;
+    uint8_t result;
+
+    if (flavor == DECIMAL_NMOS) {
+        if (al < 0) {
+            al = ((al - 0x06) & 0x0F) - 0x10;
+        }
+        int r = (a & 0xF0) - (b & 0xF0) + al;
+        if (r < 0) {
+            r -= 0x60;
+        }
+        result = (uint8_t) r;
+        return (Decimal_result_t) { result, flags(binary & 0x80, v, (binary & 0xFF) == 0, binary >= 0) };
+    }
+
+    int r = binary;
+    if (r < 0) {
+        r -= 0x60;
+    }
+    if (al < 0) {
+        r -= 0x06;
+    }
+    result = (uint8_t) r;
+    return (Decimal_result_t) { result, flags(result & 0x80, v, result == 0, binary >= 0) };
+}
+
+static int differs(Decimal_result_t x, Decimal_result_t y) {
+    return (x.value != y.value) || (x.flags != y.flags);
+}
+
+/**
+ * compare every entry with the reference
+ * @return number of entries that differ
+ */
+size_t decimal_verify(void) {
+    size_t bad = 0;
+
+    decimal_initialize();
+
+    for (unsigned flavor = 0; flavor < DECIMAL_FLAVORS; flavor++) {
+        for (unsigned carry = 0; carry < 2; carry++) {
+            for (unsigned a = 0; a < 256; a++) {
+                for (unsigned b = 0; b < 256; b++) {
+                    bad += differs(decimal_tables[flavor].adc[carry][a][b],
+                                   decimal_reference_adc((uint8_t) a, (uint8_t) b, carry, (Decimal_flavor) flavor));
+                    bad += differs(decimal_tables[flavor].sbc[carry][a][b],
+                                   decimal_reference_sbc((uint8_t) a, (uint8_t) b, carry, (Decimal_flavor) flavor));
+                }
+            }
+        }
+    }
+
+    return bad;
+}
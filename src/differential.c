@@ -0,0 +1,583 @@
+/**
+ * @file differential.c
+ * @brief runs a fast engine and the reference stepper side by side and stops where they differ
+ * @author Edwin
+ */
+
+/**
+ * The reference keeps the last DIFFERENTIAL_TRACE instructions it ran since the last comparison
+ * in a ring, which is only copied out when the machines diverge.
+ *
+ * The files of a corpus are handed out to the workers one at a time from a shared counter; a
+ * file runs for anything from a few cycles to the whole budget, so the next file goes to
+ * whichever worker is free first.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "differential.h"
+#include "block-cache.h"
+#include "jit.h"
+#include "loader.h"
+#include "reference.h"
+#include "scheduler.h"
+#include "utils.h"
+
+#define RESET_VECTOR 0xFFFC                 ///< a file covering it starts where it points
+
+/**
+ * pair the machines
+ * @param d differential run
+ * @param cpu fast engine
+ * @param mem its memory
+ * @param reference_cpu reference stepper
+ * @param reference_mem its memory
+ */
+void differential_initialize(Differential_t* d, CPU_type_t* cpu, Memory_type_t* mem,
+                             CPU_type_t* reference_cpu, Memory_type_t* reference_mem) {
+    d->cpu = cpu;
+    d->mem = mem;
+    d->reference_cpu = reference_cpu;
+    d->reference_mem = reference_mem;
+    d->interval = 0;
+    d->checks = 0;
+    d->steps = 0;
+    d->diverged = 0;
+}
+
+/* the CPU runs instructions, is about to take an interrupt, or is halted with an event to wake up for before end */
+static int moving(const CPU_type_t* cpu, uint64_t end) {
+    if( (cpu->state == CPU_RUNNING) || (cpu->state == CPU_PENDING) ) {
+        return 1;
+    }
+    return ( (cpu->state == CPU_WAITING) || (cpu->state == CPU_STOPPED) ) && (cpu->events != NULL) &&
+           (scheduler_next(cpu->events) < end);
+}
+
+/* registers the reference is about to run an instruction with */
+static void record(Differential_t* d) {
+    const CPU_type_t* cpu = d->reference_cpu;
+    Differential_entry_t* e = &d->ring[d->steps++ % DIFFERENTIAL_TRACE];
+
+    e->cycles = cpu->cycles;
+    e->PC = cpu->PC;
+    e->opcode = mem_read8(d->reference_mem, cpu->PC);
+    e->AC = cpu->AC;
+    e->X = cpu->X;
+    e->Y = cpu->Y;
+    e->SR = cpu->SR;
+    e->SP = cpu->SP;
+}
+
+static int same_cpu(const CPU_type_t* a, const CPU_type_t* b) {
+    return (a->PC == b->PC) && (a->AC == b->AC) && (a->X == b->X) && (a->Y == b->Y) &&
+           (a->SR == b->SR) && (a->SP == b->SP) && (a->cycles == b->cycles) && (a->state == b->state);
+}
+
+/*
+ * first byte that reads differently, MEMORY_SIZE if none
+ * pages that read from a device are not compared, reading them may have side effects; a page
+ * that reads from storage in one machine and from a device in the other differs at its first byte
+ */
+static uint32_t first_difference(const Memory_type_t* a, const Memory_type_t* b) {
+    for(uint32_t page = 0; page < MEMORY_PAGES; page++) {
+        const uint8_t* x = a->read_page[page];
+        const uint8_t* y = b->read_page[page];
+
+        if( (x == NULL) && (y == NULL) ) {
+            continue;
+        }
+        if( (x == NULL) || (y == NULL) ) {
+            return page * MEMORY_PAGE_SIZE;
+        }
+        if(memcmp(x, y, MEMORY_PAGE_SIZE) != 0) {
+            uint32_t i = 0;
+            while(x[i] == y[i]) {
+                i++;
+            }
+            return page * MEMORY_PAGE_SIZE + i;
+        }
+    }
+    return MEMORY_SIZE;
+}
+
+/* storage byte of a page, 0 for a device page */
+static uint8_t stored(const Memory_type_t* m, uint32_t address) {
+    const uint8_t* page = m->read_page[address / MEMORY_PAGE_SIZE];
+    return (page != NULL) ? page[address % MEMORY_PAGE_SIZE] : 0;
+}
+
+/* compare the machines, fill in the divergence if they differ @return 1 if they agree */
+static int agree(Differential_t* d, uint64_t since) {
+    const uint32_t address = first_difference(d->mem, d->reference_mem);
+
+    d->checks++;
+    if( (address == MEMORY_SIZE) && same_cpu(d->cpu, d->reference_cpu) ) {
+        d->steps = 0;
+        return 1;
+    }
+
+    Differential_divergence_t* v = &d->divergence;
+    const size_t length = (d->steps < DIFFERENTIAL_TRACE) ? (size_t) d->steps : DIFFERENTIAL_TRACE;
+
+    v->since = since;
+    v->expected = *d->reference_cpu;
+    v->actual = *d->cpu;
+    v->address = address;
+    v->expected_byte = (address < MEMORY_SIZE) ? stored(d->reference_mem, address) : 0;
+    v->actual_byte = (address < MEMORY_SIZE) ? stored(d->mem, address) : 0;
+    for(size_t i = 0; i < length; i++) {
+        v->trace[i] = d->ring[(d->steps - length + i) % DIFFERENTIAL_TRACE];
+    }
+    v->length = length;
+    v->dropped = d->steps - length;
+
+    d->diverged = 1;
+    return 0;
+}
+
+/*
+ * step the reference until its cycle counter reaches end, a halted reference only moves on to
+ * events before horizon
+ */
+static void catch_up(Differential_t* d, uint64_t end, uint64_t horizon) {
+    while( (d->reference_cpu->cycles < end) && moving(d->reference_cpu, horizon) ) {
+        record(d);
+        reference_step(d->reference_cpu, d->reference_mem);
+    }
+}
+
+/**
+ * run both machines slice by slice
+ * @param d differential run
+ * @param cycle_budget cycles to run the fast machine for
+ * @return 0 if they agreed, 1 if they diverged
+ */
+int differential_run(Differential_t* d, uint64_t cycle_budget) {
+    const uint64_t end = d->cpu->cycles + cycle_budget;
+    Block_cache_t* cache = ( (d->mem->blocks != NULL) && (d->mem->blocks->variant == d->cpu->variant) ) ?
+                           d->mem->blocks : NULL;
+    const int stepping = (cache != NULL) ? cache->stepping : 0;
+    int diverged = 0;
+
+    d->diverged = 0;
+    d->steps = 0;
+    if(!agree(d, d->cpu->cycles)) {
+        return 1;
+    }
+
+    /* the core comes back after every block by itself, without a block cache every instruction is one */
+    if(cache != NULL) {
+        cache->stepping = (d->interval == 0);
+    }
+
+    /* a pending CPU takes its interrupt at the start of the next slice */
+    while( !diverged && moving(d->cpu, end) && (d->cpu->cycles < end) ) {
+        const uint64_t since = d->cpu->cycles;
+        uint64_t slice = (d->interval != 0) ? d->interval : (cache != NULL) ? end - since : 1;
+
+        if(slice > end - since) {
+            slice = end - since;
+        }
+
+        cpu_run(d->cpu, d->mem, slice);
+        if( (d->cpu->state == CPU_BREAK) && (d->interval == 0) && (cache != NULL) &&
+            !block_cache_breakpoint(cache, d->cpu->PC) ) {
+            cpu_resume(d->cpu);
+        }
+
+        /* a reference that does not land on the same cycle ran different instructions */
+        catch_up(d, d->cpu->cycles, d->cpu->cycles + 1);
+        diverged = !agree(d, since);
+    }
+
+    if(cache != NULL) {
+        cache->stepping = stepping;
+    }
+
+    return diverged;
+}
+
+/**
+ * run the lanes of a lockstep engine slice by slice, each next to its own reference
+ * @param ls lockstep engine
+ * @param lanes one pair per lane
+ * @param cycle_budget cycles to run every lane for
+ * @return 0 if every lane agreed, 1 if one diverged
+ */
+int differential_run_lockstep(Lockstep_type_t* ls, Differential_t* lanes, uint64_t cycle_budget) {
+    const uint64_t slice = (lanes[0].interval != 0) ? lanes[0].interval : DIFFERENTIAL_SLICE;
+    int running = 0;
+
+    for(size_t i = 0; i < ls->lanes; i++) {
+        Differential_t* d = &lanes[i];
+
+        lockstep_store(ls, i, d->cpu);
+        d->diverged = 0;
+        d->steps = 0;
+        if(!agree(d, d->cpu->cycles)) {
+            return 1;
+        }
+        running |= moving(d->cpu, d->cpu->cycles + cycle_budget);
+    }
+
+    for(uint64_t ran = 0; running && (ran < cycle_budget); ran += slice) {
+        const uint64_t length = (cycle_budget - ran < slice) ? cycle_budget - ran : slice;
+
+        lockstep_run(ls, length);
+
+        /*
+         * the references run the slice as cpu_run would, so a lane the engine left behind
+         * shows up as much as one that went wrong
+         */
+        running = 0;
+        for(size_t i = 0; i < ls->lanes; i++) {
+            Differential_t* d = &lanes[i];
+            const uint64_t since = d->cpu->cycles;
+
+            lockstep_store(ls, i, d->cpu);
+            catch_up(d, since + length, since + length);
+            if(d->reference_cpu->state == CPU_PENDING) {
+                /* cpu_run takes an interrupt that came up in the last instruction before it returns */
+                record(d);
+                reference_step(d->reference_cpu, d->reference_mem);
+            }
+            if(!agree(d, since)) {
+                return 1;
+            }
+            running |= moving(d->cpu, UINT64_MAX);
+        }
+    }
+
+    return 0;
+}
+
+static void print_cpu(const char* name, const CPU_type_t* cpu, FILE* out) {
+    fprintf(out, "%-9s PC=%04X A=%02X X=%02X Y=%02X SP=%02X SR=%02X cycles=%llu state=%d\n", name,
+            cpu->PC, cpu->AC, cpu->X, cpu->Y, cpu->SP, cpu->SR, (unsigned long long) cpu->cycles, (int) cpu->state);
+}
+
+/**
+ * print a divergence
+ * @param v divergence
+ * @param variant CPU variant that ran the trace
+ * @param out where to
+ */
+void differential_print(const Differential_divergence_t* v, CPU_variant variant, FILE* out) {
+    fprintf(out, "diverged after cycle %llu\n", (unsigned long long) v->since);
+    print_cpu("reference", &v->expected, out);
+    print_cpu("actual", &v->actual, out);
+    if(v->address < MEMORY_SIZE) {
+        fprintf(out, "memory $%04X: reference $%02X, actual $%02X\n", (unsigned) v->address,
+                v->expected_byte, v->actual_byte);
+    }
+
+    if(v->dropped != 0) {
+        fprintf(out, "... %llu instructions\n", (unsigned long long) v->dropped);
+    }
+    for(size_t i = 0; i < v->length; i++) {
+        const Differential_entry_t* e = &v->trace[i];
+        const Instruction* ins = &cpu_instructions[variant][e->opcode];
+
+        fprintf(out, "%12llu  %04X  %02X  %-5s %-28s A=%02X X=%02X Y=%02X SP=%02X SR=%02X\n",
+                (unsigned long long) e->cycles, e->PC, e->opcode, cpu_opcode_to_str(ins->opcode),
+                cpu_addressing_mode_to_str(ins->addr_mode), e->AC, e->X, e->Y, e->SP, e->SR);
+    }
+}
+
+/**
+ * @brief shared state of the corpus workers
+ */
+typedef struct differential_workers {
+    Differential_corpus_t* corpus;
+    uint64_t cycle_budget;
+    atomic_size_t next;                     ///< next job to hand out
+    atomic_long failed;
+} Differential_workers_t;
+
+/* the pair of machines a job runs on */
+typedef struct differential_machines {
+    CPU_type_t cpu;
+    Memory_type_t mem;
+    CPU_type_t reference_cpu;
+    Memory_type_t reference_mem;
+    Block_cache_t cache;
+    Jit_type_t jit;
+    Differential_t d;
+} Differential_machines_t;
+
+static void run_job(Differential_corpus_t* corpus, Differential_job_t* job, uint64_t cycle_budget) {
+    Differential_machines_t* m = calloc(1, sizeof(Differential_machines_t));
+    Loader_info_t info;
+    int blocks = 0;
+    int jit = 0;
+
+    job->result = -1;
+    job->cycles = 0;
+    if(m == NULL) {
+        return;
+    }
+    if(memory_initialize(&m->mem) == NULL) {
+        free(m);
+        return;
+    }
+    if(memory_initialize(&m->reference_mem) == NULL) {
+        memory_free(&m->mem);
+        free(m);
+        return;
+    }
+
+    if(loader_load(&m->mem, job->path, LOADER_AUTO, corpus->address, &info) == 0) {
+        /* both address spaces are plain RAM, the image is all there is to copy */
+        memcpy(m->reference_mem.data, m->mem.data, MEMORY_SIZE);
+
+        cpu_initialize(&m->cpu, corpus->variant);
+        cpu_reset(&m->cpu, &m->mem);
+        if(info.entry >= 0) {
+            m->cpu.PC = (uint16_t) info.entry;
+        } else if( (info.first > RESET_VECTOR) || (info.last < RESET_VECTOR + 1) ) {
+            m->cpu.PC = info.first;
+        }
+        m->reference_cpu = m->cpu;
+
+        blocks = corpus->blocks && (block_cache_initialize(&m->cache, &m->mem, corpus->variant) == 0);
+        jit = blocks && corpus->jit && (jit_initialize(&m->jit, &m->cache, 0) == 0);
+
+        differential_initialize(&m->d, &m->cpu, &m->mem, &m->reference_cpu, &m->reference_mem);
+        if(corpus->interval != 0) {
+            m->d.interval = corpus->interval;
+        }
+
+        const uint64_t start = m->cpu.cycles;
+        job->result = differential_run(&m->d, cycle_budget);
+        job->cycles = m->cpu.cycles - start;
+        if(job->result != 0) {
+            job->divergence = m->d.divergence;
+        }
+    }
+
+    if(jit) {
+        jit_free(&m->jit);
+    }
+    if(blocks) {
+        block_cache_free(&m->cache);
+    }
+    memory_free(&m->reference_mem);
+    memory_free(&m->mem);
+    free(m);
+}
+
+/* the lanes of a lockstep engine and a reference for each */
+typedef struct differential_lanes {
+    Lockstep_type_t ls;
+    CPU_type_t cpu[DIFFERENTIAL_LANES];
+    Memory_type_t mem[DIFFERENTIAL_LANES];
+    CPU_type_t reference_cpu[DIFFERENTIAL_LANES];
+    Memory_type_t reference_mem[DIFFERENTIAL_LANES];
+    Differential_t d[DIFFERENTIAL_LANES];
+    uint8_t image[MEMORY_SIZE];             ///< the file as loaded, shared by the second half of the lanes
+} Differential_lanes_t;
+
+/*
+ * every lane loads the same file and starts from the same place, pairs of lanes with the same
+ * accumulator and index registers, so the lanes split up on programs that read them before
+ * setting them and fall back into step once they do. the first half of the lanes run from RAM of
+ * their own, the second half from one image mapped copy on write, so the engine both compares the
+ * code of lanes and shares it
+ */
+static void run_lockstep_job(Differential_corpus_t* corpus, Differential_job_t* job, uint64_t cycle_budget) {
+    Differential_lanes_t* m = calloc(1, sizeof(Differential_lanes_t));
+    Loader_info_t info;
+    size_t ready = 0;
+
+    job->result = -1;
+    job->cycles = 0;
+    if(m == NULL) {
+        return;
+    }
+    for(; ready < DIFFERENTIAL_LANES; ready++) {
+        if(memory_initialize(&m->mem[ready]) == NULL) {
+            break;
+        }
+        if(memory_initialize(&m->reference_mem[ready]) == NULL) {
+            memory_free(&m->mem[ready]);
+            break;
+        }
+    }
+
+    if( (ready == DIFFERENTIAL_LANES) && (lockstep_initialize(&m->ls, DIFFERENTIAL_LANES) == 0) ) {
+        if(loader_load(&m->mem[0], job->path, LOADER_AUTO, corpus->address, &info) == 0) {
+            CPU_type_t cpu;
+
+            cpu_initialize(&cpu, corpus->variant);
+            cpu_reset(&cpu, &m->mem[0]);
+            if(info.entry >= 0) {
+                cpu.PC = (uint16_t) info.entry;
+            } else if( (info.first > RESET_VECTOR) || (info.last < RESET_VECTOR + 1) ) {
+                cpu.PC = info.first;
+            }
+
+            memcpy(m->image, m->mem[0].data, MEMORY_SIZE);
+            for(size_t i = 0; i < DIFFERENTIAL_LANES; i++) {
+                if(i != 0) {
+                    memcpy(m->mem[i].data, m->image, MEMORY_SIZE);
+                }
+                if(i >= DIFFERENTIAL_LANES / 2) {
+                    memory_map_shared(&m->mem[i], 0, MEMORY_PAGES, m->image);
+                }
+                memcpy(m->reference_mem[i].data, m->image, MEMORY_SIZE);
+
+                cpu.AC = cpu.X = cpu.Y = (uint8_t) ((i / 2) * 0x47);
+                m->cpu[i] = cpu;
+                m->reference_cpu[i] = cpu;
+                lockstep_load(&m->ls, i, &cpu, &m->mem[i]);
+                differential_initialize(&m->d[i], &m->cpu[i], &m->mem[i], &m->reference_cpu[i], &m->reference_mem[i]);
+                m->d[i].interval = corpus->interval;
+            }
+
+            const uint64_t start = cpu.cycles;
+            job->result = differential_run_lockstep(&m->ls, m->d, cycle_budget);
+            job->cycles = m->cpu[0].cycles - start;
+            for(size_t i = 0; i < DIFFERENTIAL_LANES; i++) {
+                if(m->d[i].diverged) {
+                    job->lane = i;
+                    job->divergence = m->d[i].divergence;
+                    break;
+                }
+            }
+        }
+        lockstep_free(&m->ls);
+    }
+
+    for(size_t i = 0; i < ready; i++) {
+        memory_free(&m->reference_mem[i]);
+        memory_free(&m->mem[i]);
+    }
+    free(m);
+}
+
+static void* corpus_worker(void* arg) {
+    Differential_workers_t* w = (Differential_workers_t*) arg;
+    Differential_corpus_t* corpus = w->corpus;
+
+    for(;;) {
+        const size_t i = atomic_fetch_add(&w->next, 1);
+        if(i >= corpus->count) {
+            break;
+        }
+
+        if(corpus->lockstep) {
+            run_lockstep_job(corpus, &corpus->jobs[i], w->cycle_budget);
+        } else {
+            run_job(corpus, &corpus->jobs[i], w->cycle_budget);
+        }
+        if(corpus->jobs[i].result != 0) {
+            atomic_fetch_add(&w->failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/* an instruction and the cycles the data sheets give it */
+typedef struct timing_probe {
+    uint16_t PC;
+    uint8_t code[2];
+    uint8_t SR;
+    uint8_t cmos;                           ///< 65C02 and W65C02S only
+    uint32_t cycles;
+} Timing_probe_t;
+
+static const Timing_probe_t timing_probes[] = {
+    { 0x0200, { 0xD0, 0x10 }, Z_MASK | IG_MASK, 0, 2 },     /* BNE not taken */
+    { 0x0200, { 0xD0, 0x10 }, IG_MASK, 0, 3 },              /* BNE taken within the page */
+    { 0x02F0, { 0xD0, 0x20 }, IG_MASK, 0, 4 },              /* BNE taken to the next page */
+    { 0x0200, { 0x80, 0x10 }, IG_MASK, 1, 3 },              /* BRA within the page */
+    { 0x02F0, { 0x80, 0x20 }, IG_MASK, 1, 4 },              /* BRA to the next page */
+};
+
+/**
+ * check the cycles of the timing probes
+ * @param variant instruction set to check
+ * @return number of probes the interpreter or the reference got wrong, 0 if both match
+ */
+size_t differential_verify_timing(CPU_variant variant) {
+    Memory_type_t mem;
+    size_t errors = 0;
+
+    if(memory_initialize(&mem) == NULL) {
+        return sizeof(timing_probes) / sizeof(timing_probes[0]);
+    }
+
+    for(size_t i = 0; i < sizeof(timing_probes) / sizeof(timing_probes[0]); i++) {
+        const Timing_probe_t* probe = &timing_probes[i];
+        CPU_type_t cpu;
+
+        if(probe->cmos && (variant == CPU_NMOS)) {
+            continue;
+        }
+        mem_write8(&mem, probe->PC, probe->code[0]);
+        mem_write8(&mem, (uint16_t) (probe->PC + 1), probe->code[1]);
+
+        for(int reference = 0; reference < 2; reference++) {
+            cpu_initialize(&cpu, variant);
+            cpu.PC = probe->PC;
+            cpu.SR = probe->SR;
+            const uint32_t cycles = reference ? reference_step(&cpu, &mem) : cpu_step(&cpu, &mem);
+            errors += (cycles != probe->cycles);
+        }
+    }
+
+    memory_free(&mem);
+    return errors;
+}
+
+/**
+ * run a corpus
+ * the calling thread is one of the workers
+ * @param corpus files and settings
+ * @param cycle_budget cycles to run every file for
+ * @return number of files that diverged or could not be loaded, -1 if the threads could not be allocated
+ */
+long differential_run_corpus(Differential_corpus_t* corpus, uint64_t cycle_budget) {
+    Differential_workers_t w;
+    unsigned count = corpus->threads;
+
+    if(count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (online > 0) ? (unsigned) online : 1;
+    }
+    if(count > corpus->count) {
+        count = corpus->count ? (unsigned) corpus->count : 1;
+    }
+
+    pthread_t* threads = (pthread_t*) calloc(count, sizeof(pthread_t));
+    if(threads == NULL) {
+        return -1;
+    }
+
+    w.corpus = corpus;
+    w.cycle_budget = cycle_budget;
+    atomic_init(&w.next, 0);
+    atomic_init(&w.failed, 0);
+
+    /* the workers that did start take the files of the ones that did not */
+    unsigned started = 1;
+    for(; started < count; started++) {
+        if(pthread_create(&threads[started], NULL, corpus_worker, &w) != 0) {
+            break;
+        }
+    }
+
+    corpus_worker(&w);
+
+    for(unsigned i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    return atomic_load(&w.failed);
+}
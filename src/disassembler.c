@@ -0,0 +1,514 @@
+/**
+ * @file disassembler.c
+ * @brief formats instructions in assembler syntax and resolves addresses against a symbol file
+ * @author Edwin
+ */
+
+/**
+ * An instruction is printed from two lookups: the descriptor of its opcode byte gives the
+ * mnemonic, the addressing mode and the length, and the form of the mode gives what goes around
+ * the operand. The text is put together a character at a time into the caller's buffer, there is
+ * no printf and no allocation on the way.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "disassembler.h"
+
+#define SYMBOLS_CAPACITY 256                ///< symbols a table first has room for
+#define NAMES_CAPACITY 4096                 ///< bytes of names a table first has room for
+#define SYMBOLS_LINE 512                    ///< longest line of a symbol file that is read whole
+
+/* what the operand of an addressing mode is */
+typedef enum operand {
+    OPERAND_NONE,
+    OPERAND_IMMEDIATE,
+    OPERAND_ZERO_PAGE,
+    OPERAND_ABSOLUTE,
+    OPERAND_RELATIVE,                       ///< branch offset, printed as its target
+    OPERAND_ZERO_PAGE_RELATIVE              ///< zero page address, then a branch offset
+} Operand;
+
+/* how the operand of an addressing mode is printed */
+typedef struct form {
+    uint8_t operand;
+    const char* prefix;
+    const char* suffix;
+} Form;
+
+static const Form forms[] = {
+    [ABS_A]          = { OPERAND_ABSOLUTE, "", "" },
+    [ABS_INDX_IND]   = { OPERAND_ABSOLUTE, "(", ",X)" },
+    [ABS_INDX_X]     = { OPERAND_ABSOLUTE, "", ",X" },
+    [ABS_INDX_Y]     = { OPERAND_ABSOLUTE, "", ",Y" },
+    [ABS_IND]        = { OPERAND_ABSOLUTE, "(", ")" },
+    [ACC]            = { OPERAND_NONE, "A", "" },
+    [IMM]            = { OPERAND_IMMEDIATE, "#", "" },
+    [IMP]            = { OPERAND_NONE, "", "" },
+    [PC_REL]         = { OPERAND_RELATIVE, "", "" },
+    [STK]            = { OPERAND_NONE, "", "" },
+    [ZPG]            = { OPERAND_ZERO_PAGE, "", "" },
+    [ZPG_INDX_IND]   = { OPERAND_ZERO_PAGE, "(", ",X)" },
+    [ZPG_INDX_X]     = { OPERAND_ZERO_PAGE, "", ",X" },
+    [ZPG_INDX_Y]     = { OPERAND_ZERO_PAGE, "", ",Y" },
+    [ZPG_IND]        = { OPERAND_ZERO_PAGE, "(", ")" },
+    [ZPG_IND_INDX_Y] = { OPERAND_ZERO_PAGE, "(", "),Y" },
+    [ZPG_PC_REL]     = { OPERAND_ZERO_PAGE_RELATIVE, "", "" },
+    [INV]            = { OPERAND_NONE, "", "" },
+};
+
+static const char hex[] = "0123456789ABCDEF";
+
+/* text being written, p stops at end, which keeps room for the NUL */
+typedef struct output {
+    char* p;
+    char* end;
+} Output;
+
+static inline void put(Output* o, char c) {
+    if(o->p < o->end) {
+        *o->p++ = c;
+    }
+}
+
+static inline void put_string(Output* o, const char* s) {
+    while(*s != '\0') {
+        put(o, *s++);
+    }
+}
+
+static inline void put_hex(Output* o, uint16_t value, int digits) {
+    put(o, '$');
+    for(int shift = 4 * (digits - 1); shift >= 0; shift -= 4) {
+        put(o, hex[(value >> shift) & 0xF]);
+    }
+}
+
+/* an address by name when it has one */
+static void put_address(Output* o, uint16_t address, int digits, const Disassembler_symbols_t* symbols) {
+    const char* name = (symbols != NULL) ? disassembler_symbol_at(symbols, address) : NULL;
+
+    if(name != NULL) {
+        put_string(o, name);
+    } else {
+        put_hex(o, address, digits);
+    }
+}
+
+/**
+ * format the instruction at bytes
+ * @param text where to write it
+ * @param size bytes of text
+ * @param variant instruction set
+ * @param address where the instruction is
+ * @param bytes opcode and operand
+ * @param symbols symbol table or NULL
+ * @return length of the instruction
+ */
+uint8_t disassembler_format(char* text, size_t size, CPU_variant variant, uint16_t address,
+                            const uint8_t* bytes, const Disassembler_symbols_t* symbols) {
+    const Disassembler_opcode_t* op = &disassembler_opcodes[variant][bytes[0]];
+    const Form* form = &forms[op->mode];
+    Output o;
+
+    if(size == 0) {
+        return op->length;
+    }
+    o.p = text;
+    o.end = text + size - 1;
+
+    put_string(&o, op->mnemonic);
+    if( (form->operand != OPERAND_NONE) || (form->prefix[0] != '\0') ) {
+        put(&o, ' ');
+    }
+    put_string(&o, form->prefix);
+
+    switch(form->operand) {
+        case OPERAND_IMMEDIATE:
+            put_hex(&o, bytes[1], 2);
+            break;
+        case OPERAND_ZERO_PAGE:
+            put_address(&o, bytes[1], 2, symbols);
+            break;
+        case OPERAND_ABSOLUTE:
+            put_address(&o, (uint16_t) (bytes[1] | (bytes[2] << 8)), 4, symbols);
+            break;
+        case OPERAND_RELATIVE:
+            put_address(&o, (uint16_t) (address + 2 + (int8_t) bytes[1]), 4, symbols);
+            break;
+        case OPERAND_ZERO_PAGE_RELATIVE:
+            put_address(&o, bytes[1], 2, symbols);
+            put(&o, ',');
+            put_address(&o, (uint16_t) (address + 3 + (int8_t) bytes[2]), 4, symbols);
+            break;
+        default:
+            break;
+    }
+
+    put_string(&o, form->suffix);
+    *o.p = '\0';
+
+    return op->length;
+}
+
+/**
+ * disassemble instructions of an address space
+ * @param mem memory
+ * @param variant instruction set
+ * @param address first instruction
+ * @param lines where to write them
+ * @param count room in lines
+ * @param symbols symbol table or NULL
+ * @return instructions written
+ */
+size_t disassembler_range(const Memory_type_t* mem, CPU_variant variant, uint16_t address,
+                          Disassembler_line_t* lines, size_t count, const Disassembler_symbols_t* symbols) {
+    size_t n = 0;
+
+    for(; n < count; n++) {
+        Disassembler_line_t* line = &lines[n];
+        const uint8_t* page = memory_page_storage(mem, (uint8_t) (address / MEMORY_PAGE_SIZE));
+        if(page == NULL) {
+            break;
+        }
+        line->bytes[0] = page[address % MEMORY_PAGE_SIZE];
+        line->length = disassembler_opcodes[variant][line->bytes[0]].length;
+
+        /* the operand may sit on the next page, which wraps at the top of the address space */
+        uint8_t i = 1;
+        for(; i < line->length; i++) {
+            const uint16_t at = (uint16_t) (address + i);
+            page = memory_page_storage(mem, (uint8_t) (at / MEMORY_PAGE_SIZE));
+            if(page == NULL) {
+                break;
+            }
+            line->bytes[i] = page[at % MEMORY_PAGE_SIZE];
+        }
+        if(i < line->length) {
+            break;
+        }
+
+        line->address = address;
+        disassembler_format(line->text, sizeof(line->text), variant, address, line->bytes, symbols);
+        address = (uint16_t) (address + line->length);
+    }
+
+    return n;
+}
+
+/**
+ * disassemble instructions of a buffer
+ * @param data bytes
+ * @param size bytes of data
+ * @param origin address of data[0]
+ * @param variant instruction set
+ * @param lines where to write them
+ * @param count room in lines
+ * @param symbols symbol table or NULL
+ * @return instructions written
+ */
+size_t disassembler_buffer(const uint8_t* data, size_t size, uint16_t origin, CPU_variant variant,
+                           Disassembler_line_t* lines, size_t count, const Disassembler_symbols_t* symbols) {
+    size_t offset = 0;
+    size_t n = 0;
+
+    for(; (n < count) && (offset < size); n++) {
+        Disassembler_line_t* line = &lines[n];
+        const uint8_t length = disassembler_opcodes[variant][data[offset]].length;
+
+        if(size - offset < length) {
+            break;
+        }
+
+        line->address = (uint16_t) (origin + offset);
+        line->length = length;
+        memcpy(line->bytes, &data[offset], length);
+        disassembler_format(line->text, sizeof(line->text), variant, line->address, line->bytes, symbols);
+        offset += length;
+    }
+
+    return n;
+}
+
+/**
+ * create an empty symbol table
+ * @param s symbol table
+ */
+void disassembler_symbols_initialize(Disassembler_symbols_t* s) {
+    s->entries = NULL;
+    s->count = 0;
+    s->capacity = 0;
+    s->names = NULL;
+    s->names_size = 0;
+    s->names_capacity = 0;
+}
+
+/**
+ * release a symbol table
+ * @param s symbol table
+ */
+void disassembler_symbols_free(Disassembler_symbols_t* s) {
+    free(s->entries);
+    free(s->names);
+    disassembler_symbols_initialize(s);
+}
+
+/**
+ * add a symbol
+ * @param s symbol table
+ * @param address its address
+ * @param name its name, copied
+ * @return 0 on success, -1 if the table could not grow
+ */
+int disassembler_symbols_add(Disassembler_symbols_t* s, uint16_t address, const char* name) {
+    const size_t length = strlen(name) + 1;
+
+    if(s->count == s->capacity) {
+        size_t capacity = (s->capacity != 0) ? 2 * s->capacity : SYMBOLS_CAPACITY;
+        Disassembler_symbol_t* entries = realloc(s->entries, capacity * sizeof(Disassembler_symbol_t));
+
+        if(entries == NULL) {
+            return -1;
+        }
+        s->entries = entries;
+        s->capacity = capacity;
+    }
+
+    if(s->names_capacity - s->names_size < length) {
+        size_t capacity = (s->names_capacity != 0) ? s->names_capacity : NAMES_CAPACITY;
+        while(capacity - s->names_size < length) {
+            capacity *= 2;
+        }
+
+        char* names = realloc(s->names, capacity);
+        if(names == NULL) {
+            return -1;
+        }
+        s->names = names;
+        s->names_capacity = capacity;
+    }
+
+    memcpy(&s->names[s->names_size], name, length);
+    s->entries[s->count++] = (Disassembler_symbol_t) { address, (uint32_t) s->names_size };
+    s->names_size += length;
+
+    return 0;
+}
+
+/* by address, then in the order they were added, the names only ever grow */
+static int compare_symbols(const void* a, const void* b) {
+    const Disassembler_symbol_t* x = (const Disassembler_symbol_t*) a;
+    const Disassembler_symbol_t* y = (const Disassembler_symbol_t*) b;
+
+    if(x->address != y->address) {
+        return (x->address < y->address) ? -1 : 1;
+    }
+    return (x->name > y->name) - (x->name < y->name);
+}
+
+/**
+ * sort a symbol table by address
+ * @param s symbol table
+ */
+void disassembler_symbols_sort(Disassembler_symbols_t* s) {
+    if(s->count > 1) {
+        qsort(s->entries, s->count, sizeof(Disassembler_symbol_t), compare_symbols);
+    }
+}
+
+/* a number as symbol files write addresses @return -1 if it is not one or does not fit */
+static long parse_address(const char* p) {
+    int base = 10;
+    char* end;
+
+    if(*p == '$') {
+        base = 16;
+        p++;
+    } else if( (p[0] == '0') && ( (p[1] == 'x') || (p[1] == 'X') ) ) {
+        base = 16;
+        p += 2;
+    }
+    if(!isxdigit((unsigned char) *p)) {
+        return -1;
+    }
+
+    const unsigned long value = strtoul(p, &end, base);
+    if( (*end != '\0') || (value > 0xFFFF) ) {
+        return -1;
+    }
+    return (long) value;
+}
+
+/* split a line into at most max words, cutting it at a comment @return words found */
+static int split(char* line, char** words, int max) {
+    int count = 0;
+    char* p = line;
+
+    for(;;) {
+        while( (*p != '\0') && (isspace((unsigned char) *p) || (*p == '=')) ) {
+            p++;
+        }
+        if( (*p == '\0') || (*p == ';') || (*p == '#') || (count == max) ) {
+            break;
+        }
+
+        words[count++] = p;
+        while( (*p != '\0') && !isspace((unsigned char) *p) && (*p != '=') && (*p != ';') ) {
+            p++;
+        }
+        if(*p == ';') {
+            *p = '\0';
+            break;
+        }
+        if(*p != '\0') {
+            *p++ = '\0';
+        }
+    }
+
+    return count;
+}
+
+/* a symbol of one line of a symbol file @return 1 if the line has one, 0 if not */
+static int parse_symbol(char* line, uint16_t* address, const char** name) {
+    char* words[4];
+    const int count = split(line, words, 4);
+    long value;
+
+    if(count < 2) {
+        return 0;
+    }
+
+    /* VICE: al C:1234 .name */
+    if( (strcmp(words[0], "al") == 0) && (count >= 3) ) {
+        char* colon = strchr(words[1], ':');
+        char* digits = (colon != NULL) ? colon + 1 : words[1];
+        char prefixed[16];
+
+        if(strlen(digits) + 2 > sizeof(prefixed)) {
+            return 0;
+        }
+        snprintf(prefixed, sizeof(prefixed), "$%s", digits);
+        value = parse_address(prefixed);
+        *name = (words[2][0] == '.') ? words[2] + 1 : words[2];
+    } else {
+        /* name = value, name equ value, name: value */
+        const char* text = words[1];
+        size_t length = strlen(words[0]);
+
+        if( (strcasecmp(text, "equ") == 0) || (strcasecmp(text, ".equ") == 0) ) {
+            if(count < 3) {
+                return 0;
+            }
+            text = words[2];
+        }
+        if( (length > 1) && (words[0][length - 1] == ':') ) {
+            words[0][length - 1] = '\0';
+        }
+        value = parse_address(text);
+        *name = words[0];
+    }
+
+    if( (value < 0) || ((*name)[0] == '\0') ) {
+        return 0;
+    }
+    *address = (uint16_t) value;
+    return 1;
+}
+
+/**
+ * add the symbols of a file
+ * @param s symbol table
+ * @param path symbol file
+ * @return symbols added, -1 on error
+ */
+long disassembler_symbols_load(Disassembler_symbols_t* s, const char* path) {
+    char line[SYMBOLS_LINE];
+    long added = 0;
+    FILE* in = fopen(path, "r");
+
+    if(in == NULL) {
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), in) != NULL) {
+        const size_t length = strlen(line);
+        uint16_t address;
+        const char* name;
+
+        /* the rest of a line too long to hold is dropped */
+        if( (length == sizeof(line) - 1) && (line[length - 1] != '\n') ) {
+            int c;
+            while( ((c = fgetc(in)) != EOF) && (c != '\n') ) {
+            }
+        }
+
+        if(parse_symbol(line, &address, &name)) {
+            if(disassembler_symbols_add(s, address, name) != 0) {
+                fclose(in);
+                return -1;
+            }
+            added++;
+        }
+    }
+
+    const int failed = ferror(in);
+    fclose(in);
+    disassembler_symbols_sort(s);
+
+    return failed ? -1 : added;
+}
+
+/* first entry at or above an address */
+static size_t lower_bound(const Disassembler_symbols_t* s, uint16_t address) {
+    size_t low = 0;
+    size_t high = s->count;
+
+    while(low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if(s->entries[middle].address < address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * name of an address
+ * @param s sorted symbol table
+ * @param address address
+ * @return its name, NULL if none
+ */
+const char* disassembler_symbol_at(const Disassembler_symbols_t* s, uint16_t address) {
+    const size_t i = lower_bound(s, address);
+
+    if( (i < s->count) && (s->entries[i].address == address) ) {
+        return &s->names[s->entries[i].name];
+    }
+    return NULL;
+}
+
+/**
+ * nearest symbol at or below an address
+ * @param s sorted symbol table
+ * @param address address
+ * @param offset where to store the distance from the symbol
+ * @return its name, NULL if none
+ */
+const char* disassembler_symbol_nearest(const Disassembler_symbols_t* s, uint16_t address, uint16_t* offset) {
+    const size_t above = (address == 0xFFFF) ? s->count : lower_bound(s, (uint16_t) (address + 1));
+
+    if(above == 0) {
+        return NULL;
+    }
+
+    const uint16_t base = s->entries[above - 1].address;
+    const size_t i = lower_bound(s, base);
+
+    *offset = (uint16_t) (address - base);
+    return &s->names[s->entries[i].name];
+}
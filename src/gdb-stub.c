@@ -0,0 +1,816 @@
+/**
+ * @file gdb-stub.c
+ * @brief GDB remote serial protocol server for debugging the guest program
+ * @author Edwin
+ */
+
+/**
+ * GDB sees a target with six registers, A, X, Y, P and SP of 8 bits and PC of 16 bits, in
+ * that order in the g packet, described to it by target.xml. The packets taken are the ones GDB
+ * needs for registers, memory, breakpoints, watchpoints, stepping and continuing; every other
+ * packet gets the empty reply, which tells GDB it is not supported.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "gdb-stub.h"
+#include "scheduler.h"
+
+#define SIGNAL_INT 2                        ///< stopped by an interrupt from GDB
+#define SIGNAL_TRAP 5                       ///< stopped by a step, breakpoint or watchpoint
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<feature name=\"org.gnu.gdb.m6502.core\">"
+    "<reg name=\"a\" bitsize=\"8\" type=\"uint8\" regnum=\"0\"/>"
+    "<reg name=\"x\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"y\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"p\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "</feature>"
+    "</target>";
+
+static const char hex[] = "0123456789abcdef";
+
+static int hex_digit(char c) {
+    if( (c >= '0') && (c <= '9') ) {
+        return c - '0';
+    }
+    if( (c >= 'a') && (c <= 'f') ) {
+        return c - 'a' + 10;
+    }
+    if( (c >= 'A') && (c <= 'F') ) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* hex number up to a character that is not a digit @return -1 if there is none or it is too big */
+static long parse_hex(const char** p) {
+    long value = 0;
+    int digits = 0;
+
+    for(int d; (d = hex_digit(**p)) >= 0; (*p)++) {
+        if(++digits > 8) {
+            return -1;
+        }
+        value = (value << 4) | d;
+    }
+    return (digits != 0) ? value : -1;
+}
+
+/* "addr,length" of the m, M and Z packets */
+static int parse_range(const char** p, long* address, long* length) {
+    *address = parse_hex(p);
+    if( (*address < 0) || (*address > 0xFFFF) || (**p != ',') ) {
+        return -1;
+    }
+    (*p)++;
+    *length = parse_hex(p);
+    return (*length < 0) ? -1 : 0;
+}
+
+static char* put_byte(char* out, uint8_t value) {
+    *out++ = hex[value >> 4];
+    *out++ = hex[value & 0xF];
+    return out;
+}
+
+/**
+ * set a watchpoint
+ * @param s stub
+ * @param address first byte watched
+ * @param length bytes watched
+ * @param kind accesses that stop the CPU
+ * @return 0 on success, -1 if there is no room
+ */
+int gdb_stub_set_watch(Gdb_stub_t* s, uint16_t address, uint16_t length, Gdb_watch_kind kind) {
+    static const unsigned kinds[] = {
+        [GDB_WATCH_WRITE] = WATCH_WRITE, [GDB_WATCH_READ] = WATCH_READ, [GDB_WATCH_ACCESS] = WATCH_ACCESS
+    };
+
+    if(length == 0) {
+        length = 1;
+    }
+    if(s->watch_count == GDB_STUB_WATCHES) {
+        return -1;
+    }
+
+    const int range = watch_add(&s->watch, address, (uint16_t) (address + length - 1), kinds[kind], 1);
+    if(range < 0) {
+        return -1;
+    }
+
+    Gdb_watch_t* w = &s->watches[s->watch_count++];
+    w->address = address;
+    w->length = length;
+    w->kind = (uint8_t) kind;
+    w->range = range;
+    return 0;
+}
+
+/**
+ * remove a watchpoint
+ * @param s stub
+ * @param address first byte watched
+ * @param length bytes watched
+ * @param kind accesses that stop the CPU
+ * @return 0 on success, -1 if it was not set
+ */
+int gdb_stub_clear_watch(Gdb_stub_t* s, uint16_t address, uint16_t length, Gdb_watch_kind kind) {
+    if(length == 0) {
+        length = 1;
+    }
+
+    for(size_t i = 0; i < s->watch_count; i++) {
+        const Gdb_watch_t* w = &s->watches[i];
+
+        if( (w->address == address) && (w->length == length) && (w->kind == kind) ) {
+            watch_remove(&s->watch, w->range);
+            s->watches[i] = s->watches[--s->watch_count];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * set a breakpoint
+ * @param s stub
+ * @param address instruction to stop before
+ * @return 0 on success
+ */
+int gdb_stub_set_breakpoint(Gdb_stub_t* s, uint16_t address) {
+    return block_cache_set_breakpoint(s->cache, address);
+}
+
+/**
+ * remove a breakpoint
+ * @param s stub
+ * @param address instruction it was set on
+ */
+void gdb_stub_clear_breakpoint(Gdb_stub_t* s, uint16_t address) {
+    block_cache_clear_breakpoint(s->cache, address);
+}
+
+/**
+ * attach a stub
+ * @param s stub
+ * @param cpu CPU to debug
+ * @param mem its address space
+ * @return 0 on success, -1 on error
+ */
+int gdb_stub_initialize(Gdb_stub_t* s, CPU_type_t* cpu, Memory_type_t* mem) {
+    memset(s, 0, sizeof(*s));
+    s->cpu = cpu;
+    s->mem = mem;
+    s->listener = -1;
+    s->connection = -1;
+
+    if(mem->blocks == NULL) {
+        if(block_cache_initialize(&s->own_cache, mem, cpu->variant) != 0) {
+            return -1;
+        }
+        s->owns_cache = 1;
+    } else if(mem->blocks->variant != cpu->variant) {
+        return -1;
+    }
+    s->cache = mem->blocks;
+
+    /* the watchpoints only stop the CPU, there is no log to keep */
+    if(watch_initialize(&s->watch, cpu, mem, 0) != 0) {
+        if(s->owns_cache) {
+            block_cache_free(&s->own_cache);
+            s->owns_cache = 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * release a stub
+ * @param s stub
+ */
+void gdb_stub_free(Gdb_stub_t* s) {
+    watch_free(&s->watch);
+    s->watch_count = 0;
+    if(s->cache != NULL) {
+        for(uint32_t address = 0; address < MEMORY_SIZE; address++) {
+            block_cache_clear_breakpoint(s->cache, (uint16_t) address);
+        }
+    }
+    if(s->owns_cache) {
+        block_cache_free(&s->own_cache);
+        s->owns_cache = 0;
+    }
+    s->cache = NULL;
+
+    if(s->connection >= 0) {
+        close(s->connection);
+        s->connection = -1;
+    }
+    if(s->listener >= 0) {
+        close(s->listener);
+        s->listener = -1;
+    }
+    if(s->path != NULL) {
+        unlink(s->path);
+        free(s->path);
+        s->path = NULL;
+    }
+}
+
+/**
+ * listen for GDB
+ * @param s stub
+ * @param address TCP host:port or Unix socket path
+ * @return 0 on success, -1 on error
+ */
+int gdb_stub_listen(Gdb_stub_t* s, const char* address) {
+    const int is_unix = (strncmp(address, "unix:", 5) == 0) || (strchr(address, '/') != NULL);
+    const int one = 1;
+    int fd;
+
+    if(is_unix) {
+        struct sockaddr_un un;
+        const char* path = (strncmp(address, "unix:", 5) == 0) ? address + 5 : address;
+
+        if(strlen(path) >= sizeof(un.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) {
+            return -1;
+        }
+        unlink(path);
+        if( (bind(fd, (struct sockaddr*) &un, sizeof(un)) != 0) || (listen(fd, 1) != 0) ) {
+            close(fd);
+            return -1;
+        }
+        s->path = strdup(path);
+    } else {
+        struct addrinfo hints;
+        struct addrinfo* list;
+        char host[256];
+        const char* colon = strrchr(address, ':');
+        const char* port = (colon != NULL) ? colon + 1 : address;
+        const size_t length = (colon != NULL) ? (size_t) (colon - address) : 0;
+
+        if(length >= sizeof(host)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(host, address, length);
+        host[length] = '\0';
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if(getaddrinfo((length != 0) ? host : "localhost", port, &hints, &list) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        fd = -1;
+        for(struct addrinfo* a = list; (a != NULL) && (fd < 0); a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if(fd < 0) {
+                continue;
+            }
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if( (bind(fd, a->ai_addr, a->ai_addrlen) != 0) || (listen(fd, 1) != 0) ) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(list);
+        if(fd < 0) {
+            return -1;
+        }
+    }
+
+    s->listener = fd;
+    return 0;
+}
+
+/*
+ * connection
+ */
+
+/* next byte from GDB @return -1 once the connection is gone */
+static int read_byte(Gdb_stub_t* s) {
+    if(s->input_start == s->input_end) {
+        ssize_t n;
+        do {
+            n = recv(s->connection, s->input, sizeof(s->input), 0);
+        } while( (n < 0) && (errno == EINTR) );
+        if(n <= 0) {
+            return -1;
+        }
+        s->input_start = 0;
+        s->input_end = (size_t) n;
+    }
+    return s->input[s->input_start++];
+}
+
+static int send_all(Gdb_stub_t* s, const char* data, size_t size) {
+    while(size != 0) {
+        ssize_t n = send(s->connection, data, size, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+/* send the packet in reply @return 0 on success, -1 once the connection is gone */
+static int put_packet(Gdb_stub_t* s, size_t length) {
+    char* out = s->reply;
+    uint8_t sum = 0;
+
+    /* the reply is built from the second byte on to leave room for the $ */
+    for(size_t i = 1; i <= length; i++) {
+        sum += (uint8_t) out[i];
+    }
+    out[0] = '$';
+    out[length + 1] = '#';
+    put_byte(&out[length + 2], sum);
+
+    for(;;) {
+        if(send_all(s, out, length + 4) != 0) {
+            return -1;
+        }
+        if(s->no_ack) {
+            return 0;
+        }
+
+        int c;
+        do {
+            c = read_byte(s);
+        } while( (c >= 0) && (c != '+') && (c != '-') );
+        if(c < 0) {
+            return -1;
+        }
+        if(c == '+') {
+            return 0;
+        }
+    }
+}
+
+static int put_string(Gdb_stub_t* s, const char* text) {
+    const size_t length = strlen(text);
+    memcpy(&s->reply[1], text, length);
+    return put_packet(s, length);
+}
+
+/* next packet from GDB into packet @return its length, -1 once the connection is gone */
+static long get_packet(Gdb_stub_t* s) {
+    for(;;) {
+        int c;
+        do {
+            c = read_byte(s);
+        } while( (c >= 0) && (c != '$') );
+        if(c < 0) {
+            return -1;
+        }
+
+        size_t length = 0;
+        uint8_t sum = 0;
+        int overflow = 0;
+        while( ((c = read_byte(s)) >= 0) && (c != '#') ) {
+            sum += (uint8_t) c;
+            if(length < GDB_STUB_PACKET) {
+                s->packet[length++] = (char) c;
+            } else {
+                overflow = 1;
+            }
+        }
+        const int high = read_byte(s);
+        const int low = read_byte(s);
+        if( (c < 0) || (high < 0) || (low < 0) ) {
+            return -1;
+        }
+        s->packet[length] = '\0';
+
+        const int ok = !overflow && (hex_digit((char) high) >= 0) && (hex_digit((char) low) >= 0) &&
+                       (((hex_digit((char) high) << 4) | hex_digit((char) low)) == sum);
+        if(!s->no_ack) {
+            if(send_all(s, ok ? "+" : "-", 1) != 0) {
+                return -1;
+            }
+        }
+        if(ok) {
+            return (long) length;
+        }
+    }
+}
+
+/* GDB sent an interrupt while the CPU runs @return 1 if it did, 0 if not, -1 once the connection is gone */
+static int interrupted(Gdb_stub_t* s) {
+    for(;;) {
+        while(s->input_start != s->input_end) {
+            if(s->input[s->input_start++] == 0x03) {
+                return 1;
+            }
+        }
+
+        struct pollfd p = { s->connection, POLLIN, 0 };
+        if(poll(&p, 1, 0) <= 0) {
+            return 0;
+        }
+        if(read_byte(s) < 0) {
+            return -1;
+        }
+        s->input_start--;
+    }
+}
+
+/*
+ * packets
+ */
+
+static int stop_reply(Gdb_stub_t* s, int signal) {
+    char text[32];
+
+    if(s->watch.stop_range >= 0) {
+        uint8_t hit = GDB_WATCH_ACCESS;
+        for(size_t i = 0; i < s->watch_count; i++) {
+            if(s->watches[i].range == s->watch.stop_range) {
+                hit = s->watches[i].kind;
+            }
+        }
+
+        const char* kind = (hit == GDB_WATCH_WRITE) ? "watch" : (hit == GDB_WATCH_READ) ? "rwatch" : "awatch";
+        snprintf(text, sizeof(text), "T%02x%s:%04x;", signal, kind, s->watch.stop.address);
+        s->watch.stop_range = -1;
+    } else {
+        snprintf(text, sizeof(text), "T%02x", signal);
+    }
+    return put_string(s, text);
+}
+
+/* a halted CPU that no event will wake */
+static int stuck(const CPU_type_t* cpu) {
+    return ( (cpu->state == CPU_WAITING) || (cpu->state == CPU_STOPPED) ) &&
+           ( (cpu->events == NULL) || (scheduler_next(cpu->events) == SCHEDULER_NONE) );
+}
+
+/* run one instruction, the one under a breakpoint included */
+static void step(Gdb_stub_t* s) {
+    cpu_resume(s->cpu);
+    cpu_step(s->cpu, s->mem);
+}
+
+/* run until a breakpoint, a watchpoint or GDB stops it @return signal, -1 once the connection is gone */
+static int run(Gdb_stub_t* s) {
+    CPU_type_t* cpu = s->cpu;
+
+    step(s);
+    for(;;) {
+        if(cpu->state == CPU_BREAK) {
+            return SIGNAL_TRAP;
+        }
+        if(stuck(cpu)) {
+            return SIGNAL_TRAP;
+        }
+
+        const int stop = interrupted(s);
+        if(stop != 0) {
+            return (stop > 0) ? SIGNAL_INT : -1;
+        }
+
+        cpu_run(cpu, s->mem, GDB_STUB_SLICE);
+    }
+}
+
+static int read_registers(Gdb_stub_t* s) {
+    const CPU_type_t* cpu = s->cpu;
+    char* out = &s->reply[1];
+
+    out = put_byte(out, cpu->AC);
+    out = put_byte(out, cpu->X);
+    out = put_byte(out, cpu->Y);
+    out = put_byte(out, cpu->SR);
+    out = put_byte(out, cpu->SP);
+    out = put_byte(out, (uint8_t) cpu->PC);
+    out = put_byte(out, cpu->PC >> 8);
+    return put_packet(s, (size_t) (out - &s->reply[1]));
+}
+
+/* the bytes of register n as hex, little endian @return 0 on success, -1 if there is no such register */
+static int write_register(CPU_type_t* cpu, long n, const char* p) {
+    uint8_t bytes[2];
+    const int size = (n == 5) ? 2 : 1;
+
+    for(int i = 0; i < size; i++) {
+        const int high = hex_digit(p[2 * i]);
+        const int low = (high >= 0) ? hex_digit(p[2 * i + 1]) : -1;
+        if(low < 0) {
+            return -1;
+        }
+        bytes[i] = (uint8_t) ((high << 4) | low);
+    }
+
+    switch(n) {
+        case 0: cpu->AC = bytes[0]; break;
+        case 1: cpu->X = bytes[0]; break;
+        case 2: cpu->Y = bytes[0]; break;
+        case 3: cpu->SR = bytes[0]; break;
+        case 4: cpu->SP = bytes[0]; break;
+        case 5: cpu->PC = (uint16_t) (bytes[0] | (bytes[1] << 8)); break;
+        default: return -1;
+    }
+    return 0;
+}
+
+static int read_register(Gdb_stub_t* s, long n) {
+    const CPU_type_t* cpu = s->cpu;
+    char* out = &s->reply[1];
+
+    switch(n) {
+        case 0: out = put_byte(out, cpu->AC); break;
+        case 1: out = put_byte(out, cpu->X); break;
+        case 2: out = put_byte(out, cpu->Y); break;
+        case 3: out = put_byte(out, cpu->SR); break;
+        case 4: out = put_byte(out, cpu->SP); break;
+        case 5: out = put_byte(put_byte(out, (uint8_t) cpu->PC), cpu->PC >> 8); break;
+        default: return put_string(s, "E01");
+    }
+    return put_packet(s, (size_t) (out - &s->reply[1]));
+}
+
+static int read_memory(Gdb_stub_t* s, const char* p) {
+    long address, length;
+    char* out = &s->reply[1];
+
+    if(parse_range(&p, &address, &length) != 0) {
+        return put_string(s, "E01");
+    }
+    if(length > GDB_STUB_PACKET / 2) {
+        length = GDB_STUB_PACKET / 2;
+    }
+    for(long i = 0; i < length; i++) {
+        out = put_byte(out, mem_peek8(s->mem, (uint16_t) (address + i)));
+    }
+    return put_packet(s, (size_t) (out - &s->reply[1]));
+}
+
+static int write_memory(Gdb_stub_t* s, const char* p) {
+    long address, length;
+
+    if( (parse_range(&p, &address, &length) != 0) || (*p++ != ':') ) {
+        return put_string(s, "E01");
+    }
+    for(long i = 0; i < length; i++) {
+        const int high = hex_digit(p[2 * i]);
+        const int low = (high >= 0) ? hex_digit(p[2 * i + 1]) : -1;
+        if(low < 0) {
+            return put_string(s, "E01");
+        }
+        memory_poke(s->mem, (uint16_t) (address + i), (uint8_t) ((high << 4) | low));
+    }
+    return put_string(s, "OK");
+}
+
+/* Z and z packets */
+static int breakpoint(Gdb_stub_t* s, const char* p, int set) {
+    const char type = *p++;
+    long address, length;
+    int result;
+
+    if( (*p++ != ',') || (parse_range(&p, &address, &length) != 0) ) {
+        return put_string(s, "E01");
+    }
+
+    switch(type) {
+        case '0':
+        case '1':
+            /* software and hardware breakpoints are the same thing here, the length is the kind */
+            if(set) {
+                result = gdb_stub_set_breakpoint(s, (uint16_t) address);
+            } else {
+                gdb_stub_clear_breakpoint(s, (uint16_t) address);
+                result = 0;
+            }
+            break;
+        case '2':
+        case '3':
+        case '4':
+            if(length > 0xFFFF) {
+                return put_string(s, "E01");
+            }
+            result = set ? gdb_stub_set_watch(s, (uint16_t) address, (uint16_t) length, (Gdb_watch_kind) (type - '0')) :
+                           gdb_stub_clear_watch(s, (uint16_t) address, (uint16_t) length, (Gdb_watch_kind) (type - '0'));
+            break;
+        default:
+            return put_string(s, "");
+    }
+
+    return put_string(s, (result == 0) ? "OK" : "E01");
+}
+
+/* qXfer:features:read:target.xml:offset,length */
+static int read_features(Gdb_stub_t* s, const char* p) {
+    static const char annex[] = "target.xml:";
+    long offset, length;
+
+    if(strncmp(p, annex, sizeof(annex) - 1) != 0) {
+        return put_string(s, "E00");
+    }
+    p += sizeof(annex) - 1;
+    offset = parse_hex(&p);
+    if( (offset < 0) || (*p++ != ',') || ((length = parse_hex(&p)) < 0) ) {
+        return put_string(s, "E01");
+    }
+
+    const long size = (long) sizeof(target_xml) - 1;
+    if(offset > size) {
+        offset = size;
+    }
+    if(length > size - offset) {
+        length = size - offset;
+    }
+    if(length > GDB_STUB_PACKET - 1) {
+        length = GDB_STUB_PACKET - 1;
+    }
+
+    s->reply[1] = (offset + length < size) ? 'm' : 'l';
+    memcpy(&s->reply[2], &target_xml[offset], (size_t) length);
+    return put_packet(s, (size_t) length + 1);
+}
+
+static int query(Gdb_stub_t* s, const char* p) {
+    if(strncmp(p, "qSupported", 10) == 0) {
+        char text[96];
+        snprintf(text, sizeof(text), "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+", GDB_STUB_PACKET);
+        return put_string(s, text);
+    }
+    if(strncmp(p, "qXfer:features:read:", 20) == 0) {
+        return read_features(s, p + 20);
+    }
+    if(strcmp(p, "QStartNoAckMode") == 0) {
+        const int result = put_string(s, "OK");
+        s->no_ack = 1;
+        return result;
+    }
+    if(strcmp(p, "qAttached") == 0) {
+        return put_string(s, "1");
+    }
+    if(strcmp(p, "qC") == 0) {
+        return put_string(s, "QC1");
+    }
+    if(strcmp(p, "qfThreadInfo") == 0) {
+        return put_string(s, "m1");
+    }
+    if(strcmp(p, "qsThreadInfo") == 0) {
+        return put_string(s, "l");
+    }
+    return put_string(s, "");
+}
+
+/* one connection @return as gdb_stub_serve */
+static int session(Gdb_stub_t* s) {
+    CPU_type_t* cpu = s->cpu;
+    long length;
+
+    s->no_ack = 0;
+    s->watch.stop_range = -1;
+    s->input_start = 0;
+    s->input_end = 0;
+
+    while((length = get_packet(s)) >= 0) {
+        const char* p = s->packet;
+        int result;
+        long n;
+
+        switch(p[0]) {
+            case '?':
+                result = stop_reply(s, SIGNAL_TRAP);
+                break;
+            case 'g':
+                result = read_registers(s);
+                break;
+            case 'G':
+                n = 0;
+                for(; (n < 6) && (write_register(cpu, n, p + 1 + 2 * n) == 0); n++) {
+                }
+                result = put_string(s, (n == 6) ? "OK" : "E01");
+                break;
+            case 'p':
+                p++;
+                result = read_register(s, parse_hex(&p));
+                break;
+            case 'P':
+                p++;
+                n = parse_hex(&p);
+                result = put_string(s, ( (*p == '=') && (write_register(cpu, n, p + 1) == 0) ) ? "OK" : "E01");
+                break;
+            case 'm':
+                result = read_memory(s, p + 1);
+                break;
+            case 'M':
+                result = write_memory(s, p + 1);
+                break;
+            case 'c':
+            case 's':
+                if(p[1] != '\0') {
+                    const char* at = p + 1;
+                    n = parse_hex(&at);
+                    if( (n >= 0) && (n <= 0xFFFF) ) {
+                        cpu->PC = (uint16_t) n;
+                    }
+                }
+                if(p[0] == 's') {
+                    step(s);
+                    n = SIGNAL_TRAP;
+                } else {
+                    n = run(s);
+                    if(n < 0) {
+                        return -1;
+                    }
+                }
+                result = stop_reply(s, (int) n);
+                break;
+            case 'Z':
+            case 'z':
+                result = breakpoint(s, p + 1, p[0] == 'Z');
+                break;
+            case 'H':
+            case 'T':
+                result = put_string(s, "OK");
+                break;
+            case 'q':
+            case 'Q':
+                result = query(s, p);
+                break;
+            case 'D':
+                put_string(s, "OK");
+                return 0;
+            case 'k':
+                return 1;
+            default:
+                result = put_string(s, "");
+                break;
+        }
+
+        if(result != 0) {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * serve one GDB connection
+ * @param s stub
+ * @return 0 detached or gone, 1 killed, -1 if no connection could be taken
+ */
+int gdb_stub_serve(Gdb_stub_t* s) {
+    const int one = 1;
+    int fd;
+
+    if(s->listener < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    do {
+        fd = accept(s->listener, NULL, NULL);
+    } while( (fd < 0) && (errno == EINTR) );
+    if(fd < 0) {
+        return -1;
+    }
+
+    /* every packet is a round trip, none of them should wait for more to send */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    s->connection = fd;
+
+    const int result = session(s);
+
+    close(fd);
+    s->connection = -1;
+    return (result > 0) ? 1 : 0;
+}
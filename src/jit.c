@@ -0,0 +1,1037 @@
+/**
+ * @file jit.c
+ * @brief translates hot blocks of the block cache to x86-64 machine code
+ * @author Edwin
+ */
+
+/**
+ * A translated block is a function uint32_t (CPU_type_t*, Memory_type_t*, uint64_t end) with the
+ * registers
+ *
+ *   rbx  CPU                   rbp  memory
+ *   r12d AC    r13d X    r14d Y    r15d SR, all kept as zero extended bytes
+ *   rdi  cycle counter
+ *   ecx  operand address       eax  operand value
+ *   rsi  read page             rdx  write page          r9d  offset in the page
+ *   r8d  page crossing penalty r10d, r11d scratch
+ *
+ * It loads the registers and jumps over a shared exit that stores them back. Every way out of
+ * the block sets PC, adds the base cycles of the instructions executed so far and jumps to the
+ * shared exit with the number of those instructions in eax. Penalty cycles are added to the
+ * cycle counter as they happen, after the last check that could still leave the instruction.
+ *
+ * end stays on the stack. A block that branches or jumps back to its own start goes round again
+ * without leaving the native code while the next run fits in the time slice, which is the check
+ * the core makes before entering it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "config.h"
+#include "jit.h"
+
+#if USE_JIT && defined(__GNUC__) && defined(__x86_64__)
+
+#include <sys/mman.h>
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15, NO_INDEX = -1 };
+enum { CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_A = 7 };
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+
+/* register forms of the ALU operations, the immediate forms use the enum value as the /r field */
+static const uint8_t alu_opcode[8] = {
+    [ALU_ADD] = 0x01, [ALU_OR] = 0x09, [ALU_AND] = 0x21, [ALU_SUB] = 0x29, [ALU_XOR] = 0x31, [ALU_CMP] = 0x39
+};
+
+#define REG_AC R12
+#define REG_X R13
+#define REG_Y R14
+#define REG_SR R15
+#define REG_CYCLES RDI
+
+#define CPU_FIELD(f) ((int32_t) offsetof(CPU_type_t, f))
+#define MEM_FIELD(f) ((int32_t) offsetof(Memory_type_t, f))
+
+typedef uint32_t (*jit_code_t)(CPU_type_t*, Memory_type_t*, uint64_t);
+
+typedef struct emitter {
+    uint8_t* code;
+    size_t size;
+    size_t used;                            ///< may run past size, the code is thrown away then
+    const Block_t* block;
+    CPU_variant variant;                    ///< core the block was decoded for
+    size_t exit;                            ///< offset of the shared exit
+    size_t start;                           ///< offset of the first instruction
+    uint32_t index;                         ///< instruction being translated
+    uint32_t base;                          ///< base cycles of the instructions before it
+} Emitter_t;
+
+/*
+ * encoder
+ */
+
+static void emit8(Emitter_t* e, uint8_t value) {
+    if(e->used < e->size) {
+        e->code[e->used] = value;
+    }
+    e->used++;
+}
+
+static void emit16(Emitter_t* e, uint16_t value) {
+    emit8(e, value & 0xFF);
+    emit8(e, value >> 8);
+}
+
+static void emit32(Emitter_t* e, uint32_t value) {
+    for(int i = 0; i < 4; i++) {
+        emit8(e, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+/* force is needed to reach sil, dil and friends as byte registers */
+static void rex(Emitter_t* e, int w, int reg, int index, int base, int force) {
+    uint8_t prefix = 0x40 | (w << 3) | ((reg & 8) >> 1) | (((index < 0 ? 0 : index) & 8) >> 2) | ((base & 8) >> 3);
+    if( (prefix != 0x40) || force ) {
+        emit8(e, prefix);
+    }
+}
+
+static int byte_rex(int reg) {
+    return (reg >= RSP) && (reg <= RDI);
+}
+
+static void modrm_reg(Emitter_t* e, int reg, int rm) {
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* [base + index * (1 << scale) + disp32] */
+static void modrm_mem(Emitter_t* e, int reg, int base, int index, int scale, int32_t disp) {
+    if(index == NO_INDEX) {
+        if((base & 7) == RSP) {
+            emit8(e, 0x84 | ((reg & 7) << 3));
+            emit8(e, 0x24);
+        } else {
+            emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+        }
+    } else {
+        emit8(e, 0x84 | ((reg & 7) << 3));
+        emit8(e, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+    emit32(e, (uint32_t) disp);
+}
+
+static void mov_rr(Emitter_t* e, int dst, int src) {
+    rex(e, 0, src, NO_INDEX, dst, 0);
+    emit8(e, 0x89);
+    modrm_reg(e, src, dst);
+}
+
+static void mov_rr64(Emitter_t* e, int dst, int src) {
+    rex(e, 1, src, NO_INDEX, dst, 0);
+    emit8(e, 0x89);
+    modrm_reg(e, src, dst);
+}
+
+static void mov_ri(Emitter_t* e, int dst, uint32_t imm) {
+    rex(e, 0, 0, NO_INDEX, dst, 0);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, imm);
+}
+
+static void alu_ri(Emitter_t* e, int op, int dst, uint32_t imm) {
+    rex(e, 0, 0, NO_INDEX, dst, 0);
+    emit8(e, 0x81);
+    modrm_reg(e, op, dst);
+    emit32(e, imm);
+}
+
+static void alu_rr(Emitter_t* e, int op, int dst, int src) {
+    rex(e, 0, src, NO_INDEX, dst, 0);
+    emit8(e, alu_opcode[op]);
+    modrm_reg(e, src, dst);
+}
+
+static void test_rr(Emitter_t* e, int a, int b) {
+    rex(e, 0, b, NO_INDEX, a, 0);
+    emit8(e, 0x85);
+    modrm_reg(e, b, a);
+}
+
+static void test_ri(Emitter_t* e, int dst, uint32_t imm) {
+    rex(e, 0, 0, NO_INDEX, dst, 0);
+    emit8(e, 0xF7);
+    modrm_reg(e, 0, dst);
+    emit32(e, imm);
+}
+
+static void test_rr64(Emitter_t* e, int a, int b) {
+    rex(e, 1, b, NO_INDEX, a, 0);
+    emit8(e, 0x85);
+    modrm_reg(e, b, a);
+}
+
+static void shl_ri(Emitter_t* e, int dst, uint8_t n) {
+    rex(e, 0, 0, NO_INDEX, dst, 0);
+    emit8(e, 0xC1);
+    modrm_reg(e, 4, dst);
+    emit8(e, n);
+}
+
+static void shr_ri(Emitter_t* e, int dst, uint8_t n) {
+    rex(e, 0, 0, NO_INDEX, dst, 0);
+    emit8(e, 0xC1);
+    modrm_reg(e, 5, dst);
+    emit8(e, n);
+}
+
+static void not_r(Emitter_t* e, int dst) {
+    rex(e, 0, 0, NO_INDEX, dst, 0);
+    emit8(e, 0xF7);
+    modrm_reg(e, 2, dst);
+}
+
+static void movzx_rr8(Emitter_t* e, int dst, int src) {
+    rex(e, 0, dst, NO_INDEX, src, byte_rex(src));
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    modrm_reg(e, dst, src);
+}
+
+static void setcc(Emitter_t* e, int cc, int dst) {
+    rex(e, 0, 0, NO_INDEX, dst, byte_rex(dst));
+    emit8(e, 0x0F);
+    emit8(e, 0x90 + cc);
+    modrm_reg(e, 0, dst);
+}
+
+static void load8(Emitter_t* e, int dst, int base, int index, int32_t disp) {
+    rex(e, 0, dst, index, base, 0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    modrm_mem(e, dst, base, index, 0, disp);
+}
+
+static void store8(Emitter_t* e, int base, int index, int32_t disp, int src) {
+    rex(e, 0, src, index, base, byte_rex(src));
+    emit8(e, 0x88);
+    modrm_mem(e, src, base, index, 0, disp);
+}
+
+static void load64(Emitter_t* e, int dst, int base, int index, int scale, int32_t disp) {
+    rex(e, 1, dst, index, base, 0);
+    emit8(e, 0x8B);
+    modrm_mem(e, dst, base, index, scale, disp);
+}
+
+static void store16_i(Emitter_t* e, int base, int32_t disp, uint16_t imm) {
+    emit8(e, 0x66);
+    rex(e, 0, 0, NO_INDEX, base, 0);
+    emit8(e, 0xC7);
+    modrm_mem(e, 0, base, NO_INDEX, 0, disp);
+    emit16(e, imm);
+}
+
+static void store64(Emitter_t* e, int base, int32_t disp, int src) {
+    rex(e, 1, src, NO_INDEX, base, 0);
+    emit8(e, 0x89);
+    modrm_mem(e, src, base, NO_INDEX, 0, disp);
+}
+
+static void add64_ri(Emitter_t* e, int dst, uint32_t imm) {
+    rex(e, 1, 0, NO_INDEX, dst, 0);
+    emit8(e, 0x81);
+    modrm_reg(e, ALU_ADD, dst);
+    emit32(e, imm);
+}
+
+static void lea64(Emitter_t* e, int dst, int base, int32_t disp) {
+    rex(e, 1, dst, NO_INDEX, base, 0);
+    emit8(e, 0x8D);
+    modrm_mem(e, dst, base, NO_INDEX, 0, disp);
+}
+
+static void cmp64_rm(Emitter_t* e, int reg, int base, int32_t disp) {
+    rex(e, 1, reg, NO_INDEX, base, 0);
+    emit8(e, 0x3B);
+    modrm_mem(e, reg, base, NO_INDEX, 0, disp);
+}
+
+static void add64_rr(Emitter_t* e, int dst, int src) {
+    rex(e, 1, src, NO_INDEX, dst, 0);
+    emit8(e, 0x01);
+    modrm_reg(e, src, dst);
+}
+
+static void push(Emitter_t* e, int reg) {
+    rex(e, 0, 0, NO_INDEX, reg, 0);
+    emit8(e, 0x50 + (reg & 7));
+}
+
+static void pop(Emitter_t* e, int reg) {
+    rex(e, 0, 0, NO_INDEX, reg, 0);
+    emit8(e, 0x58 + (reg & 7));
+}
+
+/* forward jumps return the offset following their rel32 for patch */
+static size_t jcc(Emitter_t* e, int cc) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 + cc);
+    emit32(e, 0);
+    return e->used;
+}
+
+static size_t jmp(Emitter_t* e) {
+    emit8(e, 0xE9);
+    emit32(e, 0);
+    return e->used;
+}
+
+static void patch(Emitter_t* e, size_t at) {
+    int32_t rel = (int32_t) (e->used - at);
+    if(at <= e->size) {
+        memcpy(e->code + at - 4, &rel, 4);
+    }
+}
+
+static void jmp_to(Emitter_t* e, size_t target) {
+    emit8(e, 0xE9);
+    emit32(e, (uint32_t) (int32_t) (target - (e->used + 4)));
+}
+
+static void jcc_to(Emitter_t* e, int cc, size_t target) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 + cc);
+    emit32(e, (uint32_t) (int32_t) (target - (e->used + 4)));
+}
+
+/*
+ * translation
+ */
+
+/* address of an instruction of the block */
+static uint16_t op_address(const Block_t* block, uint32_t index) {
+    return (index == 0) ? block->start : block->ops[index - 1].next;
+}
+
+static void emit_exit(Emitter_t* e, uint16_t pc, uint32_t cycles, uint32_t count) {
+    store16_i(e, RBX, CPU_FIELD(PC), pc);
+    if(cycles != 0) {
+        add64_ri(e, REG_CYCLES, cycles);
+    }
+    mov_ri(e, RAX, count);
+    jmp_to(e, e->exit);
+}
+
+/* leave the block for a branch or jump target, looping back to the start when there is time */
+static void emit_goto(Emitter_t* e, uint16_t pc, uint32_t cycles) {
+    if(pc != e->block->start) {
+        emit_exit(e, pc, cycles, e->index + 1);
+        return;
+    }
+
+    add64_ri(e, REG_CYCLES, cycles);
+    lea64(e, R10, REG_CYCLES, (int32_t) e->block->worst);
+    cmp64_rm(e, R10, RSP, 0);
+    jcc_to(e, CC_B, e->start);
+    emit_exit(e, pc, 0, e->index + 1);
+}
+
+/* leave the block before the instruction being translated when the condition holds */
+static void exit_if(Emitter_t* e, int cc) {
+    size_t skip = jcc(e, cc ^ 1);
+    emit_exit(e, op_address(e->block, e->index), e->base, e->index);
+    patch(e, skip);
+}
+
+/* without branches, the value is data; uses ecx, which no instruction needs once it sets N and Z */
+static void emit_nz(Emitter_t* e, int reg) {
+    test_rr(e, reg, reg);
+    setcc(e, CC_E, RCX);
+    movzx_rr8(e, RCX, RCX);
+    shl_ri(e, RCX, 1);
+    mov_rr(e, R10, reg);
+    alu_ri(e, ALU_AND, R10, N_MASK);
+    alu_ri(e, ALU_AND, REG_SR, (uint8_t) ~(N_MASK | Z_MASK));
+    alu_rr(e, ALU_OR, REG_SR, R10);
+    alu_rr(e, ALU_OR, REG_SR, RCX);
+}
+
+/* carry from a register holding 0 or 1 */
+static void emit_carry(Emitter_t* e, int reg) {
+    alu_ri(e, ALU_AND, REG_SR, (uint8_t) ~C_MASK);
+    alu_rr(e, ALU_OR, REG_SR, reg);
+}
+
+/* ecx = (ecx + index) & 0xFFFF, with the page crossing penalty against base in r8d */
+static int emit_indexed(Emitter_t* e, int index, int base_reg, uint32_t base, int page_penalty) {
+    alu_rr(e, ALU_ADD, RCX, index);
+    alu_ri(e, ALU_AND, RCX, 0xFFFF);
+    if(!page_penalty) {
+        return 0;
+    }
+    mov_rr(e, R8, RCX);
+    if(base_reg == NO_INDEX) {
+        alu_ri(e, ALU_XOR, R8, base);
+    } else {
+        alu_rr(e, ALU_XOR, R8, base_reg);
+    }
+    alu_ri(e, ALU_CMP, R8, 0xFF);
+    setcc(e, CC_A, R8);
+    movzx_rr8(e, R8, R8);
+    return 1;
+}
+
+/**
+ * effective address into ecx
+ * @return 1 if r8d holds a penalty cycle to add once the access can no longer leave the block
+ */
+static int emit_address(Emitter_t* e, const Block_op_t* op, Addressing_mode mode, int page_penalty) {
+    const uint8_t zp = op->operand & 0xFF;
+
+    switch(mode) {
+        case ZPG:
+            mov_ri(e, RCX, zp);
+            return 0;
+        case ABS_A:
+            mov_ri(e, RCX, op->operand);
+            return 0;
+        case ZPG_INDX_X:
+        case ZPG_INDX_Y:
+            mov_rr(e, RCX, (mode == ZPG_INDX_X) ? REG_X : REG_Y);
+            alu_ri(e, ALU_ADD, RCX, zp);
+            alu_ri(e, ALU_AND, RCX, 0xFF);
+            return 0;
+        case ABS_INDX_X:
+        case ABS_INDX_Y:
+            mov_ri(e, RCX, op->operand);
+            return emit_indexed(e, (mode == ABS_INDX_X) ? REG_X : REG_Y, NO_INDEX, op->operand, page_penalty);
+        case ZPG_IND:
+        case ZPG_INDX_IND:
+        case ZPG_IND_INDX_Y:
+            /* pointer in zero page, wrapping within it */
+            load64(e, RSI, RBP, NO_INDEX, 0, MEM_FIELD(read_page[0]));
+            test_rr64(e, RSI, RSI);
+            exit_if(e, CC_E);
+            mov_ri(e, R10, zp);
+            if(mode == ZPG_INDX_IND) {
+                alu_rr(e, ALU_ADD, R10, REG_X);
+                alu_ri(e, ALU_AND, R10, 0xFF);
+            }
+            load8(e, RCX, RSI, R10, 0);
+            alu_ri(e, ALU_ADD, R10, 1);
+            alu_ri(e, ALU_AND, R10, 0xFF);
+            load8(e, R11, RSI, R10, 0);
+            shl_ri(e, R11, 8);
+            alu_rr(e, ALU_OR, RCX, R11);
+            if(mode == ZPG_IND_INDX_Y) {
+                mov_rr(e, R11, RCX);
+                return emit_indexed(e, REG_Y, R11, 0, page_penalty);
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/* page pointers of the address in ecx, leaving the block if there is none */
+static void emit_read_page(Emitter_t* e) {
+    mov_rr(e, RDX, RCX);
+    shr_ri(e, RDX, 8);
+    load64(e, RSI, RBP, RDX, 3, MEM_FIELD(read_page));
+    test_rr64(e, RSI, RSI);
+    exit_if(e, CC_E);
+}
+
+static void emit_write_page(Emitter_t* e) {
+    mov_rr(e, RDX, RCX);
+    shr_ri(e, RDX, 8);
+    load64(e, RDX, RBP, RDX, 3, MEM_FIELD(write_page));
+    test_rr64(e, RDX, RDX);
+    exit_if(e, CC_E);
+}
+
+static void emit_penalty(Emitter_t* e, int penalty) {
+    if(penalty) {
+        add64_rr(e, REG_CYCLES, R8);
+    }
+}
+
+/* operand value into eax */
+static void emit_operand(Emitter_t* e, const Block_op_t* op, Addressing_mode mode) {
+    if(mode == IMM) {
+        mov_ri(e, RAX, op->operand & 0xFF);
+        return;
+    }
+
+    int penalty = emit_address(e, op, mode, 1);
+    emit_read_page(e);
+    emit_penalty(e, penalty);
+    movzx_rr8(e, R9, RCX);
+    load8(e, RAX, RSI, R9, 0);
+}
+
+static void emit_store(Emitter_t* e, const Block_op_t* op, Addressing_mode mode, int src) {
+    emit_address(e, op, mode, 0);
+    emit_write_page(e);
+    movzx_rr8(e, R9, RCX);
+    store8(e, RDX, R9, 0, src);
+}
+
+/* binary mode add of eax to AC, SBC passes the operand inverted */
+static void emit_add(Emitter_t* e) {
+    mov_rr(e, R10, REG_SR);
+    alu_ri(e, ALU_AND, R10, C_MASK);
+    mov_rr(e, R11, REG_AC);
+    alu_rr(e, ALU_ADD, R11, RAX);
+    alu_rr(e, ALU_ADD, R11, R10);
+
+    /* V = ~(AC ^ value) & (AC ^ sum) & 0x80 */
+    mov_rr(e, R10, REG_AC);
+    alu_rr(e, ALU_XOR, R10, RAX);
+    not_r(e, R10);
+    mov_rr(e, RCX, REG_AC);
+    alu_rr(e, ALU_XOR, RCX, R11);
+    alu_rr(e, ALU_AND, R10, RCX);
+    alu_ri(e, ALU_AND, R10, 0x80);
+    shr_ri(e, R10, 1);
+    alu_ri(e, ALU_AND, REG_SR, (uint8_t) ~(V_MASK | C_MASK));
+    alu_rr(e, ALU_OR, REG_SR, R10);
+
+    mov_rr(e, R10, R11);
+    shr_ri(e, R10, 8);
+    alu_rr(e, ALU_OR, REG_SR, R10);
+
+    mov_rr(e, REG_AC, R11);
+    alu_ri(e, ALU_AND, REG_AC, 0xFF);
+    emit_nz(e, REG_AC);
+}
+
+static void emit_compare(Emitter_t* e, int reg) {
+    alu_rr(e, ALU_CMP, reg, RAX);
+    setcc(e, CC_AE, R10);
+    movzx_rr8(e, R10, R10);
+    emit_carry(e, R10);
+    mov_rr(e, R11, reg);
+    alu_rr(e, ALU_SUB, R11, RAX);
+    alu_ri(e, ALU_AND, R11, 0xFF);
+    emit_nz(e, R11);
+}
+
+/* shifts, rotates, increments and decrements of eax */
+static void emit_shift(Emitter_t* e, Opcode opcode) {
+    switch(opcode) {
+        case ASL:
+        case ROL:
+            mov_rr(e, R11, REG_SR);
+            alu_ri(e, ALU_AND, R11, C_MASK);
+            mov_rr(e, R10, RAX);
+            shr_ri(e, R10, 7);
+            emit_carry(e, R10);
+            shl_ri(e, RAX, 1);
+            if(opcode == ROL) {
+                alu_rr(e, ALU_OR, RAX, R11);
+            }
+            alu_ri(e, ALU_AND, RAX, 0xFF);
+            break;
+        case LSR:
+        case ROR:
+            mov_rr(e, R11, REG_SR);
+            alu_ri(e, ALU_AND, R11, C_MASK);
+            shl_ri(e, R11, 7);
+            mov_rr(e, R10, RAX);
+            alu_ri(e, ALU_AND, R10, 1);
+            emit_carry(e, R10);
+            shr_ri(e, RAX, 1);
+            if(opcode == ROR) {
+                alu_rr(e, ALU_OR, RAX, R11);
+            }
+            break;
+        case INC:
+        case DEC:
+            alu_ri(e, (opcode == INC) ? ALU_ADD : ALU_SUB, RAX, 1);
+            alu_ri(e, ALU_AND, RAX, 0xFF);
+            break;
+        default:
+            break;
+    }
+    emit_nz(e, RAX);
+}
+
+static void emit_rmw(Emitter_t* e, const Block_op_t* op, Addressing_mode mode, Opcode opcode) {
+    if(mode == ACC) {
+        mov_rr(e, RAX, REG_AC);
+        emit_shift(e, opcode);
+        mov_rr(e, REG_AC, RAX);
+        return;
+    }
+
+    /* on the CMOS cores shifts and rotates on a,x take the extra cycle only when a page is crossed */
+    int penalty = emit_address(e, op, mode, (e->variant != CPU_NMOS) && (opcode != INC) && (opcode != DEC));
+    emit_read_page(e);
+    mov_rr(e, RDX, RCX);
+    shr_ri(e, RDX, 8);
+    load64(e, RDX, RBP, RDX, 3, MEM_FIELD(write_page));
+    test_rr64(e, RDX, RDX);
+    exit_if(e, CC_E);
+    emit_penalty(e, penalty);
+    movzx_rr8(e, R9, RCX);
+    load8(e, RAX, RSI, R9, 0);
+    emit_shift(e, opcode);
+    store8(e, RDX, R9, 0, RAX);
+}
+
+static void emit_flag(Emitter_t* e, uint8_t mask, int on) {
+    if(on) {
+        alu_ri(e, ALU_OR, REG_SR, mask);
+    } else {
+        alu_ri(e, ALU_AND, REG_SR, (uint8_t) ~mask);
+    }
+}
+
+static void emit_transfer(Emitter_t* e, int dst, int src) {
+    mov_rr(e, dst, src);
+    emit_nz(e, dst);
+}
+
+static void emit_step(Emitter_t* e, int reg, int op) {
+    alu_ri(e, op, reg, 1);
+    alu_ri(e, ALU_AND, reg, 0xFF);
+    emit_nz(e, reg);
+}
+
+static void emit_branch(Emitter_t* e, const Block_op_t* op, int cc_taken) {
+    uint32_t cycles = e->base + op->cycles;
+    uint32_t taken_cycles = cycles + 1 + (((op->next ^ op->target) & 0xFF00) != 0);
+
+    if(cc_taken >= 0) {
+        size_t taken = jcc(e, cc_taken);
+        emit_exit(e, op->next, cycles, e->index + 1);
+        patch(e, taken);
+    }
+    emit_goto(e, op->target, taken_cycles);
+}
+
+/* condition code that holds after testing SR against the flag when the branch is taken */
+static void emit_branch_on(Emitter_t* e, const Block_op_t* op, uint8_t mask, int when_set) {
+    test_ri(e, REG_SR, mask);
+    emit_branch(e, op, when_set ? CC_NE : CC_E);
+}
+
+static int supported(const Instruction* ins) {
+    switch(ins->addr_mode) {
+        case STK:
+        case ABS_IND:
+        case ABS_INDX_IND:
+        case ZPG_PC_REL:
+        case INV:
+            return 0;
+        default:
+            break;
+    }
+
+    switch(ins->opcode) {
+        case LDA: case LDX: case LDY: case STA: case STX: case STY: case STZ:
+        case AND: case ORA: case EOR: case ADC: case SBC: case CMP: case CPX: case CPY: case BIT:
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+        case INX: case INY: case DEX: case DEY:
+        case TAX: case TAY: case TXA: case TYA: case TSX: case TXS:
+        case CLC: case CLD: case CLV: case SEC: case SED: case SEI:
+        case NOP: case INVLD:
+        case BPL: case BMI: case BVC: case BVS: case BCC: case BCS: case BNE: case BEQ: case BRA:
+        case JMP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * translate one instruction
+ * @return 1 if it ended the block
+ */
+static int emit_op(Emitter_t* e, const Block_op_t* op) {
+    const Instruction* ins = &cpu_instructions[e->variant][op->opcode];
+    const Addressing_mode mode = ins->addr_mode;
+
+    switch(ins->opcode) {
+        case LDA: emit_operand(e, op, mode); emit_transfer(e, REG_AC, RAX); break;
+        case LDX: emit_operand(e, op, mode); emit_transfer(e, REG_X, RAX); break;
+        case LDY: emit_operand(e, op, mode); emit_transfer(e, REG_Y, RAX); break;
+        case STA: emit_store(e, op, mode, REG_AC); break;
+        case STX: emit_store(e, op, mode, REG_X); break;
+        case STY: emit_store(e, op, mode, REG_Y); break;
+        case STZ: mov_ri(e, R10, 0); emit_store(e, op, mode, R10); break;
+
+        case AND: emit_operand(e, op, mode); alu_rr(e, ALU_AND, REG_AC, RAX); emit_nz(e, REG_AC); break;
+        case ORA: emit_operand(e, op, mode); alu_rr(e, ALU_OR, REG_AC, RAX); emit_nz(e, REG_AC); break;
+        case EOR: emit_operand(e, op, mode); alu_rr(e, ALU_XOR, REG_AC, RAX); emit_nz(e, REG_AC); break;
+
+        case ADC:
+        case SBC:
+            /* decimal mode is left to the core */
+            test_ri(e, REG_SR, D_MASK);
+            exit_if(e, CC_NE);
+            emit_operand(e, op, mode);
+            if(ins->opcode == SBC) {
+                not_r(e, RAX);
+                alu_ri(e, ALU_AND, RAX, 0xFF);
+            }
+            emit_add(e);
+            break;
+
+        case CMP: emit_operand(e, op, mode); emit_compare(e, REG_AC); break;
+        case CPX: emit_operand(e, op, mode); emit_compare(e, REG_X); break;
+        case CPY: emit_operand(e, op, mode); emit_compare(e, REG_Y); break;
+
+        case BIT:
+            emit_operand(e, op, mode);
+            alu_ri(e, ALU_AND, REG_SR, (uint8_t) ~Z_MASK);
+            mov_rr(e, R10, REG_AC);
+            alu_rr(e, ALU_AND, R10, RAX);
+            {
+                size_t nonzero = jcc(e, CC_NE);
+                alu_ri(e, ALU_OR, REG_SR, Z_MASK);
+                patch(e, nonzero);
+            }
+            if(mode != IMM) {
+                alu_ri(e, ALU_AND, REG_SR, (uint8_t) ~(N_MASK | V_MASK));
+                alu_ri(e, ALU_AND, RAX, N_MASK | V_MASK);
+                alu_rr(e, ALU_OR, REG_SR, RAX);
+            }
+            break;
+
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+            emit_rmw(e, op, mode, ins->opcode);
+            break;
+
+        case INX: emit_step(e, REG_X, ALU_ADD); break;
+        case INY: emit_step(e, REG_Y, ALU_ADD); break;
+        case DEX: emit_step(e, REG_X, ALU_SUB); break;
+        case DEY: emit_step(e, REG_Y, ALU_SUB); break;
+
+        case TAX: emit_transfer(e, REG_X, REG_AC); break;
+        case TAY: emit_transfer(e, REG_Y, REG_AC); break;
+        case TXA: emit_transfer(e, REG_AC, REG_X); break;
+        case TYA: emit_transfer(e, REG_AC, REG_Y); break;
+        case TSX: load8(e, REG_X, RBX, NO_INDEX, CPU_FIELD(SP)); emit_nz(e, REG_X); break;
+        case TXS: store8(e, RBX, NO_INDEX, CPU_FIELD(SP), REG_X); break;
+
+        case CLC: emit_flag(e, C_MASK, 0); break;
+        case CLD: emit_flag(e, D_MASK, 0); break;
+        case CLV: emit_flag(e, V_MASK, 0); break;
+        case SEC: emit_flag(e, C_MASK, 1); break;
+        case SED: emit_flag(e, D_MASK, 1); break;
+        case SEI: emit_flag(e, I_MASK, 1); break;
+
+        case BPL: emit_branch_on(e, op, N_MASK, 0); return 1;
+        case BMI: emit_branch_on(e, op, N_MASK, 1); return 1;
+        case BVC: emit_branch_on(e, op, V_MASK, 0); return 1;
+        case BVS: emit_branch_on(e, op, V_MASK, 1); return 1;
+        case BCC: emit_branch_on(e, op, C_MASK, 0); return 1;
+        case BCS: emit_branch_on(e, op, C_MASK, 1); return 1;
+        case BNE: emit_branch_on(e, op, Z_MASK, 0); return 1;
+        case BEQ: emit_branch_on(e, op, Z_MASK, 1); return 1;
+        case BRA: emit_branch(e, op, -1); return 1;
+
+        case JMP:
+            emit_goto(e, op->target, e->base + op->cycles);
+            return 1;
+
+        case NOP:
+            /* the NMOS NOP a,x takes the page crossing cycle without reading */
+            if(mode == ABS_INDX_X) {
+                emit_penalty(e, emit_address(e, op, mode, 1));
+            }
+            break;
+
+        default:
+            /* NOP and the unused opcodes only take their cycles */
+            break;
+    }
+
+    return 0;
+}
+
+static void translate(Emitter_t* e) {
+    const Block_t* block = e->block;
+    static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+    for(size_t i = 0; i < 6; i++) {
+        push(e, saved[i]);
+    }
+    push(e, RDX);
+    mov_rr64(e, RBX, RDI);
+    mov_rr64(e, RBP, RSI);
+    load64(e, REG_CYCLES, RBX, NO_INDEX, 0, CPU_FIELD(cycles));
+    load8(e, REG_AC, RBX, NO_INDEX, CPU_FIELD(AC));
+    load8(e, REG_X, RBX, NO_INDEX, CPU_FIELD(X));
+    load8(e, REG_Y, RBX, NO_INDEX, CPU_FIELD(Y));
+    load8(e, REG_SR, RBX, NO_INDEX, CPU_FIELD(SR));
+    size_t body = jmp(e);
+
+    e->exit = e->used;
+    store8(e, RBX, NO_INDEX, CPU_FIELD(AC), REG_AC);
+    store8(e, RBX, NO_INDEX, CPU_FIELD(X), REG_X);
+    store8(e, RBX, NO_INDEX, CPU_FIELD(Y), REG_Y);
+    store8(e, RBX, NO_INDEX, CPU_FIELD(SR), REG_SR);
+    store64(e, RBX, CPU_FIELD(cycles), REG_CYCLES);
+    pop(e, R10);
+    for(size_t i = 6; i > 0; i--) {
+        pop(e, saved[i - 1]);
+    }
+    emit8(e, 0xC3);
+    patch(e, body);
+    e->start = e->used;
+
+    for(e->index = 0, e->base = 0; e->index < block->count; e->index++) {
+        const Block_op_t* op = &block->ops[e->index];
+
+        if(!supported(&cpu_instructions[e->variant][op->opcode])) {
+            /* the core carries on from here */
+            emit_exit(e, op_address(block, e->index), e->base, e->index);
+            return;
+        }
+        if(emit_op(e, op)) {
+            return;
+        }
+        e->base += op->cycles;
+    }
+
+    emit_exit(e, block->next, e->base, block->count);
+}
+
+/*
+ * validation
+ */
+
+static int same_cpu(const CPU_type_t* a, const CPU_type_t* b) {
+    return (a->PC == b->PC) && (a->AC == b->AC) && (a->X == b->X) && (a->Y == b->Y) &&
+           (a->SR == b->SR) && (a->SP == b->SP) && (a->cycles == b->cycles) && (a->state == b->state);
+}
+
+static void save_pages(Memory_type_t* mem, uint8_t* copy) {
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        if(mem->write_page[page] != NULL) {
+            memcpy(copy + page * MEMORY_PAGE_SIZE, mem->write_page[page], MEMORY_PAGE_SIZE);
+        }
+    }
+}
+
+static void restore_pages(Memory_type_t* mem, const uint8_t* copy) {
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        if(mem->write_page[page] != NULL) {
+            memcpy(mem->write_page[page], copy + page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+        }
+    }
+}
+
+/* first byte of writable memory that differs from a copy, MEMORY_SIZE if none does */
+static uint32_t compare_pages(Memory_type_t* mem, const uint8_t* copy) {
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        const uint8_t* data = mem->write_page[page];
+
+        if( (data != NULL) && (memcmp(data, copy + page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE) != 0) ) {
+            for(unsigned i = 0; i < MEMORY_PAGE_SIZE; i++) {
+                if(data[i] != copy[page * MEMORY_PAGE_SIZE + i]) {
+                    return page * MEMORY_PAGE_SIZE + i;
+                }
+            }
+        }
+    }
+
+    return MEMORY_SIZE;
+}
+
+static uint32_t validate(Jit_type_t* jit, Block_t* block, jit_code_t code, CPU_type_t* cpu, Memory_type_t* mem) {
+    const CPU_type_t before = *cpu;
+
+    /* an end the block cannot loop within, so the replay is one run of it */
+    save_pages(mem, jit->before);
+    uint32_t count = code(cpu, mem, cpu->cycles + block->worst + 1);
+    const CPU_type_t actual = *cpu;
+    save_pages(mem, jit->after);
+    restore_pages(mem, jit->before);
+
+    /* the interpreter's result is the one that is kept */
+    *cpu = before;
+    for(uint32_t i = 0; i < count; i++) {
+        cpu_step(cpu, mem);
+    }
+
+    uint32_t address = compare_pages(mem, jit->after);
+    if( (!same_cpu(cpu, &actual) || (address != MEMORY_SIZE)) ) {
+        if(!jit->diverged) {
+            jit->diverged = 1;
+            jit->divergence = (Jit_divergence_t) { block->start, address, *cpu, actual };
+        }
+        block->native = NULL;
+    }
+
+    return count;
+}
+
+/*
+ * interface
+ */
+
+/**
+ * map the code arena and attach the JIT to a block cache
+ * @param jit JIT
+ * @param cache block cache whose blocks get translated
+ * @param arena_size bytes of native code
+ * @return 0 on success
+ */
+int jit_initialize(Jit_type_t* jit, Block_cache_t* cache, size_t arena_size) {
+    memset(jit, 0, sizeof(*jit));
+    jit->size = arena_size ? arena_size : JIT_ARENA_SIZE;
+    jit->threshold = JIT_THRESHOLD;
+
+    void* arena = mmap(NULL, jit->size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(arena == MAP_FAILED) {
+        return -1;
+    }
+
+    jit->before = (uint8_t*) malloc(MEMORY_SIZE);
+    jit->after = (uint8_t*) malloc(MEMORY_SIZE);
+    if( (jit->before == NULL) || (jit->after == NULL) ) {
+        free(jit->before);
+        free(jit->after);
+        munmap(arena, jit->size);
+        return -1;
+    }
+
+    jit->arena = (uint8_t*) arena;
+    jit->cache = cache;
+    cache->jit = jit;
+
+    return 0;
+}
+
+/**
+ * detach the JIT and unmap the arena
+ * @param jit JIT
+ */
+void jit_free(Jit_type_t* jit) {
+    if(jit->arena == NULL) {
+        return;
+    }
+
+    jit_flush(jit);
+    if(jit->cache->jit == jit) {
+        jit->cache->jit = NULL;
+    }
+
+    munmap(jit->arena, jit->size);
+    free(jit->before);
+    free(jit->after);
+    jit->arena = NULL;
+}
+
+/**
+ * forget every translation
+ * @param jit JIT
+ */
+void jit_flush(Jit_type_t* jit) {
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        for(Block_t* block = jit->cache->page[page]; block != NULL; block = block->page_next) {
+            block->native = NULL;
+            block->executions = 0;
+        }
+    }
+
+    jit->used = 0;
+    jit->flushes++;
+}
+
+/**
+ * translate a block into the arena, emptying the arena first if it is full
+ * @param jit JIT
+ * @param block hot block
+ * @return 0 on success
+ */
+int jit_compile(Jit_type_t* jit, Block_t* block) {
+    if(!supported(&cpu_instructions[jit->cache->variant][block->ops[0].opcode])) {
+        jit->rejected++;
+        return -1;
+    }
+
+    if(mprotect(jit->arena, jit->size, PROT_READ | PROT_WRITE) != 0) {
+        return -1;
+    }
+
+    Emitter_t e = { jit->arena + jit->used, jit->size - jit->used, 0, block, jit->cache->variant, 0, 0, 0, 0 };
+    translate(&e);
+
+    if(e.used > e.size) {
+        jit_flush(jit);
+        e = (Emitter_t) { jit->arena, jit->size, 0, block, jit->cache->variant, 0, 0, 0, 0 };
+        translate(&e);
+    }
+
+    int status = -1;
+    if(e.used <= e.size) {
+        block->native = e.code;
+        jit->used += (e.used + 15) & ~(size_t) 15;
+        jit->compiled++;
+        status = 0;
+    }
+
+    mprotect(jit->arena, jit->size, PROT_READ | PROT_EXEC);
+    return status;
+}
+
+/**
+ * run the native code of a block, checking it against the interpreter in validation mode
+ * @param jit JIT
+ * @param block block with native code
+ * @param cpu CPU
+ * @param mem memory
+ * @param end cycle count the time slice ends at
+ * @return number of instructions executed in the last run of the block
+ */
+uint32_t jit_enter(Jit_type_t* jit, Block_t* block, CPU_type_t* cpu, Memory_type_t* mem, uint64_t end) {
+    jit_code_t code = (jit_code_t) block->native;
+
+    if(jit->validate) {
+        return validate(jit, block, code, cpu, mem);
+    }
+
+    return code(cpu, mem, end);
+}
+
+#else
+
+/* no native code on this host, the block cache runs on its own */
+
+int jit_initialize(Jit_type_t* jit, Block_cache_t* cache, size_t arena_size) {
+    (void) cache;
+    (void) arena_size;
+    memset(jit, 0, sizeof(*jit));
+    return -1;
+}
+
+void jit_free(Jit_type_t* jit) {
+    (void) jit;
+}
+
+int jit_compile(Jit_type_t* jit, Block_t* block) {
+    (void) jit;
+    (void) block;
+    return -1;
+}
+
+void jit_flush(Jit_type_t* jit) {
+    (void) jit;
+}
+
+uint32_t jit_enter(Jit_type_t* jit, Block_t* block, CPU_type_t* cpu, Memory_type_t* mem, uint64_t end) {
+    (void) jit;
+    (void) block;
+    (void) cpu;
+    (void) mem;
+    (void) end;
+    return 0;
+}
+
+#endif
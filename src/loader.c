@@ -0,0 +1,503 @@
+/**
+ * @file loader.c
+ * @brief loads programs into RAM and maps ROM images into the address space
+ * @author Edwin
+ */
+
+/**
+ * Files are read through a read only mapping. Programs are parsed straight out of the mapping
+ * and stored in memory, which is then unmapped; ROMs keep their mapping and the pages of the
+ * address space point into it.
+ *
+ * The ROMs open in the process are kept in a list, looked up by the device and inode of their
+ * file, so a file mapped by many machines is only mapped once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "loader.h"
+
+#define INES_HEADER 16                      ///< bytes of iNES header
+#define INES_TRAINER 512                    ///< bytes of trainer, when the header says there is one
+#define INES_PRG_UNIT (16 * 1024)           ///< PRG ROM size is given in units of 16KB
+#define RECORD_MAX 260                      ///< bytes of the longest HEX record, 255 of data
+
+static pthread_mutex_t roms_lock = PTHREAD_MUTEX_INITIALIZER;
+static Loader_rom_t* roms;                  ///< ROMs open in the process
+
+/* a file mapped read only */
+typedef struct file_map {
+    uint8_t* data;
+    size_t size;
+    uint64_t device;
+    uint64_t inode;
+} File_map_t;
+
+static int map_file(const char* path, File_map_t* map) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0) {
+        return -1;
+    }
+    if( (fstat(fd, &st) != 0) || (st.st_size <= 0) ) {
+        close(fd);
+        return -1;
+    }
+
+    void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return -1;
+    }
+
+    map->data = data;
+    map->size = (size_t) st.st_size;
+    map->device = (uint64_t) st.st_dev;
+    map->inode = (uint64_t) st.st_ino;
+    return 0;
+}
+
+/* file name ends in one of a list of extensions, any case */
+static int has_extension(const char* path, const char* const* extensions) {
+    const char* dot = (path != NULL) ? strrchr(path, '.') : NULL;
+
+    if(dot == NULL) {
+        return 0;
+    }
+    for(; *extensions != NULL; extensions++) {
+        if(strcasecmp(dot + 1, *extensions) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int hex_digit(uint8_t c) {
+    if( (c >= '0') && (c <= '9') ) {
+        return c - '0';
+    }
+    if( (c >= 'A') && (c <= 'F') ) {
+        return c - 'A' + 10;
+    }
+    if( (c >= 'a') && (c <= 'f') ) {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* every one of count characters is a hex digit */
+static int all_hex(const uint8_t* data, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        if(hex_digit(data[i]) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * tell the format of a file
+ * iNES files have a magic number, HEX and S-record files start with the hex digits of a record;
+ * a PRG file cannot be told from a raw one by its contents, so it is told by its name
+ * @param data file image
+ * @param size bytes of image
+ * @param path file name, may be NULL
+ * @return the format
+ */
+Loader_format loader_detect(const uint8_t* data, size_t size, const char* path) {
+    static const char* const prg[] = {"prg", NULL};
+    static const char* const ihex[] = {"hex", "ihex", "ihx", NULL};
+    static const char* const srec[] = {"srec", "s19", "s28", "s37", "mot", NULL};
+
+    if( (size >= INES_HEADER) && (memcmp(data, "NES\x1A", 4) == 0) ) {
+        return LOADER_INES;
+    }
+    if( (size >= 11) && (data[0] == ':') && all_hex(data + 1, 10) ) {
+        return LOADER_IHEX;
+    }
+    if( (size >= 10) && (data[0] == 'S') && (data[1] >= '0') && (data[1] <= '9') && all_hex(data + 2, 8) ) {
+        return LOADER_SREC;
+    }
+    if(has_extension(path, prg)) {
+        return LOADER_PRG;
+    }
+    if(has_extension(path, ihex)) {
+        return LOADER_IHEX;
+    }
+    if(has_extension(path, srec)) {
+        return LOADER_SREC;
+    }
+    return LOADER_RAW;
+}
+
+/* write bytes to consecutive addresses, which must not run past the end of the address space */
+static int store(Memory_type_t* mem, uint32_t address, const uint8_t* data, size_t size, Loader_info_t* info) {
+    if(address + size > MEMORY_SIZE) {
+        return -1;
+    }
+    if(size == 0) {
+        return 0;
+    }
+
+    for(size_t i = 0; i < size; i++) {
+        mem_write8(mem, (uint16_t) (address + i), data[i]);
+    }
+
+    if( (info->bytes == 0) || (address < info->first) ) {
+        info->first = (uint16_t) address;
+    }
+    if( (info->bytes == 0) || (address + size - 1 > info->last) ) {
+        info->last = (uint16_t) (address + size - 1);
+    }
+    info->bytes += (uint32_t) size;
+    return 0;
+}
+
+/**
+ * decode the hex digits of a record up to the end of its line
+ * @param p first digit
+ * @param bytes where to store the bytes, RECORD_MAX at most
+ * @return number of bytes, -1 if a character is not a hex digit or the count is odd
+ */
+static int record_bytes(const uint8_t* p, const uint8_t* end, uint8_t* bytes) {
+    int n = 0;
+
+    while( (p < end) && (*p != '\n') && (*p != '\r') ) {
+        if( (end - p < 2) || (n == RECORD_MAX) ) {
+            return -1;
+        }
+
+        int hi = hex_digit(p[0]);
+        int lo = hex_digit(p[1]);
+        if( (hi < 0) || (lo < 0) ) {
+            return -1;
+        }
+
+        bytes[n++] = (uint8_t) ((hi << 4) | lo);
+        p += 2;
+    }
+
+    return n;
+}
+
+/* start of the next line */
+static const uint8_t* next_line(const uint8_t* p, const uint8_t* end) {
+    while( (p < end) && (*p != '\n') ) {
+        p++;
+    }
+    return (p < end) ? p + 1 : end;
+}
+
+/**
+ * Intel HEX: ":" count, address, type, data, checksum, all hex; the bytes of a record add up to 0
+ */
+static int load_ihex(Memory_type_t* mem, const uint8_t* p, const uint8_t* end, Loader_info_t* info) {
+    uint32_t base = 0;
+    uint8_t bytes[RECORD_MAX];
+
+    for(; p < end; p = next_line(p, end)) {
+        if( (*p == '\n') || (*p == '\r') ) {
+            continue;
+        }
+
+        int n = (*p == ':') ? record_bytes(p + 1, end, bytes) : -1;
+        if( (n < 5) || (n != bytes[0] + 5) ) {
+            return -1;
+        }
+
+        uint8_t sum = 0;
+        for(int i = 0; i < n; i++) {
+            sum += bytes[i];
+        }
+        if(sum != 0) {
+            return -1;
+        }
+
+        const uint8_t* data = bytes + 4;
+        if( (bytes[3] >= 0x02) && (bytes[0] < ((bytes[3] & 1) ? 4 : 2)) ) {
+            return -1;
+        }
+        const uint16_t offset = (uint16_t) ((bytes[1] << 8) | bytes[2]);
+        switch(bytes[3]) {
+            case 0x00:                          // data
+                if(store(mem, base + offset, data, bytes[0], info) != 0) {
+                    return -1;
+                }
+                break;
+            case 0x01:                          // end of file
+                return 0;
+            case 0x02:                          // extended segment address
+                base = (uint32_t) ((data[0] << 8) | data[1]) << 4;
+                break;
+            case 0x04:                          // extended linear address
+                base = (uint32_t) ((data[0] << 8) | data[1]) << 16;
+                break;
+            case 0x03:                          // start segment address, CS:IP
+                info->entry = (int32_t) (((((data[0] << 8) | data[1]) << 4) + ((data[2] << 8) | data[3])) & 0xFFFF);
+                break;
+            case 0x05:                          // start linear address
+                info->entry = (int32_t) ((data[2] << 8) | data[3]);
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * S-record: "S", type, then hex count, address, data, checksum; the count covers the address,
+ * the data and the checksum, and the bytes after the type add up to 0xFF
+ */
+static int load_srec(Memory_type_t* mem, const uint8_t* p, const uint8_t* end, Loader_info_t* info) {
+    static const int address_bytes[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+    uint8_t bytes[RECORD_MAX];
+
+    for(; p < end; p = next_line(p, end)) {
+        if( (*p == '\n') || (*p == '\r') ) {
+            continue;
+        }
+
+        if( (end - p < 2) || (p[0] != 'S') || (p[1] < '0') || (p[1] > '9') || (p[1] == '4') ) {
+            return -1;
+        }
+        const int type = p[1] - '0';
+        const int width = address_bytes[type];
+
+        int n = record_bytes(p + 2, end, bytes);
+        if( (n < 1 + width + 1) || (n != bytes[0] + 1) ) {
+            return -1;
+        }
+
+        uint8_t sum = 0;
+        for(int i = 0; i < n; i++) {
+            sum += bytes[i];
+        }
+        if(sum != 0xFF) {
+            return -1;
+        }
+
+        uint32_t address = 0;
+        for(int i = 0; i < width; i++) {
+            address = (address << 8) | bytes[1 + i];
+        }
+
+        switch(type) {
+            case 1: case 2: case 3:             // data
+                if(store(mem, address, bytes + 1 + width, (size_t) (n - 2 - width), info) != 0) {
+                    return -1;
+                }
+                break;
+            case 7: case 8: case 9:             // start address
+                if(address >= MEMORY_SIZE) {
+                    return -1;
+                }
+                info->entry = (int32_t) address;
+                break;
+            default:                            // header and record counts
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/* PRG ROM of an iNES file, NULL if the file is cut short */
+static const uint8_t* ines_prg(const uint8_t* data, size_t size, uint32_t* prg_size) {
+    const size_t offset = INES_HEADER + ((data[6] & 0x04) ? INES_TRAINER : 0);
+
+    *prg_size = data[4] * INES_PRG_UNIT;
+    if( (*prg_size == 0) || (*prg_size > MEMORY_SIZE) || (offset + *prg_size > size) ) {
+        return NULL;
+    }
+    return data + offset;
+}
+
+/**
+ * store a program held in memory
+ * @param mem memory struct
+ * @param data file image
+ * @param size bytes of image
+ * @param format file format, LOADER_AUTO to detect it
+ * @param address load address of a raw file
+ * @param info what was loaded, may be NULL
+ * @return 0 on success, -1 if the file is malformed or does not fit
+ */
+int loader_load_image(Memory_type_t* mem, const uint8_t* data, size_t size, Loader_format format, uint16_t address, Loader_info_t* info) {
+    Loader_info_t dummy;
+    const uint8_t* prg;
+    uint32_t prg_size;
+
+    if(info == NULL) {
+        info = &dummy;
+    }
+    if(format == LOADER_AUTO) {
+        format = loader_detect(data, size, NULL);
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->format = format;
+    info->entry = -1;
+
+    switch(format) {
+        case LOADER_RAW:
+            return store(mem, address, data, size, info);
+        case LOADER_PRG:
+            if(size < 2) {
+                return -1;
+            }
+            return store(mem, (uint32_t) (data[0] | (data[1] << 8)), data + 2, size - 2, info);
+        case LOADER_IHEX:
+            return load_ihex(mem, data, data + size, info);
+        case LOADER_SREC:
+            return load_srec(mem, data, data + size, info);
+        case LOADER_INES:
+            /* the PRG ROM ends at the top of the address space, where its vectors are */
+            if( (size < INES_HEADER) || ((prg = ines_prg(data, size, &prg_size)) == NULL) ) {
+                return -1;
+            }
+            info->entry = prg[prg_size - 4] | (prg[prg_size - 3] << 8);
+            return store(mem, MEMORY_SIZE - prg_size, prg, prg_size, info);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * store a program from a file
+ * @param mem memory struct
+ * @param path file
+ * @param format file format, LOADER_AUTO to detect it
+ * @param address load address of a raw file
+ * @param info what was loaded, may be NULL
+ * @return 0 on success, -1 if the file could not be read, is malformed or does not fit
+ */
+int loader_load(Memory_type_t* mem, const char* path, Loader_format format, uint16_t address, Loader_info_t* info) {
+    File_map_t map;
+
+    if(map_file(path, &map) != 0) {
+        return -1;
+    }
+    if(format == LOADER_AUTO) {
+        format = loader_detect(map.data, map.size, path);
+    }
+
+    int result = loader_load_image(mem, map.data, map.size, format, address, info);
+    munmap(map.data, map.size);
+    return result;
+}
+
+/**
+ * map a ROM file, shared with every other open of it
+ * @param path file
+ * @return the ROM, NULL if the file could not be mapped or holds no ROM
+ */
+const Loader_rom_t* loader_rom_open(const char* path) {
+    File_map_t map;
+    Loader_rom_t* rom;
+
+    if(map_file(path, &map) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&roms_lock);
+
+    for(rom = roms; rom != NULL; rom = rom->next) {
+        if( (rom->device == map.device) && (rom->inode == map.inode) && (rom->length == map.size) ) {
+            rom->users++;
+            pthread_mutex_unlock(&roms_lock);
+            munmap(map.data, map.size);
+            return rom;
+        }
+    }
+
+    rom = calloc(1, sizeof(*rom));
+    if(rom != NULL) {
+        rom->mapping = map.data;
+        rom->length = map.size;
+        rom->device = map.device;
+        rom->inode = map.inode;
+        rom->users = 1;
+
+        if(loader_detect(map.data, map.size, path) == LOADER_INES) {
+            rom->format = LOADER_INES;
+            rom->data = ines_prg(map.data, map.size, &rom->size);
+        } else if(map.size <= MEMORY_SIZE) {
+            rom->format = LOADER_RAW;
+            rom->data = map.data;
+            rom->size = (uint32_t) map.size;
+        }
+
+        if(rom->data != NULL) {
+            rom->next = roms;
+            roms = rom;
+        } else {
+            free(rom);
+            rom = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&roms_lock);
+
+    if(rom == NULL) {
+        munmap(map.data, map.size);
+    }
+    return rom;
+}
+
+/**
+ * drop a user of a ROM
+ * @param rom ROM from loader_rom_open
+ */
+void loader_rom_close(const Loader_rom_t* rom) {
+    Loader_rom_t** link;
+
+    pthread_mutex_lock(&roms_lock);
+
+    for(link = &roms; *link != NULL; link = &(*link)->next) {
+        if(*link == rom) {
+            Loader_rom_t* found = *link;
+
+            if(--found->users == 0) {
+                *link = found->next;
+                munmap(found->mapping, found->length);
+                free(found);
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&roms_lock);
+}
+
+/**
+ * map a ROM over a range of pages, repeating it over the range
+ * @param mem memory struct
+ * @param rom ROM from loader_rom_open
+ * @param first_page first page to map
+ * @param pages number of pages to map, 0 for the size of the ROM
+ */
+void loader_rom_map(Memory_type_t* mem, const Loader_rom_t* rom, uint8_t first_page, uint16_t pages) {
+    const uint16_t rom_pages = (uint16_t) ((rom->size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE);
+
+    if(pages == 0) {
+        pages = rom_pages;
+    }
+
+    for(uint16_t page = 0; page < pages; page += rom_pages) {
+        const uint16_t n = (pages - page < rom_pages) ? (uint16_t) (pages - page) : rom_pages;
+
+        if(first_page + page >= MEMORY_PAGES) {
+            break;
+        }
+        memory_map_rom(mem, (uint8_t) (first_page + page), n, rom->data);
+    }
+}
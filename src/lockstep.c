@@ -0,0 +1,1158 @@
+/**
+ * @file lockstep.c
+ * @brief structure-of-arrays engine that steps many CPUs running the same program together
+ * @author Edwin
+ */
+
+/**
+ * A step is split in three:
+ * 1. a scalar front end walks the lanes of the group, works out the operand address from each
+ *    lane's own registers, gathers the operand or scatters the store and advances PC and cycles
+ * 2. the ALU work runs over LOCKSTEP_VECTOR lanes at a time, with the lanes outside the group
+ *    blended back to their old values; a read-modify-write then scatters its results to memory
+ * 3. in validation mode every lane is stepped again on the scalar core and compared
+ *
+ * The vector code is written with GCC vector extensions and built twice, once for AVX2 and once
+ * for the SSE2 baseline of x86-64. lockstep_initialize picks the AVX2 version when the host has it.
+ *
+ * The runs of member are handed out from the end of the array. A group that grows and is not the
+ * last one is moved to the end, and once there is no room left the runs are packed again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "decimal.h"
+#include "lockstep.h"
+#include "scheduler.h"
+
+/* how a step is executed */
+typedef enum lockstep_kind {
+    KIND_SCALAR,                            /*!< every lane on the scalar core */
+    KIND_BRANCH,                            /*!< conditional branch, resolved per lane */
+    KIND_JUMP,                              /*!< absolute jump */
+    KIND_READ,                              /*!< ALU op on a gathered operand */
+    KIND_REGISTER,                          /*!< ALU op on registers only */
+    KIND_STORE,                             /*!< register scattered to memory */
+    KIND_MODIFY                             /*!< shift, increment or decrement of a gathered operand, scattered back */
+} Lockstep_kind;
+
+/* running lanes at one PC */
+typedef struct lockstep_group {
+    uint32_t begin;                         /* first entry of the group in member */
+    uint32_t count;
+    uint16_t PC;                            /* of every lane of the group */
+    uint8_t variant;
+    uint8_t dirty;                          /* a lane may have left, see regroup */
+    int page;                               /* code page every lane was checked to run the same code in, -1 if none */
+    const uint8_t* code;                    /* storage of that page when every lane maps the same, NULL if not */
+    int64_t slack;                          /* cycles every lane can run before the first one reaches its limit */
+} Lockstep_group_t;
+
+typedef uint8_t vec_u8 __attribute__((vector_size(LOCKSTEP_VECTOR)));
+
+/*
+ * lanes
+ */
+
+static void* lane_array(size_t stride, size_t size) {
+    void* p = aligned_alloc(LOCKSTEP_VECTOR, stride * size);
+    if(p != NULL) {
+        memset(p, 0, stride * size);
+    }
+    return p;
+}
+
+/* whole CPU state of a lane */
+static CPU_type_t lane_get(const Lockstep_type_t* ls, size_t lane) {
+    CPU_type_t cpu = ls->cpu[lane];
+
+    cpu.PC = ls->PC[lane];
+    cpu.AC = ls->AC[lane];
+    cpu.X = ls->X[lane];
+    cpu.Y = ls->Y[lane];
+    cpu.SR = ls->SR[lane];
+    cpu.SP = ls->SP[lane];
+    cpu.cycles = ls->cycles[lane];
+    cpu.state = (CPU_state) ls->state[lane];
+
+    return cpu;
+}
+
+/* registers of a lane into the CPU of the lane, so the scalar core can step it where it is */
+static void lane_flush(Lockstep_type_t* ls, size_t lane) {
+    CPU_type_t* cpu = &ls->cpu[lane];
+
+    cpu->PC = ls->PC[lane];
+    cpu->AC = ls->AC[lane];
+    cpu->X = ls->X[lane];
+    cpu->Y = ls->Y[lane];
+    cpu->SR = ls->SR[lane];
+    cpu->SP = ls->SP[lane];
+    cpu->cycles = ls->cycles[lane];
+    cpu->state = (CPU_state) ls->state[lane];
+}
+
+/* and back once it has */
+static void lane_fetch(Lockstep_type_t* ls, size_t lane) {
+    const CPU_type_t* cpu = &ls->cpu[lane];
+
+    ls->PC[lane] = cpu->PC;
+    ls->AC[lane] = cpu->AC;
+    ls->X[lane] = cpu->X;
+    ls->Y[lane] = cpu->Y;
+    ls->SR[lane] = cpu->SR;
+    ls->SP[lane] = cpu->SP;
+    ls->cycles[lane] = cpu->cycles;
+    ls->state[lane] = (uint8_t) cpu->state;
+}
+
+/* the end of the lane, or its next event when that comes first */
+static void lane_limit(Lockstep_type_t* ls, size_t lane) {
+    const Scheduler_t* events = ls->events[lane];
+    const uint64_t next = (events != NULL) ? scheduler_next(events) : SCHEDULER_NONE;
+
+    ls->limit[lane] = (next < ls->end[lane]) ? next : ls->end[lane];
+}
+
+/* cycles the lane can run before it reaches its limit */
+static int64_t lane_slack(const Lockstep_type_t* ls, size_t lane) {
+    const uint64_t slack = ls->limit[lane] - ls->cycles[lane];
+    return (slack > INT64_MAX) ? INT64_MAX : (int64_t) slack;
+}
+
+/* the lane can execute an instruction: it runs, has time left and no event of its scheduler is due */
+static int lane_running(const Lockstep_type_t* ls, size_t lane) {
+    return (ls->state[lane] == CPU_RUNNING) && (ls->cycles[lane] < ls->limit[lane]);
+}
+
+/* the lane has to go through lane_settle before it can be stepped, or before the run can end */
+static int lane_unsettled(const Lockstep_type_t* ls, size_t lane) {
+    const Scheduler_t* events = ls->events[lane];
+    const uint64_t next = (events != NULL) ? scheduler_next(events) : SCHEDULER_NONE;
+
+    switch(ls->state[lane]) {
+        case CPU_RUNNING: return next <= ls->cycles[lane];
+        case CPU_PENDING: return 1;
+        case CPU_BREAK: return 0;
+        default: return (next < ls->end[lane]) || (next <= ls->cycles[lane]);
+    }
+}
+
+/*
+ * what cpu_execute does between two slices of a lane: run the events that are due, take a pending
+ * interrupt, and move a halted lane on to its next event if that comes before the end of the run.
+ * the lane's scheduler is pointed at the lane's CPU for the run, so it is brought up to date first
+ */
+static void lane_settle(Lockstep_type_t* ls, size_t lane) {
+    CPU_type_t* cpu = &ls->cpu[lane];
+    Scheduler_t* events = ls->events[lane];
+    const uint64_t end = ls->end[lane];
+
+    lane_flush(ls, lane);
+    while(cpu->state != CPU_BREAK) {
+        if( (events != NULL) && (scheduler_next(events) <= cpu->cycles) ) {
+            scheduler_run(events, cpu->cycles);
+        }
+
+        if(cpu->state == CPU_PENDING) {
+            /* cpu_step takes the interrupt; the events due after it wait for the next pass, as in cpu_execute */
+            cpu->events = NULL;
+            cpu_step(cpu, ls->mem[lane]);
+            cpu->events = events;
+        }
+
+        if(cpu->cycles >= end) {
+            break;
+        }
+
+        const uint64_t next = (events != NULL) ? scheduler_next(events) : SCHEDULER_NONE;
+
+        if(cpu->state == CPU_RUNNING) {
+            if(next > cpu->cycles) {
+                break;
+            }
+            continue;
+        }
+
+        /* halted, nothing happens until the next event */
+        if(next >= end) {
+            break;
+        }
+        cpu->cycles = next;
+    }
+    lane_fetch(ls, lane);
+    lane_limit(ls, lane);
+}
+
+static void lane_step_scalar(Lockstep_type_t* ls, size_t lane) {
+    lane_flush(ls, lane);
+    cpu_step(&ls->cpu[lane], ls->mem[lane]);
+    lane_fetch(ls, lane);
+    lane_limit(ls, lane);
+}
+
+static int same_state(const CPU_type_t* a, const CPU_type_t* b) {
+    return (a->PC == b->PC) && (a->AC == b->AC) && (a->X == b->X) && (a->Y == b->Y) &&
+           (a->SR == b->SR) && (a->SP == b->SP) && (a->cycles == b->cycles) && (a->state == b->state);
+}
+
+/*
+ * classification of the opcode map
+ */
+
+static int vector_mode(Addressing_mode mode) {
+    return (mode == IMM) || (mode == ZPG) || (mode == ZPG_INDX_X) || (mode == ZPG_INDX_Y) ||
+           (mode == ZPG_IND) || (mode == ZPG_INDX_IND) || (mode == ZPG_IND_INDX_Y) ||
+           (mode == ABS_A) || (mode == ABS_INDX_X) || (mode == ABS_INDX_Y);
+}
+
+static Lockstep_kind classify(const Instruction* ins) {
+    switch(ins->opcode) {
+        case LDA: case LDX: case LDY: case AND: case ORA: case EOR:
+        case ADC: case SBC: case CMP: case CPX: case CPY:
+            return vector_mode(ins->addr_mode) ? KIND_READ : KIND_SCALAR;
+        case STA: case STX: case STY: case STZ:
+            return vector_mode(ins->addr_mode) ? KIND_STORE : KIND_SCALAR;
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+            /* the 65C02 shifts take a cycle more across a page with X, those are left to the scalar core */
+            if(ins->addr_mode == ACC) {
+                return KIND_REGISTER;
+            }
+            return ( (ins->addr_mode == ZPG) || (ins->addr_mode == ZPG_INDX_X) || (ins->addr_mode == ABS_A) ) ?
+                   KIND_MODIFY : KIND_SCALAR;
+        case INX: case INY: case DEX: case DEY:
+        case TAX: case TAY: case TXA: case TYA:
+        case CLC: case SEC: case CLV:
+            return KIND_REGISTER;
+        case NOP:
+            /* the undocumented NMOS NOPs have operands */
+            return (ins->addr_mode == IMP) ? KIND_REGISTER : KIND_SCALAR;
+        case BPL: case BMI: case BVC: case BVS: case BCC: case BCS: case BNE: case BEQ: case BRA:
+            return KIND_BRANCH;
+        case JMP:
+            return (ins->addr_mode == ABS_A) ? KIND_JUMP : KIND_SCALAR;
+        default:
+            return KIND_SCALAR;
+    }
+}
+
+/*
+ * vector ALU
+ */
+
+/* macros rather than functions, so no vector is passed by value across an ABI boundary */
+#define VLOAD(v, p) memcpy(&(v), (p), sizeof(vec_u8))
+#define VSTORE(p, v) do { vec_u8 tmp_ = (v); memcpy((p), &tmp_, sizeof(vec_u8)); } while(0)
+
+/*
+ * only the vectors between the first and the last lane of the group are touched; with memory set
+ * a shift, increment or decrement works on the operand instead of the accumulator
+ */
+static inline __attribute__((always_inline)) void alu_lanes(Lockstep_type_t* ls, size_t first, size_t last, const Opcode opcode,
+                                                            const int memory) {
+    for(size_t k = first / LOCKSTEP_VECTOR * LOCKSTEP_VECTOR; k <= last; k += LOCKSTEP_VECTOR) {
+        vec_u8 g, a, x, y, sr, op;
+        VLOAD(g, ls->mask + k);
+        VLOAD(a, ls->AC + k);
+        VLOAD(x, ls->X + k);
+        VLOAD(y, ls->Y + k);
+        VLOAD(sr, ls->SR + k);
+        VLOAD(op, ls->operand + k);
+        vec_u8 na = a, nx = x, ny = y, nsr = sr, result = a;
+        const vec_u8 in = memory ? op : a;
+        vec_u8 carry;
+        int nz = 1;
+
+        switch(opcode) {
+            case LDA: na = result = op; break;
+            case LDX: nx = result = op; break;
+            case LDY: ny = result = op; break;
+            case AND: na = result = a & op; break;
+            case ORA: na = result = a | op; break;
+            case EOR: na = result = a ^ op; break;
+            case SBC:
+                op = ~op;
+                /* fall through */
+            case ADC: {
+                vec_u8 partial = a + op;
+                vec_u8 sum = partial + (sr & C_MASK);
+                carry = (vec_u8) ((partial < a) | (sum < partial)) & C_MASK;
+                vec_u8 overflow = ((~(a ^ op) & (a ^ sum) & 0x80) >> 1);
+                nsr = (sr & (uint8_t) ~(C_MASK | V_MASK)) | carry | overflow;
+                na = result = sum;
+                break;
+            }
+            case CMP:
+            case CPX:
+            case CPY: {
+                vec_u8 reg = (opcode == CMP) ? a : (opcode == CPX) ? x : y;
+                carry = (vec_u8) (reg >= op) & C_MASK;
+                nsr = (sr & (uint8_t) ~C_MASK) | carry;
+                result = reg - op;
+                break;
+            }
+            case ASL:
+                carry = in >> 7;
+                na = result = in << 1;
+                nsr = (sr & (uint8_t) ~C_MASK) | carry;
+                break;
+            case LSR:
+                carry = in & C_MASK;
+                na = result = in >> 1;
+                nsr = (sr & (uint8_t) ~C_MASK) | carry;
+                break;
+            case ROL:
+                carry = in >> 7;
+                na = result = (in << 1) | (sr & C_MASK);
+                nsr = (sr & (uint8_t) ~C_MASK) | carry;
+                break;
+            case ROR:
+                carry = in & C_MASK;
+                na = result = (in >> 1) | ((sr & C_MASK) << 7);
+                nsr = (sr & (uint8_t) ~C_MASK) | carry;
+                break;
+            case INC: na = result = in + 1; break;
+            case DEC: na = result = in - 1; break;
+            case INX: nx = result = x + 1; break;
+            case INY: ny = result = y + 1; break;
+            case DEX: nx = result = x - 1; break;
+            case DEY: ny = result = y - 1; break;
+            case TAX: nx = result = a; break;
+            case TAY: ny = result = a; break;
+            case TXA: na = result = x; break;
+            case TYA: na = result = y; break;
+            case CLC: nsr = sr & (uint8_t) ~C_MASK; nz = 0; break;
+            case SEC: nsr = sr | C_MASK; nz = 0; break;
+            case CLV: nsr = sr & (uint8_t) ~V_MASK; nz = 0; break;
+            default: nz = 0; break;
+        }
+
+        if(nz) {
+            nsr = (nsr & (uint8_t) ~(N_MASK | Z_MASK)) | (result & N_MASK) | ((vec_u8) (result == 0) & Z_MASK);
+        }
+        if(memory) {
+            VSTORE(ls->operand + k, (result & g) | (op & ~g));
+            na = a;
+        }
+
+        VSTORE(ls->AC + k, (na & g) | (a & ~g));
+        VSTORE(ls->X + k, (nx & g) | (x & ~g));
+        VSTORE(ls->Y + k, (ny & g) | (y & ~g));
+        VSTORE(ls->SR + k, (nsr & g) | (sr & ~g));
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("avx2")))
+static void alu_avx2(Lockstep_type_t* ls, size_t first, size_t last, Opcode opcode, int memory) {
+    alu_lanes(ls, first, last, opcode, memory);
+}
+#endif
+
+static void alu_baseline(Lockstep_type_t* ls, size_t first, size_t last, Opcode opcode, int memory) {
+    alu_lanes(ls, first, last, opcode, memory);
+}
+
+/*
+ * groups
+ * the lanes of a group are a sorted run of member, handed out from its end
+ */
+
+/* pack the runs of every group to the front of member, the one given last so it can grow */
+static void pack_groups(Lockstep_type_t* ls, Lockstep_group_t* last) {
+    size_t used = 0;
+
+    for(size_t j = 0; j <= ls->group_count; j++) {
+        Lockstep_group_t* g = (j < ls->group_count) ? &ls->groups[j] : last;
+
+        if( (j < ls->group_count) && (g == last) ) {
+            continue;
+        }
+        memcpy(ls->spare + used, ls->member + g->begin, g->count * sizeof(uint32_t));
+        g->begin = (uint32_t) used;
+        used += g->count;
+    }
+
+    memcpy(ls->member, ls->spare, used * sizeof(uint32_t));
+    ls->used = used;
+}
+
+/* room for more lanes at the end of the run of a group */
+static void group_reserve(Lockstep_type_t* ls, Lockstep_group_t* g, size_t more) {
+    if(g->begin + g->count == ls->used) {
+        if(ls->used + more <= 2 * ls->stride) {
+            ls->used += more;
+            return;
+        }
+    } else if(ls->used + g->count + more <= 2 * ls->stride) {
+        memmove(ls->member + ls->used, ls->member + g->begin, g->count * sizeof(uint32_t));
+        g->begin = (uint32_t) ls->used;
+        ls->used += g->count + more;
+        return;
+    }
+
+    pack_groups(ls, g);
+    ls->used += more;
+}
+
+static Lockstep_group_t* group_new(Lockstep_type_t* ls, size_t lane) {
+    Lockstep_group_t* g = &ls->groups[ls->group_count++];
+
+    *g = (Lockstep_group_t) { (uint32_t) ls->used, 0, ls->PC[lane], (uint8_t) ls->cpu[lane].variant, 0, -1, NULL, INT64_MAX };
+    return g;
+}
+
+static void group_remove(Lockstep_type_t* ls, size_t index) {
+    ls->groups[index] = ls->groups[--ls->group_count];
+}
+
+static void group_insert(Lockstep_type_t* ls, Lockstep_group_t* g, size_t lane) {
+    group_reserve(ls, g, 1);
+
+    uint32_t* member = ls->member + g->begin;
+    size_t m = g->count++;
+
+    for(; (m > 0) && (member[m - 1] > lane); m--) {
+        member[m] = member[m - 1];
+    }
+    member[m] = (uint32_t) lane;
+
+    const int64_t slack = lane_slack(ls, lane);
+    if(slack < g->slack) {
+        g->slack = slack;
+    }
+    /* the code of the lane has not been checked against the others */
+    g->page = -1;
+}
+
+/* move the lanes of one group into another one */
+static void group_merge(Lockstep_type_t* ls, Lockstep_group_t* into, Lockstep_group_t* from) {
+    group_reserve(ls, into, from->count);
+
+    uint32_t* a = ls->member + into->begin;
+    const uint32_t* b = ls->member + from->begin;
+    size_t i = into->count;
+    size_t j = from->count;
+    size_t k = i + j;
+
+    /* from the back, the run of from is never in the room taken at the end of into */
+    while(j > 0) {
+        a[--k] = ( (i > 0) && (a[i - 1] > b[j - 1]) ) ? a[--i] : b[--j];
+    }
+
+    into->count += from->count;
+    if(from->slack < into->slack) {
+        into->slack = from->slack;
+    }
+    into->page = -1;
+}
+
+/*
+ * settle a lane that is not in a group and put it in the group at its PC, or a new one, if it is
+ * still running. once settled a lane that does not run has nothing left to do before its end
+ */
+static void lane_join(Lockstep_type_t* ls, size_t lane) {
+    if(lane_unsettled(ls, lane)) {
+        lane_settle(ls, lane);
+    }
+    if(!lane_running(ls, lane)) {
+        return;
+    }
+
+    const CPU_variant variant = ls->cpu[lane].variant;
+    Lockstep_group_t* g = NULL;
+
+    for(size_t j = 0; j < ls->group_count; j++) {
+        if( (ls->groups[j].PC == ls->PC[lane]) && (ls->groups[j].variant == variant) ) {
+            g = &ls->groups[j];
+            break;
+        }
+    }
+    if(g == NULL) {
+        g = group_new(ls, lane);
+    }
+    group_insert(ls, g, lane);
+}
+
+/*
+ * keep the lanes of a group that are still running at the PC of the first of them and let the
+ * others join the group at their PC
+ */
+static void regroup(Lockstep_type_t* ls, size_t index) {
+    Lockstep_group_t* g = &ls->groups[index];
+    uint32_t* member = ls->member + g->begin;
+    size_t kept = 0;
+
+    g->slack = INT64_MAX;
+    for(size_t m = 0; m < g->count; m++) {
+        size_t i = member[m];
+
+        if(lane_running(ls, i) && ( (kept == 0) || (ls->PC[i] == g->PC) )) {
+            const int64_t slack = lane_slack(ls, i);
+
+            g->PC = ls->PC[i];
+            if(slack < g->slack) {
+                g->slack = slack;
+            }
+            member[kept++] = (uint32_t) i;
+        } else {
+            ls->moved[ls->moved_count++] = (uint32_t) i;
+        }
+    }
+
+    g->count = (uint32_t) kept;
+    g->dirty = 0;
+    g->page = -1;
+    if(kept == 0) {
+        group_remove(ls, index);
+    }
+
+    for(size_t m = 0; m < ls->moved_count; m++) {
+        lane_join(ls, ls->moved[m]);
+    }
+    ls->moved_count = 0;
+}
+
+/*
+ * group at the lowest PC, the groups there of the same variant are merged into it
+ * @param bound set to the lowest PC of the other groups, past the end of memory if there are none
+ */
+static size_t pick_group(Lockstep_type_t* ls, uint32_t* bound) {
+    size_t lowest = 0;
+
+    for(size_t j = 1; j < ls->group_count; j++) {
+        if(ls->groups[j].PC < ls->groups[lowest].PC) {
+            lowest = j;
+        }
+    }
+
+    *bound = MEMORY_SIZE;
+    for(size_t j = 0; j < ls->group_count; ) {
+        Lockstep_group_t* g = &ls->groups[j];
+
+        if( (j != lowest) && (g->PC == ls->groups[lowest].PC) && (g->variant == ls->groups[lowest].variant) ) {
+            group_merge(ls, &ls->groups[lowest], g);
+            if(lowest == ls->group_count - 1) {
+                lowest = j;
+            }
+            group_remove(ls, j);
+            continue;
+        }
+        if( (j != lowest) && (g->PC < *bound) ) {
+            *bound = g->PC;
+        }
+        j++;
+    }
+
+    return lowest;
+}
+
+static void group_mask(Lockstep_type_t* ls, const Lockstep_group_t* g, uint8_t value) {
+    const uint32_t* member = ls->member + g->begin;
+
+    for(size_t m = 0; m < g->count; m++) {
+        ls->mask[member[m]] = value;
+    }
+}
+
+static inline int same_code(const uint8_t* a, const uint8_t* b, size_t length) {
+    return (a[0] == b[0]) && ( (length < 2) || (a[1] == b[1]) ) && ( (length < 3) || (a[2] == b[2]) );
+}
+
+/*
+ * every lane of the group runs the same instruction: lanes that map the same storage as the first
+ * one at the PC run the same code, the others have their bytes compared. a lane that runs other
+ * code, or code behind a device or hooks, leaves the group after a step on the scalar core
+ */
+static void check_code(Lockstep_type_t* ls, Lockstep_group_t* g, const uint8_t* code, size_t length) {
+    uint32_t* member = ls->member + g->begin;
+    const uint8_t page = g->PC >> 8;
+    const uint8_t offset = g->PC & 0xFF;
+    int shared = 1;
+    size_t kept = 0;
+
+    for(size_t m = 0; m < g->count; m++) {
+        size_t i = member[m];
+        const uint8_t* lane_code = ls->mem[i]->read_page[page];
+
+        if(lane_code != code) {
+            shared = 0;
+            if( (lane_code == NULL) || !same_code(lane_code + offset, code + offset, length) ) {
+                ls->mask[i] = 0;
+                lane_step_scalar(ls, i);
+                ls->moved[ls->moved_count++] = (uint32_t) i;
+                g->dirty = 1;
+                continue;
+            }
+        }
+        member[kept++] = (uint32_t) i;
+    }
+
+    g->count = (uint32_t) kept;
+    g->page = page;
+    g->code = shared ? code : NULL;
+}
+
+/*
+ * front end, one lane at a time
+ */
+
+/*
+ * the address the operand of a lane is at, operand holds the bytes after the opcode
+ * @return 0 if the pointer of an indirect mode is on a zero page without storage
+ */
+static inline __attribute__((always_inline)) int lane_address(const Lockstep_type_t* ls, size_t lane, Addressing_mode mode,
+                                                              uint16_t operand, uint16_t* address, uint8_t* extra) {
+    const uint8_t* zero_page;
+    uint8_t pointer;
+    uint16_t base;
+
+    switch(mode) {
+        case ZPG_INDX_X:
+            *address = (uint8_t) (operand + ls->X[lane]);
+            return 1;
+        case ZPG_INDX_Y:
+            *address = (uint8_t) (operand + ls->Y[lane]);
+            return 1;
+        case ABS_INDX_X:
+        case ABS_INDX_Y:
+            *address = operand + ( (mode == ABS_INDX_X) ? ls->X[lane] : ls->Y[lane] );
+            *extra = (operand ^ *address) > 0xFF;
+            return 1;
+        case ZPG_IND:
+        case ZPG_INDX_IND:
+        case ZPG_IND_INDX_Y:
+            zero_page = ls->mem[lane]->read_page[0];
+            if(zero_page == NULL) {
+                return 0;
+            }
+            pointer = (uint8_t) operand + ( (mode == ZPG_INDX_IND) ? ls->X[lane] : 0 );
+            base = zero_page[pointer] | (zero_page[(uint8_t) (pointer + 1)] << 8);
+            *address = base + ( (mode == ZPG_IND_INDX_Y) ? ls->Y[lane] : 0 );
+            *extra = (base ^ *address) > 0xFF;
+            return 1;
+        default:
+            *address = operand;
+            return 1;
+    }
+}
+
+/* a lane the vector step cannot take is stepped on the scalar core instead and left out of the ALU */
+static void lane_fall_back(Lockstep_type_t* ls, Lockstep_group_t* g, size_t lane) {
+    ls->mask[lane] = 0;
+    lane_step_scalar(ls, lane);
+    g->dirty = 1;
+}
+
+/*
+ * decimal mode ADC and SBC look their result up in the tables of decimal.h as the scalar core does,
+ * those lanes are left out of the ALU and the count of them is returned
+ */
+static inline __attribute__((always_inline)) size_t read_lanes(Lockstep_type_t* ls, Lockstep_group_t* g, Addressing_mode mode,
+                                                               uint16_t operand, uint16_t next, uint8_t cycles,
+                                                               const Decimal_result_t (*decimal)[256][256]) {
+    const uint32_t* member = ls->member + g->begin;
+    Memory_type_t* const* mem = ls->mem;
+    uint8_t* value = ls->operand;
+    uint8_t* ac = ls->AC;
+    uint8_t* sr = ls->SR;
+    uint16_t* pc = ls->PC;
+    uint64_t* clock = ls->cycles;
+    const uint8_t decimal_cycle = (g->variant != CPU_NMOS);
+    const size_t count = g->count;
+    size_t held = 0;
+
+    for(size_t m = 0; m < count; m++) {
+        const size_t i = member[m];
+        uint16_t address;
+        uint8_t extra = 0;
+
+        if(mode == IMM) {
+            value[i] = (uint8_t) operand;
+        } else {
+            const uint8_t* page = lane_address(ls, i, mode, operand, &address, &extra) ? mem[i]->read_page[address >> 8] : NULL;
+
+            /* a device or the hooks of an instrumented page may post events or change the interrupt lines */
+            if(page == NULL) {
+                lane_fall_back(ls, g, i);
+                continue;
+            }
+            value[i] = page[address & 0xFF];
+        }
+
+        pc[i] = next;
+        clock[i] += cycles + extra;
+
+        if(decimal && (sr[i] & D_MASK)) {
+            const Decimal_result_t* result = &decimal[sr[i] & C_MASK][ac[i]][value[i]];
+
+            ac[i] = result->value;
+            sr[i] = (sr[i] & ~(N_MASK | V_MASK | Z_MASK | C_MASK)) | result->flags;
+            clock[i] += decimal_cycle;
+            ls->mask[i] = 0;
+            held++;
+        }
+    }
+
+    return held;
+}
+
+static inline __attribute__((always_inline)) void store_lanes(Lockstep_type_t* ls, Lockstep_group_t* g, Addressing_mode mode,
+                                                              uint16_t operand, uint16_t next, uint8_t cycles, const uint8_t* source) {
+    const uint32_t* member = ls->member + g->begin;
+    Memory_type_t* const* mem = ls->mem;
+    uint16_t* pc = ls->PC;
+    uint64_t* clock = ls->cycles;
+    const int validate = ls->validate;
+    const size_t count = g->count;
+
+    for(size_t m = 0; m < count; m++) {
+        const size_t i = member[m];
+        uint16_t address;
+        uint8_t extra = 0;
+        uint8_t* page = lane_address(ls, i, mode, operand, &address, &extra) ? mem[i]->write_page[address >> 8] : NULL;
+
+        if(page == NULL) {
+            lane_fall_back(ls, g, i);
+            continue;
+        }
+        if(validate) {
+            ls->address[i] = address;
+            ls->before[i] = page[address & 0xFF];
+        }
+        page[address & 0xFF] = (source != NULL) ? source[i] : 0;
+
+        pc[i] = next;
+        clock[i] += cycles;
+    }
+}
+
+/* the operand of a read-modify-write, the page has to take the write as well */
+static inline __attribute__((always_inline)) void modify_lanes(Lockstep_type_t* ls, Lockstep_group_t* g, Addressing_mode mode,
+                                                               uint16_t operand, uint16_t next, uint8_t cycles) {
+    const uint32_t* member = ls->member + g->begin;
+    Memory_type_t* const* mem = ls->mem;
+    uint8_t* value = ls->operand;
+    uint16_t* pc = ls->PC;
+    uint64_t* clock = ls->cycles;
+    const size_t count = g->count;
+
+    for(size_t m = 0; m < count; m++) {
+        const size_t i = member[m];
+        uint16_t address;
+        uint8_t extra = 0;
+        uint8_t* page = lane_address(ls, i, mode, operand, &address, &extra) ? mem[i]->write_page[address >> 8] : NULL;
+
+        if( (page == NULL) || (mem[i]->read_page[address >> 8] != page) ) {
+            lane_fall_back(ls, g, i);
+            continue;
+        }
+        ls->address[i] = address;
+        ls->before[i] = value[i] = page[address & 0xFF];
+
+        pc[i] = next;
+        clock[i] += cycles;
+    }
+}
+
+/* the results of a read-modify-write back to where they came from */
+static void scatter_lanes(Lockstep_type_t* ls, const Lockstep_group_t* g) {
+    const uint32_t* member = ls->member + g->begin;
+
+    for(size_t m = 0; m < g->count; m++) {
+        const size_t i = member[m];
+
+        if(ls->mask[i]) {
+            ls->mem[i]->write_page[ls->address[i] >> 8][ls->address[i] & 0xFF] = ls->operand[i];
+        }
+    }
+}
+
+/* the flag a branch tests and the value it branches on, BRA tests no flag */
+static void branch_condition(Opcode opcode, uint8_t* flag, int* set) {
+    static const struct { Opcode opcode; uint8_t flag; int set; } conditions[] = {
+        { BPL, N_MASK, 0 }, { BMI, N_MASK, 1 }, { BVC, V_MASK, 0 }, { BVS, V_MASK, 1 },
+        { BCC, C_MASK, 0 }, { BCS, C_MASK, 1 }, { BNE, Z_MASK, 0 }, { BEQ, Z_MASK, 1 }
+    };
+
+    *flag = 0;
+    *set = 0;
+    for(size_t c = 0; c < sizeof(conditions) / sizeof(conditions[0]); c++) {
+        if(conditions[c].opcode == opcode) {
+            *flag = conditions[c].flag;
+            *set = conditions[c].set;
+        }
+    }
+}
+
+/*
+ * one step of every lane in the group
+ */
+
+static void step_scalar(Lockstep_type_t* ls, Lockstep_group_t* g) {
+    const uint32_t* member = ls->member + g->begin;
+
+    for(size_t m = 0; m < g->count; m++) {
+        lane_step_scalar(ls, member[m]);
+    }
+    g->dirty = 1;
+}
+
+static void validate_lanes(Lockstep_type_t* ls, const Lockstep_group_t* g, uint16_t pc, uint8_t opcode,
+                           const Instruction* ins, Lockstep_kind kind) {
+    const uint32_t* member = ls->member + g->begin;
+    const int writes = (kind == KIND_STORE) || (kind == KIND_MODIFY);
+
+    for(size_t m = 0; (m < g->count) && !ls->diverged; m++) {
+        size_t i = member[m];
+
+        if(!ls->mask[i]) {
+            continue;
+        }
+
+        CPU_type_t actual = lane_get(ls, i);
+        uint8_t value = 0;
+        uint8_t expected = 0;
+
+        /* the shadow writes again on the byte as it was, the step only ever touches RAM */
+        if(writes) {
+            value = (kind == KIND_MODIFY) ? ls->operand[i] : (ins->opcode == STA) ? ls->AC[i] :
+                    (ins->opcode == STX) ? ls->X[i] : (ins->opcode == STY) ? ls->Y[i] : 0;
+            mem_write8(ls->mem[i], ls->address[i], ls->before[i]);
+        }
+        cpu_step(&ls->shadow[i], ls->mem[i]);
+        if(writes) {
+            expected = mem_read8(ls->mem[i], ls->address[i]);
+        }
+
+        if(!same_state(&ls->shadow[i], &actual) || (expected != value)) {
+            ls->diverged = 1;
+            ls->divergence = (Lockstep_divergence_t) { i, pc, opcode, ls->shadow[i], actual,
+                                                       writes ? ls->address[i] : 0, expected, value };
+        }
+    }
+}
+
+static void step_group(Lockstep_type_t* ls, Lockstep_group_t* g) {
+    const uint16_t pc = g->PC;
+    const uint8_t* code = ls->mem[ls->member[g->begin]]->read_page[pc >> 8];
+
+    /* code behind a device or hooks is only ever fetched by the scalar core */
+    if(code == NULL) {
+        step_scalar(ls, g);
+        return;
+    }
+
+    const uint8_t opcode = code[pc & 0xFF];
+    const Instruction* ins = &cpu_instructions[g->variant][opcode];
+    const Lockstep_kind kind = (Lockstep_kind) ls->kind[g->variant][opcode];
+    const size_t length = cpu_instruction_length(ins->addr_mode);
+
+    if( (kind == KIND_SCALAR) || ((pc & 0xFF) + length > MEMORY_PAGE_SIZE) ) {
+        step_scalar(ls, g);
+        return;
+    }
+
+    /* lanes that share the code page are checked once, the others on every step */
+    if( (g->page != (pc >> 8)) || (g->code != code) ) {
+        check_code(ls, g, code, length);
+    }
+
+    const uint32_t* member = ls->member + g->begin;
+    const uint16_t operand = (length > 2) ? (code[(pc + 1) & 0xFF] | (code[(pc + 2) & 0xFF] << 8)) :
+                             code[(pc + 1) & 0xFF];
+    const uint16_t next = pc + length;
+    const Decimal_tables_t* tables = &decimal_tables[(g->variant == CPU_NMOS) ? DECIMAL_NMOS : DECIMAL_CMOS];
+    const Decimal_result_t (*decimal)[256][256] = (ins->opcode == ADC) ? tables->adc :
+                                                  (ins->opcode == SBC) ? tables->sbc : NULL;
+    size_t held = 0;
+    /* a page crossed, and in decimal mode the cycle the CMOS cores take to set N and Z */
+    uint8_t most = ins->cycles + 1 + ( (decimal != NULL) && (g->variant != CPU_NMOS) );
+
+    if(ls->validate) {
+        for(size_t m = 0; m < g->count; m++) {
+            /* the events of the lane are left to the lane, the shadow only executes the instruction */
+            ls->shadow[member[m]] = lane_get(ls, member[m]);
+            ls->shadow[member[m]].events = NULL;
+        }
+    }
+
+    switch(kind) {
+        case KIND_BRANCH: {
+            const uint16_t target = next + (int8_t) operand;
+            const uint8_t taken_cycles = ins->cycles + 1 + (((next ^ target) & 0xFF00) != 0);
+            uint8_t flag;
+            int set;
+            size_t taken = 0;
+
+            branch_condition(ins->opcode, &flag, &set);
+            for(size_t m = 0; m < g->count; m++) {
+                const size_t i = member[m];
+                const int branch = ((ls->SR[i] & flag) != 0) == set;
+
+                ls->PC[i] = branch ? target : next;
+                ls->cycles[i] += branch ? taken_cycles : ins->cycles;
+                taken += branch;
+            }
+
+            most = taken_cycles;
+            if( (taken != 0) && (taken != g->count) ) {
+                g->dirty = 1;
+            }
+            g->PC = (taken != 0) ? target : next;
+            break;
+        }
+        case KIND_JUMP:
+            for(size_t m = 0; m < g->count; m++) {
+                ls->PC[member[m]] = operand;
+                ls->cycles[member[m]] += ins->cycles;
+            }
+            g->PC = operand;
+            break;
+        case KIND_READ:
+            switch(ins->addr_mode) {
+                case IMM: held = read_lanes(ls, g, IMM, operand, next, ins->cycles, decimal); break;
+                case ZPG: held = read_lanes(ls, g, ZPG, operand, next, ins->cycles, decimal); break;
+                case ZPG_INDX_X: held = read_lanes(ls, g, ZPG_INDX_X, operand, next, ins->cycles, decimal); break;
+                case ZPG_INDX_Y: held = read_lanes(ls, g, ZPG_INDX_Y, operand, next, ins->cycles, decimal); break;
+                case ZPG_IND: held = read_lanes(ls, g, ZPG_IND, operand, next, ins->cycles, decimal); break;
+                case ZPG_INDX_IND: held = read_lanes(ls, g, ZPG_INDX_IND, operand, next, ins->cycles, decimal); break;
+                case ZPG_IND_INDX_Y: held = read_lanes(ls, g, ZPG_IND_INDX_Y, operand, next, ins->cycles, decimal); break;
+                case ABS_INDX_X: held = read_lanes(ls, g, ABS_INDX_X, operand, next, ins->cycles, decimal); break;
+                case ABS_INDX_Y: held = read_lanes(ls, g, ABS_INDX_Y, operand, next, ins->cycles, decimal); break;
+                default: held = read_lanes(ls, g, ABS_A, operand, next, ins->cycles, decimal); break;
+            }
+            g->PC = next;
+            break;
+        case KIND_STORE: {
+            const uint8_t* source = (ins->opcode == STA) ? ls->AC : (ins->opcode == STX) ? ls->X :
+                                    (ins->opcode == STY) ? ls->Y : NULL;
+            switch(ins->addr_mode) {
+                case ZPG: store_lanes(ls, g, ZPG, operand, next, ins->cycles, source); break;
+                case ZPG_INDX_X: store_lanes(ls, g, ZPG_INDX_X, operand, next, ins->cycles, source); break;
+                case ZPG_INDX_Y: store_lanes(ls, g, ZPG_INDX_Y, operand, next, ins->cycles, source); break;
+                case ZPG_IND: store_lanes(ls, g, ZPG_IND, operand, next, ins->cycles, source); break;
+                case ZPG_INDX_IND: store_lanes(ls, g, ZPG_INDX_IND, operand, next, ins->cycles, source); break;
+                case ZPG_IND_INDX_Y: store_lanes(ls, g, ZPG_IND_INDX_Y, operand, next, ins->cycles, source); break;
+                case ABS_INDX_X: store_lanes(ls, g, ABS_INDX_X, operand, next, ins->cycles, source); break;
+                case ABS_INDX_Y: store_lanes(ls, g, ABS_INDX_Y, operand, next, ins->cycles, source); break;
+                default: store_lanes(ls, g, ABS_A, operand, next, ins->cycles, source); break;
+            }
+            g->PC = next;
+            break;
+        }
+        case KIND_MODIFY:
+            switch(ins->addr_mode) {
+                case ZPG: modify_lanes(ls, g, ZPG, operand, next, ins->cycles); break;
+                case ZPG_INDX_X: modify_lanes(ls, g, ZPG_INDX_X, operand, next, ins->cycles); break;
+                default: modify_lanes(ls, g, ABS_A, operand, next, ins->cycles); break;
+            }
+            g->PC = next;
+            break;
+        default:
+            for(size_t m = 0; m < g->count; m++) {
+                ls->PC[member[m]] = next;
+                ls->cycles[member[m]] += ins->cycles;
+            }
+            g->PC = next;
+            break;
+    }
+
+    if( (g->count > 0) && ( (kind == KIND_READ) || (kind == KIND_REGISTER) || (kind == KIND_MODIFY) ) ) {
+        ls->alu(ls, member[0], member[g->count - 1], ins->opcode, kind == KIND_MODIFY);
+    }
+    if(kind == KIND_MODIFY) {
+        scatter_lanes(ls, g);
+    }
+    /* the decimal lanes rejoin the ALU, after a fall back the mask is set again for the next group */
+    if(held && !g->dirty) {
+        group_mask(ls, g, 0xFF);
+    }
+
+    if(ls->validate) {
+        validate_lanes(ls, g, pc, opcode, ins, kind);
+    }
+
+    /* no lane can have reached its limit as long as there is slack left for the longest step */
+    g->slack -= most;
+    if(g->slack <= 0) {
+        g->dirty = 1;
+    }
+}
+
+/**
+ * allocate the lane arrays and pick the vector ALU for the host
+ * @param ls engine
+ * @param lanes number of lanes
+ * @return 0 on success
+ */
+int lockstep_initialize(Lockstep_type_t* ls, size_t lanes) {
+    memset(ls, 0, sizeof(*ls));
+    ls->lanes = lanes;
+    ls->stride = (lanes + LOCKSTEP_VECTOR - 1) / LOCKSTEP_VECTOR * LOCKSTEP_VECTOR;
+    if(ls->stride == 0) {
+        ls->stride = LOCKSTEP_VECTOR;
+    }
+
+    ls->PC = lane_array(ls->stride, sizeof(uint16_t));
+    ls->AC = lane_array(ls->stride, sizeof(uint8_t));
+    ls->X = lane_array(ls->stride, sizeof(uint8_t));
+    ls->Y = lane_array(ls->stride, sizeof(uint8_t));
+    ls->SR = lane_array(ls->stride, sizeof(uint8_t));
+    ls->SP = lane_array(ls->stride, sizeof(uint8_t));
+    ls->cycles = lane_array(ls->stride, sizeof(uint64_t));
+    ls->end = lane_array(ls->stride, sizeof(uint64_t));
+    ls->limit = lane_array(ls->stride, sizeof(uint64_t));
+    ls->state = lane_array(ls->stride, sizeof(uint8_t));
+    ls->cpu = lane_array(ls->stride, sizeof(CPU_type_t));
+    ls->mem = lane_array(ls->stride, sizeof(Memory_type_t*));
+    ls->events = lane_array(ls->stride, sizeof(Scheduler_t*));
+    ls->attached = lane_array(ls->stride, sizeof(CPU_type_t*));
+    ls->groups = lane_array(ls->stride, sizeof(Lockstep_group_t));
+    ls->member = lane_array(2 * ls->stride, sizeof(uint32_t));
+    ls->spare = lane_array(ls->stride, sizeof(uint32_t));
+    ls->moved = lane_array(ls->stride, sizeof(uint32_t));
+    ls->mask = lane_array(ls->stride, sizeof(uint8_t));
+    ls->operand = lane_array(ls->stride, sizeof(uint8_t));
+    ls->address = lane_array(ls->stride, sizeof(uint16_t));
+    ls->before = lane_array(ls->stride, sizeof(uint8_t));
+    ls->shadow = lane_array(ls->stride, sizeof(CPU_type_t));
+
+    if( !ls->PC || !ls->AC || !ls->X || !ls->Y || !ls->SR || !ls->SP || !ls->cycles || !ls->end ||
+        !ls->limit || !ls->state || !ls->cpu || !ls->mem || !ls->events || !ls->attached || !ls->groups ||
+        !ls->member || !ls->spare || !ls->moved || !ls->mask || !ls->operand || !ls->address || !ls->before || !ls->shadow ) {
+        lockstep_free(ls);
+        return -1;
+    }
+
+    /* padding lanes never run */
+    for(size_t i = 0; i < ls->stride; i++) {
+        ls->state[i] = CPU_STOPPED;
+    }
+
+    decimal_initialize();
+    for(unsigned variant = 0; variant < CPU_VARIANTS; variant++) {
+        for(unsigned opcode = 0; opcode < 256; opcode++) {
+            ls->kind[variant][opcode] = (uint8_t) classify(&cpu_instructions[variant][opcode]);
+        }
+    }
+
+    ls->alu = alu_baseline;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if(__builtin_cpu_supports("avx2")) {
+        ls->alu = alu_avx2;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * free the lane arrays
+ * @param ls engine
+ */
+void lockstep_free(Lockstep_type_t* ls) {
+    free(ls->PC);
+    free(ls->AC);
+    free(ls->X);
+    free(ls->Y);
+    free(ls->SR);
+    free(ls->SP);
+    free(ls->cycles);
+    free(ls->end);
+    free(ls->limit);
+    free(ls->state);
+    free(ls->cpu);
+    free(ls->mem);
+    free(ls->events);
+    free(ls->attached);
+    free(ls->groups);
+    free(ls->member);
+    free(ls->spare);
+    free(ls->moved);
+    free(ls->mask);
+    free(ls->operand);
+    free(ls->address);
+    free(ls->before);
+    free(ls->shadow);
+    memset(ls, 0, sizeof(*ls));
+}
+
+/**
+ * copy a CPU into a lane
+ * @param ls engine
+ * @param lane lane number
+ * @param cpu CPU to copy
+ * @param mem memory the lane runs on
+ */
+void lockstep_load(Lockstep_type_t* ls, size_t lane, const CPU_type_t* cpu, Memory_type_t* mem) {
+    ls->cpu[lane] = *cpu;
+    lane_fetch(ls, lane);
+    ls->mem[lane] = mem;
+}
+
+/**
+ * copy a lane out to a CPU
+ * @param ls engine
+ * @param lane lane number
+ * @param cpu where to store the state
+ */
+void lockstep_store(const Lockstep_type_t* ls, size_t lane, CPU_type_t* cpu) {
+    *cpu = lane_get(ls, lane);
+}
+
+/**
+ * run every lane for the cycle budget
+ * @param ls engine
+ * @param cycle_budget cycles per lane
+ * @return 0 on success, -1 on a divergence in validation mode
+ */
+int lockstep_run(Lockstep_type_t* ls, uint64_t cycle_budget) {
+    ls->group_count = 0;
+    ls->used = 0;
+    ls->moved_count = 0;
+
+    for(size_t i = 0; i < ls->lanes; i++) {
+        ls->end[i] = ls->cycles[i] + cycle_budget;
+
+        /* the events of a lane go to the lane for the run, not to the CPU it was loaded from */
+        ls->events[i] = ls->cpu[i].events;
+        if(ls->events[i] != NULL) {
+            ls->attached[i] = ls->events[i]->cpu;
+            ls->events[i]->cpu = &ls->cpu[i];
+        }
+
+        lane_limit(ls, i);
+        lane_join(ls, i);
+    }
+
+    /*
+     * the group at the lowest PC runs until it gets to the PC of another one, or a lane may have
+     * left it. the run is over once no lane is left in a group
+     */
+    while( (ls->group_count > 0) && !ls->diverged ) {
+        uint32_t bound;
+        size_t index = pick_group(ls, &bound);
+        Lockstep_group_t* g = &ls->groups[index];
+
+        group_mask(ls, g, 0xFF);
+        do {
+            step_group(ls, g);
+        } while( !g->dirty && (g->PC < bound) && !ls->diverged );
+        group_mask(ls, g, 0);
+
+        if(g->dirty) {
+            regroup(ls, index);
+        }
+    }
+
+    /* same as cpu_run, the next time slice starts from here */
+    for(size_t i = 0; i < ls->lanes; i++) {
+        ls->cpu[i].deadline = ls->cycles[i];
+        if(ls->events[i] != NULL) {
+            ls->events[i]->cpu = ls->attached[i];
+        }
+    }
+
+    return ls->diverged ? -1 : 0;
+}
@@ -0,0 +1,459 @@
+/**
+ * @file machine.c
+ * @brief a CPU and its address space, with snapshots of both and copy on write forks
+ * @author Edwin
+ */
+
+/**
+ * A snapshot file, and the image of one in memory:
+ *
+ *   0    magic      MACHINE_SNAPSHOT_MAGIC
+ *   8    version    2 bytes
+ *   10   variant    1 byte
+ *   11   state      1 byte
+ *   12   PC         2 bytes
+ *   14   AC X Y SR SP   1 byte each
+ *   19   NMI        1 byte, the NMI latch
+ *   20   devices    2 bytes, number of device records
+ *   22   unused     2 bytes
+ *   24   cycles     8 bytes
+ *   32   deadline   8 bytes
+ *   40   memory     4 bytes, offset of the address space, a multiple of MACHINE_SNAPSHOT_ALIGN
+ *   44   IRQ        4 bytes, the IRQ lines asserted
+ *   48   pages      256 bytes, Machine_page of every page
+ *   304  device records: first page of the device, 3 unused bytes, 4 bytes of state size and
+ *        the state itself
+ *
+ * Multi-byte fields are little endian. The address space follows, MEMORY_SIZE bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "machine.h"
+#include "replay.h"
+
+#define HEADER_PAGES 48                     ///< offset of the page map
+#define HEADER_DEVICES (HEADER_PAGES + MEMORY_PAGES)    ///< offset of the first device record
+#define DEVICE_RECORD 8                     ///< bytes of a device record before its state
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    put16(p, (uint16_t) v);
+    put16(p + 2, (uint16_t) (v >> 16));
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+    put32(p, (uint32_t) v);
+    put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+/* the page is mapped to the RAM of memory_initialize, shared or not */
+static int own_ram(const Memory_type_t* mem, unsigned page) {
+    return (mem->shared_page[page] != NULL) || (memory_page_storage(mem, (uint8_t) page) == mem->data + page * MEMORY_PAGE_SIZE);
+}
+
+/* a device is saved once, at the first page it is mapped to */
+static int first_page_of(const Memory_type_t* mem, unsigned page) {
+    const Memory_device_t* device = mem->device[page];
+
+    if( (device == NULL) || (device->state == NULL) || (device->state_size == 0) ) {
+        return 0;
+    }
+    for(unsigned i = 0; i < page; i++) {
+        if(mem->device[i] == device) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * create the memory and a reset CPU
+ * @param machine machine struct
+ * @param variant CPU variant
+ * @return 0 on success, -1 if the memory could not be allocated
+ */
+int machine_initialize(Machine_t* machine, CPU_variant variant) {
+    if(memory_initialize(&machine->mem) == NULL) {
+        return -1;
+    }
+
+    cpu_initialize(&machine->cpu, variant);
+    machine->base = NULL;
+    return 0;
+}
+
+/**
+ * release the memory
+ * @param machine machine struct
+ */
+void machine_free(Machine_t* machine) {
+    memory_free(&machine->mem);
+    machine->base = NULL;
+}
+
+/**
+ * save the CPU, the address space and the state of the devices into a file image
+ * @param machine machine struct
+ * @param snapshot where to store the snapshot
+ * @return 0 on success, -1 if the image could not be allocated
+ */
+int machine_snapshot(const Machine_t* machine, Machine_snapshot_t* snapshot) {
+    const Memory_type_t* mem = &machine->mem;
+    const CPU_type_t* cpu = &machine->cpu;
+    size_t header = HEADER_DEVICES;
+    uint16_t devices = 0;
+
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        if(first_page_of(mem, page)) {
+            header += DEVICE_RECORD + mem->device[page]->state_size;
+            devices++;
+        }
+    }
+
+    const size_t offset = (header + MACHINE_SNAPSHOT_ALIGN - 1) & ~(size_t) (MACHINE_SNAPSHOT_ALIGN - 1);
+    uint8_t* image = aligned_alloc(MACHINE_SNAPSHOT_ALIGN, offset + MEMORY_SIZE);
+    if(image == NULL) {
+        return -1;
+    }
+    memset(image, 0, offset);
+
+    memcpy(image, MACHINE_SNAPSHOT_MAGIC, 8);
+    put16(image + 8, MACHINE_SNAPSHOT_VERSION);
+    image[10] = (uint8_t) cpu->variant;
+    image[11] = (uint8_t) cpu->state;
+    put16(image + 12, cpu->PC);
+    image[14] = cpu->AC;
+    image[15] = cpu->X;
+    image[16] = cpu->Y;
+    image[17] = cpu->SR;
+    image[18] = cpu->SP;
+    image[19] = cpu->nmi;
+    put16(image + 20, devices);
+    put64(image + 24, cpu->cycles);
+    put64(image + 32, cpu->deadline);
+    put32(image + 40, (uint32_t) offset);
+    put32(image + 44, cpu->irq);
+
+    uint8_t* record = image + HEADER_DEVICES;
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        const uint8_t* data = memory_page_storage(mem, (uint8_t) page);
+        uint8_t* copy = image + offset + page * MEMORY_PAGE_SIZE;
+
+        if(own_ram(mem, page)) {
+            image[HEADER_PAGES + page] = MACHINE_PAGE_RAM;
+        } else if(data != NULL) {
+            image[HEADER_PAGES + page] = MACHINE_PAGE_MAPPED;
+        } else {
+            image[HEADER_PAGES + page] = MACHINE_PAGE_DEVICE;
+        }
+
+        if(data != NULL) {
+            memcpy(copy, data, MEMORY_PAGE_SIZE);
+        } else {
+            memset(copy, 0, MEMORY_PAGE_SIZE);
+        }
+
+        if(first_page_of(mem, page)) {
+            const Memory_device_t* device = mem->device[page];
+
+            record[0] = (uint8_t) page;
+            put32(record + 4, device->state_size);
+            memcpy(record + DEVICE_RECORD, device->state, device->state_size);
+            record += DEVICE_RECORD + device->state_size;
+        }
+    }
+
+    snapshot->image = image;
+    snapshot->size = offset + MEMORY_SIZE;
+    snapshot->memory = image + offset;
+    snapshot->mapped = 0;
+    return 0;
+}
+
+/**
+ * release a snapshot
+ * @param snapshot snapshot taken or loaded
+ */
+void machine_snapshot_free(Machine_snapshot_t* snapshot) {
+    if(snapshot->mapped) {
+        munmap(snapshot->image, snapshot->size);
+    } else {
+        free(snapshot->image);
+    }
+
+    snapshot->image = NULL;
+    snapshot->memory = NULL;
+    snapshot->size = 0;
+}
+
+/**
+ * write a snapshot to a file
+ * @param snapshot snapshot taken or loaded
+ * @param out file
+ * @return 0 on success, -1 on a write error
+ */
+int machine_snapshot_save(const Machine_snapshot_t* snapshot, FILE* out) {
+    return (fwrite(snapshot->image, 1, snapshot->size, out) == snapshot->size) ? 0 : -1;
+}
+
+/**
+ * check the header of a file image, the device records have to lie before the address space
+ */
+static int image_valid(const uint8_t* image, size_t size) {
+    if( (size < HEADER_DEVICES) || (memcmp(image, MACHINE_SNAPSHOT_MAGIC, 8) != 0) ||
+        (get16(image + 8) > MACHINE_SNAPSHOT_VERSION) || (image[10] >= CPU_VARIANTS) ) {
+        return 0;
+    }
+
+    const size_t offset = get32(image + 40);
+    if( (offset % MACHINE_SNAPSHOT_ALIGN != 0) || (offset < HEADER_DEVICES) || (offset + MEMORY_SIZE > size) ) {
+        return 0;
+    }
+
+    size_t record = HEADER_DEVICES;
+    for(unsigned i = get16(image + 20); i > 0; i--) {
+        if(record + DEVICE_RECORD > offset) {
+            return 0;
+        }
+        record += DEVICE_RECORD + get32(image + record + 4);
+        if(record > offset) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * map a snapshot file read only
+ * @param snapshot where to store the snapshot
+ * @param path file
+ * @return 0 on success, -1 if the file could not be mapped or is not a snapshot
+ */
+int machine_snapshot_load(Machine_snapshot_t* snapshot, const char* path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0) {
+        return -1;
+    }
+    if( (fstat(fd, &st) != 0) || (st.st_size < HEADER_DEVICES) ) {
+        close(fd);
+        return -1;
+    }
+
+    void* image = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) {
+        return -1;
+    }
+
+    if(!image_valid(image, (size_t) st.st_size)) {
+        munmap(image, (size_t) st.st_size);
+        return -1;
+    }
+
+    snapshot->image = image;
+    snapshot->size = (size_t) st.st_size;
+    snapshot->memory = snapshot->image + get32(snapshot->image + 40);
+    snapshot->mapped = 1;
+    return 0;
+}
+
+/**
+ * read a snapshot image from a stream
+ * @param snapshot where to store the snapshot
+ * @param in stream, at the start of the image
+ * @param size bytes of image
+ * @return 0 on success, -1 if the image could not be allocated or read or is not a snapshot
+ */
+int machine_snapshot_read(Machine_snapshot_t* snapshot, FILE* in, size_t size) {
+    if( (size < HEADER_DEVICES) || (size > SIZE_MAX - MACHINE_SNAPSHOT_ALIGN) ) {
+        return -1;
+    }
+
+    const size_t rounded = (size + MACHINE_SNAPSHOT_ALIGN - 1) & ~(size_t) (MACHINE_SNAPSHOT_ALIGN - 1);
+    uint8_t* image = aligned_alloc(MACHINE_SNAPSHOT_ALIGN, rounded);
+    if(image == NULL) {
+        return -1;
+    }
+    if( (fread(image, 1, size, in) != size) || !image_valid(image, size) ) {
+        free(image);
+        return -1;
+    }
+
+    snapshot->image = image;
+    snapshot->size = size;
+    snapshot->memory = image + get32(image + 40);
+    snapshot->mapped = 0;
+    return 0;
+}
+
+/**
+ * the devices the snapshot has state for are mapped at the same pages with state of the same size
+ */
+static int devices_match(const Memory_type_t* mem, const uint8_t* image) {
+    const uint8_t* record = image + HEADER_DEVICES;
+
+    for(unsigned i = get16(image + 20); i > 0; i--) {
+        const Memory_device_t* device = mem->device[record[0]];
+        uint32_t size = get32(record + 4);
+
+        if( (device == NULL) || (device->state == NULL) || (device->state_size != size) ) {
+            return 0;
+        }
+        record += DEVICE_RECORD + size;
+    }
+
+    return 1;
+}
+
+/**
+ * share a page of the snapshot again, if it is RAM in both the snapshot and the machine
+ */
+static void restore_page(Memory_type_t* mem, const Machine_snapshot_t* snapshot, unsigned page) {
+    if( (snapshot->image[HEADER_PAGES + page] == MACHINE_PAGE_RAM) && own_ram(mem, page) ) {
+        memory_map_shared(mem, (uint8_t) page, 1, snapshot->memory + page * MEMORY_PAGE_SIZE);
+    } else {
+        mem->dirty[page >> 6] &= ~((uint64_t) 1 << (page & 63));
+    }
+}
+
+/**
+ * put a machine back in the state of a snapshot
+ * @param machine machine struct
+ * @param snapshot snapshot taken or loaded
+ * @return 0 on success, -1 if the devices of the machine do not match the snapshot's
+ */
+int machine_restore(Machine_t* machine, const Machine_snapshot_t* snapshot) {
+    const uint8_t* image = snapshot->image;
+    Memory_type_t* mem = &machine->mem;
+    CPU_type_t* cpu = &machine->cpu;
+
+    if(!devices_match(mem, image)) {
+        return -1;
+    }
+
+    if(machine->base == snapshot) {
+        /* only the dirty pages differ from the snapshot */
+        for(unsigned word = 0; word < MEMORY_PAGES / 64; word++) {
+            uint64_t dirty = mem->dirty[word];
+
+            while(dirty != 0) {
+                restore_page(mem, snapshot, word * 64 + (unsigned) __builtin_ctzll(dirty));
+                dirty &= dirty - 1;
+            }
+        }
+    } else {
+        for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+            restore_page(mem, snapshot, page);
+        }
+        machine->base = snapshot;
+    }
+
+    const uint8_t* record = image + HEADER_DEVICES;
+    for(unsigned i = get16(image + 20); i > 0; i--) {
+        uint32_t size = get32(record + 4);
+
+        memcpy(mem->device[record[0]]->state, record + DEVICE_RECORD, size);
+        record += DEVICE_RECORD + size;
+    }
+
+    cpu->variant = (CPU_variant) image[10];
+    cpu->state = (CPU_state) image[11];
+    cpu->PC = get16(image + 12);
+    cpu->AC = image[14];
+    cpu->X = image[15];
+    cpu->Y = image[16];
+    cpu->SR = image[17];
+    cpu->SP = image[18];
+    cpu->nmi = image[19];
+    cpu->irq = get32(image + 44);
+    cpu->cycles = get64(image + 24);
+    cpu->deadline = get64(image + 32);
+
+    return 0;
+}
+
+/* device mapped at a page, the one a replay of the machine stands in for */
+static Memory_device_t* device_of(const Machine_t* machine, unsigned page) {
+#if USE_REPLAY
+    if(machine->cpu.replay != NULL) {
+        return replay_device(machine->cpu.replay, machine->mem.device[page]);
+    }
+#endif
+    return machine->mem.device[page];
+}
+
+/**
+ * create a machine in the state of another one, sharing its memory copy on write
+ * @param child machine to create
+ * @param parent machine restored from a snapshot
+ * @return 0 on success, -1 if the parent has no snapshot or the memory could not be allocated
+ */
+int machine_fork(Machine_t* child, const Machine_t* parent) {
+    const Memory_type_t* from = &parent->mem;
+
+    if( (parent->base == NULL) || (machine_initialize(child, parent->cpu.variant) != 0) ) {
+        return -1;
+    }
+
+    Memory_type_t* mem = &child->mem;
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        /* the child gets the mappings of the parent without its hooks */
+        const uint8_t* data = memory_page_storage(from, (uint8_t) page);
+        uint8_t* storage = (from->hook[page] != NULL) ? from->hooked_write[page] : from->write_page[page];
+        if(storage == NULL) {
+            storage = from->code_page[page];
+        }
+
+        if(from->shared_page[page] != NULL) {
+            memory_map_shared(mem, (uint8_t) page, 1, from->shared_page[page]);
+        } else if(own_ram(from, page)) {
+            /* dirty in the parent, the child's copy differs from the snapshot as well */
+            memcpy(mem->data + page * MEMORY_PAGE_SIZE, data, MEMORY_PAGE_SIZE);
+            mem->dirty[page >> 6] |= (uint64_t) 1 << (page & 63);
+        } else if(data == NULL) {
+            memory_map_device(mem, (uint8_t) page, 1, device_of(parent, page));
+        } else if(storage != NULL) {
+            memory_map_ram(mem, (uint8_t) page, 1, storage);
+        } else {
+            memory_map_rom(mem, (uint8_t) page, 1, data);
+        }
+    }
+
+    child->cpu = parent->cpu;
+#if USE_PROFILER
+    child->cpu.profiler = NULL;
+#endif
+#if USE_TRACE
+    child->cpu.trace = NULL;
+#endif
+#if USE_REPLAY
+    child->cpu.replay = NULL;
+#endif
+    child->cpu.events = NULL;
+    child->base = parent->base;
+    return 0;
+}
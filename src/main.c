@@ -1,50 +1,473 @@
 /**
- * @file main.c Main emulator file
+ * @file main.c
+ * @brief headless runner: runs programs and ROMs to a stop condition and reports their final state
  * @author Edwin
  * @email emwiti658@gmail.com
-*/
+ *
+ * usage: main [-v nmos|cmos|wdc] [-e interpreter|blocks|jit] [-t threads] [-f job file]
+ *             [-j json file] [-o csv file] [job options] [program]...
+ *
+ * job options:
+ *   -a address       where a raw program is loaded, 0x0200 by default
+ *   -r address       start there instead of at the reset vector
+ *   -m rom           raw or iNES ROM mapped at the top of memory
+ *   -c cycles        cycle limit, 100000000 by default, 0 for none
+ *   -n instructions  instruction limit, the job is stepped on the interpreter
+ *   -x condition     stop at pc=ADDRESS, at brk, or once mem=ADDRESS:VALUE is written; repeatable
+ *   -l name          name in the results, the program or the ROM by default
+ *
+ * Every program is a job, and so is every line of a job file: job options and a program split at
+ * white space, on top of the job options of the command line. Blank lines and lines starting with
+ * # are skipped. A ROM with no program is a job of its own as well. A job also ends when STP or
+ * WAI halts the CPU.
+ *
+ * The results are printed as a table, and written as JSON and CSV to the files given, - for the
+ * standard output in place of the table. The exit status is 1 if a job could not be run.
+ */
 
 #include <stdio.h>
-#include <stdint.h>
-#include "config.h"
-#include "types.h"
-#include "memory-map.h"
+#include <stdlib.h>
+#include <string.h>
 #include "cpu.h"
+#include "runner.h"
 #include "utils.h"
 
-int main() {
-    CPU_type_t cpu_6502; // cpu instance
-    Memory_type_t c_mem; // some memory
+#define RUN_CYCLES 100000000ULL             ///< cycle limit of a job that gives none
 
-    CPU_type_t* cpu_6502_ptr = &cpu_6502;
-    Memory_type_t* mem_ptr = &c_mem;
+/* what the jobs run on */
+typedef enum engine { ENGINE_INTERPRETER, ENGINE_BLOCKS, ENGINE_JIT } Engine;
 
-    /*
-     * initialize
-     * I am initializing the memory separately because memory is not a part of the CPU
-     * alternatively we could have stored a memory object in the CPU and set it to zero on
-     * CPU reset but this is not a standard implementation since memory is outside the
-     * CPU
-     */
-    cpu_reset(cpu_6502_ptr);
-    uint16_t* m_ptr = memory_initialize(mem_ptr);
+static const char* const engine_names[] = { "interpreter", "blocks", "jit" };
 
-    printf("%d\n", cpu_6502_ptr->PC);
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-v nmos|cmos|wdc] [-e interpreter|blocks|jit] [-t threads] [-f job file]\n"
+                    "       [-j json file] [-o csv file] [-a address] [-r address] [-m rom] [-c cycles]\n"
+                    "       [-n instructions] [-x pc=ADDRESS|brk|mem=ADDRESS:VALUE] [-l name] [program]...\n", name);
+}
+
+/* a whole number no larger than max, in C notation */
+static int number(const char* value, uint64_t max, uint64_t* n) {
+    char* end;
+
+    if( (value[0] < '0') || (value[0] > '9') ) {
+        return -1;
+    }
+    *n = strtoull(value, &end, 0);
+    return ((*end == '\0') && (*n <= max)) ? 0 : -1;
+}
+
+static int stop_condition(Runner_job_t* job, const char* value) {
+    uint64_t address;
+    uint64_t n;
+
+    if(strcmp(value, "brk") == 0) {
+        job->stops |= RUNNER_STOP_BRK;
+        return 0;
+    }
+    if( (strncmp(value, "pc=", 3) == 0) && (number(value + 3, 0xFFFF, &address) == 0) ) {
+        job->stops |= RUNNER_STOP_PC;
+        job->stop_pc = (uint16_t) address;
+        return 0;
+    }
+    if(strncmp(value, "mem=", 4) == 0) {
+        char text[32];
+        char* colon;
+
+        if( (strlen(value + 4) >= sizeof(text)) || ((colon = strchr(strcpy(text, value + 4), ':')) == NULL) ) {
+            return -1;
+        }
+        *colon = '\0';
+        if( (number(text, 0xFFFF, &address) != 0) || (number(colon + 1, 0xFF, &n) != 0) ) {
+            return -1;
+        }
+        job->stops |= RUNNER_STOP_MEMORY;
+        job->stop_address = (uint16_t) address;
+        job->stop_value = (uint8_t) n;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * apply a job option
+ * @return 0 on success, -1 if it is not a job option or its value is malformed
+ */
+static int job_option(Runner_job_t* job, char option, const char* value) {
+    uint64_t n;
+
+    switch(option) {
+        case 'a':
+            if(number(value, 0xFFFF, &n) != 0) {
+                return -1;
+            }
+            job->address = (uint16_t) n;
+            return 0;
+        case 'r':
+            if(number(value, 0xFFFF, &n) != 0) {
+                return -1;
+            }
+            job->reset = (int32_t) n;
+            return 0;
+        case 'c':
+            return number(value, UINT64_MAX, &job->cycles);
+        case 'n':
+            return number(value, UINT64_MAX, &job->instructions);
+        case 'm':
+            job->rom = value;
+            return 0;
+        case 'x':
+            return stop_condition(job, value);
+        case 'l':
+            job->name = value;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static int add_job(Runner_t* runner, size_t* capacity, const Runner_job_t* job) {
+    if(runner->count == *capacity) {
+        const size_t grown = *capacity ? *capacity * 2 : 64;
+        Runner_job_t* jobs = (Runner_job_t*) realloc(runner->jobs, grown * sizeof(Runner_job_t));
 
-    // simple program
-    m_ptr[0xFFFC] = 0xA9;
-    m_ptr[0xFFFD] = 0x34;
-    m_ptr[0xFFFE] = 0x5A;
-    // end simple program
+        if(jobs == NULL) {
+            return -1;
+        }
+        runner->jobs = jobs;
+        *capacity = grown;
+    }
 
-    // fetch opcode and addressing mode
-    Instruction i;
-    Instruction* instr_ptr = &i;
-    cpu_fetch_instruction(cpu_6502_ptr, m_ptr, cpu_6502_ptr->PC, instr_ptr);
+    Runner_job_t* added = &runner->jobs[runner->count++];
+    *added = *job;
+    if(added->name == NULL) {
+        added->name = (added->program != NULL) ? added->program : added->rom;
+    }
+    return 0;
+}
+
+/**
+ * add the jobs of a job file
+ * @param contents set to the contents of the file, which the jobs point into
+ * @return 0 on success, -1 if it could not be read or a line is malformed
+ */
+static int read_jobs(Runner_t* runner, size_t* capacity, const Runner_job_t* defaults, const char* path, char** contents) {
+    FILE* in = fopen(path, "rb");
+    char* text = NULL;
+    long size = -1;
 
-    puts("Fetched instruction from memory\n");
-    printf("%s, %s\n", cpu_opcode_to_str(instr_ptr->opcode), cpu_addressing_mode_to_str(instr_ptr->addr_mode));
+    if(in == NULL) {
+        perror(path);
+        return -1;
+    }
+    if(fseek(in, 0, SEEK_END) == 0) {
+        size = ftell(in);
+    }
+    if( (size >= 0) && (fseek(in, 0, SEEK_SET) == 0) && ((text = (char*) malloc((size_t) size + 1)) != NULL) ) {
+        size = (fread(text, 1, (size_t) size, in) == (size_t) size) ? size : -1;
+    }
+    fclose(in);
+    if( (text == NULL) || (size < 0) ) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        free(text);
+        return -1;
+    }
+    text[size] = '\0';
+    *contents = text;
 
+    char* line = text;
+    for(unsigned line_number = 1; line != NULL; line_number++) {
+        char* next = strchr(line, '\n');
+        char* save;
 
+        if(next != NULL) {
+            *next++ = '\0';
+        }
+
+        char* token = strtok_r(line, " \t\r", &save);
+        line = next;
+        if( (token == NULL) || (token[0] == '#') ) {
+            continue;
+        }
+
+        Runner_job_t job = *defaults;
+        int ok = 1;
+        for(; ok && (token != NULL); token = strtok_r(NULL, " \t\r", &save)) {
+            if( (token[0] == '-') && (token[1] != '\0') && (token[2] == '\0') ) {
+                const char* value = strtok_r(NULL, " \t\r", &save);
+                ok = (value != NULL) && (job_option(&job, token[1], value) == 0);
+            } else {
+                ok = (job.program == NULL);
+                job.program = token;
+            }
+        }
+        if( !ok || ((job.program == NULL) && (job.rom == NULL)) ) {
+            fprintf(stderr, "%s:%u: malformed job\n", path, line_number);
+            return -1;
+        }
+        if(add_job(runner, capacity, &job) != 0) {
+            perror(path);
+            return -1;
+        }
+    }
     return 0;
 }
+
+/* a string in JSON, NULL as null */
+static void json_string(FILE* out, const char* s) {
+    if(s == NULL) {
+        fputs("null", out);
+        return;
+    }
+    fputc('"', out);
+    for(; *s != '\0'; s++) {
+        const unsigned char c = (unsigned char) *s;
+
+        if( (c == '"') || (c == '\\') ) {
+            fprintf(out, "\\%c", c);
+        } else if(c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* a field of CSV, quoted when it has to be */
+static void csv_field(FILE* out, const char* s) {
+    if(s == NULL) {
+        return;
+    }
+    if(strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, out);
+        return;
+    }
+    fputc('"', out);
+    for(; *s != '\0'; s++) {
+        if(*s == '"') {
+            fputc('"', out);
+        }
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static double mhz(const Runner_job_t* job) {
+    return (job->seconds > 0) ? (double) job->cycles_run / job->seconds * 1e-6 : 0.0;
+}
+
+static void print_table(FILE* out, const Runner_t* runner) {
+    fprintf(out, "%-24s %-6s %4s %2s %2s %2s %2s %2s %12s %12s %10s\n",
+            "job", "stop", "PC", "A", "X", "Y", "SP", "SR", "cycles", "instructions", "MHz");
+    for(size_t i = 0; i < runner->count; i++) {
+        const Runner_job_t* job = &runner->jobs[i];
+
+        if(job->stop == RUNNER_ERROR) {
+            fprintf(out, "%-24s %-6s\n", job->name, runner_stop_to_str(job->stop));
+            continue;
+        }
+        fprintf(out, "%-24s %-6s %04X %02X %02X %02X %02X %02X %12llu ", job->name, runner_stop_to_str(job->stop),
+                job->PC, job->AC, job->X, job->Y, job->SP, job->SR, (unsigned long long) job->cycles_run);
+        if(job->stepped) {
+            fprintf(out, "%12llu ", (unsigned long long) job->instructions_run);
+        } else {
+            fprintf(out, "%12s ", "-");
+        }
+        fprintf(out, "%10.1f\n", mhz(job));
+    }
+}
+
+static void write_json(FILE* out, const Runner_t* runner, const char* engine) {
+    fprintf(out, "{\n  \"variant\": \"%s\",\n  \"engine\": \"%s\",\n  \"jobs\": [", cpu_variant_to_str(runner->variant), engine);
+    for(size_t i = 0; i < runner->count; i++) {
+        const Runner_job_t* job = &runner->jobs[i];
+
+        fprintf(out, "%s\n    { \"name\": ", (i == 0) ? "" : ",");
+        json_string(out, job->name);
+        fputs(", \"program\": ", out);
+        json_string(out, job->program);
+        fputs(", \"rom\": ", out);
+        json_string(out, job->rom);
+        fprintf(out, ", \"stop\": \"%s\", ", runner_stop_to_str(job->stop));
+        if(job->stop == RUNNER_ERROR) {
+            fputs("\"pc\": null, \"a\": null, \"x\": null, \"y\": null, \"sp\": null, \"sr\": null, \"cycles\": null, "
+                  "\"instructions\": null, \"seconds\": null, \"mhz\": null }", out);
+            continue;
+        }
+        fprintf(out, "\"pc\": %u, \"a\": %u, \"x\": %u, \"y\": %u, \"sp\": %u, \"sr\": %u, \"cycles\": %llu, ",
+                job->PC, job->AC, job->X, job->Y, job->SP, job->SR, (unsigned long long) job->cycles_run);
+        if(job->stepped) {
+            fprintf(out, "\"instructions\": %llu, ", (unsigned long long) job->instructions_run);
+        } else {
+            fputs("\"instructions\": null, ", out);
+        }
+        fprintf(out, "\"seconds\": %.6f, \"mhz\": %.3f }", job->seconds, mhz(job));
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void write_csv(FILE* out, const Runner_t* runner, const char* engine) {
+    fprintf(out, "variant,engine,name,program,rom,stop,pc,a,x,y,sp,sr,cycles,instructions,seconds,mhz\n");
+    for(size_t i = 0; i < runner->count; i++) {
+        const Runner_job_t* job = &runner->jobs[i];
+
+        fprintf(out, "%s,%s,", cpu_variant_to_str(runner->variant), engine);
+        csv_field(out, job->name);
+        fputc(',', out);
+        csv_field(out, job->program);
+        fputc(',', out);
+        csv_field(out, job->rom);
+        fprintf(out, ",%s,", runner_stop_to_str(job->stop));
+        if(job->stop == RUNNER_ERROR) {
+            fputs(",,,,,,,,,\n", out);
+            continue;
+        }
+        fprintf(out, "%u,%u,%u,%u,%u,%u,%llu,", job->PC, job->AC, job->X, job->Y, job->SP, job->SR,
+                (unsigned long long) job->cycles_run);
+        if(job->stepped) {
+            fprintf(out, "%llu", (unsigned long long) job->instructions_run);
+        }
+        fprintf(out, ",%.6f,%.3f\n", job->seconds, mhz(job));
+    }
+}
+
+static int write_file(const char* path, void (*writer)(FILE*, const Runner_t*, const char*),
+                      const Runner_t* runner, const char* engine) {
+    if(strcmp(path, "-") == 0) {
+        writer(stdout, runner, engine);
+        return fflush(stdout);
+    }
+
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        perror(path);
+        return -1;
+    }
+    writer(out, runner, engine);
+    return fclose(out);
+}
+
+/**
+ * run the jobs and report on them
+ * @return exit status
+ */
+static int report(Runner_t* runner, Engine engine, const char* json, const char* csv) {
+    long failed = runner_run(runner);
+    if(failed < 0) {
+        perror("main");
+        return 1;
+    }
+    for(size_t j = 0; j < runner->count; j++) {
+        if(runner->jobs[j].stop == RUNNER_ERROR) {
+            fprintf(stderr, "%s: could not be run\n", runner->jobs[j].name);
+        }
+    }
+
+    const int quiet = ((json != NULL) && (strcmp(json, "-") == 0)) || ((csv != NULL) && (strcmp(csv, "-") == 0));
+    if(!quiet) {
+        print_table(stdout, runner);
+    }
+    if( (json != NULL) && (write_file(json, write_json, runner, engine_names[engine]) != 0) ) {
+        return 1;
+    }
+    if( (csv != NULL) && (write_file(csv, write_csv, runner, engine_names[engine]) != 0) ) {
+        return 1;
+    }
+    return failed != 0;
+}
+
+int main(int argc, char** argv) {
+    Runner_t runner = { NULL, 0, CPU_DEFAULT_VARIANT, 0, 1, 1 };
+    Runner_job_t defaults;
+    size_t capacity = 0;
+    Engine engine = ENGINE_JIT;
+    const char* job_file = NULL;
+    const char* json = NULL;
+    const char* csv = NULL;
+    char* job_text = NULL;
+    int status = 0;
+    int i = 1;
+
+    memset(&defaults, 0, sizeof(defaults));
+    defaults.address = RUNNER_ADDRESS;
+    defaults.reset = -1;
+    defaults.cycles = RUN_CYCLES;
+
+    for(; (i < argc) && (argv[i][0] == '-'); i += 2) {
+        const char* option = argv[i];
+
+        if( (option[1] == '\0') || (option[2] != '\0') || (i + 1 >= argc) ) {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[i + 1];
+
+        switch(option[1]) {
+            case 'v':
+                if(strcmp(value, "nmos") == 0) {
+                    runner.variant = CPU_NMOS;
+                } else if(strcmp(value, "cmos") == 0) {
+                    runner.variant = CPU_65C02;
+                } else if(strcmp(value, "wdc") == 0) {
+                    runner.variant = CPU_W65C02S;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'e':
+                if(strcmp(value, "interpreter") == 0) {
+                    engine = ENGINE_INTERPRETER;
+                } else if(strcmp(value, "blocks") == 0) {
+                    engine = ENGINE_BLOCKS;
+                } else if(strcmp(value, "jit") == 0) {
+                    engine = ENGINE_JIT;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                runner.blocks = (engine != ENGINE_INTERPRETER);
+                runner.jit = (engine == ENGINE_JIT);
+                break;
+            case 't': runner.threads = (unsigned) strtoul(value, NULL, 0); break;
+            case 'f': job_file = value; break;
+            case 'j': json = value; break;
+            case 'o': csv = value; break;
+            default:
+                if(job_option(&defaults, option[1], value) != 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+        }
+    }
+
+    for(; i < argc; i++) {
+        Runner_job_t job = defaults;
+
+        job.program = argv[i];
+        if(add_job(&runner, &capacity, &job) != 0) {
+            perror(argv[0]);
+            status = 1;
+            break;
+        }
+    }
+    if( (status == 0) && (job_file != NULL) && (read_jobs(&runner, &capacity, &defaults, job_file, &job_text) != 0) ) {
+        status = 2;
+    }
+    if( (status == 0) && (runner.count == 0) && (defaults.rom != NULL) && (job_file == NULL) &&
+        (add_job(&runner, &capacity, &defaults) != 0) ) {
+        perror(argv[0]);
+        status = 1;
+    }
+    if( (status == 0) && (runner.count == 0) ) {
+        usage(argv[0]);
+        status = 2;
+    }
+    if(status == 0) {
+        status = report(&runner, engine, json, csv);
+    }
+
+    free(runner.jobs);
+    free(job_text);
+    return status;
+}
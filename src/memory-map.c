@@ -13,24 +13,302 @@
 #include <stdint.h>
 #include <string.h>
 #include "memory-map.h"
-
-
-uint8_t HI_BYTE_MASK = 0xF0;                ///< for extracting the high byte
-uint8_t LO_BYTE_MASK = 0x0F;                ///< for extracting the low byte
+#include "block-cache.h"
 
 
 /**
  * create a memory area and initialize it to 0
+ * the area is one byte per address and starts on a cache line boundary
  * @param m memory struct
  * @return pointer to the memory area
  */
-uint16_t* memory_initialize(Memory_type_t* m) {
+uint8_t* memory_initialize(Memory_type_t* m) {
     m->size = MEMORY_SIZE;
-    uint16_t* mem_ptr = (uint16_t*) malloc(m->size);
+    uint8_t* mem_ptr = (uint8_t*) aligned_alloc(MEMORY_ALIGNMENT, m->size);
 
     if(mem_ptr != NULL) {
         memset(mem_ptr, 0, m->size);
     }
 
+    m->data = mem_ptr;
+    m->blocks = NULL;
+    memset(m->code_page, 0, sizeof(m->code_page));
+    memset(m->shared_page, 0, sizeof(m->shared_page));
+    memset(m->dirty, 0, sizeof(m->dirty));
+    memset(m->hook, 0, sizeof(m->hook));
+    memset(m->hooked_read, 0, sizeof(m->hooked_read));
+    memset(m->hooked_write, 0, sizeof(m->hooked_write));
+    memory_unmap(m, 0, MEMORY_PAGES);
+
     return mem_ptr;
-}
\ No newline at end of file
+}
+
+/**
+ * free the memory area
+ * @param m memory struct
+ */
+void memory_free(Memory_type_t* m) {
+    free(m->data);
+    m->data = NULL;
+
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        m->read_page[page] = NULL;
+        m->write_page[page] = NULL;
+        m->device[page] = NULL;
+        m->code_page[page] = NULL;
+        m->shared_page[page] = NULL;
+        m->hook[page] = NULL;
+        m->hooked_read[page] = NULL;
+        m->hooked_write[page] = NULL;
+    }
+}
+
+/**
+ * number of pages of a range that fit below the end of the address space
+ */
+static unsigned page_count(uint8_t first_page, uint16_t pages) {
+    return (first_page + pages > MEMORY_PAGES) ? (unsigned) (MEMORY_PAGES - first_page) : pages;
+}
+
+/**
+ * cached code in a page is stale once the page is mapped to something else
+ */
+static void page_remap(Memory_type_t* m, unsigned page) {
+    if(m->blocks != NULL) {
+        block_cache_invalidate_page(m->blocks, (uint8_t) page);
+    }
+}
+
+/**
+ * a shared page mapped to something else no longer holds the shared storage, which makes it dirty
+ */
+static void page_unshare(Memory_type_t* m, unsigned page) {
+    if(m->shared_page[page] != NULL) {
+        m->shared_page[page] = NULL;
+        m->dirty[page >> 6] |= (uint64_t) 1 << (page & 63);
+    }
+}
+
+/**
+ * set the storage pointers of a page, behind the hooks when the page is instrumented
+ */
+static void page_set(Memory_type_t* m, unsigned page, const uint8_t* read, uint8_t* write) {
+    if(m->hook[page] != NULL) {
+        m->hooked_read[page] = read;
+        m->hooked_write[page] = write;
+    } else {
+        m->read_page[page] = read;
+        m->write_page[page] = write;
+    }
+}
+
+/**
+ * write pointer of a page, the one behind the hooks when the page is instrumented
+ */
+static uint8_t* page_write(const Memory_type_t* m, unsigned page) {
+    return (m->hook[page] != NULL) ? m->hooked_write[page] : m->write_page[page];
+}
+
+/**
+ * map read/write storage over a range of pages
+ * @param m memory struct
+ * @param first_page first page to map
+ * @param pages number of pages to map
+ * @param storage backing storage, one MEMORY_PAGE_SIZE block per page
+ */
+void memory_map_ram(Memory_type_t* m, uint8_t first_page, uint16_t pages, uint8_t* storage) {
+    unsigned n = page_count(first_page, pages);
+
+    for(unsigned i = 0; i < n; i++) {
+        page_remap(m, first_page + i);
+        page_unshare(m, first_page + i);
+        page_set(m, first_page + i, storage + i * MEMORY_PAGE_SIZE, storage + i * MEMORY_PAGE_SIZE);
+        m->device[first_page + i] = NULL;
+    }
+}
+
+/**
+ * map read only storage over a range of pages
+ * the pages get no write pointer and no device, so the slow path drops writes to them
+ * @param m memory struct
+ * @param first_page first page to map
+ * @param pages number of pages to map
+ * @param storage backing storage, one MEMORY_PAGE_SIZE block per page
+ */
+void memory_map_rom(Memory_type_t* m, uint8_t first_page, uint16_t pages, const uint8_t* storage) {
+    unsigned n = page_count(first_page, pages);
+
+    for(unsigned i = 0; i < n; i++) {
+        page_remap(m, first_page + i);
+        page_unshare(m, first_page + i);
+        page_set(m, first_page + i, storage + i * MEMORY_PAGE_SIZE, NULL);
+        m->device[first_page + i] = NULL;
+    }
+}
+
+/**
+ * route every access to a range of pages through a device
+ * @param m memory struct
+ * @param first_page first page to map
+ * @param pages number of pages to map
+ * @param device read and write handlers
+ */
+void memory_map_device(Memory_type_t* m, uint8_t first_page, uint16_t pages, Memory_device_t* device) {
+    unsigned n = page_count(first_page, pages);
+
+    for(unsigned i = 0; i < n; i++) {
+        page_remap(m, first_page + i);
+        page_unshare(m, first_page + i);
+        page_set(m, first_page + i, NULL, NULL);
+        m->device[first_page + i] = device;
+    }
+}
+
+/**
+ * map a range of pages back to the default RAM
+ * @param m memory struct
+ * @param first_page first page to map
+ * @param pages number of pages to map
+ */
+void memory_unmap(Memory_type_t* m, uint8_t first_page, uint16_t pages) {
+    memory_map_ram(m, first_page, page_count(first_page, pages), m->data + first_page * MEMORY_PAGE_SIZE);
+}
+
+/**
+ * share read only storage over a range of RAM pages, copied into the RAM on the first write
+ * @param m memory struct
+ * @param first_page first page to map
+ * @param pages number of pages to map
+ * @param storage shared storage, one MEMORY_PAGE_SIZE block per page
+ */
+void memory_map_shared(Memory_type_t* m, uint8_t first_page, uint16_t pages, const uint8_t* storage) {
+    unsigned n = page_count(first_page, pages);
+
+    for(unsigned i = 0; i < n; i++) {
+        unsigned page = first_page + i;
+
+        page_remap(m, page);
+        page_set(m, page, storage + i * MEMORY_PAGE_SIZE, NULL);
+        m->device[page] = NULL;
+        m->shared_page[page] = storage + i * MEMORY_PAGE_SIZE;
+        m->dirty[page >> 6] &= ~((uint64_t) 1 << (page & 63));
+    }
+}
+
+/**
+ * first write to a shared page, copy it into its own RAM
+ * a page a block cache has code in gets its RAM as write protected code storage
+ */
+static void page_copy(Memory_type_t* m, unsigned page) {
+    uint8_t* ram = m->data + page * MEMORY_PAGE_SIZE;
+
+    memcpy(ram, m->shared_page[page], MEMORY_PAGE_SIZE);
+    if( (m->blocks != NULL) && (m->blocks->users[page] != 0) ) {
+        m->code_page[page] = ram;
+        page_set(m, page, ram, NULL);
+    } else {
+        page_set(m, page, ram, ram);
+    }
+    m->shared_page[page] = NULL;
+    m->dirty[page >> 6] |= (uint64_t) 1 << (page & 63);
+}
+
+/**
+ * send the accesses to a range of pages through hooks
+ * the code cached in a page is dropped when it is instrumented, and none is cached in it until
+ * the hooks are taken off again
+ * @param m memory struct
+ * @param first_page first page to instrument
+ * @param pages number of pages to instrument
+ * @param hook hooks to call, NULL to give the pages their fast path back
+ */
+void memory_instrument(Memory_type_t* m, uint8_t first_page, uint16_t pages, Memory_hook_t* hook) {
+    unsigned n = page_count(first_page, pages);
+
+    for(unsigned i = 0; i < n; i++) {
+        unsigned page = first_page + i;
+
+        if( (m->hook[page] == NULL) && (hook != NULL) ) {
+            /* dropping the blocks gives a write protected page its write pointer back */
+            page_remap(m, page);
+            m->hooked_read[page] = m->read_page[page];
+            m->hooked_write[page] = m->write_page[page];
+            m->read_page[page] = NULL;
+            m->write_page[page] = NULL;
+        } else if( (m->hook[page] != NULL) && (hook == NULL) ) {
+            m->read_page[page] = m->hooked_read[page];
+            m->write_page[page] = m->hooked_write[page];
+            m->hooked_read[page] = NULL;
+            m->hooked_write[page] = NULL;
+        }
+        m->hook[page] = hook;
+    }
+}
+
+/**
+ * read from a page without backing storage, or from an instrumented page
+ * unmapped reads return the high byte of the address, the last value left on the data bus
+ */
+uint8_t memory_read_slow(Memory_type_t* m, uint16_t address) {
+    const unsigned page = address >> 8;
+    const Memory_hook_t* hook = m->hook[page];
+    const uint8_t* storage = (hook != NULL) ? m->hooked_read[page] : m->read_page[page];
+    Memory_device_t* device = m->device[page];
+    uint8_t value = address >> 8;
+
+    if(storage != NULL) {
+        value = storage[address & 0xFF];
+    } else if( (device != NULL) && (device->read != NULL) ) {
+        value = device->read(device->context, address);
+    }
+
+    if( (hook != NULL) && (hook->read != NULL) ) {
+        hook->read(hook->context, address, value);
+    }
+    return value;
+}
+
+/**
+ * write a byte to the storage or device behind a page
+ * writes to shared RAM copy the page first,
+ * writes to RAM holding cached code go through and drop the code they hit from the cache,
+ * writes to ROM and to read only devices are dropped
+ */
+static void write_through(Memory_type_t* m, uint16_t address, uint8_t value) {
+    const unsigned page = address >> 8;
+    Memory_device_t* device = m->device[page];
+    uint8_t* storage = page_write(m, page);
+
+    if( (storage == NULL) && (m->shared_page[page] != NULL) ) {
+        page_copy(m, page);
+        storage = page_write(m, page);
+    }
+
+    if(storage != NULL) {
+        storage[address & 0xFF] = value;
+    } else if(m->code_page[page] != NULL) {
+        m->code_page[page][address & 0xFF] = value;
+        block_cache_invalidate(m->blocks, address);
+    } else if( (device != NULL) && (device->write != NULL) ) {
+        device->write(device->context, address, value);
+    }
+}
+
+/**
+ * write to a page without writable storage, or to an instrumented page
+ */
+void memory_write_slow(Memory_type_t* m, uint16_t address, uint8_t value) {
+    const Memory_hook_t* hook = m->hook[address >> 8];
+
+    write_through(m, address, value);
+    if( (hook != NULL) && (hook->write != NULL) ) {
+        hook->write(hook->context, address, value);
+    }
+}
+
+/**
+ * write a byte as the CPU would, without calling the hooks of an instrumented page
+ */
+void memory_poke(Memory_type_t* m, uint16_t address, uint8_t value) {
+    write_through(m, address, value);
+}
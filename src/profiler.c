@@ -0,0 +1,436 @@
+/**
+ * @file profiler.c
+ * @brief per instruction profile of the guest program
+ * @author Edwin
+ */
+
+/**
+ * Calling contexts form a tree with one node per routine per caller context, node 0 being the
+ * root. A node is always created after its parent, so its index is higher, which lets the report
+ * add subtrees up in one backward pass. The running instruction's cycles go to the current node
+ * only; what a routine costs with its callees is worked out when the report is written.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "profiler.h"
+#include "utils.h"
+
+#if USE_PROFILER
+
+#define PROFILER_NODES 256                  ///< nodes allocated at first, doubled when they run out
+
+/**
+ * allocate the counters
+ * @param p profiler
+ * @return 0 on success
+ */
+int profiler_initialize(Profiler_t* p) {
+    memset(p, 0, sizeof(*p));
+
+    p->pc_count = (uint64_t*) calloc(MEMORY_SIZE, sizeof(uint64_t));
+    p->pc_cycles = (uint64_t*) calloc(MEMORY_SIZE, sizeof(uint64_t));
+    p->back_edges = (uint64_t*) calloc(MEMORY_SIZE, sizeof(uint64_t));
+    p->back_target = (uint16_t*) calloc(MEMORY_SIZE, sizeof(uint16_t));
+    p->nodes = (Profiler_node_t*) calloc(PROFILER_NODES, sizeof(Profiler_node_t));
+
+    if( (p->pc_count == NULL) || (p->pc_cycles == NULL) || (p->back_edges == NULL) ||
+        (p->back_target == NULL) || (p->nodes == NULL) ) {
+        profiler_free(p);
+        return -1;
+    }
+
+    p->node_capacity = PROFILER_NODES;
+    p->node_count = 1;
+    p->variant = CPU_DEFAULT_VARIANT;
+    return 0;
+}
+
+/**
+ * release the counters
+ * @param p profiler
+ */
+void profiler_free(Profiler_t* p) {
+    free(p->pc_count);
+    free(p->pc_cycles);
+    free(p->back_edges);
+    free(p->back_target);
+    free(p->nodes);
+    memset(p, 0, sizeof(*p));
+}
+
+/**
+ * clear the counters
+ * @param p profiler
+ */
+void profiler_reset(Profiler_t* p) {
+    memset(p->pc_count, 0, MEMORY_SIZE * sizeof(uint64_t));
+    memset(p->pc_cycles, 0, MEMORY_SIZE * sizeof(uint64_t));
+    memset(p->back_edges, 0, MEMORY_SIZE * sizeof(uint64_t));
+    memset(p->back_target, 0, MEMORY_SIZE * sizeof(uint16_t));
+    memset(p->opcode_count, 0, sizeof(p->opcode_count));
+    memset(p->opcode_cycles, 0, sizeof(p->opcode_cycles));
+    memset(p->nodes, 0, p->node_capacity * sizeof(Profiler_node_t));
+    p->instructions = 0;
+    p->cycles = 0;
+    p->node_count = 1;
+    p->node = 0;
+    p->depth = 0;
+}
+
+/**
+ * start profiling a CPU
+ * @param p profiler
+ * @param cpu CPU to profile
+ */
+void profiler_attach(Profiler_t* p, CPU_type_t* cpu) {
+    p->variant = cpu->variant;
+    p->node = 0;
+    p->depth = 0;
+    cpu->profiler = p;
+}
+
+/**
+ * stop profiling a CPU
+ * @param cpu profiled CPU
+ */
+void profiler_detach(CPU_type_t* cpu) {
+    cpu->profiler = NULL;
+}
+
+/* node of a routine called from a context, created on the first call; 0 if out of memory */
+static uint32_t callee(Profiler_t* p, uint32_t parent, uint16_t routine) {
+    uint32_t node;
+
+    for(node = p->nodes[parent].child; node != 0; node = p->nodes[node].sibling) {
+        if(p->nodes[node].routine == routine) {
+            return node;
+        }
+    }
+
+    if(p->node_count == p->node_capacity) {
+        Profiler_node_t* nodes = (Profiler_node_t*) realloc(p->nodes, 2 * p->node_capacity * sizeof(Profiler_node_t));
+        if(nodes == NULL) {
+            return 0;
+        }
+        memset(nodes + p->node_capacity, 0, p->node_capacity * sizeof(Profiler_node_t));
+        p->nodes = nodes;
+        p->node_capacity *= 2;
+    }
+
+    node = p->node_count++;
+    p->nodes[node].routine = routine;
+    p->nodes[node].parent = parent;
+    p->nodes[node].sibling = p->nodes[parent].child;
+    p->nodes[parent].child = node;
+    return node;
+}
+
+static void enter(Profiler_t* p, uint16_t routine, uint8_t sp) {
+    if(p->depth == PROFILER_MAX_DEPTH) {
+        return;
+    }
+
+    uint32_t node = callee(p, p->node, routine);
+    if(node == 0) {
+        return;
+    }
+
+    p->nodes[node].calls++;
+    p->stack[p->depth++] = (Profiler_frame_t) { node, sp };
+    p->node = node;
+}
+
+/*
+ * the RTS returned from every frame whose return address is now above SP: the one it was paired
+ * with, and any the program dropped by moving SP. An RTS used as a jump leaves SP below the
+ * frame it runs in and pops nothing
+ */
+static void leave(Profiler_t* p, uint8_t sp) {
+    while( (p->depth > 0) && (p->stack[p->depth - 1].sp + 2 <= sp) ) {
+        p->depth--;
+    }
+    p->node = (p->depth > 0) ? p->stack[p->depth - 1].node : 0;
+}
+
+/**
+ * count one instruction
+ * @param p profiler
+ * @param cpu CPU after the instruction
+ * @param pc address of the opcode
+ * @param opcode opcode byte
+ * @param cycles cycles the instruction took
+ */
+void profiler_record(Profiler_t* p, const CPU_type_t* cpu, uint16_t pc, uint8_t opcode, uint32_t cycles) {
+    const Instruction* ins = &cpu_instructions[p->variant][opcode];
+
+    p->pc_count[pc]++;
+    p->pc_cycles[pc] += cycles;
+    p->opcode_count[opcode]++;
+    p->opcode_cycles[opcode] += cycles;
+    p->instructions++;
+    p->cycles += cycles;
+    p->nodes[p->node].cycles += cycles;
+
+    switch(ins->opcode) {
+        case JSR:
+            enter(p, cpu->PC, cpu->SP);
+            break;
+        case RTS:
+            leave(p, cpu->SP);
+            break;
+        default:
+            if( (cpu->PC <= pc) &&
+                ( (ins->addr_mode == PC_REL) || (ins->addr_mode == ZPG_PC_REL) || (ins->opcode == JMP) ) ) {
+                p->back_edges[pc]++;
+                p->back_target[pc] = cpu->PC;
+            }
+            break;
+    }
+}
+
+/*
+ * report
+ */
+
+typedef struct profiler_loop {
+    uint16_t branch;
+    uint16_t target;
+    uint64_t iterations;
+    uint64_t cycles;                        ///< cycles of the instructions from target to branch
+} Profiler_loop_t;
+
+static int loop_order(const void* a, const void* b) {
+    const Profiler_loop_t* x = (const Profiler_loop_t*) a;
+    const Profiler_loop_t* y = (const Profiler_loop_t*) b;
+    return (x->cycles < y->cycles) - (x->cycles > y->cycles);
+}
+
+/* a routine that calls itself counts its cycles with callees once, at its outermost call */
+static int recursive(const Profiler_t* p, uint32_t node) {
+    uint16_t routine = p->nodes[node].routine;
+
+    for(node = p->nodes[node].parent; node != 0; node = p->nodes[node].parent) {
+        if(p->nodes[node].routine == routine) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void write_subroutines(const Profiler_t* p, FILE* out) {
+    uint64_t* total = (uint64_t*) calloc(p->node_count, sizeof(uint64_t));
+    uint64_t* calls = (uint64_t*) calloc(MEMORY_SIZE, sizeof(uint64_t));
+    uint64_t* self = (uint64_t*) calloc(MEMORY_SIZE, sizeof(uint64_t));
+    uint64_t* inclusive = (uint64_t*) calloc(MEMORY_SIZE, sizeof(uint64_t));
+    const char* separator = "";
+
+    fputs("  \"subroutines\": [", out);
+
+    if( (total != NULL) && (calls != NULL) && (self != NULL) && (inclusive != NULL) ) {
+        for(uint32_t node = p->node_count - 1; node > 0; node--) {
+            const Profiler_node_t* n = &p->nodes[node];
+            total[node] += n->cycles;
+            total[n->parent] += total[node];
+            calls[n->routine] += n->calls;
+            self[n->routine] += n->cycles;
+            if(!recursive(p, node)) {
+                inclusive[n->routine] += total[node];
+            }
+        }
+
+        for(uint32_t address = 0; address < MEMORY_SIZE; address++) {
+            if(calls[address] != 0) {
+                fprintf(out, "%s\n    { \"address\": %u, \"calls\": %llu, \"cycles\": %llu, \"self\": %llu }",
+                        separator, (unsigned) address, (unsigned long long) calls[address],
+                        (unsigned long long) inclusive[address], (unsigned long long) self[address]);
+                separator = ",";
+            }
+        }
+    }
+
+    fputs("\n  ],\n", out);
+    free(total);
+    free(calls);
+    free(self);
+    free(inclusive);
+}
+
+static void write_loops(const Profiler_t* p, FILE* out) {
+    size_t count = 0;
+
+    for(uint32_t address = 0; address < MEMORY_SIZE; address++) {
+        count += (p->back_edges[address] != 0);
+    }
+
+    Profiler_loop_t* loops = (Profiler_loop_t*) calloc(count + 1, sizeof(Profiler_loop_t));
+    const char* separator = "";
+
+    fputs("  \"loops\": [", out);
+
+    if(loops != NULL) {
+        count = 0;
+        for(uint32_t address = 0; address < MEMORY_SIZE; address++) {
+            if(p->back_edges[address] != 0) {
+                Profiler_loop_t* loop = &loops[count++];
+                loop->branch = (uint16_t) address;
+                loop->target = p->back_target[address];
+                loop->iterations = p->back_edges[address];
+                for(uint32_t pc = loop->target; pc <= address; pc++) {
+                    loop->cycles += p->pc_cycles[pc];
+                }
+            }
+        }
+
+        qsort(loops, count, sizeof(Profiler_loop_t), loop_order);
+
+        for(size_t i = 0; i < count; i++) {
+            fprintf(out, "%s\n    { \"branch\": %u, \"target\": %u, \"iterations\": %llu, \"cycles\": %llu }",
+                    separator, loops[i].branch, loops[i].target,
+                    (unsigned long long) loops[i].iterations, (unsigned long long) loops[i].cycles);
+            separator = ",";
+        }
+    }
+
+    fputs("\n  ]\n", out);
+    free(loops);
+}
+
+/**
+ * write the profile as JSON
+ * addresses are numbers, mnemonics and addressing modes are the strings of utils.h
+ * @param p profiler
+ * @param out stream to write to
+ * @return 0 on success
+ */
+int profiler_write_json(const Profiler_t* p, FILE* out) {
+    const Instruction* instructions = cpu_instructions[p->variant];
+    uint64_t mode_count[INV + 1] = { 0 };
+    uint64_t mode_cycles[INV + 1] = { 0 };
+    const char* separator = "";
+
+    fprintf(out, "{\n  \"variant\": \"%s\",\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n",
+            cpu_variant_to_str(p->variant), (unsigned long long) p->instructions, (unsigned long long) p->cycles);
+
+    fputs("  \"opcodes\": [", out);
+    for(unsigned opcode = 0; opcode < 256; opcode++) {
+        if(p->opcode_count[opcode] != 0) {
+            const Instruction* ins = &instructions[opcode];
+            fprintf(out, "%s\n    { \"opcode\": %u, \"mnemonic\": \"%s\", \"mode\": \"%s\", \"count\": %llu, \"cycles\": %llu }",
+                    separator, opcode, cpu_opcode_to_str(ins->opcode), cpu_addressing_mode_to_str(ins->addr_mode),
+                    (unsigned long long) p->opcode_count[opcode], (unsigned long long) p->opcode_cycles[opcode]);
+            separator = ",";
+            mode_count[ins->addr_mode] += p->opcode_count[opcode];
+            mode_cycles[ins->addr_mode] += p->opcode_cycles[opcode];
+        }
+    }
+    fputs("\n  ],\n", out);
+
+    separator = "";
+    fputs("  \"modes\": [", out);
+    for(unsigned mode = 0; mode <= INV; mode++) {
+        if(mode_count[mode] != 0) {
+            fprintf(out, "%s\n    { \"mode\": \"%s\", \"count\": %llu, \"cycles\": %llu }",
+                    separator, cpu_addressing_mode_to_str((Addressing_mode) mode),
+                    (unsigned long long) mode_count[mode], (unsigned long long) mode_cycles[mode]);
+            separator = ",";
+        }
+    }
+    fputs("\n  ],\n", out);
+
+    separator = "";
+    fputs("  \"pcs\": [", out);
+    for(uint32_t address = 0; address < MEMORY_SIZE; address++) {
+        if(p->pc_count[address] != 0) {
+            fprintf(out, "%s\n    { \"pc\": %u, \"count\": %llu, \"cycles\": %llu }",
+                    separator, (unsigned) address, (unsigned long long) p->pc_count[address],
+                    (unsigned long long) p->pc_cycles[address]);
+            separator = ",";
+        }
+    }
+    fputs("\n  ],\n", out);
+
+    write_subroutines(p, out);
+    write_loops(p, out);
+    fputs("}\n", out);
+
+    return ferror(out) ? -1 : 0;
+}
+
+/**
+ * write the cycles of every calling context as collapsed stacks, root first
+ * @param p profiler
+ * @param out stream to write to
+ * @return 0 on success
+ */
+int profiler_write_collapsed(const Profiler_t* p, FILE* out) {
+    uint16_t path[PROFILER_MAX_DEPTH];
+
+    for(uint32_t node = 0; node < p->node_count; node++) {
+        if(p->nodes[node].cycles == 0) {
+            continue;
+        }
+
+        size_t depth = 0;
+        for(uint32_t n = node; (n != 0) && (depth < PROFILER_MAX_DEPTH); n = p->nodes[n].parent) {
+            path[depth++] = p->nodes[n].routine;
+        }
+
+        fputs("top", out);
+        while(depth > 0) {
+            fprintf(out, ";$%04X", path[--depth]);
+        }
+        fprintf(out, " %llu\n", (unsigned long long) p->nodes[node].cycles);
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+#else
+
+/* profiling is compiled out, the CPU has nowhere to hang a profiler */
+
+int profiler_initialize(Profiler_t* p) {
+    memset(p, 0, sizeof(*p));
+    return -1;
+}
+
+void profiler_free(Profiler_t* p) {
+    (void) p;
+}
+
+void profiler_reset(Profiler_t* p) {
+    (void) p;
+}
+
+void profiler_attach(Profiler_t* p, CPU_type_t* cpu) {
+    (void) p;
+    (void) cpu;
+}
+
+void profiler_detach(CPU_type_t* cpu) {
+    (void) cpu;
+}
+
+void profiler_record(Profiler_t* p, const CPU_type_t* cpu, uint16_t pc, uint8_t opcode, uint32_t cycles) {
+    (void) p;
+    (void) cpu;
+    (void) pc;
+    (void) opcode;
+    (void) cycles;
+}
+
+int profiler_write_json(const Profiler_t* p, FILE* out) {
+    (void) p;
+    (void) out;
+    return -1;
+}
+
+int profiler_write_collapsed(const Profiler_t* p, FILE* out) {
+    (void) p;
+    (void) out;
+    return -1;
+}
+
+#endif
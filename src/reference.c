@@ -0,0 +1,554 @@
+/**
+ * @file reference.c
+ * @brief plain instruction stepper with eager flags, the yardstick the cores are checked against
+ * @author Edwin
+ */
+
+/**
+ * Written to be read rather than to be fast: one switch over the mnemonic, the operand address
+ * worked out from memory every time, and SR updated bit by bit. Binary SBC is ADC of the
+ * complemented operand, as in the chip, rather than a subtraction of its own.
+ */
+
+#include "reference.h"
+#include "decimal.h"
+#include "scheduler.h"
+
+#define STACK 0x0100                        ///< page of the stack
+#define NMI_VECTOR 0xFFFA
+#define IRQ_VECTOR 0xFFFE
+#define INTERRUPT_CYCLES 7                  ///< length of the IRQ and NMI sequences
+
+/*
+ * status register
+ */
+
+static void flag(CPU_type_t* cpu, uint8_t mask, int on) {
+    if(on) {
+        cpu->SR |= mask;
+    } else {
+        cpu->SR &= (uint8_t) ~mask;
+    }
+}
+
+static int is_set(const CPU_type_t* cpu, uint8_t mask) {
+    return (cpu->SR & mask) != 0;
+}
+
+static void set_nz(CPU_type_t* cpu, uint8_t value) {
+    flag(cpu, N_MASK, value & 0x80);
+    flag(cpu, Z_MASK, value == 0);
+}
+
+/* as interrupt_poll: a CPU that lets an asserted line through takes it before its next instruction */
+static void poll(CPU_type_t* cpu) {
+    if( (cpu->state == CPU_RUNNING) && (cpu->nmi || ( (cpu->irq != 0) && !is_set(cpu, I_MASK) )) ) {
+        cpu->state = CPU_PENDING;
+    }
+}
+
+/*
+ * memory
+ */
+
+static uint8_t next_byte(CPU_type_t* cpu, Memory_type_t* mem) {
+    return mem_read8(mem, cpu->PC++);
+}
+
+static uint16_t next_word(CPU_type_t* cpu, Memory_type_t* mem) {
+    const uint8_t low = next_byte(cpu, mem);
+    return (uint16_t) (low | (next_byte(cpu, mem) << 8));
+}
+
+static uint16_t read_word(Memory_type_t* mem, uint16_t address) {
+    return (uint16_t) (mem_read8(mem, address) | (mem_read8(mem, (uint16_t) (address + 1)) << 8));
+}
+
+/* a pointer in zero page wraps around within zero page */
+static uint16_t zero_page_word(Memory_type_t* mem, uint8_t address) {
+    return (uint16_t) (mem_read8(mem, address) | (mem_read8(mem, (uint8_t) (address + 1)) << 8));
+}
+
+static void push(CPU_type_t* cpu, Memory_type_t* mem, uint8_t value) {
+    mem_write8(mem, STACK | cpu->SP, value);
+    cpu->SP--;
+}
+
+static uint8_t pull(CPU_type_t* cpu, Memory_type_t* mem) {
+    cpu->SP++;
+    return mem_read8(mem, STACK | cpu->SP);
+}
+
+/*
+ * operand address of a mode, PC is left on the next instruction
+ * crossed tells whether an index carried into the high byte; implied, accumulator and stack
+ * modes have no operand and give 0
+ */
+static uint16_t effective_address(CPU_type_t* cpu, Memory_type_t* mem, Addressing_mode mode, int* crossed) {
+    uint16_t base;
+    uint16_t address;
+
+    *crossed = 0;
+    switch(mode) {
+        case IMM:
+            return cpu->PC++;
+        case ZPG:
+            return next_byte(cpu, mem);
+        case ZPG_INDX_X:
+            return (uint8_t) (next_byte(cpu, mem) + cpu->X);
+        case ZPG_INDX_Y:
+            return (uint8_t) (next_byte(cpu, mem) + cpu->Y);
+        case ZPG_IND:
+            return zero_page_word(mem, next_byte(cpu, mem));
+        case ZPG_INDX_IND:
+            return zero_page_word(mem, (uint8_t) (next_byte(cpu, mem) + cpu->X));
+        case ZPG_IND_INDX_Y:
+            base = zero_page_word(mem, next_byte(cpu, mem));
+            address = (uint16_t) (base + cpu->Y);
+            *crossed = (base >> 8) != (address >> 8);
+            return address;
+        case ABS_A:
+            return next_word(cpu, mem);
+        case ABS_INDX_X:
+        case ABS_INDX_Y:
+            base = next_word(cpu, mem);
+            address = (uint16_t) (base + ((mode == ABS_INDX_X) ? cpu->X : cpu->Y));
+            *crossed = (base >> 8) != (address >> 8);
+            return address;
+        case ABS_IND:
+            return read_word(mem, next_word(cpu, mem));
+        case ABS_INDX_IND:
+            return read_word(mem, (uint16_t) (next_word(cpu, mem) + cpu->X));
+        default:
+            return 0;
+    }
+}
+
+/* address of a store or read-modify-write, which never pays for a page crossing */
+static uint16_t target(CPU_type_t* cpu, Memory_type_t* mem, Addressing_mode mode) {
+    int crossed;
+    return effective_address(cpu, mem, mode, &crossed);
+}
+
+/* operand of a read, one cycle more when indexing crossed a page */
+static uint8_t load(CPU_type_t* cpu, Memory_type_t* mem, Addressing_mode mode) {
+    int crossed;
+    const uint16_t address = effective_address(cpu, mem, mode, &crossed);
+
+    cpu->cycles += (uint64_t) crossed;
+    return mem_read8(mem, address);
+}
+
+/*
+ * arithmetic
+ */
+
+static void add(CPU_type_t* cpu, uint8_t value, CPU_variant variant) {
+    const unsigned carry = is_set(cpu, C_MASK);
+
+    if(is_set(cpu, D_MASK)) {
+        const Decimal_result_t r = decimal_reference_adc(cpu->AC, value, carry,
+                                                         (variant == CPU_NMOS) ? DECIMAL_NMOS : DECIMAL_CMOS);
+        cpu->AC = r.value;
+        cpu->SR = (uint8_t) ((cpu->SR & ~(N_MASK | V_MASK | Z_MASK | C_MASK)) | r.flags);
+        cpu->cycles += (variant != CPU_NMOS);
+        return;
+    }
+
+    const int sum = cpu->AC + value + (int) carry;
+    const int signed_sum = (int8_t) cpu->AC + (int8_t) value + (int) carry;
+
+    flag(cpu, C_MASK, sum > 0xFF);
+    flag(cpu, V_MASK, (signed_sum < -128) || (signed_sum > 127));
+    cpu->AC = (uint8_t) sum;
+    set_nz(cpu, cpu->AC);
+}
+
+static void subtract(CPU_type_t* cpu, uint8_t value, CPU_variant variant) {
+    if(is_set(cpu, D_MASK)) {
+        const Decimal_result_t r = decimal_reference_sbc(cpu->AC, value, is_set(cpu, C_MASK),
+                                                         (variant == CPU_NMOS) ? DECIMAL_NMOS : DECIMAL_CMOS);
+        cpu->AC = r.value;
+        cpu->SR = (uint8_t) ((cpu->SR & ~(N_MASK | V_MASK | Z_MASK | C_MASK)) | r.flags);
+        cpu->cycles += (variant != CPU_NMOS);
+        return;
+    }
+
+    add(cpu, (uint8_t) ~value, variant);
+}
+
+static void compare(CPU_type_t* cpu, uint8_t reg, uint8_t value) {
+    flag(cpu, C_MASK, reg >= value);
+    set_nz(cpu, (uint8_t) (reg - value));
+}
+
+/* the shift, rotate, increment or decrement an instruction does to its operand */
+static uint8_t modify(CPU_type_t* cpu, Opcode opcode, uint8_t value) {
+    const uint8_t carry = is_set(cpu, C_MASK);
+    uint8_t result;
+
+    switch(opcode) {
+        case ASL: case SLO:
+            result = (uint8_t) (value << 1);
+            flag(cpu, C_MASK, value & 0x80);
+            break;
+        case LSR: case SRE:
+            result = value >> 1;
+            flag(cpu, C_MASK, value & 0x01);
+            break;
+        case ROL: case RLA:
+            result = (uint8_t) ((value << 1) | carry);
+            flag(cpu, C_MASK, value & 0x80);
+            break;
+        case ROR: case RRA:
+            result = (uint8_t) ((value >> 1) | (carry << 7));
+            flag(cpu, C_MASK, value & 0x01);
+            break;
+        case INC: case ISC:
+            result = (uint8_t) (value + 1);
+            break;
+        default:
+            /* DEC and DCP */
+            result = (uint8_t) (value - 1);
+            break;
+    }
+    set_nz(cpu, result);
+
+    return result;
+}
+
+/* read-modify-write of memory, the new value is returned for the combined undocumented opcodes */
+static uint8_t modify_memory(CPU_type_t* cpu, Memory_type_t* mem, Opcode opcode, Addressing_mode mode, int page_penalty) {
+    int crossed;
+    const uint16_t address = effective_address(cpu, mem, mode, &crossed);
+    const uint8_t value = modify(cpu, opcode, mem_read8(mem, address));
+
+    if(page_penalty) {
+        cpu->cycles += (uint64_t) crossed;
+    }
+    mem_write8(mem, address, value);
+
+    return value;
+}
+
+/*
+ * control flow
+ */
+
+static void branch(CPU_type_t* cpu, int8_t offset, int taken) {
+    if(!taken) {
+        return;
+    }
+
+    const uint16_t destination = (uint16_t) (cpu->PC + offset);
+    cpu->cycles += ((destination >> 8) == (cpu->PC >> 8)) ? 1 : 2;
+    cpu->PC = destination;
+}
+
+static int condition(const CPU_type_t* cpu, Opcode opcode) {
+    switch(opcode) {
+        case BPL: return !is_set(cpu, N_MASK);
+        case BMI: return is_set(cpu, N_MASK);
+        case BVC: return !is_set(cpu, V_MASK);
+        case BVS: return is_set(cpu, V_MASK);
+        case BCC: return !is_set(cpu, C_MASK);
+        case BCS: return is_set(cpu, C_MASK);
+        case BNE: return !is_set(cpu, Z_MASK);
+        case BEQ: return is_set(cpu, Z_MASK);
+        default: return 1;
+    }
+}
+
+/* push PC and the status, mask IRQs and jump through a vector, for BRK and the interrupts */
+static void enter(CPU_type_t* cpu, Memory_type_t* mem, uint16_t vector, uint8_t status) {
+    push(cpu, mem, (uint8_t) (cpu->PC >> 8));
+    push(cpu, mem, (uint8_t) cpu->PC);
+    push(cpu, mem, status);
+    flag(cpu, I_MASK, 1);
+    if(cpu->variant != CPU_NMOS) {
+        flag(cpu, D_MASK, 0);
+    }
+    cpu->PC = read_word(mem, vector);
+}
+
+/* the unstable NMOS stores: the value is ANDed with the high byte of the base plus one, which
+ * also becomes the high byte of the address when the index crosses a page */
+static void unstable_store(CPU_type_t* cpu, Memory_type_t* mem, Addressing_mode mode, uint8_t value) {
+    const uint16_t base = (mode == ZPG_IND_INDX_Y) ? zero_page_word(mem, next_byte(cpu, mem)) : next_word(cpu, mem);
+    uint16_t address = (uint16_t) (base + ((mode == ABS_INDX_X) ? cpu->X : cpu->Y));
+
+    value &= (uint8_t) ((base >> 8) + 1);
+    if((base >> 8) != (address >> 8)) {
+        address = (uint16_t) ((value << 8) | (address & 0xFF));
+    }
+    mem_write8(mem, address, value);
+}
+
+/*
+ * instructions
+ */
+
+static void execute(CPU_type_t* cpu, Memory_type_t* mem) {
+    const uint16_t at = cpu->PC;
+    const CPU_variant variant = cpu->variant;
+    const Instruction ins = cpu_instructions[variant][next_byte(cpu, mem)];
+    const Addressing_mode mode = ins.addr_mode;
+    uint8_t value;
+    uint16_t address;
+
+    switch(ins.opcode) {
+        case LDA: cpu->AC = load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case LDX: cpu->X = load(cpu, mem, mode); set_nz(cpu, cpu->X); break;
+        case LDY: cpu->Y = load(cpu, mem, mode); set_nz(cpu, cpu->Y); break;
+        case STA: mem_write8(mem, target(cpu, mem, mode), cpu->AC); break;
+        case STX: mem_write8(mem, target(cpu, mem, mode), cpu->X); break;
+        case STY: mem_write8(mem, target(cpu, mem, mode), cpu->Y); break;
+        case STZ: mem_write8(mem, target(cpu, mem, mode), 0); break;
+
+        case AND: cpu->AC &= load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case ORA: cpu->AC |= load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case EOR: cpu->AC ^= load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case ADC: add(cpu, load(cpu, mem, mode), variant); break;
+        case SBC: subtract(cpu, load(cpu, mem, mode), variant); break;
+        case CMP: compare(cpu, cpu->AC, load(cpu, mem, mode)); break;
+        case CPX: compare(cpu, cpu->X, load(cpu, mem, mode)); break;
+        case CPY: compare(cpu, cpu->Y, load(cpu, mem, mode)); break;
+
+        case BIT:
+            value = load(cpu, mem, mode);
+            flag(cpu, Z_MASK, (cpu->AC & value) == 0);
+            if(mode != IMM) {
+                flag(cpu, N_MASK, value & N_MASK);
+                flag(cpu, V_MASK, value & V_MASK);
+            }
+            break;
+        case TSB:
+        case TRB:
+            address = target(cpu, mem, mode);
+            value = mem_read8(mem, address);
+            flag(cpu, Z_MASK, (cpu->AC & value) == 0);
+            mem_write8(mem, address, (ins.opcode == TSB) ? (uint8_t) (value | cpu->AC) : (uint8_t) (value & ~cpu->AC));
+            break;
+
+        /* the CMOS parts only take the extra cycle of a shift on a,x when it crosses a page */
+        case ASL: case LSR: case ROL: case ROR: case INC: case DEC:
+            if(mode == ACC) {
+                cpu->AC = modify(cpu, ins.opcode, cpu->AC);
+            } else {
+                modify_memory(cpu, mem, ins.opcode, mode,
+                              (variant != CPU_NMOS) && (ins.opcode != INC) && (ins.opcode != DEC));
+            }
+            break;
+
+        case INX: cpu->X++; set_nz(cpu, cpu->X); break;
+        case INY: cpu->Y++; set_nz(cpu, cpu->Y); break;
+        case DEX: cpu->X--; set_nz(cpu, cpu->X); break;
+        case DEY: cpu->Y--; set_nz(cpu, cpu->Y); break;
+        case TAX: cpu->X = cpu->AC; set_nz(cpu, cpu->X); break;
+        case TAY: cpu->Y = cpu->AC; set_nz(cpu, cpu->Y); break;
+        case TXA: cpu->AC = cpu->X; set_nz(cpu, cpu->AC); break;
+        case TYA: cpu->AC = cpu->Y; set_nz(cpu, cpu->AC); break;
+        case TSX: cpu->X = cpu->SP; set_nz(cpu, cpu->X); break;
+        case TXS: cpu->SP = cpu->X; break;
+
+        case PHA: push(cpu, mem, cpu->AC); break;
+        case PHX: push(cpu, mem, cpu->X); break;
+        case PHY: push(cpu, mem, cpu->Y); break;
+        case PHP: push(cpu, mem, cpu->SR | B_MASK | IG_MASK); break;
+        case PLA: cpu->AC = pull(cpu, mem); set_nz(cpu, cpu->AC); break;
+        case PLX: cpu->X = pull(cpu, mem); set_nz(cpu, cpu->X); break;
+        case PLY: cpu->Y = pull(cpu, mem); set_nz(cpu, cpu->Y); break;
+        case PLP: cpu->SR = (uint8_t) ((pull(cpu, mem) & ~B_MASK) | IG_MASK); poll(cpu); break;
+
+        case CLC: flag(cpu, C_MASK, 0); break;
+        case CLD: flag(cpu, D_MASK, 0); break;
+        case CLI: flag(cpu, I_MASK, 0); poll(cpu); break;
+        case CLV: flag(cpu, V_MASK, 0); break;
+        case SEC: flag(cpu, C_MASK, 1); break;
+        case SED: flag(cpu, D_MASK, 1); break;
+        case SEI: flag(cpu, I_MASK, 1); break;
+
+        case BPL: case BMI: case BVC: case BVS: case BCC: case BCS: case BNE: case BEQ: case BRA:
+            value = next_byte(cpu, mem);
+            branch(cpu, (int8_t) value, condition(cpu, ins.opcode));
+            break;
+
+        case JMP:
+            if( (variant == CPU_NMOS) && (mode == ABS_IND) ) {
+                /* the pointer's high byte is read without a carry out of its low byte */
+                address = next_word(cpu, mem);
+                cpu->PC = (uint16_t) (mem_read8(mem, address) |
+                                      (mem_read8(mem, (uint16_t) ((address & 0xFF00) | ((address + 1) & 0xFF))) << 8));
+            } else {
+                cpu->PC = target(cpu, mem, mode);
+            }
+            break;
+        case JSR:
+            address = next_word(cpu, mem);
+            cpu->PC--;
+            push(cpu, mem, (uint8_t) (cpu->PC >> 8));
+            push(cpu, mem, (uint8_t) cpu->PC);
+            cpu->PC = address;
+            break;
+        case RTS:
+            value = pull(cpu, mem);
+            cpu->PC = (uint16_t) ((value | (pull(cpu, mem) << 8)) + 1);
+            break;
+        case RTI:
+            cpu->SR = (uint8_t) ((pull(cpu, mem) & ~B_MASK) | IG_MASK);
+            value = pull(cpu, mem);
+            cpu->PC = (uint16_t) (value | (pull(cpu, mem) << 8));
+            poll(cpu);
+            break;
+        case BRK:
+            /* the byte after BRK is skipped */
+            cpu->PC++;
+            enter(cpu, mem, IRQ_VECTOR, cpu->SR | B_MASK | IG_MASK);
+            break;
+
+        case WAI: cpu->state = (cpu->irq != 0) ? CPU_PENDING : CPU_WAITING; break;
+        case STP: cpu->state = CPU_STOPPED; break;
+        case JAM: cpu->PC = at; cpu->state = CPU_STOPPED; break;
+
+        case NOP: {
+            /* the NMOS NOP a,x reads like LDA a,x */
+            int crossed;
+            (void) effective_address(cpu, mem, mode, &crossed);
+            cpu->cycles += (uint64_t) ( (mode == ABS_INDX_X) && crossed );
+            break;
+        }
+        case INVLD:
+            (void) target(cpu, mem, mode);
+            break;
+
+        /* undocumented NMOS opcodes */
+        case SLO: cpu->AC |= modify_memory(cpu, mem, ins.opcode, mode, 0); set_nz(cpu, cpu->AC); break;
+        case RLA: cpu->AC &= modify_memory(cpu, mem, ins.opcode, mode, 0); set_nz(cpu, cpu->AC); break;
+        case SRE: cpu->AC ^= modify_memory(cpu, mem, ins.opcode, mode, 0); set_nz(cpu, cpu->AC); break;
+        case RRA: add(cpu, modify_memory(cpu, mem, ins.opcode, mode, 0), variant); break;
+        case DCP: compare(cpu, cpu->AC, modify_memory(cpu, mem, ins.opcode, mode, 0)); break;
+        case ISC: subtract(cpu, modify_memory(cpu, mem, ins.opcode, mode, 0), variant); break;
+
+        case LAX: cpu->AC = cpu->X = load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case SAX: mem_write8(mem, target(cpu, mem, mode), cpu->AC & cpu->X); break;
+        case LAS: cpu->AC = cpu->X = cpu->SP = load(cpu, mem, mode) & cpu->SP; set_nz(cpu, cpu->AC); break;
+        case ANC:
+            cpu->AC &= load(cpu, mem, mode);
+            set_nz(cpu, cpu->AC);
+            flag(cpu, C_MASK, cpu->AC & 0x80);
+            break;
+        case ALR:
+            value = cpu->AC & load(cpu, mem, mode);
+            flag(cpu, C_MASK, value & 0x01);
+            cpu->AC = value >> 1;
+            set_nz(cpu, cpu->AC);
+            break;
+        case ARR: {
+            const uint8_t both = cpu->AC & load(cpu, mem, mode);
+            uint8_t result = (uint8_t) ((both >> 1) | (is_set(cpu, C_MASK) << 7));
+
+            set_nz(cpu, result);
+            if(!is_set(cpu, D_MASK)) {
+                flag(cpu, C_MASK, result & 0x40);
+                flag(cpu, V_MASK, ((result >> 6) ^ (result >> 5)) & 0x01);
+            } else {
+                /* N and Z come from the rotated value, then each digit is adjusted on its own */
+                flag(cpu, V_MASK, (both ^ result) & 0x40);
+                if( (both & 0x0F) + (both & 0x01) > 0x05 ) {
+                    result = (uint8_t) ((result & 0xF0) | ((result + 0x06) & 0x0F));
+                }
+                flag(cpu, C_MASK, (both & 0xF0) + (both & 0x10) > 0x50);
+                if(is_set(cpu, C_MASK)) {
+                    result = (uint8_t) (result + 0x60);
+                }
+            }
+            cpu->AC = result;
+            break;
+        }
+        case SBX:
+            value = load(cpu, mem, mode);
+            flag(cpu, C_MASK, (cpu->AC & cpu->X) >= value);
+            cpu->X = (uint8_t) ((cpu->AC & cpu->X) - value);
+            set_nz(cpu, cpu->X);
+            break;
+        case ANE: cpu->AC = (cpu->AC | 0xEE) & cpu->X & load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case LXA: cpu->AC = cpu->X = (cpu->AC | 0xEE) & load(cpu, mem, mode); set_nz(cpu, cpu->AC); break;
+        case SHA: unstable_store(cpu, mem, mode, cpu->AC & cpu->X); break;
+        case SHX: unstable_store(cpu, mem, mode, cpu->X); break;
+        case SHY: unstable_store(cpu, mem, mode, cpu->Y); break;
+        case TAS: cpu->SP = cpu->AC & cpu->X; unstable_store(cpu, mem, mode, cpu->SP); break;
+
+        /* W65C02S bit instructions on zero page, BBR and BBS take the address and then the offset */
+        case RMB0: case RMB1: case RMB2: case RMB3: case RMB4: case RMB5: case RMB6: case RMB7:
+            address = next_byte(cpu, mem);
+            mem_write8(mem, address, mem_read8(mem, address) & (uint8_t) ~(1u << (ins.opcode - RMB0)));
+            break;
+        case SMB0: case SMB1: case SMB2: case SMB3: case SMB4: case SMB5: case SMB6: case SMB7:
+            address = next_byte(cpu, mem);
+            mem_write8(mem, address, mem_read8(mem, address) | (uint8_t) (1u << (ins.opcode - SMB0)));
+            break;
+        case BBR0: case BBR1: case BBR2: case BBR3: case BBR4: case BBR5: case BBR6: case BBR7:
+        case BBS0: case BBS1: case BBS2: case BBS3: case BBS4: case BBS5: case BBS6: case BBS7: {
+            const int set = ins.opcode >= BBS0;
+            const unsigned bit = (unsigned) (ins.opcode - (set ? BBS0 : BBR0));
+
+            address = next_byte(cpu, mem);
+            value = next_byte(cpu, mem);
+            branch(cpu, (int8_t) value, ((mem_read8(mem, address) >> bit) & 1) == (unsigned) set);
+            break;
+        }
+    }
+
+    cpu->cycles += ins.cycles;
+}
+
+/* take the interrupt that made the CPU pending, an NMI before an IRQ */
+static void interrupt(CPU_type_t* cpu, Memory_type_t* mem) {
+    uint16_t vector;
+
+    cpu->state = CPU_RUNNING;
+    if(cpu->nmi) {
+        cpu->nmi = 0;
+        vector = NMI_VECTOR;
+    } else if( (cpu->irq != 0) && !is_set(cpu, I_MASK) ) {
+        vector = IRQ_VECTOR;
+    } else {
+        /* woken by an IRQ it masks, it carries on with the next instruction */
+        return;
+    }
+
+    enter(cpu, mem, vector, (uint8_t) ((cpu->SR & ~B_MASK) | IG_MASK));
+    cpu->cycles += INTERRUPT_CYCLES;
+}
+
+/**
+ * one instruction, one interrupt, or a halted CPU moved on to its next event
+ */
+uint32_t reference_step(CPU_type_t* cpu, Memory_type_t* mem) {
+    const uint64_t start = cpu->cycles;
+    Scheduler_t* events = cpu->events;
+
+    if( (events != NULL) && ( (cpu->state == CPU_WAITING) || (cpu->state == CPU_STOPPED) ) ) {
+        const uint64_t next = scheduler_next(events);
+
+        if(next != SCHEDULER_NONE) {
+            if(next > cpu->cycles) {
+                cpu->cycles = next;
+            }
+            scheduler_run(events, cpu->cycles);
+        }
+    }
+
+    if(cpu->state == CPU_PENDING) {
+        interrupt(cpu, mem);
+    } else if(cpu->state == CPU_RUNNING) {
+        mem_execute(mem, cpu->PC);
+        execute(cpu, mem);
+    }
+
+    if( (events != NULL) && (scheduler_next(events) <= cpu->cycles) ) {
+        scheduler_run(events, cpu->cycles);
+    }
+
+    return (uint32_t) (cpu->cycles - start);
+}
@@ -0,0 +1,809 @@
+/**
+ * @file replay.c
+ * @brief recording of what a machine takes from the outside, and bit exact replay of it with
+ * seeking and stepping back
+ * @author Edwin
+ */
+
+/**
+ * A recording:
+ *
+ *   0    magic      REPLAY_MAGIC
+ *   8    version    2 bytes
+ *   10   variant    1 byte
+ *   11   unused     1 byte
+ *   12   interval   8 bytes
+ *
+ * followed by records, each a tag byte and its fields:
+ *
+ *   'R'  count, then count read values
+ *   'A'  cycles since the previous line change, the lines asserted
+ *   'L'  cycles since the previous line change, the lines released
+ *   'N'  cycles since the previous line change
+ *   'K'  cycles, reads and line changes before it, 8 bytes each; PC 2 bytes; AC X Y SR SP 1 byte
+ *        each; the size of the snapshot 4 bytes, then the snapshot image, see machine.c
+ *   'E'  cycles, 8 bytes
+ *
+ * Counts, distances and lines are LEB128 varints, the other fields little endian. The first line
+ * change is counted from cycle 0.
+ *
+ * Every instruction boundary cpu_run returns at is one cpu_step stops at as well, so running to a
+ * cycle with cpu_run and then stepping to it lands exactly where the recording stopped to save a
+ * keyframe.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+#define HEADER 20                           ///< bytes of the header
+#define KEYFRAME 36                         ///< bytes of a keyframe record before the snapshot image
+#define APPROACH 32                         ///< cpu_run ends within an instruction and an interrupt past where it was told to
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    put16(p, (uint16_t) v);
+    put16(p + 2, (uint16_t) (v >> 16));
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+    put32(p, (uint32_t) v);
+    put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+/* @return bytes written, at most 10 */
+static size_t put_varint(uint8_t* p, uint64_t v) {
+    size_t n = 0;
+
+    while(v >= 0x80) {
+        p[n++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t) v;
+    return n;
+}
+
+/* @return 0 on success, -1 at the end of the stream or on an overlong varint */
+static int get_varint(FILE* in, uint64_t* v) {
+    *v = 0;
+    for(unsigned shift = 0; shift < 64; shift += 7) {
+        const int c = fgetc(in);
+
+        if(c == EOF) {
+            return -1;
+        }
+        *v |= (uint64_t) (c & 0x7F) << shift;
+        if(!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void emit(Replay_t* r, const void* data, size_t size) {
+    if(fwrite(data, 1, size, r->out) != size) {
+        r->error = 1;
+    }
+}
+
+static void flush_reads(Replay_t* r) {
+    uint8_t head[11];
+
+    if(r->pending_count == 0) {
+        return;
+    }
+    head[0] = 'R';
+    emit(r, head, 1 + put_varint(head + 1, r->pending_count));
+    emit(r, r->pending, r->pending_count);
+    r->pending_count = 0;
+}
+
+static void keyframe_registers(Replay_keyframe_t* k, const Replay_t* r) {
+    const CPU_type_t* cpu = &r->machine->cpu;
+
+    k->cycles = cpu->cycles;
+    k->reads = r->reads;
+    k->events = r->events;
+    k->PC = cpu->PC;
+    k->AC = cpu->AC;
+    k->X = cpu->X;
+    k->Y = cpu->Y;
+    k->SR = cpu->SR;
+    k->SP = cpu->SP;
+}
+
+static void write_keyframe(Replay_t* r) {
+    Replay_keyframe_t k;
+    uint8_t head[KEYFRAME];
+
+    if(machine_snapshot(r->machine, &k.snapshot) != 0) {
+        r->error = 1;
+        return;
+    }
+    keyframe_registers(&k, r);
+    flush_reads(r);
+
+    head[0] = 'K';
+    put64(head + 1, k.cycles);
+    put64(head + 9, k.reads);
+    put64(head + 17, k.events);
+    put16(head + 25, k.PC);
+    head[27] = k.AC;
+    head[28] = k.X;
+    head[29] = k.Y;
+    head[30] = k.SR;
+    head[31] = k.SP;
+    put32(head + 32, (uint32_t) k.snapshot.size);
+    emit(r, head, KEYFRAME);
+    emit(r, k.snapshot.image, k.snapshot.size);
+    machine_snapshot_free(&k.snapshot);
+
+    if(fflush(r->out) != 0) {
+        r->error = 1;
+    }
+}
+
+/**
+ * record a line change
+ * one made during a device access comes after the instruction making it, the cycle counter is
+ * still at or one after its start and the instruction takes at least two
+ */
+static void record_line(Replay_t* r, Replay_kind kind, uint32_t lines) {
+    uint64_t when = r->machine->cpu.cycles + (r->in_access != 0);
+    uint8_t record[1 + 10 + 5];
+    size_t n = 0;
+
+    if(when < r->last) {
+        when = r->last;
+    }
+    record[n++] = (uint8_t) kind;
+    n += put_varint(record + n, when - r->last);
+    if(kind != REPLAY_NMI) {
+        n += put_varint(record + n, lines);
+    }
+    emit(r, record, n);
+    r->last = when;
+    r->events++;
+}
+
+/* the CPU needs a read the recording does not have, it stops after the instruction */
+static uint8_t overrun(Replay_t* r, uint16_t address) {
+    CPU_type_t* cpu = &r->machine->cpu;
+
+    r->overrun = 1;
+    if( (cpu->state == CPU_RUNNING) || (cpu->state == CPU_PENDING) ) {
+        cpu->state = CPU_BREAK;
+    }
+    return address >> 8;
+}
+
+static uint8_t tap_read(void* context, uint16_t address) {
+    Replay_tap_t* tap = (Replay_tap_t*) context;
+    Replay_t* r = tap->replay;
+    const Memory_device_t* device = tap->original;
+    uint8_t value = address >> 8;
+
+    if(r->mode == REPLAY_PLAY) {
+        return (r->reads < r->value_count) ? r->values[r->reads++] : overrun(r, address);
+    }
+
+    if(device->read != NULL) {
+        r->in_access = 1;
+        value = device->read(device->context, address);
+        r->in_access = 0;
+    }
+    r->pending[r->pending_count++] = value;
+    r->reads++;
+    if(r->pending_count == REPLAY_READS) {
+        flush_reads(r);
+    }
+    return value;
+}
+
+static void tap_write(void* context, uint16_t address, uint8_t value) {
+    Replay_tap_t* tap = (Replay_tap_t*) context;
+    const Memory_device_t* device = tap->original;
+
+    tap->replay->in_access = 1;
+    device->write(device->context, address, value);
+    tap->replay->in_access = 0;
+}
+
+/* map a tap over every device, one per device so its state is saved once as before */
+static void tap_devices(Replay_t* r) {
+    Memory_type_t* mem = &r->machine->mem;
+
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        Memory_device_t* device = mem->device[page];
+        Replay_tap_t* tap = NULL;
+
+        if(device == NULL) {
+            continue;
+        }
+        for(size_t i = 0; i < r->tap_count; i++) {
+            if(r->taps[i].original == device) {
+                tap = &r->taps[i];
+                break;
+            }
+        }
+        if(tap == NULL) {
+            tap = &r->taps[r->tap_count++];
+            tap->device = *device;
+            tap->device.read = tap_read;
+            tap->device.write = (device->write != NULL) ? tap_write : NULL;
+            tap->device.context = tap;
+            tap->device.steady = 0;
+            tap->original = device;
+            tap->replay = r;
+        }
+        memory_map_device(mem, (uint8_t) page, 1, &tap->device);
+    }
+}
+
+static void untap_devices(Replay_t* r) {
+    Memory_type_t* mem = &r->machine->mem;
+
+    for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+        Memory_device_t* device = mem->device[page];
+        Memory_device_t* original = replay_device(r, device);
+
+        if(original != device) {
+            memory_map_device(mem, (uint8_t) page, 1, original);
+        }
+    }
+    r->tap_count = 0;
+}
+
+static void attach(Replay_t* r, Replay_t* replay) {
+#if USE_REPLAY
+    r->machine->cpu.replay = replay;
+#else
+    (void) r;
+    (void) replay;
+#endif
+}
+
+/* scheduler event applying the recorded line changes that are due, then posting the next one */
+static void apply(void* context, CPU_type_t* cpu, uint64_t now) {
+    Replay_t* r = (Replay_t*) context;
+
+    r->applying = 1;
+    while( (r->events < r->change_count) && (r->changes[r->events].when <= now) ) {
+        const Replay_event_t* e = &r->changes[r->events++];
+
+        switch(e->kind) {
+            case REPLAY_ASSERT: cpu_irq_assert(cpu, e->lines); break;
+            case REPLAY_RELEASE: cpu_irq_release(cpu, e->lines); break;
+            default: cpu_nmi(cpu); break;
+        }
+    }
+    r->applying = 0;
+
+    if(r->events < r->change_count) {
+        scheduler_post(cpu->events, r->changes[r->events].when, apply, r);
+    }
+}
+
+/* put the machine in the state of a keyframe, the line changes due then are applied at once */
+static int restore(Replay_t* r, const Replay_keyframe_t* k) {
+    CPU_type_t* cpu = &r->machine->cpu;
+
+    if(machine_restore(r->machine, &k->snapshot) != 0) {
+        return -1;
+    }
+    r->reads = k->reads;
+    r->events = k->events;
+    r->overrun = 0;
+    cpu_resume(cpu);
+
+    scheduler_cancel(cpu->events, apply, r);
+    apply(r, cpu, cpu->cycles);
+    return 0;
+}
+
+/* last keyframe at or before a cycle, the first one has to be */
+static size_t keyframe_before(const Replay_t* r, uint64_t cycle) {
+    size_t low = 0, high = r->keyframe_count;
+
+    while(high - low > 1) {
+        const size_t middle = low + (high - low) / 2;
+
+        if(r->keyframes[middle].cycles <= cycle) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* run to the first instruction boundary cpu_step stops at at or after a cycle */
+static void run_to(Replay_t* r, uint64_t target) {
+    CPU_type_t* cpu = &r->machine->cpu;
+    Memory_type_t* mem = &r->machine->mem;
+
+    if(target > r->end) {
+        target = r->end;
+    }
+    while( (cpu->cycles + APPROACH < target) && !r->overrun &&
+           (cpu_run(cpu, mem, target - APPROACH - cpu->cycles) != 0) ) {
+    }
+    while( (cpu->cycles < target) && !r->overrun && (cpu_step(cpu, mem) != 0) ) {
+    }
+}
+
+/**
+ * keep a keyframe of where the replay is
+ * the machine is restored from it at once, which leaves it as it is but shares its RAM with the
+ * new keyframe instead of the old one, which can go
+ */
+static void keep_near(Replay_t* r) {
+    Replay_keyframe_t k;
+
+    if(machine_snapshot(r->machine, &k.snapshot) != 0) {
+        return;
+    }
+    keyframe_registers(&k, r);
+    if(machine_restore(r->machine, &k.snapshot) != 0) {
+        machine_snapshot_free(&k.snapshot);
+        return;
+    }
+
+    if(r->near.snapshot.image != NULL) {
+        machine_snapshot_free(&r->near.snapshot);
+    }
+    r->near = k;
+}
+
+/* the machine matches a keyframe of the recording it has just reached */
+static int matches(const Replay_t* r, const Replay_keyframe_t* k) {
+    const CPU_type_t* cpu = &r->machine->cpu;
+
+    return (cpu->cycles == k->cycles) && (r->reads == k->reads) && (r->events == k->events) &&
+           (cpu->PC == k->PC) && (cpu->AC == k->AC) && (cpu->X == k->X) && (cpu->Y == k->Y) &&
+           (cpu->SR == k->SR) && (cpu->SP == k->SP);
+}
+
+/**
+ * interrupt line change made while a replay is attached
+ * @param r replay
+ * @param kind what the change is
+ * @param lines lines it changes
+ * @return 1 to make the change, 0 to drop it
+ */
+int replay_line(Replay_t* r, Replay_kind kind, uint32_t lines) {
+    if(r->mode == REPLAY_PLAY) {
+        return r->applying;
+    }
+    record_line(r, kind, lines);
+    return 1;
+}
+
+/**
+ * device a tap stands in for
+ * @param r replay, NULL if none
+ * @param device device mapped to a page
+ * @return the original device, or device if it is not a tap of r
+ */
+Memory_device_t* replay_device(const Replay_t* r, Memory_device_t* device) {
+    if(r != NULL) {
+        for(size_t i = 0; i < r->tap_count; i++) {
+            if(device == &r->taps[i].device) {
+                return r->taps[i].original;
+            }
+        }
+    }
+    return device;
+}
+
+/**
+ * start recording a machine
+ * @param r replay
+ * @param machine machine to record, from where it is now
+ * @param out recording
+ * @param interval cycles between keyframes, 0 for REPLAY_INTERVAL
+ * @return 0 on success, -1 on error
+ */
+int replay_record(Replay_t* r, Machine_t* machine, FILE* out, uint64_t interval) {
+    uint8_t header[HEADER];
+
+    if(!USE_REPLAY) {
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->machine = machine;
+    r->mode = REPLAY_RECORD;
+    r->out = out;
+    r->interval = (interval != 0) ? interval : REPLAY_INTERVAL;
+    r->end = UINT64_MAX;
+
+    memcpy(header, REPLAY_MAGIC, 8);
+    put16(header + 8, REPLAY_VERSION);
+    header[10] = (uint8_t) machine->cpu.variant;
+    header[11] = 0;
+    put64(header + 12, r->interval);
+    emit(r, header, HEADER);
+    write_keyframe(r);
+    if(r->error) {
+        r->machine = NULL;
+        return -1;
+    }
+    r->next_keyframe = machine->cpu.cycles + r->interval;
+
+    tap_devices(r);
+    attach(r, r);
+    return 0;
+}
+
+/* read every record of a recording, up to its end or to the first one that is cut short */
+static int read_records(Replay_t* r, FILE* in) {
+    size_t values = 0, changes = 0, keyframes = 0;
+    uint64_t last = 0;
+    int tag;
+
+    while( (tag = fgetc(in)) != EOF ) {
+        uint64_t count, delta, lines = 0;
+        uint8_t head[KEYFRAME];
+
+        if(tag == 'R') {
+            if( (get_varint(in, &count) != 0) || (count > SIZE_MAX - r->value_count) ) {
+                break;
+            }
+            if(r->value_count + count > values) {
+                values = (r->value_count + count) * 2;
+                uint8_t* grown = realloc(r->values, values);
+                if(grown == NULL) {
+                    return -1;
+                }
+                r->values = grown;
+            }
+            if(fread(r->values + r->value_count, 1, count, in) != count) {
+                break;
+            }
+            r->value_count += count;
+        } else if( (tag == REPLAY_ASSERT) || (tag == REPLAY_RELEASE) || (tag == REPLAY_NMI) ) {
+            if( (get_varint(in, &delta) != 0) || ( (tag != REPLAY_NMI) && (get_varint(in, &lines) != 0) ) ) {
+                break;
+            }
+            if(r->change_count == changes) {
+                changes = (changes != 0) ? changes * 2 : 1024;
+                Replay_event_t* grown = realloc(r->changes, changes * sizeof(Replay_event_t));
+                if(grown == NULL) {
+                    return -1;
+                }
+                r->changes = grown;
+            }
+            last += delta;
+            r->changes[r->change_count].when = last;
+            r->changes[r->change_count].lines = (uint32_t) lines;
+            r->changes[r->change_count].kind = (uint8_t) tag;
+            r->change_count++;
+        } else if(tag == 'K') {
+            Replay_keyframe_t k;
+
+            if(fread(head + 1, 1, KEYFRAME - 1, in) != KEYFRAME - 1) {
+                break;
+            }
+            k.cycles = get64(head + 1);
+            k.reads = get64(head + 9);
+            k.events = get64(head + 17);
+            k.PC = get16(head + 25);
+            k.AC = head[27];
+            k.X = head[28];
+            k.Y = head[29];
+            k.SR = head[30];
+            k.SP = head[31];
+            if( (k.reads > r->value_count) || (k.events > r->change_count) ||
+                ( (r->keyframe_count != 0) && (k.cycles < r->keyframes[r->keyframe_count - 1].cycles) ) ||
+                (machine_snapshot_read(&k.snapshot, in, get32(head + 32)) != 0) ) {
+                break;
+            }
+            if(r->keyframe_count == keyframes) {
+                keyframes = (keyframes != 0) ? keyframes * 2 : 16;
+                Replay_keyframe_t* grown = realloc(r->keyframes, keyframes * sizeof(Replay_keyframe_t));
+                if(grown == NULL) {
+                    machine_snapshot_free(&k.snapshot);
+                    return -1;
+                }
+                r->keyframes = grown;
+            }
+            r->keyframes[r->keyframe_count++] = k;
+        } else if(tag == 'E') {
+            if(fread(head, 1, 8, in) == 8) {
+                r->end = get64(head);
+            }
+            break;
+        } else {
+            break;
+        }
+    }
+
+    return (r->keyframe_count != 0) ? 0 : -1;
+}
+
+static void release_recording(Replay_t* r) {
+    for(size_t i = 0; i < r->keyframe_count; i++) {
+        machine_snapshot_free(&r->keyframes[i].snapshot);
+    }
+    if(r->near.snapshot.image != NULL) {
+        machine_snapshot_free(&r->near.snapshot);
+    }
+    free(r->keyframes);
+    free(r->changes);
+    free(r->values);
+    r->keyframes = NULL;
+    r->changes = NULL;
+    r->values = NULL;
+    r->keyframe_count = 0;
+}
+
+/**
+ * load a recording
+ * @param r replay
+ * @param machine machine to replay it on, mapped as the recorded one was
+ * @param path recording
+ * @return 0 on success, -1 on error
+ */
+int replay_load(Replay_t* r, Machine_t* machine, const char* path) {
+    uint8_t header[HEADER];
+
+    if(!USE_REPLAY) {
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->mode = REPLAY_PLAY;
+    r->end = UINT64_MAX;
+
+    FILE* in = fopen(path, "rb");
+    if(in == NULL) {
+        return -1;
+    }
+    if( (fread(header, 1, HEADER, in) != HEADER) || (memcmp(header, REPLAY_MAGIC, 8) != 0) ||
+        (get16(header + 8) > REPLAY_VERSION) || (header[10] >= CPU_VARIANTS) || (read_records(r, in) != 0) ) {
+        fclose(in);
+        release_recording(r);
+        return -1;
+    }
+    fclose(in);
+    r->interval = get64(header + 12);
+
+    r->machine = machine;
+    if(machine->cpu.events == NULL) {
+        if(scheduler_initialize(&r->scheduler, 0) != 0) {
+            release_recording(r);
+            r->machine = NULL;
+            return -1;
+        }
+        scheduler_attach(&r->scheduler, &machine->cpu);
+        r->owns_scheduler = 1;
+    }
+    tap_devices(r);
+    attach(r, r);
+
+    if(restore(r, &r->keyframes[0]) != 0) {
+        replay_free(r);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * stop recording or replaying
+ * @param r replay
+ * @return 0 on success, -1 if a write of the recording failed
+ */
+int replay_free(Replay_t* r) {
+    Machine_t* machine = r->machine;
+    uint8_t end[9];
+
+    if(machine == NULL) {
+        return 0;
+    }
+
+    if(r->mode == REPLAY_RECORD) {
+        flush_reads(r);
+        end[0] = 'E';
+        put64(end + 1, machine->cpu.cycles);
+        emit(r, end, sizeof(end));
+        if(fflush(r->out) != 0) {
+            r->error = 1;
+        }
+    } else {
+        Memory_type_t* mem = &machine->mem;
+
+        /* the RAM still shared with the keyframes becomes the machine's own */
+        scheduler_cancel(machine->cpu.events, apply, r);
+        for(unsigned page = 0; page < MEMORY_PAGES; page++) {
+            if(mem->shared_page[page] != NULL) {
+                memcpy(mem->data + page * MEMORY_PAGE_SIZE, mem->shared_page[page], MEMORY_PAGE_SIZE);
+                memory_unmap(mem, (uint8_t) page, 1);
+            }
+        }
+        machine->base = NULL;
+        release_recording(r);
+    }
+
+    if(r->owns_scheduler) {
+        scheduler_detach(&machine->cpu);
+        scheduler_free(&r->scheduler);
+        r->owns_scheduler = 0;
+    }
+    untap_devices(r);
+    attach(r, NULL);
+    r->machine = NULL;
+
+    return r->error ? -1 : 0;
+}
+
+/**
+ * run the machine
+ * @param r replay
+ * @param cycles cycles to run for
+ * @return cycles run
+ */
+uint64_t replay_run(Replay_t* r, uint64_t cycles) {
+    CPU_type_t* cpu = &r->machine->cpu;
+    Memory_type_t* mem = &r->machine->mem;
+    const uint64_t start = cpu->cycles;
+
+    if(r->mode == REPLAY_RECORD) {
+        uint64_t run = 0;
+
+        while(run < cycles) {
+            uint64_t slice = cycles - run;
+
+            if( (r->next_keyframe > cpu->cycles) && (r->next_keyframe - cpu->cycles < slice) ) {
+                slice = r->next_keyframe - cpu->cycles;
+            }
+            const uint64_t ran = cpu_run(cpu, mem, slice);
+            run += ran;
+
+            /* a halted CPU has no instruction boundaries, the keyframe waits until it runs again */
+            if( (cpu->cycles >= r->next_keyframe) && ( (cpu->state == CPU_RUNNING) || (cpu->state == CPU_PENDING) ) ) {
+                write_keyframe(r);
+                r->next_keyframe = cpu->cycles + r->interval;
+            }
+            if( (ran == 0) || (cpu->state == CPU_BREAK) ) {
+                break;
+            }
+        }
+        return run;
+    }
+
+    if(start >= r->end) {
+        return 0;
+    }
+    const uint64_t target = (cycles > r->end - start) ? r->end : start + cycles;
+
+    while( (cpu->cycles < target) && !r->diverged && !r->overrun && (cpu->state != CPU_BREAK) ) {
+        const size_t next = keyframe_before(r, cpu->cycles) + 1;
+        const Replay_keyframe_t* k = (next < r->keyframe_count) ? &r->keyframes[next] : NULL;
+        const uint64_t before = cpu->cycles;
+
+        if( (k != NULL) && (k->cycles <= target) ) {
+            run_to(r, k->cycles);
+            if( (cpu->cycles == k->cycles) && !matches(r, k) ) {
+                r->diverged = 1;
+            } else if(cpu->cycles < k->cycles) {
+                break;
+            }
+        } else {
+            run_to(r, target);
+        }
+        if(cpu->cycles == before) {
+            break;
+        }
+    }
+    return cpu->cycles - start;
+}
+
+/**
+ * move a replay to a cycle
+ * @param r replay
+ * @param cycle where to
+ * @return 0 on success, -1 on error
+ */
+int replay_seek(Replay_t* r, uint64_t cycle) {
+    CPU_type_t* cpu = &r->machine->cpu;
+
+    if( (r->mode != REPLAY_PLAY) || (cycle < r->keyframes[0].cycles) ) {
+        return -1;
+    }
+    if(cycle > r->end) {
+        cycle = r->end;
+    }
+
+    const Replay_keyframe_t* from = &r->keyframes[keyframe_before(r, cycle)];
+    if( (r->near.snapshot.image != NULL) && (r->near.cycles <= cycle) && (r->near.cycles > from->cycles) ) {
+        from = &r->near;
+    }
+
+    /* running on from where the replay is is cheaper than restoring, unless a keyframe is closer */
+    if( (cpu->cycles > cycle) || (cpu->cycles < from->cycles) || r->overrun ) {
+        if(restore(r, from) != 0) {
+            return -1;
+        }
+    } else {
+        cpu_resume(cpu);
+    }
+
+    if(cycle - cpu->cycles > 2 * REPLAY_NEAR) {
+        run_to(r, cycle - REPLAY_NEAR);
+        keep_near(r);
+    }
+    run_to(r, cycle);
+    return r->overrun ? -1 : 0;
+}
+
+/**
+ * run one instruction
+ * @param r replay
+ * @return cycles it took
+ */
+uint32_t replay_step(Replay_t* r) {
+    CPU_type_t* cpu = &r->machine->cpu;
+
+    if( (r->mode == REPLAY_PLAY) && ( (cpu->cycles >= r->end) || r->overrun ) ) {
+        return 0;
+    }
+    return cpu_step(cpu, &r->machine->mem);
+}
+
+/**
+ * go back one instruction
+ * the boundary before this one is looked for forward from a little earlier, further back each
+ * time there is none
+ * @param r replay
+ * @return 0 on success, -1 at the start of the recording
+ */
+int replay_step_back(Replay_t* r) {
+    CPU_type_t* cpu = &r->machine->cpu;
+    const uint64_t now = cpu->cycles;
+    uint64_t margin = 64;
+
+    if( (r->mode != REPLAY_PLAY) || (now <= r->keyframes[0].cycles) ) {
+        return -1;
+    }
+
+    for(;;) {
+        const uint64_t from = (now - r->keyframes[0].cycles > margin) ? now - margin : r->keyframes[0].cycles;
+
+        if(replay_seek(r, from) != 0) {
+            return -1;
+        }
+        if(cpu->cycles < now) {
+            break;
+        }
+        if(from == r->keyframes[0].cycles) {
+            return -1;
+        }
+        margin *= 2;
+    }
+
+    uint64_t previous = cpu->cycles;
+    while(cpu->cycles < now) {
+        previous = cpu->cycles;
+        if(cpu_step(cpu, &r->machine->mem) == 0) {
+            break;
+        }
+    }
+    return replay_seek(r, previous);
+}
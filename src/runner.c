@@ -0,0 +1,443 @@
+/**
+ * @file runner.c
+ * @brief runs batches of programs to a stop condition on worker threads and keeps their final state
+ * @author Edwin
+ */
+
+/**
+ * Jobs are handed out to the workers one at a time from a shared counter, as the files of a
+ * differential corpus are, sorted by how they are set up. A worker keeps the image of the last job
+ * it set up, so the runs of one program cost a load on every worker that takes one of them and a
+ * restore of the pages written per run, however they are spread over the batch.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "runner.h"
+#include "machine.h"
+#include "block-cache.h"
+#include "jit.h"
+#include "watch.h"
+#include "loader.h"
+
+#define RESET_VECTOR 0xFFFC                 ///< a program covering it starts where it points
+#define IRQ_VECTOR 0xFFFE                   ///< BRK goes where it points
+
+/**
+ * @brief shared state of the workers
+ */
+typedef struct runner_workers {
+    Runner_t* runner;
+    Runner_job_t** order;                   ///< jobs by setup
+    atomic_size_t next;                     ///< next job to hand out
+    atomic_long failed;
+} Runner_workers_t;
+
+/* the machine of a worker, kept from one job to the next */
+typedef struct runner_worker {
+    Machine_t machine;
+    Block_cache_t cache;
+    Jit_type_t jit;
+    Watch_t watch;                          ///< looks for stop values, set up by the first job that has one
+    int blocks;
+    int jitting;
+    int watching;
+    Machine_snapshot_t image;               ///< machine as the last setup left it
+    const Runner_job_t* setup;              ///< job the image was set up for, NULL if none
+    const Loader_rom_t* rom;                ///< mapped by the setup, NULL if none
+} Runner_worker_t;
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+/* order of two names, none first */
+static int compare_path(const char* a, const char* b) {
+    if( (a == NULL) || (b == NULL) ) {
+        return (a != NULL) - (b != NULL);
+    }
+    return strcmp(a, b);
+}
+
+/* order of two setups, 0 if the jobs load the same memory and start at the same place */
+static int compare_setup(const Runner_job_t* a, const Runner_job_t* b) {
+    int order = compare_path(a->program, b->program);
+
+    if(order == 0) {
+        order = compare_path(a->rom, b->rom);
+    }
+    return (order != 0) ? order : (int) a->address - (int) b->address;
+}
+
+/* back to cleared RAM, with nothing mapped and no image */
+static void clear(Runner_worker_t* w) {
+    Machine_t* m = &w->machine;
+
+    memory_unmap(&m->mem, 0, MEMORY_PAGES);
+    memset(m->mem.data, 0, MEMORY_SIZE);
+    m->base = NULL;
+    if(w->setup != NULL) {
+        machine_snapshot_free(&w->image);
+        w->setup = NULL;
+    }
+}
+
+/* put the machine in the state the job starts in, the image of the last setup when it fits */
+static int prepare(Runner_worker_t* w, const Runner_t* runner, const Runner_job_t* job) {
+    Machine_t* m = &w->machine;
+    const Loader_rom_t* rom = NULL;
+    Loader_info_t info;
+
+    if( (w->setup != NULL) && (compare_setup(w->setup, job) == 0) ) {
+        return machine_restore(m, &w->image);
+    }
+
+    /* opened before the old one is closed, a ROM both use stays mapped */
+    if( (job->rom != NULL) && ((rom = loader_rom_open(job->rom)) == NULL) ) {
+        return -1;
+    }
+    clear(w);
+    if(w->rom != NULL) {
+        loader_rom_close(w->rom);
+    }
+    w->rom = rom;
+
+    int vector = 0;
+    if(rom != NULL) {
+        const uint32_t pages = (rom->size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+        const uint16_t covered = (pages < MEMORY_PAGES) ? (uint16_t) pages : MEMORY_PAGES;
+        loader_rom_map(&m->mem, rom, (uint8_t) (MEMORY_PAGES - covered), covered);
+        vector = 1;
+    }
+
+    info.entry = -1;
+    if(job->program != NULL) {
+        if(loader_load(&m->mem, job->program, LOADER_AUTO, job->address, &info) != 0) {
+            return -1;
+        }
+        vector |= (info.first <= RESET_VECTOR) && (info.last >= RESET_VECTOR + 1);
+    }
+
+    cpu_initialize(&m->cpu, runner->variant);
+    cpu_reset(&m->cpu, &m->mem);
+    if(info.entry >= 0) {
+        m->cpu.PC = (uint16_t) info.entry;
+    } else if( !vector && (job->program != NULL) ) {
+        m->cpu.PC = info.first;
+    }
+
+    if(machine_snapshot(m, &w->image) != 0) {
+        return -1;
+    }
+    w->setup = job;
+
+    /* the job runs on the image from the start, so the next one only maps its dirty pages back */
+    return machine_restore(m, &w->image);
+}
+
+/* why the CPU stopped, RUNNER_LIMIT if it goes on */
+static Runner_stop stopped(Runner_worker_t* w, const Runner_job_t* job, uint16_t brk) {
+    CPU_type_t* cpu = &w->machine.cpu;
+
+    switch(cpu->state) {
+        case CPU_STOPPED:
+            return RUNNER_STP;
+        case CPU_WAITING:
+            return RUNNER_WAI;
+        case CPU_BREAK:
+            break;
+        default:
+            return RUNNER_LIMIT;
+    }
+
+    if( w->watching && (w->watch.stop_range >= 0) ) {
+        w->watch.stop_range = -1;
+        if(w->watch.stop.value == job->stop_value) {
+            return RUNNER_MEMORY;
+        }
+    }
+    if( (job->stops & RUNNER_STOP_PC) && (cpu->PC == job->stop_pc) ) {
+        return RUNNER_PC;
+    }
+    if( (job->stops & RUNNER_STOP_BRK) && (cpu->PC == brk) ) {
+        return RUNNER_BRK;
+    }
+
+    /* another value written to the stop address */
+    cpu_resume(cpu);
+    return RUNNER_LIMIT;
+}
+
+/* run on whatever is attached, the stop addresses are breakpoints */
+static Runner_stop run_fast(Runner_worker_t* w, const Runner_job_t* job, uint16_t brk) {
+    CPU_type_t* cpu = &w->machine.cpu;
+    const uint64_t end = (job->cycles != 0) ? cpu->cycles + job->cycles : UINT64_MAX;
+
+    while(cpu->cycles < end) {
+        cpu_run(cpu, &w->machine.mem, end - cpu->cycles);
+
+        const Runner_stop stop = stopped(w, job, brk);
+        if(stop != RUNNER_LIMIT) {
+            return stop;
+        }
+    }
+    return RUNNER_LIMIT;
+}
+
+/* run instruction by instruction, counting them */
+static Runner_stop run_stepped(Runner_worker_t* w, Runner_job_t* job, uint16_t brk) {
+    CPU_type_t* cpu = &w->machine.cpu;
+    const uint64_t start = cpu->cycles;
+
+    for(;;) {
+        if( (job->stops & RUNNER_STOP_PC) && (cpu->PC == job->stop_pc) ) {
+            return RUNNER_PC;
+        }
+        if( (job->stops & RUNNER_STOP_BRK) && (cpu->PC == brk) ) {
+            return RUNNER_BRK;
+        }
+        if( ((job->cycles != 0) && (cpu->cycles - start >= job->cycles)) ||
+            ((job->instructions != 0) && (job->instructions_run >= job->instructions)) ) {
+            return RUNNER_LIMIT;
+        }
+
+        cpu_step(cpu, &w->machine.mem);
+        job->instructions_run++;
+
+        const Runner_stop stop = stopped(w, job, brk);
+        if(stop != RUNNER_LIMIT) {
+            return stop;
+        }
+    }
+}
+
+static void run_job(Runner_worker_t* w, const Runner_t* runner, Runner_job_t* job) {
+    Machine_t* m = &w->machine;
+    CPU_type_t* cpu = &m->cpu;
+    const int stepped = !w->blocks || (job->instructions != 0);
+    int range = -1;
+    uint16_t brk = 0;
+
+    job->stop = RUNNER_ERROR;
+    job->cycles_run = 0;
+    job->instructions_run = 0;
+    job->stepped = stepped;
+    job->seconds = 0;
+
+    if(prepare(w, runner, job) != 0) {
+        /* whatever it got to is no image to start the next job from */
+        if(w->setup == NULL) {
+            clear(w);
+        }
+        return;
+    }
+    if(job->reset >= 0) {
+        cpu->PC = (uint16_t) job->reset;
+    }
+    if(job->stops & RUNNER_STOP_BRK) {
+        brk = (uint16_t) (mem_peek8(&m->mem, IRQ_VECTOR) | (mem_peek8(&m->mem, IRQ_VECTOR + 1) << 8));
+    }
+
+    int ready = 1;
+    if(!stepped) {
+        if(job->stops & RUNNER_STOP_PC) {
+            ready = (block_cache_set_breakpoint(&w->cache, job->stop_pc) == 0);
+        }
+        if(job->stops & RUNNER_STOP_BRK) {
+            ready &= (block_cache_set_breakpoint(&w->cache, brk) == 0);
+        }
+    }
+    if(job->stops & RUNNER_STOP_MEMORY) {
+        if(!w->watching) {
+            w->watching = (watch_initialize(&w->watch, cpu, &m->mem, 0) == 0);
+        }
+        if(w->watching) {
+            range = watch_add(&w->watch, job->stop_address, job->stop_address, WATCH_WRITE, 1);
+        }
+        ready &= (range >= 0);
+    }
+
+    if(ready) {
+        const uint64_t start = cpu->cycles;
+        const double t = now_seconds();
+
+        job->stop = stepped ? run_stepped(w, job, brk) : run_fast(w, job, brk);
+        job->seconds = now_seconds() - t;
+        job->cycles_run = cpu->cycles - start;
+        job->PC = cpu->PC;
+        job->AC = cpu->AC;
+        job->X = cpu->X;
+        job->Y = cpu->Y;
+        job->SP = cpu->SP;
+        job->SR = cpu->SR;
+    }
+
+    if(!stepped) {
+        if(job->stops & RUNNER_STOP_PC) {
+            block_cache_clear_breakpoint(&w->cache, job->stop_pc);
+        }
+        if(job->stops & RUNNER_STOP_BRK) {
+            block_cache_clear_breakpoint(&w->cache, brk);
+        }
+    }
+    if(range >= 0) {
+        watch_remove(&w->watch, range);
+    }
+}
+
+static Runner_worker_t* worker_create(const Runner_t* runner) {
+    Runner_worker_t* w = (Runner_worker_t*) calloc(1, sizeof(Runner_worker_t));
+
+    if(w == NULL) {
+        return NULL;
+    }
+    if(machine_initialize(&w->machine, runner->variant) != 0) {
+        free(w);
+        return NULL;
+    }
+    w->blocks = runner->blocks && (block_cache_initialize(&w->cache, &w->machine.mem, runner->variant) == 0);
+    w->jitting = w->blocks && runner->jit && (jit_initialize(&w->jit, &w->cache, 0) == 0);
+    return w;
+}
+
+static void worker_free(Runner_worker_t* w) {
+    if(w->watching) {
+        watch_free(&w->watch);
+    }
+    if(w->jitting) {
+        jit_free(&w->jit);
+    }
+    if(w->blocks) {
+        block_cache_free(&w->cache);
+    }
+    /* RAM of its own again before the image and the ROM go */
+    clear(w);
+    if(w->rom != NULL) {
+        loader_rom_close(w->rom);
+    }
+    machine_free(&w->machine);
+    free(w);
+}
+
+static void* runner_worker(void* arg) {
+    Runner_workers_t* workers = (Runner_workers_t*) arg;
+    Runner_t* runner = workers->runner;
+    Runner_worker_t* w = NULL;
+
+    for(;;) {
+        const size_t next = atomic_fetch_add(&workers->next, 1);
+        if(next >= runner->count) {
+            break;
+        }
+        Runner_job_t* job = workers->order[next];
+
+        if(w == NULL) {
+            w = worker_create(runner);
+        }
+        if(w != NULL) {
+            run_job(w, runner, job);
+        } else {
+            job->stop = RUNNER_ERROR;
+        }
+        if(job->stop == RUNNER_ERROR) {
+            atomic_fetch_add(&workers->failed, 1);
+        }
+    }
+
+    if(w != NULL) {
+        worker_free(w);
+    }
+    return NULL;
+}
+
+static int compare_order(const void* a, const void* b) {
+    Runner_job_t* const i = *(Runner_job_t* const*) a;
+    Runner_job_t* const j = *(Runner_job_t* const*) b;
+    const int order = compare_setup(i, j);
+
+    /* stable, the runs of a setup stay in the order they were given */
+    return (order != 0) ? order : (i > j) - (i < j);
+}
+
+/**
+ * run every job
+ * the calling thread is one of the workers
+ * @param runner jobs and settings
+ * @return number of jobs that could not be run, -1 if the threads could not be allocated
+ */
+long runner_run(Runner_t* runner) {
+    Runner_workers_t workers;
+    unsigned count = runner->threads;
+
+    if(count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (online > 0) ? (unsigned) online : 1;
+    }
+    if(count > runner->count) {
+        count = runner->count ? (unsigned) runner->count : 1;
+    }
+
+    pthread_t* threads = (pthread_t*) calloc(count, sizeof(pthread_t));
+    Runner_job_t** order = (Runner_job_t**) malloc((runner->count ? runner->count : 1) * sizeof(Runner_job_t*));
+    if( (threads == NULL) || (order == NULL) ) {
+        free(threads);
+        free(order);
+        return -1;
+    }
+    for(size_t i = 0; i < runner->count; i++) {
+        order[i] = &runner->jobs[i];
+    }
+    qsort(order, runner->count, sizeof(Runner_job_t*), compare_order);
+
+    workers.runner = runner;
+    workers.order = order;
+    atomic_init(&workers.next, 0);
+    atomic_init(&workers.failed, 0);
+
+    /* the workers that did start take the jobs of the ones that did not */
+    unsigned started = 1;
+    for(; started < count; started++) {
+        if(pthread_create(&threads[started], NULL, runner_worker, &workers) != 0) {
+            break;
+        }
+    }
+
+    runner_worker(&workers);
+
+    for(unsigned i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(order);
+
+    return atomic_load(&workers.failed);
+}
+
+/**
+ * name of a stop reason
+ * @param stop stop reason
+ */
+const char* runner_stop_to_str(Runner_stop stop) {
+    switch(stop) {
+        case RUNNER_LIMIT:
+            return "limit";
+        case RUNNER_PC:
+            return "pc";
+        case RUNNER_BRK:
+            return "brk";
+        case RUNNER_MEMORY:
+            return "memory";
+        case RUNNER_STP:
+            return "stp";
+        case RUNNER_WAI:
+            return "wai";
+        default:
+            return "error";
+    }
+}
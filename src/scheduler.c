@@ -0,0 +1,220 @@
+/**
+ * @file scheduler.c
+ * @brief cycle stamped events that devices post to the CPU they are attached to
+ * @author Edwin
+ */
+
+#include <stdlib.h>
+#include "scheduler.h"
+
+#define SCHEDULER_CAPACITY 16               ///< default room in the queue
+
+/* a comes before b */
+static int earlier(const Scheduler_event_t* a, const Scheduler_event_t* b) {
+    return (a->when < b->when) || ( (a->when == b->when) && (a->order < b->order) );
+}
+
+static void sift_up(Scheduler_event_t* heap, size_t i) {
+    Scheduler_event_t event = heap[i];
+
+    while(i > 0) {
+        size_t parent = (i - 1) / 2;
+        if(!earlier(&event, &heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = event;
+}
+
+static void sift_down(Scheduler_event_t* heap, size_t count, size_t i) {
+    Scheduler_event_t event = heap[i];
+
+    for(;;) {
+        size_t child = 2 * i + 1;
+        if(child >= count) {
+            break;
+        }
+        if( (child + 1 < count) && earlier(&heap[child + 1], &heap[child]) ) {
+            child++;
+        }
+        if(!earlier(&heap[child], &event)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = event;
+}
+
+/**
+ * create an empty queue
+ * @param s scheduler struct
+ * @param capacity initial room, 0 for SCHEDULER_CAPACITY
+ * @return 0 on success, -1 if it could not be allocated
+ */
+int scheduler_initialize(Scheduler_t* s, size_t capacity) {
+    if(capacity == 0) {
+        capacity = SCHEDULER_CAPACITY;
+    }
+
+    s->heap = malloc(capacity * sizeof(Scheduler_event_t));
+    s->count = 0;
+    s->capacity = (s->heap != NULL) ? capacity : 0;
+    s->posted = 0;
+    s->cpu = NULL;
+    s->horizon = 0;
+
+    return (s->heap != NULL) ? 0 : -1;
+}
+
+/**
+ * release the queue
+ * @param s scheduler struct
+ */
+void scheduler_free(Scheduler_t* s) {
+    free(s->heap);
+    s->heap = NULL;
+    s->count = 0;
+    s->capacity = 0;
+}
+
+/**
+ * run the events of a CPU
+ * @param s scheduler struct
+ * @param cpu CPU to attach to
+ */
+void scheduler_attach(Scheduler_t* s, CPU_type_t* cpu) {
+    s->cpu = cpu;
+    s->horizon = 0;
+    cpu->events = s;
+}
+
+/**
+ * stop running the events of a CPU
+ * @param cpu CPU with a scheduler attached
+ */
+void scheduler_detach(CPU_type_t* cpu) {
+    if(cpu->events != NULL) {
+        cpu->events->cpu = NULL;
+        cpu->events = NULL;
+    }
+}
+
+/**
+ * post an event
+ * an event due before the end of the slice the CPU is running stops the core after the current
+ * instruction, the run loop then runs the slice up to the event
+ * @param s scheduler struct
+ * @param when cycle the event is due
+ * @param callback function to call
+ * @param context handed to the callback
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int scheduler_post(Scheduler_t* s, uint64_t when, scheduler_callback_t callback, void* context) {
+    if(s->count == s->capacity) {
+        size_t capacity = (s->capacity != 0) ? 2 * s->capacity : SCHEDULER_CAPACITY;
+        Scheduler_event_t* heap = realloc(s->heap, capacity * sizeof(Scheduler_event_t));
+
+        if(heap == NULL) {
+            return -1;
+        }
+        s->heap = heap;
+        s->capacity = capacity;
+    }
+
+    s->heap[s->count] = (Scheduler_event_t) { when, s->posted++, callback, context };
+    sift_up(s->heap, s->count++);
+
+    if( (when < s->horizon) && (s->cpu != NULL) && (s->cpu->state == CPU_RUNNING) ) {
+        s->cpu->state = CPU_PENDING;
+    }
+
+    return 0;
+}
+
+/**
+ * take events out of the queue
+ * @param s scheduler struct
+ * @param callback function the events call
+ * @param context context the events were posted with
+ * @return number of events taken out
+ */
+size_t scheduler_cancel(Scheduler_t* s, scheduler_callback_t callback, void* context) {
+    size_t kept = 0;
+
+    for(size_t i = 0; i < s->count; i++) {
+        if( (s->heap[i].callback != callback) || (s->heap[i].context != context) ) {
+            s->heap[kept++] = s->heap[i];
+        }
+    }
+
+    const size_t removed = s->count - kept;
+    s->count = kept;
+    if(removed != 0) {
+        for(size_t i = kept / 2; i-- > 0; ) {
+            sift_down(s->heap, s->count, i);
+        }
+    }
+
+    return removed;
+}
+
+/* the context of the interrupt events is the IRQ lines they change */
+static void irq_assert(void* context, CPU_type_t* cpu, uint64_t now) {
+    (void) now;
+    cpu_irq_assert(cpu, (uint32_t) (uintptr_t) context);
+}
+
+static void irq_release(void* context, CPU_type_t* cpu, uint64_t now) {
+    (void) now;
+    cpu_irq_release(cpu, (uint32_t) (uintptr_t) context);
+}
+
+static void nmi(void* context, CPU_type_t* cpu, uint64_t now) {
+    (void) context;
+    (void) now;
+    cpu_nmi(cpu);
+}
+
+/**
+ * post an event changing IRQ lines
+ * @param s scheduler struct
+ * @param when cycle the event is due
+ * @param lines IRQ lines to change
+ * @param assert assert them if not 0, release them if 0
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int scheduler_irq(Scheduler_t* s, uint64_t when, uint32_t lines, int assert) {
+    return scheduler_post(s, when, assert ? irq_assert : irq_release, (void*) (uintptr_t) lines);
+}
+
+/**
+ * post an event raising an NMI
+ * @param s scheduler struct
+ * @param when cycle the event is due
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int scheduler_nmi(Scheduler_t* s, uint64_t when) {
+    return scheduler_post(s, when, nmi, NULL);
+}
+
+/**
+ * run the events that are due
+ * an event is taken out of the queue before its callback runs, so the callback may post it again
+ * @param s scheduler struct
+ * @param now cycle counter of the CPU
+ */
+void scheduler_run(Scheduler_t* s, uint64_t now) {
+    while( (s->count != 0) && (s->heap[0].when <= now) ) {
+        Scheduler_event_t event = s->heap[0];
+
+        s->heap[0] = s->heap[--s->count];
+        if(s->count != 0) {
+            sift_down(s->heap, s->count, 0);
+        }
+
+        event.callback(event.context, s->cpu, now);
+    }
+}
@@ -0,0 +1,572 @@
+/**
+ * @file trace.c
+ * @brief ring buffer of the last instructions executed, and its compressed file format
+ * @author Edwin
+ */
+
+/**
+ * A file starts with TRACE_MAGIC and the CPU variant byte, followed by one record per
+ * instruction:
+ *
+ *   fields    byte, which of the fields below are present
+ *   opcode    byte
+ *   operand   the instruction's operand bytes, 0 to 2 of them
+ *   pc        2 bytes, when it is not the previous PC plus the length of the previous instruction
+ *   AC X Y SR SP   1 byte each, when it changed
+ *   address   2 bytes, when the instruction has an effective address that is not its operand
+ *   cycles    zigzag LEB128 varint, the difference from the previous stamp plus the base cycles
+ *             of the previous instruction, when it is not 0
+ *
+ * Multi-byte fields are little endian. Before the first record the previous entry is all zero,
+ * which makes it a BRK at address 0.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include "config.h"
+#include "trace.h"
+
+#define TRACE_BUFFER (64 * 1024)            ///< bytes the stream thread encodes before each write
+#define TRACE_RECORD_MAX 24                 ///< longest record, 13 bytes of fields and a 10 byte varint
+
+enum {
+    FIELD_PC = 0x01,
+    FIELD_AC = 0x02,
+    FIELD_X = 0x04,
+    FIELD_Y = 0x08,
+    FIELD_SR = 0x10,
+    FIELD_SP = 0x20,
+    FIELD_ADDRESS = 0x40,
+    FIELD_CYCLES = 0x80
+};
+
+/* encoder or decoder, both only remember the previous entry */
+typedef struct trace_coder {
+    CPU_variant variant;
+    Trace_entry_t last;
+} Trace_coder_t;
+
+static int has_address(Addressing_mode mode) {
+    switch(mode) {
+        case ZPG: case ZPG_INDX_X: case ZPG_INDX_Y: case ZPG_IND: case ZPG_INDX_IND: case ZPG_IND_INDX_Y:
+        case ABS_A: case ABS_INDX_X: case ABS_INDX_Y: case ABS_IND: case ABS_INDX_IND: case ZPG_PC_REL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* PC and cycle stamp of the next entry if the previous one ran straight through */
+static void predict(const Trace_coder_t* coder, uint16_t* pc, uint64_t* cycles) {
+    const Instruction* last = &cpu_instructions[coder->variant][coder->last.opcode];
+
+    *pc = (uint16_t) (coder->last.pc + cpu_instruction_length(last->addr_mode));
+    *cycles = coder->last.cycles + last->cycles;
+}
+
+#if USE_TRACE
+
+static size_t encode(Trace_coder_t* coder, const Trace_entry_t* e, uint8_t* out) {
+    const Instruction* ins = &cpu_instructions[coder->variant][e->opcode];
+    const uint8_t length = cpu_instruction_length(ins->addr_mode);
+    const Trace_entry_t* last = &coder->last;
+    uint16_t pc;
+    uint64_t cycles;
+    uint8_t fields = 0;
+    size_t n = 2;
+
+    predict(coder, &pc, &cycles);
+
+    out[1] = e->opcode;
+    if(length > 1) {
+        out[n++] = (uint8_t) e->operand;
+    }
+    if(length > 2) {
+        out[n++] = (uint8_t) (e->operand >> 8);
+    }
+    if(e->pc != pc) {
+        fields |= FIELD_PC;
+        out[n++] = (uint8_t) e->pc;
+        out[n++] = (uint8_t) (e->pc >> 8);
+    }
+    if(e->AC != last->AC) {
+        fields |= FIELD_AC;
+        out[n++] = e->AC;
+    }
+    if(e->X != last->X) {
+        fields |= FIELD_X;
+        out[n++] = e->X;
+    }
+    if(e->Y != last->Y) {
+        fields |= FIELD_Y;
+        out[n++] = e->Y;
+    }
+    if(e->SR != last->SR) {
+        fields |= FIELD_SR;
+        out[n++] = e->SR;
+    }
+    if(e->SP != last->SP) {
+        fields |= FIELD_SP;
+        out[n++] = e->SP;
+    }
+    if(e->has_address && (e->address != e->operand)) {
+        fields |= FIELD_ADDRESS;
+        out[n++] = (uint8_t) e->address;
+        out[n++] = (uint8_t) (e->address >> 8);
+    }
+    if(e->cycles != cycles) {
+        int64_t delta = (int64_t) (e->cycles - cycles);
+        uint64_t zigzag = ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+
+        fields |= FIELD_CYCLES;
+        while(zigzag >= 0x80) {
+            out[n++] = (uint8_t) (zigzag | 0x80);
+            zigzag >>= 7;
+        }
+        out[n++] = (uint8_t) zigzag;
+    }
+
+    out[0] = fields;
+    coder->last = *e;
+    return n;
+}
+
+/* effective address of the instruction about to run, read without touching devices */
+static int effective_address(const CPU_type_t* cpu, const Memory_type_t* mem, Addressing_mode mode, uint16_t operand, uint16_t* address) {
+    uint16_t pointer;
+
+    switch(mode) {
+        case ZPG:
+        case ABS_A:
+            *address = operand;
+            break;
+        case ZPG_INDX_X:
+            *address = (uint8_t) (operand + cpu->X);
+            break;
+        case ZPG_INDX_Y:
+            *address = (uint8_t) (operand + cpu->Y);
+            break;
+        case ZPG_IND:
+        case ZPG_INDX_IND:
+        case ZPG_IND_INDX_Y:
+            pointer = (uint8_t) (operand + ((mode == ZPG_INDX_IND) ? cpu->X : 0));
+            *address = mem_peek8(mem, pointer) | (mem_peek8(mem, (uint8_t) (pointer + 1)) << 8);
+            if(mode == ZPG_IND_INDX_Y) {
+                *address += cpu->Y;
+            }
+            break;
+        case ABS_INDX_X:
+            *address = operand + cpu->X;
+            break;
+        case ABS_INDX_Y:
+            *address = operand + cpu->Y;
+            break;
+        case ABS_IND:
+            /* the NMOS core does not carry into the high byte of the pointer */
+            pointer = (cpu->variant == CPU_NMOS) ? ((operand & 0xFF00) | ((operand + 1) & 0x00FF)) : (uint16_t) (operand + 1);
+            *address = mem_peek8(mem, operand) | (mem_peek8(mem, pointer) << 8);
+            break;
+        case ABS_INDX_IND:
+            pointer = operand + cpu->X;
+            *address = mem_peek8(mem, pointer) | (mem_peek8(mem, (uint16_t) (pointer + 1)) << 8);
+            break;
+        case ZPG_PC_REL:
+            *address = operand & 0xFF;
+            break;
+        default:
+            *address = 0;
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * create the ring
+ * @param t trace
+ * @param entries instructions to keep
+ * @return 0 on success
+ */
+int trace_initialize(Trace_t* t, size_t entries) {
+    uint64_t capacity = 1;
+
+    memset(t, 0, sizeof(*t));
+
+    if(entries == 0) {
+        entries = TRACE_ENTRIES;
+    }
+    while(capacity < entries) {
+        capacity <<= 1;
+    }
+
+    t->ring = (Trace_entry_t*) malloc(capacity * sizeof(Trace_entry_t));
+    if(t->ring == NULL) {
+        return -1;
+    }
+
+    t->capacity = capacity;
+    t->variant = CPU_DEFAULT_VARIANT;
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->streaming, 0);
+    atomic_init(&t->stop, 0);
+    return 0;
+}
+
+/**
+ * release the ring
+ * @param t trace
+ */
+void trace_free(Trace_t* t) {
+    if(atomic_load(&t->streaming)) {
+        trace_stream_stop(t);
+    }
+    free(t->ring);
+    t->ring = NULL;
+}
+
+/**
+ * start recording a CPU
+ * @param t trace
+ * @param cpu CPU to record
+ */
+void trace_attach(Trace_t* t, CPU_type_t* cpu) {
+    t->variant = cpu->variant;
+    cpu->trace = t;
+}
+
+/**
+ * stop recording a CPU
+ * @param cpu recorded CPU
+ */
+void trace_detach(CPU_type_t* cpu) {
+    cpu->trace = NULL;
+}
+
+/**
+ * store one instruction
+ * @param t trace
+ * @param cpu CPU about to run the instruction
+ * @param mem its address space
+ * @param opcode opcode byte
+ */
+void trace_record(Trace_t* t, const CPU_type_t* cpu, const Memory_type_t* mem, uint8_t opcode) {
+    const uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    const Instruction* ins = &cpu_instructions[t->variant][opcode];
+    const uint8_t length = cpu_instruction_length(ins->addr_mode);
+
+    if(atomic_load_explicit(&t->streaming, memory_order_relaxed)) {
+        /* wait for the stream thread to free a slot */
+        while( (head - atomic_load_explicit(&t->tail, memory_order_acquire) >= t->capacity) &&
+               atomic_load_explicit(&t->streaming, memory_order_relaxed) ) {
+            sched_yield();
+        }
+    }
+
+    Trace_entry_t* e = &t->ring[head & (t->capacity - 1)];
+    e->cycles = cpu->cycles;
+    e->pc = cpu->PC;
+    e->operand = (length == 1) ? 0 :
+                 (length == 2) ? mem_peek8(mem, (uint16_t) (cpu->PC + 1)) :
+                                 mem_peek8(mem, (uint16_t) (cpu->PC + 1)) | (mem_peek8(mem, (uint16_t) (cpu->PC + 2)) << 8);
+    e->opcode = opcode;
+    e->AC = cpu->AC;
+    e->X = cpu->X;
+    e->Y = cpu->Y;
+    e->SR = cpu->SR;
+    e->SP = cpu->SP;
+    e->has_address = (uint8_t) effective_address(cpu, mem, ins->addr_mode, e->operand, &e->address);
+
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+static int write_header(CPU_variant variant, FILE* out) {
+    uint8_t header[sizeof(TRACE_MAGIC)];
+
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+    header[sizeof(TRACE_MAGIC) - 1] = (uint8_t) variant;
+    return (fwrite(header, 1, sizeof(header), out) == sizeof(header)) ? 0 : -1;
+}
+
+/**
+ * write the ring to a file
+ * @param t trace
+ * @param out file to write to
+ * @return 0 on success
+ */
+int trace_save(const Trace_t* t, FILE* out) {
+    const uint64_t head = atomic_load(&t->head);
+    uint64_t index = (head > t->capacity) ? head - t->capacity : 0;
+    Trace_coder_t coder = { .variant = t->variant };
+    uint8_t* buffer = (uint8_t*) malloc(TRACE_BUFFER);
+    int result = -1;
+
+    if( (buffer == NULL) || (write_header(t->variant, out) != 0) ) {
+        free(buffer);
+        return -1;
+    }
+
+    while(index < head) {
+        size_t used = 0;
+        while( (index < head) && (used + TRACE_RECORD_MAX <= TRACE_BUFFER) ) {
+            used += encode(&coder, &t->ring[index++ & (t->capacity - 1)], buffer + used);
+        }
+        if(fwrite(buffer, 1, used, out) != used) {
+            free(buffer);
+            return -1;
+        }
+    }
+
+    result = (fflush(out) == 0) ? 0 : -1;
+    free(buffer);
+    return result;
+}
+
+/* the stream thread, encodes what the core has published and hands the slots back */
+static void* stream_worker(void* arg) {
+    Trace_t* t = (Trace_t*) arg;
+    Trace_coder_t coder = { .variant = t->variant };
+    uint8_t buffer[TRACE_BUFFER];
+    const struct timespec idle = { 0, 1000000 };
+
+    for(;;) {
+        const uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+
+        if(tail == head) {
+            if(atomic_load(&t->stop)) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        size_t used = 0;
+        while( (tail != head) && (used + TRACE_RECORD_MAX <= TRACE_BUFFER) ) {
+            used += encode(&coder, &t->ring[tail++ & (t->capacity - 1)], buffer + used);
+        }
+
+        if(fwrite(buffer, 1, used, t->out) != used) {
+            t->error = 1;
+        }
+        t->bytes += used;
+        atomic_store_explicit(&t->tail, tail, memory_order_release);
+    }
+
+    if(fflush(t->out) != 0) {
+        t->error = 1;
+    }
+    return NULL;
+}
+
+/**
+ * start the stream thread
+ * @param t trace
+ * @param out file to write to
+ * @return 0 on success
+ */
+int trace_stream_start(Trace_t* t, FILE* out) {
+    if( atomic_load(&t->streaming) || (write_header(t->variant, out) != 0) ) {
+        return -1;
+    }
+
+    t->out = out;
+    t->error = 0;
+    t->bytes = sizeof(TRACE_MAGIC);
+    atomic_store(&t->tail, atomic_load(&t->head));
+    atomic_store(&t->stop, 0);
+    atomic_store(&t->streaming, 1);
+
+    if(pthread_create(&t->writer, NULL, stream_worker, t) != 0) {
+        atomic_store(&t->streaming, 0);
+        t->out = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * drain the ring and stop the stream thread
+ * @param t trace
+ * @return 0 if every write succeeded
+ */
+int trace_stream_stop(Trace_t* t) {
+    if(!atomic_load(&t->streaming)) {
+        return -1;
+    }
+
+    atomic_store(&t->stop, 1);
+    pthread_join(t->writer, NULL);
+    atomic_store(&t->streaming, 0);
+    t->out = NULL;
+
+    return t->error ? -1 : 0;
+}
+
+#else
+
+/* recording is compiled out, the CPU has nowhere to hang a trace */
+
+int trace_initialize(Trace_t* t, size_t entries) {
+    (void) entries;
+    memset(t, 0, sizeof(*t));
+    return -1;
+}
+
+void trace_free(Trace_t* t) {
+    (void) t;
+}
+
+void trace_attach(Trace_t* t, CPU_type_t* cpu) {
+    (void) t;
+    (void) cpu;
+}
+
+void trace_detach(CPU_type_t* cpu) {
+    (void) cpu;
+}
+
+void trace_record(Trace_t* t, const CPU_type_t* cpu, const Memory_type_t* mem, uint8_t opcode) {
+    (void) t;
+    (void) cpu;
+    (void) mem;
+    (void) opcode;
+}
+
+int trace_save(const Trace_t* t, FILE* out) {
+    (void) t;
+    (void) out;
+    return -1;
+}
+
+int trace_stream_start(Trace_t* t, FILE* out) {
+    (void) t;
+    (void) out;
+    return -1;
+}
+
+int trace_stream_stop(Trace_t* t) {
+    (void) t;
+    return -1;
+}
+
+#endif
+
+/*
+ * reading
+ */
+
+/**
+ * check the header of a trace file
+ * @param r reader
+ * @param in file positioned at its start
+ * @return 0 on success
+ */
+int trace_reader_open(Trace_reader_t* r, FILE* in) {
+    uint8_t header[sizeof(TRACE_MAGIC)];
+
+    memset(r, 0, sizeof(*r));
+
+    if( (fread(header, 1, sizeof(header), in) != sizeof(header)) ||
+        (memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0) ||
+        (header[sizeof(TRACE_MAGIC) - 1] >= CPU_VARIANTS) ) {
+        return -1;
+    }
+
+    r->in = in;
+    r->variant = (CPU_variant) header[sizeof(TRACE_MAGIC) - 1];
+    return 0;
+}
+
+/* next byte of a record, -1 past the end */
+static int next(Trace_reader_t* r, uint8_t* value) {
+    int c = getc(r->in);
+    *value = (uint8_t) c;
+    return (c == EOF) ? -1 : 0;
+}
+
+static int next16(Trace_reader_t* r, uint16_t* value) {
+    uint8_t lo, hi;
+    if( (next(r, &lo) != 0) || (next(r, &hi) != 0) ) {
+        return -1;
+    }
+    *value = lo | (hi << 8);
+    return 0;
+}
+
+/**
+ * decode the next record
+ * @param r reader
+ * @param entry the instruction
+ * @return 1 if one was read, 0 at the end of the file, -1 if it is cut short
+ */
+int trace_read(Trace_reader_t* r, Trace_entry_t* entry) {
+    Trace_coder_t coder = { r->variant, r->last };
+    Trace_entry_t e = r->last;
+    uint8_t fields;
+    uint8_t byte;
+
+    int c = getc(r->in);
+    if(c == EOF) {
+        return 0;
+    }
+    fields = (uint8_t) c;
+
+    predict(&coder, &e.pc, &e.cycles);
+
+    if(next(r, &e.opcode) != 0) {
+        return -1;
+    }
+
+    const Instruction* ins = &cpu_instructions[r->variant][e.opcode];
+    const uint8_t length = cpu_instruction_length(ins->addr_mode);
+
+    e.operand = 0;
+    if(length > 1) {
+        if(next(r, &byte) != 0) {
+            return -1;
+        }
+        e.operand = byte;
+    }
+    if(length > 2) {
+        if(next(r, &byte) != 0) {
+            return -1;
+        }
+        e.operand |= byte << 8;
+    }
+
+    if( ((fields & FIELD_PC) && (next16(r, &e.pc) != 0)) ||
+        ((fields & FIELD_AC) && (next(r, &e.AC) != 0)) ||
+        ((fields & FIELD_X) && (next(r, &e.X) != 0)) ||
+        ((fields & FIELD_Y) && (next(r, &e.Y) != 0)) ||
+        ((fields & FIELD_SR) && (next(r, &e.SR) != 0)) ||
+        ((fields & FIELD_SP) && (next(r, &e.SP) != 0)) ) {
+        return -1;
+    }
+
+    e.has_address = (uint8_t) has_address(ins->addr_mode);
+    e.address = e.has_address ? e.operand : 0;
+    if( (fields & FIELD_ADDRESS) && (next16(r, &e.address) != 0) ) {
+        return -1;
+    }
+
+    if(fields & FIELD_CYCLES) {
+        uint64_t zigzag = 0;
+        unsigned shift = 0;
+        do {
+            if( (shift > 63) || (next(r, &byte) != 0) ) {
+                return -1;
+            }
+            zigzag |= (uint64_t) (byte & 0x7F) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+        e.cycles += (uint64_t) ((int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1));
+    }
+
+    r->last = e;
+    *entry = e;
+    return 1;
+}
@@ -0,0 +1,301 @@
+/**
+ * @file watch.c
+ * @brief read, write and execute watches on ranges of the address space, with a log of their hits
+ * @author Edwin
+ */
+
+/**
+ * A watched page is instrumented with the hooks of the watch, which look for the ranges an access
+ * hits only after the memory map did the access. A page stays instrumented while any range
+ * covers part of it.
+ *
+ * PC has moved past the operand of an instruction by the time it reads or writes memory, in the
+ * interpreter as in the predecoded handlers, and native code leaves the block before an access to
+ * an instrumented page so the handler makes it. The end of the instruction is known, its start is
+ * looked up from there.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "watch.h"
+
+static int covers(const Watch_range_t* r, uint16_t address) {
+    return (uint16_t) (address - r->first) <= (uint16_t) (r->last - r->first);
+}
+
+/* instruction of a decoded block that ends at an address @return 1 if there is one */
+static int decoded_instruction(const Block_cache_t* cache, uint16_t end, uint16_t* start) {
+    const uint16_t last = (uint16_t) (end - 1);
+
+    /* blocks are cut at the end of their page, only the last instruction runs into the next */
+    for(unsigned back = 0; back < 2; back++) {
+        for(const Block_t* block = cache->page[(uint8_t) ((last >> 8) - back)]; block != NULL; block = block->page_next) {
+            if( (uint32_t) last - block->start >= block->end - block->start ) {
+                continue;
+            }
+
+            uint16_t at = block->start;
+            for(uint16_t i = 0; i < block->count; i++) {
+                if(block->ops[i].next == end) {
+                    *start = at;
+                    return 1;
+                }
+                at = block->ops[i].next;
+            }
+        }
+    }
+    return 0;
+}
+
+/* address of the instruction making the access going on */
+static uint16_t instruction(const Watch_t* w) {
+    const uint16_t end = w->cpu->PC;
+    uint16_t start;
+
+    if( (w->cache != NULL) && decoded_instruction(w->cache, end, &start) ) {
+        return start;
+    }
+    if( (w->fetch_length != 0) && ((uint16_t) (end - w->fetch) <= w->fetch_length) ) {
+        return w->fetch;
+    }
+    return end;
+}
+
+static void check(Watch_t* w, uint16_t address, uint8_t value, uint8_t kind) {
+    int hit = 0;
+    int stop = -1;
+
+    for(size_t i = 0; i < w->count; i++) {
+        const Watch_range_t* r = &w->ranges[i];
+
+        if( (r->kinds & kind) && covers(r, address) ) {
+            hit = 1;
+            if(r->stop) {
+                stop = (int) i;
+                break;
+            }
+        }
+    }
+    if(!hit) {
+        return;
+    }
+
+    Watch_hit_t h;
+    h.cycles = w->cpu->cycles;
+    h.pc = (kind == WATCH_EXECUTE) ? address : instruction(w);
+    h.address = address;
+    h.value = value;
+    h.kind = kind;
+
+    if(w->capacity != 0) {
+        w->log[w->hits % w->capacity] = h;
+    }
+    w->hits++;
+
+    if(stop >= 0) {
+        if(w->stop_range < 0) {
+            w->stop_range = stop;
+            w->stop = h;
+        }
+        /* the core stops after the instruction */
+        if( (w->cpu->state == CPU_RUNNING) || (w->cpu->state == CPU_PENDING) ) {
+            w->cpu->state = CPU_BREAK;
+        }
+    }
+}
+
+/* the core fetches the opcode and then the operand bytes in order, before the instruction reads data */
+static void watched_read(void* context, uint16_t address, uint8_t value) {
+    Watch_t* w = (Watch_t*) context;
+
+    if( (w->fetched < w->fetch_length) && (address == (uint16_t) (w->fetch + w->fetched)) ) {
+        w->fetched++;
+        return;
+    }
+    check(w, address, value, WATCH_READ);
+}
+
+static void watched_write(void* context, uint16_t address, uint8_t value) {
+    check((Watch_t*) context, address, value, WATCH_WRITE);
+}
+
+static void watched_execute(void* context, uint16_t address) {
+    Watch_t* w = (Watch_t*) context;
+    const uint8_t opcode = mem_peek8(w->mem, address);
+
+    w->fetch = address;
+    w->fetch_length = cpu_instruction_length(cpu_instructions[w->cpu->variant][opcode].addr_mode);
+    w->fetched = 0;
+    check(w, address, opcode, WATCH_EXECUTE);
+}
+
+/* count a range in or out of the pages it covers, instrumenting the pages it is the first on */
+static void cover(Watch_t* w, const Watch_range_t* r, int add) {
+    const uint8_t first = r->first >> 8;
+    unsigned pages = (uint8_t) ((r->last >> 8) - first) + 1;
+
+    if( (r->last < r->first) && ((r->last >> 8) == first) ) {
+        pages = MEMORY_PAGES;
+    }
+
+    for(unsigned i = 0; i < pages; i++) {
+        const uint8_t page = (uint8_t) (first + i);
+
+        if(add) {
+            if(w->covering[page]++ == 0) {
+                memory_instrument(w->mem, page, 1, &w->hook);
+            }
+        } else if(--w->covering[page] == 0) {
+            memory_instrument(w->mem, page, 1, NULL);
+            if(page == (w->fetch >> 8)) {
+                w->fetch_length = 0;
+            }
+        }
+    }
+}
+
+/**
+ * attach watches
+ * @param w watch
+ * @param cpu CPU making the accesses
+ * @param mem its address space
+ * @param capacity hits the log holds
+ * @return 0 on success, -1 on error
+ */
+int watch_initialize(Watch_t* w, CPU_type_t* cpu, Memory_type_t* mem, size_t capacity) {
+    memset(w, 0, sizeof(*w));
+    w->cpu = cpu;
+    w->mem = mem;
+    w->stop_range = -1;
+    w->hook.read = watched_read;
+    w->hook.write = watched_write;
+    w->hook.execute = watched_execute;
+    w->hook.context = w;
+
+    if(capacity != 0) {
+        w->log = (Watch_hit_t*) calloc(capacity, sizeof(Watch_hit_t));
+        if(w->log == NULL) {
+            return -1;
+        }
+        w->capacity = capacity;
+    }
+
+    if(mem->blocks == NULL) {
+        if(block_cache_initialize(&w->own_cache, mem, cpu->variant) != 0) {
+            free(w->log);
+            w->log = NULL;
+            return -1;
+        }
+        w->owns_cache = 1;
+    } else if(mem->blocks->variant != cpu->variant) {
+        free(w->log);
+        w->log = NULL;
+        return -1;
+    }
+    w->cache = mem->blocks;
+
+    return 0;
+}
+
+/**
+ * release a watch
+ * @param w watch
+ */
+void watch_free(Watch_t* w) {
+    for(size_t i = 0; i < WATCH_RANGES; i++) {
+        watch_remove(w, (int) i);
+    }
+    if(w->owns_cache) {
+        block_cache_free(&w->own_cache);
+        w->owns_cache = 0;
+    }
+    w->cache = NULL;
+
+    free(w->log);
+    w->log = NULL;
+    w->capacity = 0;
+}
+
+/**
+ * watch a range
+ * @param w watch
+ * @param first first byte
+ * @param last last byte
+ * @param kinds accesses to log
+ * @param stop stop the CPU on a hit
+ * @return number of the range, -1 if there is no room
+ */
+int watch_add(Watch_t* w, uint16_t first, uint16_t last, unsigned kinds, int stop) {
+    kinds &= WATCH_ACCESS | WATCH_EXECUTE;
+    if(kinds == 0) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < WATCH_RANGES; i++) {
+        Watch_range_t* r = &w->ranges[i];
+
+        if(r->kinds == 0) {
+            r->first = first;
+            r->last = last;
+            r->kinds = (uint8_t) kinds;
+            r->stop = (stop != 0);
+            if(i >= w->count) {
+                w->count = i + 1;
+            }
+            cover(w, r, 1);
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * stop watching a range
+ * @param w watch
+ * @param range number of the range
+ */
+void watch_remove(Watch_t* w, int range) {
+    if( (range < 0) || (range >= WATCH_RANGES) || (w->ranges[range].kinds == 0) ) {
+        return;
+    }
+
+    cover(w, &w->ranges[range], 0);
+    w->ranges[range].kinds = 0;
+    while( (w->count != 0) && (w->ranges[w->count - 1].kinds == 0) ) {
+        w->count--;
+    }
+}
+
+/**
+ * forget the hits logged so far
+ * @param w watch
+ */
+void watch_clear_log(Watch_t* w) {
+    w->hits = 0;
+}
+
+/**
+ * print the log
+ * the instructions are disassembled from memory as it is now
+ * @param w watch
+ * @param symbols symbols to print addresses with, NULL if none
+ * @param out where to
+ */
+void watch_print(const Watch_t* w, const Disassembler_symbols_t* symbols, FILE* out) {
+    const size_t logged = watch_logged(w);
+
+    if(w->hits > logged) {
+        fprintf(out, "... %llu hits\n", (unsigned long long) (w->hits - logged));
+    }
+    for(size_t i = 0; i < logged; i++) {
+        const Watch_hit_t* h = watch_entry(w, i);
+        const char kind = (h->kind == WATCH_READ) ? 'R' : (h->kind == WATCH_WRITE) ? 'W' : 'X';
+        Disassembler_line_t line;
+
+        if(disassembler_range(w->mem, w->cpu->variant, h->pc, &line, 1, symbols) == 0) {
+            strcpy(line.text, "???");
+        }
+        fprintf(out, "%12llu  %04X  %-28s %c $%04X $%02X\n", (unsigned long long) h->cycles, h->pc, line.text,
+                kind, h->address, h->value);
+    }
+}
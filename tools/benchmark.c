@@ -0,0 +1,1006 @@
+/**
+ * @file benchmark.c
+ * @brief runs a fixed corpus of programs on every core and reports how fast the emulator runs them
+ * @author Edwin
+ *
+ * usage: benchmark [-v nmos|cmos|wdc] [-c cycles] [-r repeats] [-d functional test binary]
+ *                  [-s success address] [-j json file] [-o csv file] [-l label]
+ *
+ * Every program runs for the same number of emulated cycles on the interpreter, the block cache
+ * and the native code tier, the best of the repeats is reported. Klaus Dormann's functional test
+ * runs until it traps when its binary is given with -d; it is not shipped with the emulator.
+ *
+ * The corpus programs also run on BENCH_LANES copies side by side on the lockstep engine, each for
+ * its share of the cycles, with the program mapped into every copy from one shared image. After
+ * every timed run each lane is compared with a machine that ran its share on the interpreter,
+ * registers, interrupt lines and RAM, so the interrupt program checks the engine against the
+ * scalar core with a device and scheduler events.
+ *
+ * The instructions a program executes are counted once, stepping it on the interpreter, so the
+ * timed runs are not slowed down by counting. Host cycles and instructions come from the hardware
+ * counters when perf_event_open lets us have them, and are left out otherwise.
+ *
+ * After a timed run the program is stepped to the end of the pass it is in and its results are
+ * checked, a core that got something wrong is reported as failed whatever its speed. Every entry of
+ * the decimal mode tables is checked against the reference algorithms before the programs run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+#include "memory-map.h"
+#include "block-cache.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "scheduler.h"
+#include "loader.h"
+#include "decimal.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define BENCH_CYCLES 50000000ULL            ///< emulated cycles every program runs for
+#define BENCH_REPEATS 3                     ///< timed runs of every program on every core
+#define BENCH_ORIGIN 0x0400                 ///< where the corpus programs are loaded
+#define BENCH_DATA 0x2000                   ///< 32 pages of test data the programs read
+#define BENCH_DATA_PAGES 32
+#define BENCH_IRQ_PERIOD 100                ///< cycles between the interrupts of the interrupt program
+#define BENCH_IRQ_DEVICE 0xD0               ///< page of the device the interrupt handler acknowledges
+#define BENCH_STEP_LIMIT 100000000ULL       ///< most instructions stepped to finish a pass or reach a trap
+#define BENCH_LANES LOCKSTEP_GROUP          ///< copies of a program the lockstep engine runs
+#define FUNCTIONAL_ORIGIN 0x0400            ///< start of Klaus Dormann's functional test
+#define FUNCTIONAL_SUCCESS 0x3469           ///< where it traps when every test passed, as assembled by default
+
+/* zero page of the corpus programs */
+#define ZP_COUNT 0x06                       ///< primes found by the sieve
+#define ZP_PASSES 0x08                      ///< passes finished, 3 bytes
+#define ZP_CRC 0x0B                         ///< CRC register, 4 bytes
+#define ZP_BCD_SUM 0x14                     ///< BCD sum, 4 bytes
+#define ZP_BCD_DIFFERENCE 0x18              ///< BCD difference
+#define ZP_IRQS 0x20                        ///< interrupts taken, 2 bytes
+
+/*
+ * the corpus, assembled by hand. Each program but the interrupt one runs in passes over its work,
+ * starting again at BENCH_ORIGIN and counting them in ZP_PASSES. Besides the results above, the
+ * zero page holds ptr at $00, i at $02 and j at $04 for the sieve, bits at $0F for the CRC, src
+ * at $10 and dst at $12 for the copy and work at $22 for the interrupt program
+ */
+
+static const uint8_t program_sieve[] = {
+    0xA9, 0x00,             /* 0400  start:  LDA #$00 */
+    0x85, 0x00,             /* 0402  STA ptr */
+    0xA9, 0x20,             /* 0404  LDA #$20 */
+    0x85, 0x01,             /* 0406  STA ptr+1 */
+    0xA2, 0x20,             /* 0408  LDX #$20 */
+    0xA0, 0x00,             /* 040A  LDY #$00 */
+    0xA9, 0x01,             /* 040C  LDA #$01 */
+    0x91, 0x00,             /* 040E  fill:   STA (ptr),Y */
+    0xC8,                   /* 0410  INY */
+    0xD0, 0xFB,             /* 0411  BNE fill */
+    0xE6, 0x01,             /* 0413  INC ptr+1 */
+    0xCA,                   /* 0415  DEX */
+    0xD0, 0xF6,             /* 0416  BNE fill */
+    0x84, 0x06,             /* 0418  STY count */
+    0x84, 0x07,             /* 041A  STY count+1 */
+    0x84, 0x03,             /* 041C  STY i+1 */
+    0xA9, 0x02,             /* 041E  LDA #$02 */
+    0x85, 0x02,             /* 0420  STA i */
+    0xA5, 0x02,             /* 0422  loop:   LDA i */
+    0x85, 0x00,             /* 0424  STA ptr */
+    0xA5, 0x03,             /* 0426  LDA i+1 */
+    0x18,                   /* 0428  CLC */
+    0x69, 0x20,             /* 0429  ADC #$20 */
+    0x85, 0x01,             /* 042B  STA ptr+1 */
+    0xB1, 0x00,             /* 042D  LDA (ptr),Y */
+    0xF0, 0x31,             /* 042F  BEQ next */
+    0xE6, 0x06,             /* 0431  INC count */
+    0xD0, 0x02,             /* 0433  BNE double */
+    0xE6, 0x07,             /* 0435  INC count+1 */
+    0xA5, 0x02,             /* 0437  double: LDA i */
+    0x0A,                   /* 0439  ASL A */
+    0x85, 0x04,             /* 043A  STA j */
+    0xA5, 0x03,             /* 043C  LDA i+1 */
+    0x2A,                   /* 043E  ROL A */
+    0x85, 0x05,             /* 043F  STA j+1 */
+    0xA5, 0x05,             /* 0441  mark:   LDA j+1 */
+    0xC9, 0x20,             /* 0443  CMP #$20 */
+    0xB0, 0x1B,             /* 0445  BCS next */
+    0x69, 0x20,             /* 0447  ADC #$20 */
+    0x85, 0x01,             /* 0449  STA ptr+1 */
+    0xA5, 0x04,             /* 044B  LDA j */
+    0x85, 0x00,             /* 044D  STA ptr */
+    0x98,                   /* 044F  TYA */
+    0x91, 0x00,             /* 0450  STA (ptr),Y */
+    0xA5, 0x04,             /* 0452  LDA j */
+    0x18,                   /* 0454  CLC */
+    0x65, 0x02,             /* 0455  ADC i */
+    0x85, 0x04,             /* 0457  STA j */
+    0xA5, 0x05,             /* 0459  LDA j+1 */
+    0x65, 0x03,             /* 045B  ADC i+1 */
+    0x85, 0x05,             /* 045D  STA j+1 */
+    0x4C, 0x41, 0x04,       /* 045F  JMP mark */
+    0xE6, 0x02,             /* 0462  next:   INC i */
+    0xD0, 0x02,             /* 0464  BNE check */
+    0xE6, 0x03,             /* 0466  INC i+1 */
+    0xA5, 0x03,             /* 0468  check:  LDA i+1 */
+    0xC9, 0x20,             /* 046A  CMP #$20 */
+    0x90, 0xB4,             /* 046C  BCC loop */
+    0xE6, 0x08,             /* 046E  INC passes */
+    0xD0, 0x06,             /* 0470  BNE again */
+    0xE6, 0x09,             /* 0472  INC passes+1 */
+    0xD0, 0x02,             /* 0474  BNE again */
+    0xE6, 0x0A,             /* 0476  INC passes+2 */
+    0x4C, 0x00, 0x04,       /* 0478  again:  JMP start */
+};
+static const uint8_t program_crc32[] = {
+    0xA9, 0xFF,             /* 0400  start:  LDA #$FF */
+    0x85, 0x0B,             /* 0402  STA crc */
+    0x85, 0x0C,             /* 0404  STA crc+1 */
+    0x85, 0x0D,             /* 0406  STA crc+2 */
+    0x85, 0x0E,             /* 0408  STA crc+3 */
+    0xA9, 0x00,             /* 040A  LDA #$00 */
+    0x85, 0x00,             /* 040C  STA ptr */
+    0xA9, 0x20,             /* 040E  LDA #$20 */
+    0x85, 0x01,             /* 0410  STA ptr+1 */
+    0xA2, 0x10,             /* 0412  LDX #$10 */
+    0xA0, 0x00,             /* 0414  LDY #$00 */
+    0xB1, 0x00,             /* 0416  byte:   LDA (ptr),Y */
+    0x45, 0x0B,             /* 0418  EOR crc */
+    0x85, 0x0B,             /* 041A  STA crc */
+    0xA9, 0x08,             /* 041C  LDA #$08 */
+    0x85, 0x0F,             /* 041E  STA bits */
+    0x46, 0x0E,             /* 0420  bit:    LSR crc+3 */
+    0x66, 0x0D,             /* 0422  ROR crc+2 */
+    0x66, 0x0C,             /* 0424  ROR crc+1 */
+    0x66, 0x0B,             /* 0426  ROR crc */
+    0x90, 0x18,             /* 0428  BCC skip */
+    0xA5, 0x0E,             /* 042A  LDA crc+3 */
+    0x49, 0xED,             /* 042C  EOR #$ED */
+    0x85, 0x0E,             /* 042E  STA crc+3 */
+    0xA5, 0x0D,             /* 0430  LDA crc+2 */
+    0x49, 0xB8,             /* 0432  EOR #$B8 */
+    0x85, 0x0D,             /* 0434  STA crc+2 */
+    0xA5, 0x0C,             /* 0436  LDA crc+1 */
+    0x49, 0x83,             /* 0438  EOR #$83 */
+    0x85, 0x0C,             /* 043A  STA crc+1 */
+    0xA5, 0x0B,             /* 043C  LDA crc */
+    0x49, 0x20,             /* 043E  EOR #$20 */
+    0x85, 0x0B,             /* 0440  STA crc */
+    0xC6, 0x0F,             /* 0442  skip:   DEC bits */
+    0xD0, 0xDA,             /* 0444  BNE bit */
+    0xC8,                   /* 0446  INY */
+    0xD0, 0xCD,             /* 0447  BNE byte */
+    0xE6, 0x01,             /* 0449  INC ptr+1 */
+    0xCA,                   /* 044B  DEX */
+    0xD0, 0xC8,             /* 044C  BNE byte */
+    0xE6, 0x08,             /* 044E  INC passes */
+    0xD0, 0x06,             /* 0450  BNE again */
+    0xE6, 0x09,             /* 0452  INC passes+1 */
+    0xD0, 0x02,             /* 0454  BNE again */
+    0xE6, 0x0A,             /* 0456  INC passes+2 */
+    0x4C, 0x00, 0x04,       /* 0458  again:  JMP start */
+};
+static const uint8_t program_copy[] = {
+    0xA9, 0x00,             /* 0400  start:  LDA #$00 */
+    0x85, 0x10,             /* 0402  STA src */
+    0x85, 0x12,             /* 0404  STA dst */
+    0xA9, 0x20,             /* 0406  LDA #$20 */
+    0x85, 0x11,             /* 0408  STA src+1 */
+    0xA9, 0x60,             /* 040A  LDA #$60 */
+    0x85, 0x13,             /* 040C  STA dst+1 */
+    0xA2, 0x20,             /* 040E  LDX #$20 */
+    0xA0, 0x00,             /* 0410  LDY #$00 */
+    0xB1, 0x10,             /* 0412  copy:   LDA (src),Y */
+    0x91, 0x12,             /* 0414  STA (dst),Y */
+    0xC8,                   /* 0416  INY */
+    0xD0, 0xF9,             /* 0417  BNE copy */
+    0xE6, 0x11,             /* 0419  INC src+1 */
+    0xE6, 0x13,             /* 041B  INC dst+1 */
+    0xCA,                   /* 041D  DEX */
+    0xD0, 0xF2,             /* 041E  BNE copy */
+    0xA2, 0x00,             /* 0420  LDX #$00 */
+    0xBD, 0x00, 0x20,       /* 0422  wide:   LDA $2000,X */
+    0x9D, 0x00, 0xA0,       /* 0425  STA $A000,X */
+    0xBD, 0x00, 0x21,       /* 0428  LDA $2100,X */
+    0x9D, 0x00, 0xA1,       /* 042B  STA $A100,X */
+    0xBD, 0x00, 0x22,       /* 042E  LDA $2200,X */
+    0x9D, 0x00, 0xA2,       /* 0431  STA $A200,X */
+    0xBD, 0x00, 0x23,       /* 0434  LDA $2300,X */
+    0x9D, 0x00, 0xA3,       /* 0437  STA $A300,X */
+    0xBD, 0x00, 0x24,       /* 043A  LDA $2400,X */
+    0x9D, 0x00, 0xA4,       /* 043D  STA $A400,X */
+    0xBD, 0x00, 0x25,       /* 0440  LDA $2500,X */
+    0x9D, 0x00, 0xA5,       /* 0443  STA $A500,X */
+    0xBD, 0x00, 0x26,       /* 0446  LDA $2600,X */
+    0x9D, 0x00, 0xA6,       /* 0449  STA $A600,X */
+    0xBD, 0x00, 0x27,       /* 044C  LDA $2700,X */
+    0x9D, 0x00, 0xA7,       /* 044F  STA $A700,X */
+    0xE8,                   /* 0452  INX */
+    0xD0, 0xCD,             /* 0453  BNE wide */
+    0xE6, 0x08,             /* 0455  INC passes */
+    0xD0, 0x06,             /* 0457  BNE again */
+    0xE6, 0x09,             /* 0459  INC passes+1 */
+    0xD0, 0x02,             /* 045B  BNE again */
+    0xE6, 0x0A,             /* 045D  INC passes+2 */
+    0x4C, 0x00, 0x04,       /* 045F  again:  JMP start */
+};
+static const uint8_t program_bcd[] = {
+    0xF8,                   /* 0400  start:  SED */
+    0xA2, 0x00,             /* 0401  LDX #$00 */
+    0x18,                   /* 0403  add:    CLC */
+    0xA5, 0x14,             /* 0404  LDA n */
+    0x69, 0x45,             /* 0406  ADC #$45 */
+    0x85, 0x14,             /* 0408  STA n */
+    0xA5, 0x15,             /* 040A  LDA n+1 */
+    0x69, 0x23,             /* 040C  ADC #$23 */
+    0x85, 0x15,             /* 040E  STA n+1 */
+    0xA5, 0x16,             /* 0410  LDA n+2 */
+    0x69, 0x01,             /* 0412  ADC #$01 */
+    0x85, 0x16,             /* 0414  STA n+2 */
+    0xA5, 0x17,             /* 0416  LDA n+3 */
+    0x69, 0x00,             /* 0418  ADC #$00 */
+    0x85, 0x17,             /* 041A  STA n+3 */
+    0x38,                   /* 041C  SEC */
+    0xA5, 0x18,             /* 041D  LDA m */
+    0xE9, 0x07,             /* 041F  SBC #$07 */
+    0x85, 0x18,             /* 0421  STA m */
+    0xCA,                   /* 0423  DEX */
+    0xD0, 0xDD,             /* 0424  BNE add */
+    0xD8,                   /* 0426  CLD */
+    0xE6, 0x08,             /* 0427  INC passes */
+    0xD0, 0x06,             /* 0429  BNE again */
+    0xE6, 0x09,             /* 042B  INC passes+1 */
+    0xD0, 0x02,             /* 042D  BNE again */
+    0xE6, 0x0A,             /* 042F  INC passes+2 */
+    0x4C, 0x00, 0x04,       /* 0431  again:  JMP start */
+};
+#define INTERRUPTS_HANDLER 0x040A           ///< handler of the interrupt program
+
+static const uint8_t program_interrupts[] = {
+    0x58,                   /* 0400  start:  CLI */
+    0xE6, 0x22,             /* 0401  loop:   INC work */
+    0xD0, 0xFC,             /* 0403  BNE loop */
+    0xE6, 0x23,             /* 0405  INC work+1 */
+    0x4C, 0x01, 0x04,       /* 0407  JMP loop */
+    0x48,                   /* 040A  handler: PHA */
+    0xE6, 0x20,             /* 040B  INC irqs */
+    0xD0, 0x02,             /* 040D  BNE ack */
+    0xE6, 0x21,             /* 040F  INC irqs+1 */
+    0x8D, 0x00, 0xD0,       /* 0411  ack:    STA $D000 */
+    0x68,                   /* 0414  PLA */
+    0x40,                   /* 0415  RTI */
+};
+
+/**
+ * @brief the cores a program is timed on
+ */
+typedef enum bench_core {
+    BENCH_INTERPRETER,
+    BENCH_BLOCKS,
+    BENCH_JIT,
+    BENCH_LOCKSTEP,
+    BENCH_CORES
+} Bench_core;
+
+static const char* const core_names[BENCH_CORES] = { "interpreter", "blocks", "jit", "lockstep" };
+
+/**
+ * @brief a machine running one program on one core
+ */
+typedef struct bench_machine {
+    Memory_type_t mem;
+    CPU_type_t cpu;
+    Scheduler_t events;
+    Block_cache_t cache;
+    Jit_type_t jit;
+    Memory_device_t device;                 ///< acknowledges the interrupts
+    Bench_core core;
+    uint64_t interrupts;                    ///< IRQs raised
+    uint64_t next_interrupt;                ///< cycle the next one is due
+} Bench_machine_t;
+
+typedef int (*bench_check_t)(Bench_machine_t* m);
+
+/**
+ * @brief one program of the corpus
+ */
+typedef struct bench_program {
+    const char* name;
+    const uint8_t* code;                    ///< loaded at BENCH_ORIGIN, NULL for the functional test
+    size_t size;
+    uint16_t handler;                       ///< IRQ handler, 0 if the program takes no interrupts
+    int passes;                             ///< runs in passes starting at BENCH_ORIGIN
+    bench_check_t check;
+} Bench_program_t;
+
+/**
+ * @brief best timed run of a program on a core
+ */
+typedef struct bench_result {
+    const char* program;
+    Bench_core core;
+    int ok;                                 ///< the program got the right results
+    uint64_t cycles;                        ///< emulated cycles
+    uint64_t instructions;                  ///< emulated instructions, interrupts taken included
+    double seconds;
+    int counted;                            ///< host_cycles and host_instructions are known
+    uint64_t host_cycles;
+    uint64_t host_instructions;
+} Bench_result_t;
+
+static const char* functional_path = NULL;
+static uint16_t functional_success = FUNCTIONAL_SUCCESS;
+
+/* test data at BENCH_DATA */
+static uint8_t data_byte(unsigned i) {
+    return (uint8_t) ((i * 131) ^ (i >> 5));
+}
+
+static uint8_t peek(Bench_machine_t* m, uint16_t address) {
+    return mem_read8(&m->mem, address);
+}
+
+static uint32_t passes(Bench_machine_t* m) {
+    return peek(m, ZP_PASSES) | (peek(m, ZP_PASSES + 1) << 8) | ((uint32_t) peek(m, ZP_PASSES + 2) << 16);
+}
+
+static int check_sieve(Bench_machine_t* m) {
+    static uint8_t composite[BENCH_DATA_PAGES * MEMORY_PAGE_SIZE];
+    unsigned primes = 0;
+
+    for(unsigned i = 2; i < sizeof(composite); i++) {
+        if(!composite[i]) {
+            primes++;
+            for(unsigned j = 2 * i; j < sizeof(composite); j += i) {
+                composite[j] = 1;
+            }
+        }
+    }
+    return (passes(m) != 0) && ( (unsigned) (peek(m, ZP_COUNT) | (peek(m, ZP_COUNT + 1) << 8)) == primes );
+}
+
+static int check_crc32(Bench_machine_t* m) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    /* the program leaves the final inversion out */
+    for(unsigned i = 0; i < 16 * MEMORY_PAGE_SIZE; i++) {
+        crc ^= data_byte(i);
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+    }
+    for(int i = 0; i < 4; i++) {
+        if(peek(m, (uint16_t) (ZP_CRC + i)) != (uint8_t) (crc >> (8 * i))) {
+            return 0;
+        }
+    }
+    return passes(m) != 0;
+}
+
+static int check_copy(Bench_machine_t* m) {
+    for(unsigned i = 0; i < BENCH_DATA_PAGES * MEMORY_PAGE_SIZE; i++) {
+        if(peek(m, (uint16_t) (0x6000 + i)) != data_byte(i)) {
+            return 0;
+        }
+        if( (i < 8 * MEMORY_PAGE_SIZE) && (peek(m, (uint16_t) (0xA000 + i)) != data_byte(i)) ) {
+            return 0;
+        }
+    }
+    return passes(m) != 0;
+}
+
+static int check_bcd(Bench_machine_t* m) {
+    /* every pass adds 12345 and takes 7 away 256 times */
+    const uint64_t additions = (uint64_t) passes(m) * 256;
+    uint64_t sum = (additions * 12345) % 100000000;
+    uint64_t difference = (100 - (additions * 7) % 100) % 100;
+
+    for(int i = 0; i < 4; i++) {
+        if(peek(m, (uint16_t) (ZP_BCD_SUM + i)) != (uint8_t) (((sum / 10) % 10) << 4 | (sum % 10))) {
+            return 0;
+        }
+        sum /= 100;
+    }
+    return (passes(m) != 0) &&
+           (peek(m, ZP_BCD_DIFFERENCE) == (uint8_t) ((difference / 10) << 4 | (difference % 10)));
+}
+
+static int check_interrupts(Bench_machine_t* m) {
+    /* the last IRQ raised may not have been taken yet */
+    const uint16_t taken = peek(m, ZP_IRQS) | (peek(m, ZP_IRQS + 1) << 8);
+    return (m->interrupts != 0) && ((uint16_t) (m->interrupts - taken) <= 1);
+}
+
+static int check_functional(Bench_machine_t* m) {
+    return m->cpu.PC == functional_success;
+}
+
+static const Bench_program_t corpus[] = {
+    { "functional", NULL, 0, 0, 0, check_functional },
+    { "sieve", program_sieve, sizeof(program_sieve), 0, 1, check_sieve },
+    { "crc32", program_crc32, sizeof(program_crc32), 0, 1, check_crc32 },
+    { "copy", program_copy, sizeof(program_copy), 0, 1, check_copy },
+    { "bcd", program_bcd, sizeof(program_bcd), 0, 1, check_bcd },
+    { "interrupts", program_interrupts, sizeof(program_interrupts), INTERRUPTS_HANDLER, 0, check_interrupts },
+};
+
+/* the interrupt device: raises IRQ line 1 every BENCH_IRQ_PERIOD cycles, a write releases it */
+static uint8_t device_read(void* context, uint16_t address) {
+    (void) context;
+    (void) address;
+    return 0;
+}
+
+static void device_write(void* context, uint16_t address, uint8_t value) {
+    Bench_machine_t* m = (Bench_machine_t*) context;
+    (void) address;
+    (void) value;
+    /* the CPU the events go to, which is the lane while the lockstep engine runs the machine */
+    cpu_irq_release(m->events.cpu, 1);
+}
+
+static void device_interrupt(void* context, CPU_type_t* cpu, uint64_t now) {
+    Bench_machine_t* m = (Bench_machine_t*) context;
+    (void) now;
+
+    m->interrupts++;
+    cpu_irq_assert(cpu, 1);
+    m->next_interrupt += BENCH_IRQ_PERIOD;
+    scheduler_post(&m->events, m->next_interrupt, device_interrupt, m);
+}
+
+static void machine_free(Bench_machine_t* m) {
+    if(m->core == BENCH_JIT) {
+        jit_free(&m->jit);
+    }
+    if(m->core != BENCH_INTERPRETER) {
+        block_cache_free(&m->cache);
+    }
+    scheduler_detach(&m->cpu);
+    scheduler_free(&m->events);
+    memory_free(&m->mem);
+}
+
+/**
+ * load a program and power the machine on
+ * @return 0 on success, -1 if something could not be allocated, the program could not be loaded
+ * or the core is not built
+ */
+static int machine_start(Bench_machine_t* m, const Bench_program_t* program, CPU_variant variant, Bench_core core) {
+    memset(m, 0, sizeof(*m));
+    m->core = BENCH_INTERPRETER;
+
+    uint8_t* ram = memory_initialize(&m->mem);
+    if(ram == NULL) {
+        return -1;
+    }
+    if(scheduler_initialize(&m->events, 0) != 0) {
+        memory_free(&m->mem);
+        return -1;
+    }
+
+    if(program->code != NULL) {
+        memcpy(ram + BENCH_ORIGIN, program->code, program->size);
+        for(unsigned i = 0; i < BENCH_DATA_PAGES * MEMORY_PAGE_SIZE; i++) {
+            ram[BENCH_DATA + i] = data_byte(i);
+        }
+        ram[0xFFFC] = (uint8_t) BENCH_ORIGIN;
+        ram[0xFFFD] = BENCH_ORIGIN >> 8;
+        ram[0xFFFE] = (uint8_t) program->handler;
+        ram[0xFFFF] = program->handler >> 8;
+    } else if( (functional_path == NULL) ||
+               (loader_load(&m->mem, functional_path, LOADER_RAW, 0x0000, NULL) != 0) ) {
+        machine_free(m);
+        return -1;
+    }
+
+    if(program->handler != 0) {
+        m->device = (Memory_device_t) { device_read, device_write, m, NULL, 0, 0 };
+        memory_map_device(&m->mem, BENCH_IRQ_DEVICE, 1, &m->device);
+    }
+
+    cpu_initialize(&m->cpu, variant);
+    cpu_reset(&m->cpu, &m->mem);
+    if(program->code == NULL) {
+        m->cpu.PC = FUNCTIONAL_ORIGIN;
+    }
+    scheduler_attach(&m->events, &m->cpu);
+    if(program->handler != 0) {
+        m->next_interrupt = m->cpu.cycles + BENCH_IRQ_PERIOD;
+        scheduler_post(&m->events, m->next_interrupt, device_interrupt, m);
+    }
+
+    if(core != BENCH_INTERPRETER) {
+        if(block_cache_initialize(&m->cache, &m->mem, variant) != 0) {
+            machine_free(m);
+            return -1;
+        }
+        m->core = BENCH_BLOCKS;
+    }
+    if(core == BENCH_JIT) {
+        if(jit_initialize(&m->jit, &m->cache, 0) != 0) {
+            machine_free(m);
+            return -1;
+        }
+        m->core = BENCH_JIT;
+    }
+    return 0;
+}
+
+/*
+ * hardware counters of this thread, user space only
+ * the cycle counter leads a group with the instruction counter so both count the same stretch
+ */
+typedef struct bench_counters {
+    int cycles;
+    int instructions;
+} Bench_counters_t;
+
+#ifdef __linux__
+static int counter_open(uint64_t config, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (group == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void counters_open(Bench_counters_t* c) {
+    c->cycles = -1;
+    c->instructions = -1;
+#ifdef __linux__
+    c->cycles = counter_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if(c->cycles != -1) {
+        c->instructions = counter_open(PERF_COUNT_HW_INSTRUCTIONS, c->cycles);
+        if(c->instructions == -1) {
+            close(c->cycles);
+            c->cycles = -1;
+        }
+    }
+#endif
+}
+
+static void counters_close(Bench_counters_t* c) {
+#ifdef __linux__
+    if(c->cycles != -1) {
+        close(c->instructions);
+        close(c->cycles);
+    }
+#endif
+    c->cycles = -1;
+}
+
+static void counters_start(Bench_counters_t* c) {
+#ifdef __linux__
+    if(c->cycles != -1) {
+        ioctl(c->cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(c->cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#else
+    (void) c;
+#endif
+}
+
+/* @return 1 if the counts were read */
+static int counters_stop(Bench_counters_t* c, uint64_t* cycles, uint64_t* instructions) {
+#ifdef __linux__
+    uint64_t values[3];
+
+    if(c->cycles == -1) {
+        return 0;
+    }
+    ioctl(c->cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if( (read(c->cycles, values, sizeof(values)) != (ssize_t) sizeof(values)) || (values[0] != 2) ) {
+        return 0;
+    }
+    *cycles = values[1];
+    *instructions = values[2];
+    return 1;
+#else
+    (void) c;
+    (void) cycles;
+    (void) instructions;
+    return 0;
+#endif
+}
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+/**
+ * step a program on the interpreter to find how many cycles it runs for and how many
+ * instructions that is: a fixed budget for the corpus, up to its trap for the functional test
+ * @return 0 on success, -1 if the program could not be started or never trapped
+ */
+static int measure(const Bench_program_t* program, CPU_variant variant, uint64_t budget, uint64_t* cycles, uint64_t* instructions) {
+    Bench_machine_t* m = malloc(sizeof(Bench_machine_t));
+    int result = 0;
+
+    if( (m == NULL) || (machine_start(m, program, variant, BENCH_INTERPRETER) != 0) ) {
+        free(m);
+        return -1;
+    }
+
+    const uint64_t start = m->cpu.cycles;
+    uint64_t steps = 0;
+
+    if(program->code != NULL) {
+        while(m->cpu.cycles - start < budget) {
+            cpu_step(&m->cpu, &m->mem);
+            steps++;
+        }
+    } else {
+        uint16_t pc;
+        do {
+            pc = m->cpu.PC;
+            cpu_step(&m->cpu, &m->mem);
+            steps++;
+        } while( (m->cpu.PC != pc) && (steps < BENCH_STEP_LIMIT) );
+        result = (m->cpu.PC == pc) ? 0 : -1;
+    }
+
+    *cycles = m->cpu.cycles - start;
+    *instructions = steps;
+    machine_free(m);
+    free(m);
+    return result;
+}
+
+/**
+ * time the best of a number of runs of a program on a core
+ * @return 0 on success, -1 if the core is not built or the program could not be started
+ */
+static int run(const Bench_program_t* program, CPU_variant variant, Bench_core core, unsigned repeats,
+               uint64_t cycles, Bench_result_t* result) {
+    Bench_machine_t* m = malloc(sizeof(Bench_machine_t));
+    Bench_counters_t counters;
+
+    if(m == NULL) {
+        return -1;
+    }
+
+    counters_open(&counters);
+    result->program = program->name;
+    result->core = core;
+    result->ok = 1;
+    result->cycles = cycles;
+    result->seconds = 0.0;
+    result->counted = 0;
+
+    for(unsigned r = 0; r < repeats; r++) {
+        uint64_t host_cycles = 0;
+        uint64_t host_instructions = 0;
+
+        if(machine_start(m, program, variant, core) != 0) {
+            counters_close(&counters);
+            free(m);
+            return -1;
+        }
+
+        const double t0 = now_seconds();
+        counters_start(&counters);
+        cpu_run(&m->cpu, &m->mem, cycles);
+        const int counted = counters_stop(&counters, &host_cycles, &host_instructions);
+        const double seconds = now_seconds() - t0;
+
+        if(program->passes) {
+            for(uint64_t steps = 0; (m->cpu.PC != BENCH_ORIGIN) && (steps < BENCH_STEP_LIMIT); steps++) {
+                cpu_step(&m->cpu, &m->mem);
+            }
+        }
+        result->ok &= program->check(m);
+
+        if( (r == 0) || (seconds < result->seconds) ) {
+            result->seconds = seconds;
+            result->counted = counted;
+            result->host_cycles = host_cycles;
+            result->host_instructions = host_instructions;
+        }
+        machine_free(m);
+    }
+
+    counters_close(&counters);
+    free(m);
+    return 0;
+}
+
+/* a lane of the lockstep engine ended up where the interpreter did */
+static int same_machine(const Bench_machine_t* a, const Bench_machine_t* b) {
+    return (a->cpu.PC == b->cpu.PC) && (a->cpu.AC == b->cpu.AC) && (a->cpu.X == b->cpu.X) &&
+           (a->cpu.Y == b->cpu.Y) && (a->cpu.SR == b->cpu.SR) && (a->cpu.SP == b->cpu.SP) &&
+           (a->cpu.cycles == b->cpu.cycles) && (a->cpu.state == b->cpu.state) && (a->cpu.irq == b->cpu.irq) &&
+           (a->cpu.nmi == b->cpu.nmi) && (a->interrupts == b->interrupts) &&
+           (memcmp(a->mem.data, b->mem.data, MEMORY_SIZE) == 0);
+}
+
+/**
+ * start the lanes of the lockstep engine and the machine they are compared with
+ * @return 0 on success, -1 if a machine could not be started, none is left running then
+ */
+static int lanes_start(Lockstep_type_t* ls, Bench_machine_t* lanes, Bench_machine_t* scalar,
+                       const Bench_program_t* program, CPU_variant variant, const uint8_t* image) {
+    const uint16_t pages = (uint16_t) ((program->size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE);
+    size_t started = 0;
+
+    if(machine_start(scalar, program, variant, BENCH_INTERPRETER) != 0) {
+        return -1;
+    }
+    while( (started < BENCH_LANES) && (machine_start(&lanes[started], program, variant, BENCH_INTERPRETER) == 0) ) {
+        /* the lanes decode the program once for all of them when they map the same storage */
+        memory_map_shared(&lanes[started].mem, BENCH_ORIGIN >> 8, pages, image);
+        lockstep_load(ls, started, &lanes[started].cpu, &lanes[started].mem);
+        started++;
+    }
+    if(started < BENCH_LANES) {
+        while(started > 0) {
+            machine_free(&lanes[--started]);
+        }
+        machine_free(scalar);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * time the best of a number of runs of BENCH_LANES copies of a program on the lockstep engine
+ * every lane is compared with a copy run on the interpreter, which is then checked as usual
+ * @param cycles cycles every lane runs for
+ * @return 0 on success, -1 if the machines or the engine could not be allocated
+ */
+static int run_lockstep(const Bench_program_t* program, CPU_variant variant, unsigned repeats,
+                        uint64_t cycles, Bench_result_t* result) {
+    Bench_machine_t* lanes = malloc(BENCH_LANES * sizeof(Bench_machine_t));
+    Bench_machine_t* scalar = malloc(sizeof(Bench_machine_t));
+    uint8_t* image = calloc((program->size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+    Lockstep_type_t ls;
+    int status = 0;
+
+    if( (lanes == NULL) || (scalar == NULL) || (image == NULL) || (lockstep_initialize(&ls, BENCH_LANES) != 0) ) {
+        free(lanes);
+        free(scalar);
+        free(image);
+        return -1;
+    }
+    memcpy(image, program->code, program->size);
+
+    result->program = program->name;
+    result->core = BENCH_LOCKSTEP;
+    result->ok = 1;
+    result->cycles = cycles * BENCH_LANES;
+    result->seconds = 0.0;
+    result->counted = 0;
+
+    for(unsigned r = 0; r < repeats; r++) {
+        if(lanes_start(&ls, lanes, scalar, program, variant, image) != 0) {
+            status = -1;
+            break;
+        }
+
+        const double t0 = now_seconds();
+        lockstep_run(&ls, cycles);
+        const double seconds = now_seconds() - t0;
+
+        cpu_run(&scalar->cpu, &scalar->mem, cycles);
+        for(size_t i = 0; i < BENCH_LANES; i++) {
+            lockstep_store(&ls, i, &lanes[i].cpu);
+            result->ok &= same_machine(&lanes[i], scalar);
+            machine_free(&lanes[i]);
+        }
+
+        if(program->passes) {
+            for(uint64_t steps = 0; (scalar->cpu.PC != BENCH_ORIGIN) && (steps < BENCH_STEP_LIMIT); steps++) {
+                cpu_step(&scalar->cpu, &scalar->mem);
+            }
+        }
+        result->ok &= program->check(scalar);
+        machine_free(scalar);
+
+        if( (r == 0) || (seconds < result->seconds) ) {
+            result->seconds = seconds;
+        }
+    }
+
+    lockstep_free(&ls);
+    free(lanes);
+    free(scalar);
+    free(image);
+    return status;
+}
+
+static void print_table(FILE* out, const Bench_result_t* results, size_t count) {
+    fprintf(out, "%-12s %-12s %-6s %12s %12s %10s %10s %8s\n",
+            "program", "core", "result", "cycles", "instructions", "MHz", "ns/instr", "IPC");
+    for(size_t i = 0; i < count; i++) {
+        const Bench_result_t* r = &results[i];
+
+        fprintf(out, "%-12s %-12s %-6s %12llu %12llu %10.1f %10.2f ", r->program, core_names[r->core],
+                r->ok ? "ok" : "FAILED", (unsigned long long) r->cycles, (unsigned long long) r->instructions,
+                (double) r->cycles / r->seconds * 1e-6, r->seconds * 1e9 / (double) r->instructions);
+        if(r->counted && (r->host_cycles != 0)) {
+            fprintf(out, "%8.2f\n", (double) r->host_instructions / (double) r->host_cycles);
+        } else {
+            fprintf(out, "%8s\n", "-");
+        }
+    }
+}
+
+static void write_json(FILE* out, const Bench_result_t* results, size_t count, const char* label, CPU_variant variant) {
+    fprintf(out, "{\n  \"label\": \"%s\",\n  \"variant\": \"%s\",\n  \"results\": [", label, cpu_variant_to_str(variant));
+    for(size_t i = 0; i < count; i++) {
+        const Bench_result_t* r = &results[i];
+
+        fprintf(out, "%s\n    { \"program\": \"%s\", \"core\": \"%s\", \"ok\": %s, \"cycles\": %llu, \"instructions\": %llu, "
+                "\"seconds\": %.6f, \"mhz\": %.3f, \"ns_per_instruction\": %.4f, ",
+                (i == 0) ? "" : ",", r->program, core_names[r->core], r->ok ? "true" : "false",
+                (unsigned long long) r->cycles, (unsigned long long) r->instructions, r->seconds,
+                (double) r->cycles / r->seconds * 1e-6, r->seconds * 1e9 / (double) r->instructions);
+        if(r->counted && (r->host_cycles != 0)) {
+            fprintf(out, "\"host_cycles\": %llu, \"host_instructions\": %llu, \"ipc\": %.3f }",
+                    (unsigned long long) r->host_cycles, (unsigned long long) r->host_instructions,
+                    (double) r->host_instructions / (double) r->host_cycles);
+        } else {
+            fprintf(out, "\"host_cycles\": null, \"host_instructions\": null, \"ipc\": null }");
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void write_csv(FILE* out, const Bench_result_t* results, size_t count, const char* label, CPU_variant variant) {
+    fprintf(out, "label,variant,program,core,ok,cycles,instructions,seconds,mhz,ns_per_instruction,host_cycles,host_instructions,ipc\n");
+    for(size_t i = 0; i < count; i++) {
+        const Bench_result_t* r = &results[i];
+
+        fprintf(out, "%s,%s,%s,%s,%d,%llu,%llu,%.6f,%.3f,%.4f,", label, cpu_variant_to_str(variant), r->program,
+                core_names[r->core], r->ok, (unsigned long long) r->cycles, (unsigned long long) r->instructions,
+                r->seconds, (double) r->cycles / r->seconds * 1e-6, r->seconds * 1e9 / (double) r->instructions);
+        if(r->counted && (r->host_cycles != 0)) {
+            fprintf(out, "%llu,%llu,%.3f\n", (unsigned long long) r->host_cycles,
+                    (unsigned long long) r->host_instructions, (double) r->host_instructions / (double) r->host_cycles);
+        } else {
+            fprintf(out, ",,\n");
+        }
+    }
+}
+
+static int write_file(const char* path, void (*writer)(FILE*, const Bench_result_t*, size_t, const char*, CPU_variant),
+                      const Bench_result_t* results, size_t count, const char* label, CPU_variant variant) {
+    FILE* out = fopen(path, "w");
+
+    if(out == NULL) {
+        perror(path);
+        return -1;
+    }
+    writer(out, results, count, label, variant);
+    return fclose(out);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-v nmos|cmos|wdc] [-c cycles] [-r repeats] [-d functional test binary]\n"
+                    "       [-s success address] [-j json file] [-o csv file] [-l label]\n", name);
+}
+
+int main(int argc, char** argv) {
+    CPU_variant variant = CPU_DEFAULT_VARIANT;
+    uint64_t budget = BENCH_CYCLES;
+    unsigned repeats = BENCH_REPEATS;
+    const char* json = NULL;
+    const char* csv = NULL;
+    const char* label = "";
+
+    for(int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+
+        if( (option[0] != '-') || (option[1] == '\0') || (option[2] != '\0') || (i + 1 >= argc) ) {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[++i];
+
+        switch(option[1]) {
+            case 'v':
+                if(strcmp(value, "nmos") == 0) {
+                    variant = CPU_NMOS;
+                } else if(strcmp(value, "cmos") == 0) {
+                    variant = CPU_65C02;
+                } else if(strcmp(value, "wdc") == 0) {
+                    variant = CPU_W65C02S;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'c': budget = strtoull(value, NULL, 0); break;
+            case 'r': repeats = (unsigned) strtoul(value, NULL, 0); break;
+            case 'd': functional_path = value; break;
+            case 's': functional_success = (uint16_t) strtoul(value, NULL, 0); break;
+            case 'j': json = value; break;
+            case 'o': csv = value; break;
+            case 'l': label = value; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if( (budget == 0) || (repeats == 0) ) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Bench_result_t results[sizeof(corpus) / sizeof(corpus[0]) * BENCH_CORES];
+    size_t count = 0;
+    int failed = 0;
+
+    /* a wrong decimal table entry fails the bench whatever the programs do */
+    const size_t decimal_errors = decimal_verify();
+    if(decimal_errors != 0) {
+        fprintf(stderr, "decimal tables: %zu entries differ from the reference\n", decimal_errors);
+        failed = 1;
+    }
+
+    for(size_t p = 0; p < sizeof(corpus) / sizeof(corpus[0]); p++) {
+        const Bench_program_t* program = &corpus[p];
+        uint64_t cycles;
+        uint64_t instructions;
+
+        if( (program->code == NULL) && (functional_path == NULL) ) {
+            continue;
+        }
+        if(measure(program, variant, budget, &cycles, &instructions) != 0) {
+            fprintf(stderr, "%s: could not be run\n", program->name);
+            failed = 1;
+            continue;
+        }
+
+        for(int core = 0; core < BENCH_LOCKSTEP; core++) {
+            if(run(program, variant, (Bench_core) core, repeats, cycles, &results[count]) != 0) {
+                /* the native code tier is not built for every host */
+                continue;
+            }
+            results[count].instructions = instructions;
+            failed |= !results[count].ok;
+            count++;
+        }
+
+        /* the lanes share the cycles out, each one has fewer instructions to its name */
+        if( (program->code == NULL) || (budget < BENCH_LANES) ||
+            (measure(program, variant, budget / BENCH_LANES, &cycles, &instructions) != 0) ) {
+            continue;
+        }
+        if(run_lockstep(program, variant, repeats, cycles, &results[count]) != 0) {
+            fprintf(stderr, "%s: could not be run on the lockstep engine\n", program->name);
+            failed = 1;
+            continue;
+        }
+        results[count].instructions = instructions * BENCH_LANES;
+        failed |= !results[count].ok;
+        count++;
+    }
+
+    print_table(stdout, results, count);
+    if( (json != NULL) && (write_file(json, write_json, results, count, label, variant) != 0) ) {
+        return 1;
+    }
+    if( (csv != NULL) && (write_file(csv, write_csv, results, count, label, variant) != 0) ) {
+        return 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file differential.c
+ * @brief runs a corpus of programs on a fast engine and the reference stepper side by side
+ * @author Edwin
+ *
+ * usage: differential [-v nmos|cmos|wdc] [-e interpreter|blocks|jit|lockstep] [-c cycles] [-i interval]
+ *                     [-t threads] [-a raw load address] <file>...
+ *
+ * the machines are compared after every block the fast engine runs, or every interval cycles with
+ * -i. The lockstep engine runs every file on DIFFERENTIAL_LANES lanes, each with a reference of its
+ * own, and compares them every DIFFERENTIAL_SLICE cycles unless -i is given. One line per file,
+ * followed by the divergence report for every file that diverged. Every entry of the decimal mode
+ * tables is checked against the reference algorithms as well, and a few branch cycle counts
+ * against the data sheets. The exit status is 1 if any file diverged or could not be loaded, or a
+ * table entry or cycle count is wrong
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "differential.h"
+#include "decimal.h"
+
+#define CORPUS_CYCLES 10000000ULL           ///< default cycles every file runs for
+#define CORPUS_ADDRESS 0x0200               ///< default address of raw files
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-v nmos|cmos|wdc] [-e interpreter|blocks|jit|lockstep] [-c cycles] [-i interval]\n"
+                    "       [-t threads] [-a raw load address] <file>...\n", name);
+}
+
+int main(int argc, char** argv) {
+    Differential_corpus_t corpus = { NULL, 0, CPU_DEFAULT_VARIANT, CORPUS_ADDRESS, 0, 0, 1, 1, 0 };
+    uint64_t budget = CORPUS_CYCLES;
+    int i = 1;
+
+    for(; (i < argc) && (argv[i][0] == '-'); i += 2) {
+        const char* option = argv[i];
+
+        if( (option[1] == '\0') || (option[2] != '\0') || (i + 1 >= argc) ) {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[i + 1];
+
+        switch(option[1]) {
+            case 'v':
+                if(strcmp(value, "nmos") == 0) {
+                    corpus.variant = CPU_NMOS;
+                } else if(strcmp(value, "cmos") == 0) {
+                    corpus.variant = CPU_65C02;
+                } else if(strcmp(value, "wdc") == 0) {
+                    corpus.variant = CPU_W65C02S;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'e':
+                corpus.lockstep = 0;
+                if(strcmp(value, "interpreter") == 0) {
+                    corpus.blocks = 0;
+                    corpus.jit = 0;
+                } else if(strcmp(value, "blocks") == 0) {
+                    corpus.blocks = 1;
+                    corpus.jit = 0;
+                } else if(strcmp(value, "jit") == 0) {
+                    corpus.blocks = 1;
+                    corpus.jit = 1;
+                } else if(strcmp(value, "lockstep") == 0) {
+                    corpus.lockstep = 1;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'c': budget = strtoull(value, NULL, 0); break;
+            case 'i': corpus.interval = (uint32_t) strtoul(value, NULL, 0); break;
+            case 't': corpus.threads = (unsigned) strtoul(value, NULL, 0); break;
+            case 'a': corpus.address = (uint16_t) strtoul(value, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if(i >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    corpus.count = (size_t) (argc - i);
+    corpus.jobs = (Differential_job_t*) calloc(corpus.count, sizeof(Differential_job_t));
+    if(corpus.jobs == NULL) {
+        perror("differential");
+        return 1;
+    }
+    for(size_t j = 0; j < corpus.count; j++) {
+        corpus.jobs[j].path = argv[i + j];
+    }
+
+    long failed = differential_run_corpus(&corpus, budget);
+    if(failed < 0) {
+        perror("differential");
+        free(corpus.jobs);
+        return 1;
+    }
+
+    /* the decimal tables both machines use are checked against the reference algorithms on their own */
+    const size_t decimal_errors = decimal_verify();
+    if(decimal_errors != 0) {
+        printf("decimal tables: %zu entries differ from the reference\n", decimal_errors);
+        failed++;
+    }
+
+    /* so are a few cycle counts, which both machines take from the same opcode maps */
+    const size_t timing_errors = differential_verify_timing(corpus.variant);
+    if(timing_errors != 0) {
+        printf("timing: %zu instructions took the wrong number of cycles\n", timing_errors);
+        failed++;
+    }
+
+    for(size_t j = 0; j < corpus.count; j++) {
+        const Differential_job_t* job = &corpus.jobs[j];
+        printf("%-8s %12llu  %s\n", (job->result == 0) ? "ok" : (job->result > 0) ? "DIVERGED" : "UNREAD",
+               (unsigned long long) job->cycles, job->path);
+    }
+    for(size_t j = 0; j < corpus.count; j++) {
+        const Differential_job_t* job = &corpus.jobs[j];
+        if(job->result <= 0) {
+            continue;
+        }
+        if(corpus.lockstep) {
+            printf("\n%s, lane %zu\n", job->path, job->lane);
+        } else {
+            printf("\n%s\n", job->path);
+        }
+        differential_print(&job->divergence, corpus.variant, stdout);
+    }
+
+    free(corpus.jobs);
+    return failed != 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file gdb-server.c
+ * @brief loads a program and lets GDB debug it over the remote serial protocol
+ * @author Edwin
+ *
+ * usage: gdb-server [-v nmos|cmos|wdc] [-a raw load address] [-l host:port|unix:path] <file>
+ *
+ * the program starts where the file gives an entry point, else at the reset vector when the file
+ * covers it, else at its first address. The server listens on localhost:1234 unless told
+ * otherwise, and takes the next connection when GDB detaches; it exits when GDB kills the program
+ *
+ * (gdb) target remote localhost:1234
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "gdb-stub.h"
+#include "loader.h"
+
+#define SERVER_ADDRESS 0x0200               ///< default address of raw files
+#define RESET_VECTOR 0xFFFC
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-v nmos|cmos|wdc] [-a raw load address] [-l host:port|unix:path] <file>\n", name);
+}
+
+int main(int argc, char** argv) {
+    CPU_variant variant = CPU_DEFAULT_VARIANT;
+    uint16_t address = SERVER_ADDRESS;
+    const char* listen = "localhost:1234";
+    int i = 1;
+
+    for(; (i < argc) && (argv[i][0] == '-'); i += 2) {
+        const char* option = argv[i];
+
+        if( (option[1] == '\0') || (option[2] != '\0') || (i + 1 >= argc) ) {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[i + 1];
+
+        switch(option[1]) {
+            case 'v':
+                if(strcmp(value, "nmos") == 0) {
+                    variant = CPU_NMOS;
+                } else if(strcmp(value, "cmos") == 0) {
+                    variant = CPU_65C02;
+                } else if(strcmp(value, "wdc") == 0) {
+                    variant = CPU_W65C02S;
+                } else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'a': address = (uint16_t) strtoul(value, NULL, 0); break;
+            case 'l': listen = value; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if(i + 1 != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    CPU_type_t cpu;
+    Memory_type_t mem;
+    Loader_info_t info;
+    Gdb_stub_t* stub = (Gdb_stub_t*) malloc(sizeof(Gdb_stub_t));
+
+    if( (stub == NULL) || (memory_initialize(&mem) == NULL) ) {
+        perror("gdb-server");
+        return 1;
+    }
+    if(loader_load(&mem, argv[i], LOADER_AUTO, address, &info) != 0) {
+        fprintf(stderr, "%s: cannot load\n", argv[i]);
+        return 1;
+    }
+
+    cpu_initialize(&cpu, variant);
+    cpu_reset(&cpu, &mem);
+    if(info.entry >= 0) {
+        cpu.PC = (uint16_t) info.entry;
+    } else if( (info.first > RESET_VECTOR) || (info.last < RESET_VECTOR + 1) ) {
+        cpu.PC = info.first;
+    }
+
+    if(gdb_stub_initialize(stub, &cpu, &mem) != 0) {
+        perror("gdb-server");
+        return 1;
+    }
+    if(gdb_stub_listen(stub, listen) != 0) {
+        perror(listen);
+        gdb_stub_free(stub);
+        return 1;
+    }
+    fprintf(stderr, "listening on %s\n", listen);
+
+    int result;
+    while((result = gdb_stub_serve(stub)) == 0) {
+    }
+    if(result < 0) {
+        perror(listen);
+    }
+
+    gdb_stub_free(stub);
+    memory_free(&mem);
+    free(stub);
+    return result < 0;
+}
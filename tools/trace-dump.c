@@ -0,0 +1,81 @@
+/**
+ * @file trace-dump.c
+ * @brief prints a trace file written by trace_save or a trace stream as disassembly
+ * @author Edwin
+ *
+ * usage: trace-dump <trace file> [symbol file]
+ *
+ * one line per instruction: cycle stamp, address, opcode byte, the instruction, the registers
+ * before it and the effective address; with a symbol file the addresses that have a name are
+ * printed by it, and every instruction that starts a symbol is preceded by its label
+ */
+
+#include <stdio.h>
+#include "cpu.h"
+#include "disassembler.h"
+#include "trace.h"
+#include "utils.h"
+
+int main(int argc, char** argv) {
+    Trace_reader_t reader;
+    Trace_entry_t e;
+    Disassembler_symbols_t symbols;
+    const Disassembler_symbols_t* names = NULL;
+    int result;
+
+    if( (argc != 2) && (argc != 3) ) {
+        fprintf(stderr, "usage: %s <trace file> [symbol file]\n", argv[0]);
+        return 2;
+    }
+
+    disassembler_symbols_initialize(&symbols);
+    if(argc == 3) {
+        if(disassembler_symbols_load(&symbols, argv[2]) < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        names = &symbols;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(in == NULL) {
+        perror(argv[1]);
+        disassembler_symbols_free(&symbols);
+        return 1;
+    }
+
+    if(trace_reader_open(&reader, in) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        fclose(in);
+        disassembler_symbols_free(&symbols);
+        return 1;
+    }
+
+    printf("; %s\n", cpu_variant_to_str(reader.variant));
+
+    while((result = trace_read(&reader, &e)) == 1) {
+        const uint8_t bytes[3] = { e.opcode, (uint8_t) e.operand, (uint8_t) (e.operand >> 8) };
+        const char* label = (names != NULL) ? disassembler_symbol_at(names, e.pc) : NULL;
+        char text[DISASSEMBLER_TEXT];
+
+        if(label != NULL) {
+            printf("%s:\n", label);
+        }
+        disassembler_format(text, sizeof(text), reader.variant, e.pc, bytes, names);
+        printf("%12llu  %04X  %02X  %-17s A=%02X X=%02X Y=%02X SP=%02X SR=%02X",
+               (unsigned long long) e.cycles, e.pc, e.opcode, text, e.AC, e.X, e.Y, e.SP, e.SR);
+        if(e.has_address) {
+            printf("  @%04X", e.address);
+        }
+        putchar('\n');
+    }
+
+    fclose(in);
+    disassembler_symbols_free(&symbols);
+
+    if(result < 0) {
+        fprintf(stderr, "%s: trace is cut short\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}